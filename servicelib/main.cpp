@@ -22,10 +22,9 @@ public:
 		//auto dword_auto = m_dwtest.Value;
 
 		// Self-stop; could be useful model for trigger services
-		std::async(std::launch::async, [=]() { 
+		LaunchWorker(_T("selfstop"), [=](const svctl::worker_token& token) { 
 
-			Sleep(10000);
-			Stop();
+			if(token.Sleep(10000)) Stop();
 		});
 	}
 
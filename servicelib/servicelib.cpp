@@ -23,20 +23,24 @@
 #include "stdafx.h"
 #include "servicelib.h"
 
+#pragma comment(lib, "iphlpapi.lib")
+#pragma comment(lib, "wtsapi32.lib")
+#pragma comment(lib, "ws2_32.lib")
+
 #pragma warning(push, 4)
 
 namespace svctl {
 
 //-----------------------------------------------------------------------------
-// svctl::GetServiceProcessType
+// svctl::GetServiceAsyncStatus
 //
-// Reads the service process type flags from the registry
+// Reads the AsyncStatus flag from the service's Parameters registry key
 //
 // Arguments:
 //
 //	name		- Service key name
 
-ServiceProcessType GetServiceProcessType(const tchar_t* name)
+bool GetServiceAsyncStatus(const tchar_t* name)
 {
 	HKEY			key;						// Service registry key
 	DWORD			value = 0;					// REG_DWORD value buffer
@@ -44,855 +48,7822 @@ ServiceProcessType GetServiceProcessType(const tchar_t* name)
 
 	// Attempt to open the services registry key with read-only access
 	if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, _T("SYSTEM\\CurrentControlSet\\Services"), 0, KEY_READ, &key) == ERROR_SUCCESS) {
-		
-		// Attempt to grab the Type REG_DWORD value from the registry and close the key
-		RegGetValue(key, name, _T("Type"), RRF_RT_REG_DWORD, nullptr, &value, &cb);
+
+		// Attempt to grab the AsyncStatus REG_DWORD value from the registry and close the key
+		tstring subkey = tstring(name) + _T("\\Parameters");
+		RegGetValue(key, subkey.c_str(), _T("AsyncStatus"), RRF_RT_REG_DWORD, nullptr, &value, &cb);
 		RegCloseKey(key);
 	}
 
-	return static_cast<ServiceProcessType>(value);
+	return (value != 0);
 }
 
 //-----------------------------------------------------------------------------
-// svctl::resstring
-//-----------------------------------------------------------------------------
-
-//-----------------------------------------------------------------------------
-// resstring::GetResourceString (private, static)
+// svctl::GetServiceProcessId
 //
-// Gets a tstring from a module string resource
+// Gets the identifier of the process hosting a running service; zero if the service
+// isn't running or can't be queried
 //
 // Arguments:
 //
-//	id			- Resource identifier code
-//	instance	- Module instance handle to acquire the resource from
+//	name		- Service key name
 
-const tstring resstring::GetResourceString(unsigned int id, HINSTANCE instance)
+DWORD GetServiceProcessId(const tchar_t* name)
 {
-	// LoadString() has a neat trick to return a read-only string pointer, but
-	// it won't necessarily be null-terminated.  Length is returned as result
-	tchar_t* string = nullptr;
-	int result = LoadString(instance, id, reinterpret_cast<tchar_t*>(&string), 0);
+	SERVICE_STATUS_PROCESS	status = {};				// Service status information
+	DWORD					cb = 0;						// Length of the status information
 
-	return tstring(string, result);
-}
+	SC_HANDLE scm = OpenSCManager(nullptr, nullptr, SC_MANAGER_CONNECT);
+	if(scm == nullptr) return 0;
 
-//-----------------------------------------------------------------------------
-// svctl::service
-//-----------------------------------------------------------------------------
+	// The process identifier is zero unless the service is running
+	SC_HANDLE service = OpenService(scm, name, SERVICE_QUERY_STATUS);
+	if(service != nullptr) {
+
+		QueryServiceStatusEx(service, SC_STATUS_PROCESS_INFO, reinterpret_cast<LPBYTE>(&status), sizeof(SERVICE_STATUS_PROCESS), &cb);
+		CloseServiceHandle(service);
+	}
+
+	CloseServiceHandle(scm);
+	return status.dwProcessId;
+}
 
 //-----------------------------------------------------------------------------
-// service::Abort (private)
+// svctl::GetServiceProcessType
 //
-// Abnormally terminates the service; does not return to the calling thread
+// Reads the service process type flags from the registry
 //
 // Arguments:
 //
-//	exception	- The unhandled exception that is aborting the service
+//	name		- Service key name
 
-void service::Abort(std::exception_ptr exception)
+ServiceProcessType GetServiceProcessType(const tchar_t* name)
 {
-	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+	HKEY			key;						// Service registry key
+	DWORD			value = 0;					// REG_DWORD value buffer
+	DWORD			cb = sizeof(DWORD);			// Size of value buffer
 
-	// If this is an svctl::winexception the code can be used to set the exit
-	// code for the service otherwise just use ERROR_UNHANDLED_EXCEPTION
-	try { std::rethrow_exception(exception); }
-	catch(winexception& ex) { TrySetStatus(ServiceStatus::Stopped, ex.code()); }
-	catch(...) { TrySetStatus(ServiceStatus::Stopped, ERROR_UNHANDLED_EXCEPTION); }
+	// Attempt to open the services registry key with read-only access
+	if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, _T("SYSTEM\\CurrentControlSet\\Services"), 0, KEY_READ, &key) == ERROR_SUCCESS) {
+		
+		// Attempt to grab the Type REG_DWORD value from the registry and close the key
+		RegGetValue(key, name, _T("Type"), RRF_RT_REG_DWORD, nullptr, &value, &cb);
+		RegCloseKey(key);
+	}
 
-	m_stopsignal.Set();				// Interrupt the main service thread wait
-	Sleep(INFINITE);				// Never return
+	return static_cast<ServiceProcessType>(value);
 }
 
 //-----------------------------------------------------------------------------
-// service::Continue
+// svctl::RelativeFileTime
 //
-// Continues the service from a paused state
+// Converts a millisecond interval into a relative FILETIME for thread pool timers
 //
 // Arguments:
 //
-//	NONE
+//	milliseconds	- Relative interval in milliseconds
 
-DWORD service::Continue(void)
+FILETIME RelativeFileTime(uint32_t milliseconds)
 {
-	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
-
-	// Service has to be in a status of PAUSED to accept this control
-	if(m_status != ServiceStatus::Paused) return ERROR_CALL_NOT_IMPLEMENTED;
-	
-	// Set the status to CONTINUE_PENDING
-	try { SetStatus(ServiceStatus::ContinuePending); }
-	catch(...) { Abort(std::current_exception()); }
-
-	try {
+	// Relative times are expressed as a negative number of 100 nanosecond intervals
+	ULARGE_INTEGER duetime;
+	duetime.QuadPart = static_cast<ULONGLONG>(-(static_cast<LONGLONG>(milliseconds) * 10000));
 
-		// Invoke all of the CONTINUE handlers prior to setting the service to RUNNING
-		for(const auto& handler : Handlers) if(handler->Control == ServiceControl::Continue) handler->Invoke(this, 0, nullptr);
-		SetStatus(ServiceStatus::Running);
-	}
-
-	catch(...) { Abort(std::current_exception()); }
-
-	return ERROR_SUCCESS;
+	return { duetime.LowPart, duetime.HighPart };
 }
 
 //-----------------------------------------------------------------------------
-// service::ControlHandler (private)
+// svctl::channel_base
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// channel_base::Close
 //
-// Handles a service control request from the service control manager
+// Closes the channel
 //
 // Arguments:
 //
-//	control			- Service control code
-//	eventtype		- Control-specific event type
-//	eventdata		- Control-specific event data
+//	NONE
 
-DWORD service::ControlHandler(ServiceControl control, DWORD eventtype, void* eventdata)
+void channel_base::Close(void)
 {
-	std::unique_lock<std::recursive_mutex> critsec(m_statuslock);
-
-	// Nothing should be coming in from the service control manager when stopped
-	if(m_status == ServiceStatus::Stopped) return ERROR_CALL_NOT_IMPLEMENTED;
+	if(m_closed.exchange(true)) return;
 
-	// INTERROGATE, STOP, PAUSE and CONTINUE are special case handlers
-	if(control == ServiceControl::Interrogate) return ERROR_SUCCESS;
-	else if(control == ServiceControl::Stop) { Stop(); return ERROR_SUCCESS; }
-	else if(control == ServiceControl::Pause) { Pause(); return ERROR_SUCCESS; }
-	else if(control == ServiceControl::Continue) { Continue(); return ERROR_SUCCESS; }
+	// A send that saw the channel open before the flag was set is allowed to finish enqueuing;
+	// those sends are short and never block, so they are waited for by spinning
+	for(uint32_t iteration = 0; m_senders.load(std::memory_order_seq_cst) != 0; iteration++) {
 
-	// When a trigger event is received during service stop, ERROR_SHUTDOWN_IN_PROGRESS
-	// should be returned.  The service won't indicate that this is accepted, but the
-	// documentation in MSDN seems to imply that it may still get this control ...
-	if((control == ServiceControl::TriggerEvent) && (m_status == ServiceStatus::StopPending))
-		return ERROR_SHUTDOWN_IN_PROGRESS;
+		if(iteration < 64) YieldProcessor();
+		else SwitchToThread();
+	}
 
-	// Done with messing about with the current service status; release the critsec
-	critsec.unlock();
+	// Wake the receiver so it can drain what is left, and release the name
+	m_available.Set();
+	channel_registry::Instance().Remove(this);
+}
 
-	// Iterate over all of the implemented control handlers and invoke each of them
-	// in the order in which they appear in the control handler vector<>
-	bool handled = false;
-	for(const auto& iterator : Handlers) {
+//-----------------------------------------------------------------------------
+// svctl::channel_registry
+//-----------------------------------------------------------------------------
 
-		if(iterator->Control != control) continue;
+//-----------------------------------------------------------------------------
+// channel_registry::Add
+//
+// Registers a new channel
+//
+// Arguments:
+//
+//	channel			- Channel to register
 
-		// Invoke the service control handler; if a non-zero result is returned stop
-		// processing them and return that result back to the service control manager
-		try { 
+void channel_registry::Add(const std::shared_ptr<channel_base>& channel)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
 
-			DWORD result = iterator->Invoke(this, eventtype, eventdata);
-			if(result != ERROR_SUCCESS) return result;
-		}
-		catch(...) { Abort(std::current_exception()); }
-		
-		handled = true;				// At least one handler was successfully invoked
-	}
+	for(const auto& iterator : m_channels)
+		if(_tcsicmp(iterator->Name, channel->Name) == 0) throw winexception(ERROR_ALREADY_EXISTS);
 
-	// Default for most service controls is to return ERROR_SUCCESS if it was handled
-	// and ERROR_CALL_NOT_IMPLEMENTED if no handler was present for the control
-	return (handled) ? ERROR_SUCCESS : ERROR_CALL_NOT_IMPLEMENTED;
+	m_channels.push_back(channel);
 }
 
 //-----------------------------------------------------------------------------
-// service::getAcceptedControls (private)
+// channel_registry::Find
 //
-// Determines what SERVICE_ACCEPT_XXXX codes the service will respond to based
-// on what control handlers have been registered
+// Retrieves an open channel
 //
 // Arguments:
 //
-//	NONE
+//	name			- Name of the channel
 
-DWORD service::getAcceptedControls(void)
+std::shared_ptr<channel_base> channel_registry::Find(const tchar_t* name)
 {
-	DWORD accept = 0;
+	std::lock_guard<std::mutex> critsec(m_lock);
 
-	// Derive what controls this service should report based on what service control handlers have
-	// been implemented in the derived class
-	for(const auto& iterator : Handlers) {
-
-		if(iterator->Control == ServiceControl::Stop)						accept |= SERVICE_ACCEPT_STOP;
-		else if(iterator->Control == ServiceControl::Pause)					accept |= SERVICE_ACCEPT_PAUSE_CONTINUE;
-		else if(iterator->Control == ServiceControl::Continue)				accept |= SERVICE_ACCEPT_PAUSE_CONTINUE;
-		else if(iterator->Control == ServiceControl::Shutdown)				accept |= SERVICE_ACCEPT_SHUTDOWN;
-		else if(iterator->Control == ServiceControl::ParameterChange)		accept |= SERVICE_ACCEPT_PARAMCHANGE;
-		else if(iterator->Control == ServiceControl::NetBindAdd)			accept |= SERVICE_ACCEPT_NETBINDCHANGE;
-		else if(iterator->Control == ServiceControl::NetBindRemove)			accept |= SERVICE_ACCEPT_NETBINDCHANGE;
-		else if(iterator->Control == ServiceControl::NetBindEnable)			accept |= SERVICE_ACCEPT_NETBINDCHANGE;
-		else if(iterator->Control == ServiceControl::NetBindDisable)		accept |= SERVICE_ACCEPT_NETBINDCHANGE;
-		else if(iterator->Control == ServiceControl::HardwareProfileChange)	accept |= SERVICE_ACCEPT_HARDWAREPROFILECHANGE;
-		else if(iterator->Control == ServiceControl::PowerEvent)			accept |= SERVICE_ACCEPT_POWEREVENT;
-		else if(iterator->Control == ServiceControl::SessionChange)			accept |= SERVICE_ACCEPT_SESSIONCHANGE;
-		else if(iterator->Control == ServiceControl::PreShutdown)			accept |= SERVICE_ACCEPT_PRESHUTDOWN;
-		else if(iterator->Control == ServiceControl::TimeChange)			accept |= SERVICE_ACCEPT_TIMECHANGE;
-		else if(iterator->Control == ServiceControl::TriggerEvent)			accept |= SERVICE_ACCEPT_TRIGGEREVENT;
-	}
+	for(const auto& iterator : m_channels)
+		if(_tcsicmp(iterator->Name, name) == 0) return iterator;
 
-	return accept;						// Return the generated bitmask
+	throw winexception(ERROR_NOT_FOUND);
 }
 
 //-----------------------------------------------------------------------------
-// service::getHandlers (protected, virtual)
+// channel_registry::Instance (static)
 //
-// Gets the collection of service-specific control handlers
+// Gets the process-wide channel registry
+//
+// Arguments:
+//
+//	NONE
 
-const control_handler_table& service::getHandlers(void) const
+channel_registry& channel_registry::Instance(void)
 {
-	// The default implementation has no handlers; this results in a service that
-	// can be started but otherwise will not respond to any controls, including STOP
-	static control_handler_table nohandlers;
-	return nohandlers;
+	static channel_registry instance;
+	return instance;
 }
 
 //-----------------------------------------------------------------------------
-// service::Pause
+// channel_registry::Remove
 //
-// Pauses the service
+// Removes a channel from the registry if it is still registered
 //
 // Arguments:
 //
-//	NONE
+//	channel			- Channel to remove
 
-DWORD service::Pause(void)
+void channel_registry::Remove(const channel_base* channel)
 {
-	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
-
-	// Service has to be in a status of RUNNING to accept this control
-	if(m_status != ServiceStatus::Running) return ERROR_CALL_NOT_IMPLEMENTED;
-	
-	// Set the service status to PAUSE_PENDING
-	try { SetStatus(ServiceStatus::PausePending); }
-	catch(...) { Abort(std::current_exception()); }
+	std::shared_ptr<channel_base> removed;		// Released after the lock
 
-	try {
+	std::lock_guard<std::mutex> critsec(m_lock);
 
-		// Invoke all of the PAUSE handlers prior to setting the service to PAUSED
-		for(const auto& handler : Handlers) if(handler->Control == ServiceControl::Pause) handler->Invoke(this, 0, nullptr);
-		SetStatus(ServiceStatus::Paused);
-	}
+	for(auto iterator = m_channels.begin(); iterator != m_channels.end(); iterator++) {
 
-	catch(...) { Abort(std::current_exception()); }
+		if(iterator->get() != channel) continue;
 
-	return ERROR_SUCCESS;
+		removed = std::move(*iterator);
+		m_channels.erase(iterator);
+		return;
+	}
 }
 
 //-----------------------------------------------------------------------------
-// service::Main
-//
-// Service instance entry point
+// svctl::control_channel
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// control_channel Constructor
 //
 // Arguments:
 //
-//	argc				- Number of command line arguments
-//	argv				- Array of command line argument strings
-//	context				- Service runtime context information and callbacks
+//	servicename		- Name of the service to connect to
+//	processid		- Process hosting the service instance, or zero to ask the service control manager
 
-void service::Main(int argc, tchar_t** argv, const service_context& context)
+control_channel::control_channel(const tchar_t* servicename, DWORD processid)
 {
-	using namespace std::placeholders;
-
-	assert(context.RegisterHandlerFunc);
-	if(!context.RegisterHandlerFunc) throw winexception(ERROR_INVALID_PARAMETER);
+	if((servicename == nullptr) || (*servicename == 0)) throw winexception(E_INVALIDARG);
 
-	assert(context.SetStatusFunc);
-	if(!context.SetStatusFunc) throw winexception(ERROR_INVALID_PARAMETER);
-
-	// Define a static HandlerEx callback that calls back into this service instance
-	LPHANDLER_FUNCTION_EX handler = [](DWORD control, DWORD eventtype, void* eventdata, void* context) -> DWORD { 
-		return reinterpret_cast<service*>(context)->ControlHandler(static_cast<ServiceControl>(control), eventtype, eventdata); };
+	// The channel names include the hosting process so that instances of a service with the same name
+	// in different processes don't collide; the service control manager knows the process of a service
+	if(processid == 0) processid = GetServiceProcessId(servicename);
+	if(processid == 0) throw winexception(ERROR_SERVICE_NOT_ACTIVE);
 
-	// Register a service control handler for this service instance
-	SERVICE_STATUS_HANDLE statushandle = context.RegisterHandlerFunc(argv[0], handler, this);
-	if(statushandle == 0) throw winexception();
+	// Services create the channel in the global namespace unless they lack the privilege to do
+	// so, applications hosting a service through the harness generally create it in the session
+	m_mapping = OpenFileMapping(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, control_channel_layout::ObjectName(servicename, processid, TEXT(""), true).c_str());
+	bool global = (m_mapping != nullptr);
+	if(!global) m_mapping = OpenFileMapping(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, control_channel_layout::ObjectName(servicename, processid, TEXT(""), false).c_str());
 
-	// Define a status reporting function that uses the handle and process type defined above
-	m_statusfunc = [=](SERVICE_STATUS& status) -> void {
+	// If the section doesn't exist the service isn't running or doesn't have any payload handlers
+	if(m_mapping == nullptr) throw winexception((GetLastError() == ERROR_FILE_NOT_FOUND) ? ERROR_SERVICE_NOT_ACTIVE : GetLastError());
 
-		assert(statushandle != 0);
-		status.dwServiceType = static_cast<DWORD>(context.ProcessType);
-		if(!context.SetStatusFunc(statushandle, &status)) throw winexception();
-	};
+	m_layout = reinterpret_cast<control_channel_layout*>(MapViewOfFile(m_mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(control_channel_layout)));
+	m_event = OpenEvent(EVENT_MODIFY_STATE, FALSE, control_channel_layout::ObjectName(servicename, processid, TEXT(".request"), global).c_str());
 
-	try {
+	if((m_layout == nullptr) || (m_event == nullptr) || (m_layout->Header.magic != control_channel_layout::MAGIC)) {
 
-		// Service is starting; report SERVICE_START_PENDING
-		SetStatus(ServiceStatus::StartPending);
+		DWORD result = ((m_layout != nullptr) && (m_event != nullptr)) ? ERROR_INVALID_DATA : GetLastError();
 
-		// Invoke derived service class startup code
-		OnStart(argc, argv);
+		if(m_event) CloseHandle(m_event);
+		if(m_layout) UnmapViewOfFile(m_layout);
+		CloseHandle(m_mapping);
 
-		// Service is now running, wait for the event indicating SERVICE_STOPPED has been set
-		SetStatus(ServiceStatus::Running);
-		WaitForSingleObject(m_stopsignal, INFINITE);
+		throw winexception(result);
 	}
+}
 
-	// Set the service to STOPPED on an unhandled winexception, translating ERROR_SUCCESS into ERROR_SERVICE_SPECIFIC.
-	// If the exception thrown is unknown use a generic ERROR_UNHANDLED_EXCEPTION as the stop code
-	catch(winexception& ex) { TrySetStatus(ServiceStatus::Stopped, (ex.code() != ERROR_SUCCESS) ? ex.code() : ERROR_SERVICE_SPECIFIC_ERROR); }
-	catch(...) { TrySetStatus(ServiceStatus::Stopped, ERROR_UNHANDLED_EXCEPTION); }
+//-----------------------------------------------------------------------------
+// control_channel Destructor
+
+control_channel::~control_channel()
+{
+	CloseHandle(m_event);
+	UnmapViewOfFile(m_layout);
+	CloseHandle(m_mapping);
 }
 
 //-----------------------------------------------------------------------------
-// service::SetNonPendingStatus (private)
+// control_channel::Backoff (private, static)
 //
-// Sets a non-pending service status
+// Spins, then yields, then sleeps while waiting on the service
 //
 // Arguments:
 //
-//	status				- New service status to set
-//	win32exitcode		- Win32 service exit code for ServiceStatus::Stopped (see documentation)
-//	serviceexitcode		- Service specific exit code for ServiceStatus::Stopped (see documentation)
+//	iteration	- Number of times the caller has already waited
+//	deadline	- Tick count after which the wait has timed out
 
-void service::SetNonPendingStatus(ServiceStatus status, uint32_t win32exitcode, uint32_t serviceexitcode)
+bool control_channel::Backoff(uint32_t iteration, uint64_t deadline)
 {
-	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+	// Most requests are answered within microseconds, spin on the processor first
+	if(iteration < SPIN_COUNT) { YieldProcessor(); return true; }
 
-	assert(m_statusfunc);							// Needs to be set
-	assert(!m_statusworker.joinable());			// Should not be running
+	if(GetTickCount64() >= deadline) return false;
 
-	// Create and initialize a new SERVICE_STATUS for this operation
-	SERVICE_STATUS newstatus;
-	newstatus.dwServiceType = 0;		// <-- Set by m_statusfunc
-	newstatus.dwCurrentState = static_cast<DWORD>(status);
-	newstatus.dwControlsAccepted = (status == ServiceStatus::Stopped) ? 0 : AcceptedControls;
-	newstatus.dwWin32ExitCode = (status == ServiceStatus::Stopped) ? win32exitcode : ERROR_SUCCESS;
-	newstatus.dwServiceSpecificExitCode = (status == ServiceStatus::Stopped) ? serviceexitcode : ERROR_SUCCESS;
-	newstatus.dwCheckPoint = 0;
-	newstatus.dwWaitHint = 0;
+	// Give up the remainder of the time slice before falling back to sleeping
+	if(iteration < (SPIN_COUNT * 2)) SwitchToThread();
+	else Sleep(1);
 
-	m_statusfunc(newstatus);						// Set the non-pending status
+	return true;
 }
 
 //-----------------------------------------------------------------------------
-// service::SetPendingStatus (private)
+// control_channel::Send
 //
-// Sets an automatically checkpointed pending service status
+// Sends a custom control and it's payload to the service and waits for the reply
 //
 // Arguments:
 //
-//	status				- Pending service status to set
-
-void service::SetPendingStatus(ServiceStatus status)
+//	control			- Custom control code (128 - 255)
+//	request			- Optional request payload
+//	requestlength	- Length of the request payload
+//	reply			- Optional buffer to receive the reply payload
+//	replycapacity	- Length of the reply buffer
+//	replylength		- Optional variable to receive the length of the reply payload
+//	timeout			- Time to wait for the service, in milliseconds
+
+DWORD control_channel::Send(uint32_t control, const void* request, size_t requestlength, void* reply, size_t replycapacity, 
+	size_t* replylength, uint32_t timeout)
 {
-	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
-
-	assert(m_statusfunc);							// Needs to be set
-	assert(!m_statusworker.joinable());				// Should not be running
+	if(replylength) *replylength = 0;
 
-	// Block all controls during SERVICE_START_PENDING and SERVICE_STOP_PENDING, otherwise only block
-	// controls that would result in a service status change while a status change is pending
-	DWORD accept = ((status == ServiceStatus::StartPending) || (status == ServiceStatus::StopPending)) ? 0 
-		: (AcceptedControls & ~(SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_PAUSE_CONTINUE | SERVICE_ACCEPT_SHUTDOWN));
+	// Only the custom control range can be sent, and the payload has to fit in a single slot
+	if((control < 128) || (control > 255)) return ERROR_INVALID_PARAMETER;
+	if((request == nullptr) && (requestlength > 0)) return ERROR_INVALID_PARAMETER;
+	if(requestlength > control_channel_layout::PAYLOAD_MAX) return ERROR_INVALID_PARAMETER;
 
-	// Set the initial pending status before launching the worker thread
-	SERVICE_STATUS newstatus;
-	newstatus.dwServiceType = 0;			// <-- Set by m_statusfunc
-	newstatus.dwCurrentState = static_cast<DWORD>(status);
-	newstatus.dwControlsAccepted = accept;
-	newstatus.dwWin32ExitCode = ERROR_SUCCESS;
-	newstatus.dwServiceSpecificExitCode = ERROR_SUCCESS;
-	newstatus.dwCheckPoint = 1;
-	newstatus.dwWaitHint = (status == ServiceStatus::StartPending) ? STARTUP_WAIT_HINT : PENDING_WAIT_HINT;
-	m_statusfunc(newstatus);
+	uint64_t deadline = (timeout == INFINITE) ? UINT64_MAX : GetTickCount64() + timeout;
+	control_channel_layout::header& header = m_layout->Header;
+	control_channel_layout::slot* slot = nullptr;
 
-	// Kick off a new worker thread to manage the automatic checkpoint operation
-	m_statusworker = std::move(std::thread([=]() {
+	// Claim the next free slot in the ring; when every slot is in use wait for one to be released
+	uint32_t position = header.enqueue.load(std::memory_order_relaxed);
+	for(uint32_t iteration = 0;;) {
 
-		try {
+		slot = &m_layout->Slots[position % control_channel_layout::SLOTS];
+		uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+		int32_t difference = static_cast<int32_t>(sequence - position);
 
-			// Copy the previous SERVICE_STATUS into a structure on the thread's stack
-			SERVICE_STATUS pendingstatus = newstatus;
+		if(difference == 0) { if(header.enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break; }
+		else if(difference > 0) position = header.enqueue.load(std::memory_order_relaxed);
+		else {
 
-			// Continually report the same pending status with an incremented checkpoint until signaled
-			while(WaitForSingleObject(m_statussignal, PENDING_CHECKPOINT_INTERVAL) == WAIT_TIMEOUT) {
+			// A reply from the previous lap that has not been released in time belongs to a client that
+			// died before reading it; release the slot on it's behalf rather than wait for it forever
+			if((sequence == position + 1 - control_channel_layout::SLOTS) &&
+				(slot->state.load(std::memory_order_acquire) == control_channel_layout::STATE_REPLIED) &&
+				(GetTickCount64() - slot->replytime >= control_channel_layout::RELEASE_TIMEOUT)) {
 
-				++pendingstatus.dwCheckPoint;
-				m_statusfunc(pendingstatus);
+				slot->sequence.compare_exchange_strong(sequence, position, std::memory_order_release, std::memory_order_relaxed);
+				continue;
 			}
+
+			if(!Backoff(iteration++, deadline)) return ERROR_TIMEOUT;
+			position = header.enqueue.load(std::memory_order_relaxed);
+		}
+	}
+
+	// Write the request into the slot, publish it and wake up the service.  If this thread stalled
+	// for longer than CLAIM_TIMEOUT the service has skipped the slot and the request can't be sent
+	slot->control = control;
+	slot->requestlength = static_cast<uint32_t>(requestlength);
+	if(requestlength) memcpy(slot->request, request, requestlength);
+	slot->state.store(control_channel_layout::STATE_PENDING, std::memory_order_relaxed);
+
+	uint32_t claimed = position;
+	if(!slot->sequence.compare_exchange_strong(claimed, position + 1, std::memory_order_release, std::memory_order_relaxed)) return ERROR_TIMEOUT;
+	SetEvent(m_event);
+
+	// Wait for the reply; if the wait times out the slot is abandoned and will be released by the
+	// service after it has been processed, unless the reply arrived in the meantime
+	for(uint32_t iteration = 0; slot->state.load(std::memory_order_acquire) != control_channel_layout::STATE_REPLIED;) {
+
+		if(!Backoff(iteration++, deadline)) {
+
+			if(slot->state.exchange(control_channel_layout::STATE_ABANDONED, std::memory_order_acq_rel) != control_channel_layout::STATE_REPLIED) return ERROR_TIMEOUT;
+			break;
 		}
+	}
 
-		// Copy any worker thread exceptions into the m_statusexception member variable,
-		// this can be checked on the next call to SetStatus()
-		catch(...) { m_statusexception = std::current_exception(); }
-	}));
+	// Copy as much of the reply as will fit into the caller's buffer
+	DWORD result = slot->result;
+	size_t length = std::min(static_cast<size_t>(slot->replylength), sizeof(slot->reply));
+	if(reply) memcpy(reply, slot->reply, std::min(length, replycapacity));
+	if((length > replycapacity) && (result == ERROR_SUCCESS)) result = ERROR_MORE_DATA;
+
+	// Release the slot for the next lap around the ring; if another client reclaimed it after
+	// RELEASE_TIMEOUT the reply may have been overwritten while it was being copied
+	uint32_t published = position + 1;
+	if(!slot->sequence.compare_exchange_strong(published, position + control_channel_layout::SLOTS, std::memory_order_release, std::memory_order_relaxed)) return ERROR_TIMEOUT;
+
+	if(replylength) *replylength = length;
+	return result;
 }
 
 //-----------------------------------------------------------------------------
-// service::SetStatus (private)
-//
-// Sets a new service status; pending vs. non-pending is handled automatically
+// svctl::control_channel_host
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// control_channel_host Constructor
 //
 // Arguments:
 //
-//	status			- New service status to set
-//	win32exitcode	- Win32 specific exit code for ServiceStatus::Stopped (see documentation)
-//	serviceexitcode	- Service-specific exit code for ServiceStatus::Stopped (see documentation)
+//	servicename		- Name of the service exposing the channel
+//	handler			- Function invoked to process each request
+//	keepalive		- Optional function that references the owner during dispatch
+//	environ			- Optional thread pool callback environment
 
-void service::SetStatus(ServiceStatus status, uint32_t win32exitcode, uint32_t serviceexitcode)
+control_channel_host::control_channel_host(const tchar_t* servicename, handler_func handler, keepalive_func keepalive, PTP_CALLBACK_ENVIRON environ) :
+	m_handler(std::move(handler)), m_keepalive(std::move(keepalive))
 {
-	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+	if((servicename == nullptr) || (*servicename == 0)) throw winexception(E_INVALIDARG);
+	if(!m_handler) throw winexception(E_INVALIDARG);
 
-	// Check for a duplicate status; pending states are managed automatically
-	if(status == m_status) return;
+	try {
+
+		DWORD processid = GetCurrentProcessId();
+
+		// Create the section in the global namespace so that tools in other sessions can reach the service,
+		// fall back to the session namespace if the process doesn't hold SeCreateGlobalPrivilege
+		bool global = true;
+		m_mapping = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(control_channel_layout), 
+			control_channel_layout::ObjectName(servicename, processid, TEXT(""), true).c_str());
+		if(m_mapping == nullptr) {
+
+			global = false;
+			m_mapping = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(control_channel_layout), 
+				control_channel_layout::ObjectName(servicename, processid, TEXT(""), false).c_str());
+			if(m_mapping == nullptr) throw winexception();
+		}
+
+		// Another instance of the service in this process already owns the channel; don't take over it's ring
+		if(GetLastError() == ERROR_ALREADY_EXISTS) throw winexception(ERROR_ALREADY_EXISTS);
+
+		m_layout = reinterpret_cast<control_channel_layout*>(MapViewOfFile(m_mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(control_channel_layout)));
+		if(m_layout == nullptr) throw winexception();
+
+		m_event = CreateEvent(nullptr, FALSE, FALSE, control_channel_layout::ObjectName(servicename, processid, TEXT(".request"), global).c_str());
+		if(m_event == nullptr) throw winexception();
+		if(GetLastError() == ERROR_ALREADY_EXISTS) throw winexception(ERROR_ALREADY_EXISTS);
+
+		// Initialize the ring; the magic number is written last so clients won't attach to a
+		// partially initialized section
+		m_layout->Header.magic = 0;
+		m_layout->Header.slots = control_channel_layout::SLOTS;
+		m_layout->Header.payloadmax = control_channel_layout::PAYLOAD_MAX;
+		m_layout->Header.enqueue.store(0, std::memory_order_relaxed);
+		m_layout->Header.dequeue.store(0, std::memory_order_relaxed);
+		for(uint32_t index = 0; index < control_channel_layout::SLOTS; index++) m_layout->Slots[index].sequence.store(index, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_layout->Header.magic = control_channel_layout::MAGIC;
+
+		// Dispatch requests from the thread pool whenever the request event is signaled
+		m_wait = CreateThreadpoolWait(WaitCallback, this, environ);
+		if(m_wait == nullptr) throw winexception();
+		SetThreadpoolWait(m_wait, m_event, nullptr);
+	}
+
+	catch(...) { Release(); throw; }
+}
+
+//-----------------------------------------------------------------------------
+// control_channel_host Destructor
+
+control_channel_host::~control_channel_host()
+{
+	Close();
+	Release();
+}
+
+//-----------------------------------------------------------------------------
+// control_channel_host::Close
+//
+// Stops dispatching requests; may be called more than once and from a request handler
+//
+// Arguments:
+//
+//	NONE
+
+void control_channel_host::Close(void)
+{
+	m_closed = true;
+
+	// Stop the wait and, unless this is being called from a dispatch of this host, wait for any
+	// in-progress dispatch to finish.  The wait is stopped again in case it was rearmed before
+	// the dispatch noticed the flag
+	SetThreadpoolWait(m_wait, nullptr, nullptr);
+	if(Dispatching() != this) {
+
+		WaitForThreadpoolWaitCallbacks(m_wait, TRUE);
+		SetThreadpoolWait(m_wait, nullptr, nullptr);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// control_channel_host::Dispatching (private, static)
+//
+// Gets the host dispatching requests on the calling thread, if any
+//
+// Arguments:
+//
+//	NONE
+
+const control_channel_host*& control_channel_host::Dispatching(void)
+{
+	static thread_local const control_channel_host* host = nullptr;
+	return host;
+}
+
+//-----------------------------------------------------------------------------
+// control_channel_host::Drain (private)
+//
+// Processes all of the published requests in the ring
+//
+// Arguments:
+//
+//	NONE
+
+bool control_channel_host::Drain(void)
+{
+	control_channel_layout::header& header = m_layout->Header;
+
+	// Only one dispatch runs at a time, the service is the single consumer of the ring
+	while(!m_closed) {
+
+		uint32_t position = header.dequeue.load(std::memory_order_relaxed);
+		control_channel_layout::slot& slot = m_layout->Slots[position % control_channel_layout::SLOTS];
+		uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+		if(sequence != position + 1) {
+
+			// Nothing else has been published unless a client has claimed this position
+			if((sequence != position) || (header.enqueue.load(std::memory_order_relaxed) == position)) break;
+
+			// A client that dies between claiming and publishing the slot would hold up the ring forever;
+			// once it has been claimed for CLAIM_TIMEOUT skip it, unless it was published in the meantime
+			uint64_t now = GetTickCount64();
+			if((m_stalledsince == 0) || (m_stalled != position)) { m_stalled = position; m_stalledsince = now; return false; }
+			if(now - m_stalledsince < control_channel_layout::CLAIM_TIMEOUT) return false;
+
+			m_stalledsince = 0;
+			if(slot.sequence.compare_exchange_strong(sequence, position + control_channel_layout::SLOTS, std::memory_order_release, std::memory_order_relaxed))
+				header.dequeue.store(position + 1, std::memory_order_relaxed);
+
+			continue;
+		}
+
+		// The request and reply have separate buffers in the slot, the handler can use them in place
+		control_payload payload = { slot.request, std::min(static_cast<size_t>(slot.requestlength), sizeof(slot.request)), 
+			slot.reply, sizeof(slot.reply), 0 };
+
+		// The section is writable by any client; never let it deliver anything but a custom control
+		slot.result = ((slot.control >= 128) && (slot.control <= 255)) ? m_handler(slot.control, payload) : ERROR_INVALID_PARAMETER;
+		slot.replylength = static_cast<uint32_t>(std::min(payload.ReplyLength, sizeof(slot.reply)));
+		header.dequeue.store(position + 1, std::memory_order_relaxed);
+		slot.replytime = GetTickCount64();
+
+		// Hand the reply to the client; if the client has stopped waiting release the slot here instead
+		if(slot.state.exchange(control_channel_layout::STATE_REPLIED, std::memory_order_acq_rel) == control_channel_layout::STATE_ABANDONED)
+			slot.sequence.store(position + control_channel_layout::SLOTS, std::memory_order_release);
+	}
+
+	m_stalledsince = 0;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// control_channel_host::Release (private)
+//
+// Releases the kernel objects held by the host
+//
+// Arguments:
+//
+//	NONE
+
+void control_channel_host::Release(void)
+{
+	if(m_wait) CloseThreadpoolWait(m_wait);
+	if(m_event) CloseHandle(m_event);
+	if(m_layout) UnmapViewOfFile(m_layout);
+	if(m_mapping) CloseHandle(m_mapping);
+
+	m_wait = nullptr;
+	m_event = m_mapping = nullptr;
+	m_layout = nullptr;
+}
+
+//-----------------------------------------------------------------------------
+// control_channel_host::WaitCallback (private, static)
+//
+// Thread pool callback invoked when a client has published a request
+//
+// Arguments:
+//
+//	instance	- Callback instance
+//	context		- Pointer to the control_channel_host instance
+//	wait		- Thread pool wait object
+//	result		- Wait result
+
+void CALLBACK control_channel_host::WaitCallback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WAIT wait, TP_WAIT_RESULT result)
+{
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(result);
+
+	control_channel_host* host = reinterpret_cast<control_channel_host*>(context);
+
+	// Mark this thread as dispatching for the host until the owner has been released, Close()
+	// can't wait for the dispatch to complete when it's called from the dispatch itself
+	Dispatching() = host;
+
+	{
+		// Reference the owner while requests are processed; releasing this may destroy the host
+		// so nothing can touch the host after it goes out of scope
+		std::shared_ptr<void> keepalive = (host->m_keepalive) ? host->m_keepalive() : nullptr;
+
+		// Rearm the wait for the next request unless the channel has been closed; if the ring is held
+		// up by an unpublished slot, check it again after CLAIM_TIMEOUT even if no request arrives
+		if(host->Drain()) { if(!host->m_closed) SetThreadpoolWait(wait, host->m_event, nullptr); }
+		else if(!host->m_closed) {
+
+			FILETIME timeout = RelativeFileTime(control_channel_layout::CLAIM_TIMEOUT);
+			SetThreadpoolWait(wait, host->m_event, &timeout);
+		}
+	}
+
+	Dispatching() = nullptr;
+}
+
+//-----------------------------------------------------------------------------
+// svctl::control_channel_layout
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// control_channel_layout::ObjectName (static)
+//
+// Generates the name of a control channel kernel object
+//
+// Arguments:
+//
+//	servicename		- Name of the service exposing the channel
+//	processid		- Process hosting the service instance
+//	suffix			- Suffix that identifies the object
+//	global			- Flag to use the global rather than the session namespace
+
+tstring control_channel_layout::ObjectName(const tchar_t* servicename, DWORD processid, const tchar_t* suffix, bool global)
+{
+	return tstring((global) ? TEXT("Global\\") : TEXT("Local\\")) + TEXT("svctl.control.") + servicename + TEXT(".") +
+		to_tstring(processid) + suffix;
+}
+
+//-----------------------------------------------------------------------------
+// svctl::handler_watchdog
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// handler_watchdog Constructor
+//
+// Arguments:
+//
+//	clock		- Clock used for the deadlines and the timer
+//	environ		- Thread pool callback environment for the timer; can be null
+//	func		- Function invoked for each handler that overruns it's budget
+
+handler_watchdog::handler_watchdog(service_clock& clock, PTP_CALLBACK_ENVIRON environ, stall_func func) : m_clock(clock), m_func(std::move(func))
+{
+	m_timer = m_clock.CreateTimer([=]() -> void { Check(); }, environ);
+}
+
+//-----------------------------------------------------------------------------
+// handler_watchdog Destructor
+
+handler_watchdog::~handler_watchdog()
+{
+	m_clock.CloseTimer(m_timer);
+}
+
+//-----------------------------------------------------------------------------
+// handler_watchdog::CaptureStack (private, static)
+//
+// Captures the return addresses of a thread
+//
+// Arguments:
+//
+//	threadid	- Identifier of the thread to capture
+//	stack		- Receives the return addresses, innermost first
+
+void handler_watchdog::CaptureStack(DWORD threadid, std::vector<uintptr_t>& stack)
+{
+#if defined(_M_X64)
+
+	// A handler being run by the timer callback thread itself cannot be suspended
+	if(threadid == GetCurrentThreadId()) return;
+
+	HANDLE thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, threadid);
+	if(thread == nullptr) return;
+
+	// Nothing can be allocated or unwound while the thread is suspended, it may be holding the heap
+	// lock or the loader lock the unwinder needs; the registers and the raw stack are copied into a
+	// buffer allocated up front and the copy is walked once the thread has been resumed
+	std::vector<uint8_t> copy(MAX_STACK_BYTES);
+	size_t length = 0;
+
+	CONTEXT context = {};
+	context.ContextFlags = CONTEXT_FULL;
+
+	if(SuspendThread(thread) != static_cast<DWORD>(-1)) {
+
+		// The stack runs from the stack pointer to the end of the committed region that contains it
+		MEMORY_BASIC_INFORMATION region = {};
+		if(GetThreadContext(thread, &context) && (VirtualQuery(reinterpret_cast<void*>(context.Rsp), &region, sizeof(region)) != 0) &&
+			(region.State == MEM_COMMIT) && ((region.Protect & PAGE_GUARD) == 0)) {
+
+			uintptr_t end = reinterpret_cast<uintptr_t>(region.BaseAddress) + region.RegionSize;
+			length = std::min<size_t>(static_cast<size_t>(end - context.Rsp), MAX_STACK_BYTES);
+			memcpy(copy.data(), reinterpret_cast<void*>(context.Rsp), length);
+		}
+
+		ResumeThread(thread);
+	}
+
+	CloseHandle(thread);
+	if(length == 0) return;
+
+	uintptr_t frames[MAX_FRAMES];
+	size_t count = WalkStack(context, static_cast<uintptr_t>(context.Rsp), copy.data(), length, frames, MAX_FRAMES);
+	stack.assign(frames, frames + count);
+
+#else
+
+	// The stack is only walked on x64, other platforms report the thread without it
+	UNREFERENCED_PARAMETER(threadid);
+	UNREFERENCED_PARAMETER(stack);
+
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// handler_watchdog::Check (private)
+//
+// Timer callback; reports the overdue handlers and restarts the timer
+//
+// Arguments:
+//
+//	NONE
+
+void handler_watchdog::Check(void)
+{
+	std::vector<handler_stall> stalls;
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		uint64_t now = m_clock.Now();
+
+		// Each overrun is only reported once, no matter how much longer the handler runs
+		for(auto& entry : m_watches) {
+
+			if(entry.reported || ((now - entry.started) < entry.budget)) continue;
+			entry.reported = true;
+
+			stalls.push_back({ entry.control, entry.budget, static_cast<uint32_t>(std::min<uint64_t>(now - entry.started, UINT32_MAX)), entry.threadid, {} });
+		}
+
+		Schedule();
+	}
+
+	// The stacks are captured without the lock; a handler that returns in the meantime is still reported
+	for(auto& stall : stalls) {
+
+		m_stalls++;
+		CaptureStack(stall.ThreadId, stall.Stack);
+
+		try { m_func(stall); }
+		catch(...) { /* keep watching */ }
+	}
+}
+
+//-----------------------------------------------------------------------------
+// handler_watchdog::Schedule (private)
+//
+// Starts the timer for the earliest unreported deadline; lock must be held
+//
+// Arguments:
+//
+//	NONE
+
+void handler_watchdog::Schedule(void)
+{
+	uint64_t deadline = UINT64_MAX;
+	for(const auto& entry : m_watches) if(!entry.reported) deadline = std::min(deadline, entry.started + entry.budget);
+
+	// With nothing left to watch the timer is left alone; if it fires it finds nothing overdue
+	if(deadline == UINT64_MAX) return;
+
+	uint64_t now = m_clock.Now();
+	m_clock.StartTimer(m_timer, (deadline > now) ? static_cast<uint32_t>(std::min<uint64_t>(deadline - now, UINT32_MAX - 1)) : 1);
+}
+
+//-----------------------------------------------------------------------------
+// handler_watchdog::scope Constructor
+//
+// Arguments:
+//
+//	watchdog	- Watchdog to register with; can be null
+//	control		- Control being handled
+//	budget		- Latency budget of the handler, INFINITE if it is not watched
+
+handler_watchdog::scope::scope(handler_watchdog* watchdog, ServiceControl control, uint32_t budget)
+{
+	// Handlers without a budget are not watched and cost nothing
+	if((watchdog == nullptr) || (budget == INFINITE)) return;
+
+	std::lock_guard<std::mutex> critsec(watchdog->m_lock);
+
+	m_watchdog = watchdog;
+	m_cookie = watchdog->m_nextcookie++;
+	watchdog->m_watches.push_back({ m_cookie, control, budget, watchdog->m_clock.Now(), GetCurrentThreadId(), false });
+
+	watchdog->Schedule();
+}
+
+//-----------------------------------------------------------------------------
+// handler_watchdog::scope Destructor
+
+handler_watchdog::scope::~scope()
+{
+	if(m_watchdog == nullptr) return;
+
+	std::lock_guard<std::mutex> critsec(m_watchdog->m_lock);
+
+	auto& watches = m_watchdog->m_watches;
+	watches.erase(std::remove_if(watches.begin(), watches.end(), [=](const watch& entry) -> bool { return entry.cookie == m_cookie; }), watches.end());
+}
+
+//-----------------------------------------------------------------------------
+// handler_watchdog::WalkStack (private, static)
+//
+// Unwinds a copy of a thread stack into an array of return addresses
+//
+// Arguments:
+//
+//	context		- Registers of the thread when the stack was copied
+//	stackbase	- Address the copy was taken from, the original stack pointer
+//	copy		- Copy of the stack
+//	length		- Length of the copy, in bytes
+//	frames		- Receives the return addresses, innermost first
+//	maxframes	- Maximum number of return addresses
+
+size_t handler_watchdog::WalkStack(CONTEXT& context, uintptr_t stackbase, uint8_t* copy, size_t length, uintptr_t* frames, size_t maxframes)
+{
+#if defined(_M_X64)
+
+	// The stack and frame pointers are moved into the copy; a frame pointer restored from the
+	// stack refers to the original stack and is moved the same way after each frame
+	uintptr_t copybase = reinterpret_cast<uintptr_t>(copy);
+	auto relocate = [=](DWORD64& address) -> void {
+
+		if((address >= stackbase) && (address < stackbase + length)) address = address - stackbase + copybase;
+	};
+
+	relocate(context.Rsp);
+	relocate(context.Rbp);
+
+	size_t count = 0;
+
+	// The copy of a wedged thread's stack is not trusted; a fault while walking it ends the walk
+	// rather than the process
+	__try {
+
+		while((count < maxframes) && (context.Rip != 0)) {
+
+			frames[count++] = static_cast<uintptr_t>(context.Rip);
+
+			// The walk ends when it leaves the part of the stack that was copied
+			if((context.Rsp < copybase) || (context.Rsp + sizeof(DWORD64) > copybase + length)) break;
+
+			DWORD64 imagebase = 0;
+			PRUNTIME_FUNCTION function = RtlLookupFunctionEntry(context.Rip, &imagebase, nullptr);
+
+			// Only the innermost frame can be a leaf function without unwind data, it's return address
+			// is at the top of the stack; anywhere else a missing entry means the stack can't be followed
+			if(function == nullptr) {
+
+				if(count > 1) break;
+
+				context.Rip = *reinterpret_cast<DWORD64*>(context.Rsp);
+				context.Rsp += sizeof(DWORD64);
+			}
+
+			else {
+
+				void* handlerdata = nullptr;
+				DWORD64 establisher = 0;
+				RtlVirtualUnwind(UNW_FLAG_NHANDLER, imagebase, context.Rip, function, &context, &handlerdata, &establisher, nullptr);
+				relocate(context.Rbp);
+			}
+		}
+	}
+
+	__except(EXCEPTION_EXECUTE_HANDLER) { /* partial stack */ }
+
+	return count;
+
+#else
+
+	UNREFERENCED_PARAMETER(context);
+	UNREFERENCED_PARAMETER(stackbase);
+	UNREFERENCED_PARAMETER(copy);
+	UNREFERENCED_PARAMETER(length);
+	UNREFERENCED_PARAMETER(frames);
+	UNREFERENCED_PARAMETER(maxframes);
+
+	return 0;
+
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// svctl::handoff_store
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// handoff_store Destructor
+
+handoff_store::~handoff_store()
+{
+	for(auto& iterator : m_entries) Release(iterator.second);
+}
+
+//-----------------------------------------------------------------------------
+// handoff_store::ClaimHandle
+//
+// Takes ownership of a handle parked for a service
+//
+// Arguments:
+//
+//	servicename		- Service name
+//	name			- Name the handle was parked with
+
+HANDLE handoff_store::ClaimHandle(const tchar_t* servicename, const tchar_t* name)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	parked* entry = Find(servicename, false);
+	if(entry == nullptr) return nullptr;
+
+	// A socket can only be claimed as a socket, it has to be closed with closesocket()
+	auto found = entry->handles.find(name);
+	if((found == entry->handles.end()) || (found->second.socket)) return nullptr;
+
+	HANDLE handle = found->second.handle;
+	entry->handles.erase(found);
+
+	return handle;
+}
+
+//-----------------------------------------------------------------------------
+// handoff_store::ClaimSocket
+//
+// Takes ownership of a socket parked for a service
+//
+// Arguments:
+//
+//	servicename		- Service name
+//	name			- Name the socket was parked with
+
+SOCKET handoff_store::ClaimSocket(const tchar_t* servicename, const tchar_t* name)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	parked* entry = Find(servicename, false);
+	if(entry == nullptr) return INVALID_SOCKET;
+
+	auto found = entry->handles.find(name);
+	if((found == entry->handles.end()) || (!found->second.socket)) return INVALID_SOCKET;
+
+	SOCKET sock = reinterpret_cast<SOCKET>(found->second.handle);
+	entry->handles.erase(found);
+
+	return sock;
+}
+
+//-----------------------------------------------------------------------------
+// handoff_store::ClaimState
+//
+// Takes the state parked for a service
+//
+// Arguments:
+//
+//	servicename		- Service name
+
+std::vector<uint8_t> handoff_store::ClaimState(const tchar_t* servicename)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	parked* entry = Find(servicename, false);
+	if((entry == nullptr) || (entry->section == nullptr)) return std::vector<uint8_t>();
+
+	void* view = MapViewOfFile(entry->section, FILE_MAP_READ, 0, 0, entry->length);
+	if(view == nullptr) throw winexception();
+
+	// The state can only be claimed once, the section is released as soon as it has been copied
+	std::vector<uint8_t> state(reinterpret_cast<uint8_t*>(view), reinterpret_cast<uint8_t*>(view) + entry->length);
+	UnmapViewOfFile(view);
+
+	CloseHandle(entry->section);
+	entry->section = nullptr;
+	entry->length = 0;
+
+	return state;
+}
+
+//-----------------------------------------------------------------------------
+// handoff_store::Find (private)
+//
+// Finds the parked entry for a service; lock must be held
+//
+// Arguments:
+//
+//	servicename		- Service name
+//	create			- Flag to create the entry if it does not exist
+
+handoff_store::parked* handoff_store::Find(const tchar_t* servicename, bool create)
+{
+	for(auto& iterator : m_entries)
+		if(_tcsicmp(iterator.first.c_str(), servicename) == 0) return &iterator.second;
+
+	if(!create) return nullptr;
+
+	m_entries.emplace_back(servicename, parked());
+	return &m_entries.back().second;
+}
+
+//-----------------------------------------------------------------------------
+// handoff_store::Instance (static)
+//
+// Gets the process-wide handoff store
+//
+// Arguments:
+//
+//	NONE
+
+handoff_store& handoff_store::Instance(void)
+{
+	static handoff_store instance;
+	return instance;
+}
+
+//-----------------------------------------------------------------------------
+// handoff_store::ParkHandle
+//
+// Transfers ownership of a handle to the store
+//
+// Arguments:
+//
+//	servicename		- Service name
+//	name			- Name to park the handle with
+//	handle			- Handle to be parked
+
+void handoff_store::ParkHandle(const tchar_t* servicename, const tchar_t* name, HANDLE handle)
+{
+	if((name == nullptr) || (handle == nullptr) || (handle == INVALID_HANDLE_VALUE)) throw winexception(E_INVALIDARG);
+
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	parked_handle& parkedhandle = Find(servicename, true)->handles[name];
+	Release(parkedhandle);
+
+	parkedhandle = { handle, false };
+}
+
+//-----------------------------------------------------------------------------
+// handoff_store::ParkSocket
+//
+// Transfers ownership of a socket to the store
+//
+// Arguments:
+//
+//	servicename		- Service name
+//	name			- Name to park the socket with
+//	sock			- Socket to be parked
+
+void handoff_store::ParkSocket(const tchar_t* servicename, const tchar_t* name, SOCKET sock)
+{
+	if((name == nullptr) || (sock == INVALID_SOCKET)) throw winexception(E_INVALIDARG);
+
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	parked_handle& parkedhandle = Find(servicename, true)->handles[name];
+	Release(parkedhandle);
+
+	parkedhandle = { reinterpret_cast<HANDLE>(sock), true };
+}
+
+//-----------------------------------------------------------------------------
+// handoff_store::ParkState
+//
+// Copies the state of a service into the store
+//
+// Arguments:
+//
+//	servicename		- Service name
+//	data			- State to be parked
+//	length			- Length of the state
+
+void handoff_store::ParkState(const tchar_t* servicename, const void* data, size_t length)
+{
+	if((data == nullptr) && (length > 0)) throw winexception(E_INVALIDARG);
+
+	HANDLE section = nullptr;
+
+	// The state is copied into a new section before anything already parked is replaced
+	if(length > 0) {
+
+		uint64_t size = length;
+		section = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+		if(section == nullptr) throw winexception();
+
+		void* view = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, length);
+		if(view == nullptr) { DWORD result = GetLastError(); CloseHandle(section); throw winexception(result); }
+
+		memcpy(view, data, length);
+		UnmapViewOfFile(view);
+	}
+
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	parked* entry = Find(servicename, true);
+	if(entry->section) CloseHandle(entry->section);
+
+	entry->section = section;
+	entry->length = length;
+}
+
+//-----------------------------------------------------------------------------
+// handoff_store::Release (private, static)
+//
+// Closes the section and handles held by a parked entry
+//
+// Arguments:
+//
+//	entry			- Parked entry to release
+
+void handoff_store::Release(parked& entry)
+{
+	if(entry.section) CloseHandle(entry.section);
+	entry.section = nullptr;
+	entry.length = 0;
+
+	for(auto& iterator : entry.handles) Release(iterator.second);
+	entry.handles.clear();
+}
+
+//-----------------------------------------------------------------------------
+// handoff_store::Release (private, static)
+//
+// Closes a parked handle or socket
+//
+// Arguments:
+//
+//	handle			- Parked handle to release
+
+void handoff_store::Release(parked_handle& handle)
+{
+	if(handle.handle == nullptr) return;
+
+	if(handle.socket) closesocket(reinterpret_cast<SOCKET>(handle.handle));
+	else CloseHandle(handle.handle);
+
+	handle.handle = nullptr;
+}
+
+//-----------------------------------------------------------------------------
+// svctl::io_loop
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// io_loop Constructor
+//
+// Arguments:
+//
+//	clock		- Clock used for the timeout deadlines
+//	environ		- Thread pool callback environment for the wake timer; can be null
+
+io_loop::io_loop(service_clock& clock, PTP_CALLBACK_ENVIRON environ) : m_clock(clock)
+{
+	m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+	if(m_port == nullptr) throw winexception();
+
+	// The wait for completions is not on the service clock; a timer on it wakes the loop instead
+	try { m_timer = m_clock.CreateTimer([=]() -> void { PostQueuedCompletionStatus(m_port, 0, KEY_WAKE, nullptr); }, environ); }
+	catch(...) { CloseHandle(m_port); throw; }
+}
+
+//-----------------------------------------------------------------------------
+// io_loop Destructor
+
+io_loop::~io_loop()
+{
+	m_clock.CloseTimer(m_timer);
+
+	std::vector<operation*> inflight;
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		inflight = m_inflight;
+	}
+
+	// Operations still in flight reference OVERLAPPED structures owned by this object, they have
+	// to be canceled and their completions dequeued before the memory can be released.  The handles
+	// may already have been closed, which cancels the operations, so only the port is waited on
+	for(auto& op : inflight) CancelIoEx(op->handle, op);
+
+	OVERLAPPED_ENTRY entries[BATCH_SIZE];
+	while(!inflight.empty()) {
+
+		ULONG count = 0;
+		if(!GetQueuedCompletionStatusEx(m_port, entries, BATCH_SIZE, &count, INFINITE, FALSE)) break;
+
+		for(ULONG index = 0; index < count; index++) {
+
+			if(entries[index].lpCompletionKey != KEY_IO) continue;
+
+			operation* op = static_cast<operation*>(entries[index].lpOverlapped);
+			inflight.erase(std::remove(inflight.begin(), inflight.end(), op), inflight.end());
+			delete op;
+		}
+	}
+
+	for(auto& op : m_deferred) delete op;
+
+	CloseHandle(m_port);
+}
+
+//-----------------------------------------------------------------------------
+// io_loop::Accept
+//
+// Waits for a client to connect to an overlapped named pipe instance
+//
+// Arguments:
+//
+//	pipe		- Named pipe instance created with FILE_FLAG_OVERLAPPED
+//	func		- Function to invoke once a client has connected
+
+void io_loop::Accept(HANDLE pipe, completion_func func)
+{
+	operation* op = Begin(pipe, 0, std::move(func));
+
+	if(ConnectNamedPipe(pipe, op)) { Submitted(op); return; }
+
+	DWORD result = GetLastError();
+	if(result == ERROR_IO_PENDING) { Submitted(op); return; }
+
+	// A client that connected between CreateNamedPipe and ConnectNamedPipe does not
+	// generate a completion packet; post one so the function is still invoked from Run()
+	if(result == ERROR_PIPE_CONNECTED) {
+
+		op->Internal = 0;
+		if(PostQueuedCompletionStatus(m_port, 0, KEY_IO, op)) return;
+		result = GetLastError();
+	}
+
+	Failed(op, result);
+}
+
+//-----------------------------------------------------------------------------
+// io_loop::Associate
+//
+// Associates a handle opened for overlapped I/O with the loop
+//
+// Arguments:
+//
+//	handle		- Handle to associate with the completion port
+
+void io_loop::Associate(HANDLE handle)
+{
+	if(CreateIoCompletionPort(handle, m_port, KEY_IO, 0) == nullptr) throw winexception();
+}
+
+//-----------------------------------------------------------------------------
+// io_loop::Begin (private)
+//
+// Allocates and tracks a new operation
+//
+// Arguments:
+//
+//	handle		- Handle the operation will be submitted against
+//	offset		- Offset at which to start the operation
+//	func		- Completion function
+
+io_loop::operation* io_loop::Begin(HANDLE handle, uint64_t offset, completion_func&& func)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	if(m_stopping) throw winexception(ERROR_OPERATION_ABORTED);
+
+	operation* op = new operation();
+	op->Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+	op->OffsetHigh = static_cast<DWORD>(offset >> 32);
+	op->handle = handle;
+	op->func = std::move(func);
+
+	m_inflight.push_back(op);
+	return op;
+}
+
+//-----------------------------------------------------------------------------
+// io_loop::Complete (private)
+//
+// Removes an operation from tracking and invokes or holds it's completion function
+//
+// Arguments:
+//
+//	op			- Completed operation
+
+void io_loop::Complete(operation* op)
+{
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		m_inflight.erase(std::remove(m_inflight.begin(), m_inflight.end(), op), m_inflight.end());
+	}
+
+	// A paused loop holds completions until it has been continued or stopped
+	if(m_paused) { m_deferred.push_back(op); return; }
+
+	std::unique_ptr<operation> owner(op);
+	op->func(op->result, op->bytes);
+}
+
+//-----------------------------------------------------------------------------
+// io_loop::Failed (private)
+//
+// Releases an operation that could not be submitted and throws the error
+//
+// Arguments:
+//
+//	op			- Operation that failed to be submitted
+//	result		- Win32 error code
+
+void io_loop::Failed(operation* op, DWORD result)
+{
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		m_inflight.erase(std::remove(m_inflight.begin(), m_inflight.end(), op), m_inflight.end());
+	}
+
+	delete op;
+	throw winexception(result);
+}
+
+//-----------------------------------------------------------------------------
+// io_loop::Post (private)
+//
+// Posts a control completion to the port
+//
+// Arguments:
+//
+//	key			- Control completion key
+
+void io_loop::Post(ULONG_PTR key)
+{
+	if(!PostQueuedCompletionStatus(m_port, 0, key, nullptr)) throw winexception();
+}
+
+//-----------------------------------------------------------------------------
+// io_loop::Read
+//
+// Submits an overlapped read
+//
+// Arguments:
+//
+//	handle		- Handle associated with the loop
+//	buffer		- Buffer to receive the data
+//	length		- Length of the buffer
+//	offset		- Offset at which to read; ignored for non-seeking handles
+//	func		- Function to invoke once the read has completed
+
+void io_loop::Read(HANDLE handle, void* buffer, DWORD length, uint64_t offset, completion_func func)
+{
+	operation* op = Begin(handle, offset, std::move(func));
+
+	// Even a synchronous success queues a completion packet to the port
+	if(ReadFile(handle, buffer, length, nullptr, op)) { Submitted(op); return; }
+
+	DWORD result = GetLastError();
+	if(result != ERROR_IO_PENDING) Failed(op, result);
+	Submitted(op);
+}
+
+//-----------------------------------------------------------------------------
+// io_loop::Run
+//
+// Dispatches completions on the calling thread until the loop has been stopped
+//
+// Arguments:
+//
+//	NONE
+
+void io_loop::Run(void)
+{
+	OVERLAPPED_ENTRY entries[BATCH_SIZE];
+
+	while(true) {
+
+		// Calculate how long to wait based on the nearest timeout; timeouts do not elapse while paused
+		DWORD wait = INFINITE;
+		{
+			std::lock_guard<std::mutex> critsec(m_lock);
+
+			if(m_stopping && m_inflight.empty()) break;
+
+			// A future deadline is waited for with the clock timer, which posts a wake completion
+			if(!m_paused && !m_timeouts.empty()) {
+
+				uint64_t now = m_clock.Now();
+				uint64_t deadline = m_timeouts.begin()->first;
+				if(deadline <= now) wait = 0;
+				else m_clock.StartTimer(m_timer, static_cast<uint32_t>(std::min<uint64_t>(deadline - now, INFINITE - 1)));
+			}
+		}
+
+		ULONG count = 0;
+		if(!GetQueuedCompletionStatusEx(m_port, entries, BATCH_SIZE, &count, wait, FALSE)) {
+
+			DWORD result = GetLastError();
+			if(result != WAIT_TIMEOUT) throw winexception(result);
+		}
+
+		for(ULONG index = 0; index < count; index++) {
+
+			const OVERLAPPED_ENTRY& entry = entries[index];
+
+			switch(entry.lpCompletionKey) {
+
+				case KEY_IO:
+				{
+					operation* op = static_cast<operation*>(entry.lpOverlapped);
+
+					// Internal holds the NTSTATUS of the operation; convert failures via GetOverlappedResult
+					op->bytes = entry.dwNumberOfBytesTransferred;
+					op->result = ERROR_SUCCESS;
+					if(op->Internal != 0) {
+
+						DWORD bytes;
+						op->result = GetOverlappedResult(op->handle, op, &bytes, FALSE) ? ERROR_SUCCESS : GetLastError();
+					}
+
+					Complete(op);
+					break;
+				}
+
+				case KEY_PAUSE:
+					m_paused = true;
+					break;
+
+				case KEY_CONTINUE:
+				case KEY_STOP:
+				{
+					// Release any completions that were held while paused
+					m_paused = false;
+					std::vector<operation*> deferred;
+					deferred.swap(m_deferred);
+					for(auto& op : deferred) { std::unique_ptr<operation> owner(op); op->func(op->result, op->bytes); }
+
+					if(entry.lpCompletionKey == KEY_STOP) {
+
+						std::vector<operation*> inflight;
+						std::multimap<uint64_t, timeout_func> timeouts;
+						{
+							std::lock_guard<std::mutex> critsec(m_lock);
+							m_stopping = true;
+							inflight = m_inflight;
+							timeouts.swap(m_timeouts);
+						}
+
+						// Cancel everything in flight; the aborted completions are still dispatched
+						for(auto& op : inflight) CancelIoEx(op->handle, op);
+						for(auto& iterator : timeouts) iterator.second(ERROR_OPERATION_ABORTED);
+					}
+					break;
+				}
+
+				// KEY_WAKE only serves to recalculate the wait interval
+				default: break;
+			}
+		}
+
+		// Invoke the timeouts that have elapsed
+		while(!m_paused) {
+
+			timeout_func func;
+			{
+				std::lock_guard<std::mutex> critsec(m_lock);
+				if(m_timeouts.empty() || (m_timeouts.begin()->first > m_clock.Now())) break;
+
+				func = std::move(m_timeouts.begin()->second);
+				m_timeouts.erase(m_timeouts.begin());
+			}
+
+			func(ERROR_SUCCESS);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// io_loop::Submitted (private)
+//
+// Cancels an operation that was submitted after the loop began stopping
+//
+// Arguments:
+//
+//	op			- Operation that has been submitted
+
+void io_loop::Submitted(operation* op)
+{
+	// Stop cancels the operations it finds in flight once it has set m_stopping; one that
+	// was tracked before that but submitted after the cancellation has to cancel itself.  The
+	// operation is only valid while it's still tracked, it may already have completed
+	std::lock_guard<std::mutex> critsec(m_lock);
+	if(m_stopping && (std::find(m_inflight.begin(), m_inflight.end(), op) != m_inflight.end())) CancelIoEx(op->handle, op);
+}
+
+//-----------------------------------------------------------------------------
+// io_loop::Timeout
+//
+// Invokes a function on the loop thread once the interval has elapsed
+//
+// Arguments:
+//
+//	milliseconds	- Interval in milliseconds
+//	func			- Function to invoke
+
+void io_loop::Timeout(uint32_t milliseconds, timeout_func func)
+{
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		if(m_stopping) throw winexception(ERROR_OPERATION_ABORTED);
+		m_timeouts.emplace(m_clock.Now() + milliseconds, std::move(func));
+	}
+
+	// Wake the loop so it can recalculate the wait interval
+	Post(KEY_WAKE);
+}
+
+//-----------------------------------------------------------------------------
+// io_loop::Write
+//
+// Submits an overlapped write
+//
+// Arguments:
+//
+//	handle		- Handle associated with the loop
+//	buffer		- Buffer containing the data
+//	length		- Length of the data
+//	offset		- Offset at which to write; ignored for non-seeking handles
+//	func		- Function to invoke once the write has completed
+
+void io_loop::Write(HANDLE handle, const void* buffer, DWORD length, uint64_t offset, completion_func func)
+{
+	operation* op = Begin(handle, offset, std::move(func));
+
+	// Even a synchronous success queues a completion packet to the port
+	if(WriteFile(handle, buffer, length, nullptr, op)) { Submitted(op); return; }
+
+	DWORD result = GetLastError();
+	if(result != ERROR_IO_PENDING) Failed(op, result);
+	Submitted(op);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::local_control_client
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// local_control_client Constructor
+//
+// Arguments:
+//
+//	pipename	- Name of the local control manager pipe
+
+local_control_client::local_control_client(const tchar_t* pipename)
+{
+	if((pipename == nullptr) || (*pipename == 0)) throw winexception(E_INVALIDARG);
+
+	// Wait for an instance of the pipe to become available if the manager is busy with another client
+	for(;;) {
+
+		m_pipe = CreateFile(pipename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+		if(m_pipe != INVALID_HANDLE_VALUE) break;
+
+		if(GetLastError() != ERROR_PIPE_BUSY) throw winexception();
+		if(!WaitNamedPipe(pipename, NMPWAIT_USE_DEFAULT_WAIT)) throw winexception();
+	}
+
+	// Requests and responses are exchanged as single messages
+	DWORD mode = PIPE_READMODE_MESSAGE;
+	if(!SetNamedPipeHandleState(m_pipe, &mode, nullptr, nullptr)) {
+
+		DWORD result = GetLastError();
+		CloseHandle(m_pipe);
+		throw winexception(result);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// local_control_client Destructor
+
+local_control_client::~local_control_client()
+{
+	CloseHandle(m_pipe);
+}
+
+//-----------------------------------------------------------------------------
+// local_control_client::Control
+//
+// Sends a single control to a service
+//
+// Arguments:
+//
+//	servicename		- Name of the target service; empty or null for every service
+//	control			- Service control code
+//	status			- Optional variable to receive the service status after the control
+
+DWORD local_control_client::Control(const tchar_t* servicename, ServiceControl control, SERVICE_STATUS* status)
+{
+	local_control request = {};
+	if(servicename) _tcsncpy_s(request.ServiceName, servicename, _TRUNCATE);
+	request.Control = static_cast<DWORD>(control);
+
+	// A control sent to every service reports the first failure (and that service's status)
+	std::vector<local_control_result> results = Send({ request });
+	auto found = std::find_if(results.begin(), results.end(), [](const local_control_result& result) -> bool { return result.Result != ERROR_SUCCESS; });
+	if(found == results.end()) found = results.begin();
+	if(found == results.end()) return ERROR_SERVICE_DOES_NOT_EXIST;
+
+	if(status) *status = found->Status;
+	return found->Result;
+}
+
+//-----------------------------------------------------------------------------
+// local_control_client::Send
+//
+// Sends a batch of controls to the local control manager in a single round trip
+//
+// Arguments:
+//
+//	controls	- Controls to be sent, processed in order for each service
+
+std::vector<local_control_result> local_control_client::Send(const std::vector<local_control>& controls)
+{
+	if(controls.size() > local_message_header::BATCH_MAX) throw winexception(ERROR_INVALID_PARAMETER);
+
+	// Generate the request message
+	std::vector<uint8_t> request(sizeof(local_message_header) + (controls.size() * sizeof(local_control)));
+	local_message_header* header = reinterpret_cast<local_message_header*>(request.data());
+	header->magic = local_message_header::MAGIC;
+	header->count = static_cast<uint32_t>(controls.size());
+	if(!controls.empty()) memcpy(&request[sizeof(local_message_header)], controls.data(), controls.size() * sizeof(local_control));
+
+	// Send the request and wait for the response with a single transaction
+	std::vector<uint8_t> response(sizeof(local_message_header) + (local_message_header::RESULT_MAX * sizeof(local_control_result)));
+	DWORD read = 0;
+	if(!TransactNamedPipe(m_pipe, request.data(), static_cast<DWORD>(request.size()), response.data(), static_cast<DWORD>(response.size()), &read, nullptr))
+		throw winexception();
+
+	// Validate the response message and convert it into a vector<>
+	header = reinterpret_cast<local_message_header*>(response.data());
+	if((read < sizeof(local_message_header)) || (header->magic != local_message_header::MAGIC) || 
+		(read != sizeof(local_message_header) + (header->count * sizeof(local_control_result)))) throw winexception(ERROR_INVALID_DATA);
+	if(header->result != ERROR_SUCCESS) throw winexception(header->result);
+
+	const local_control_result* results = reinterpret_cast<const local_control_result*>(&response[sizeof(local_message_header)]);
+	return std::vector<local_control_result>(results, results + header->count);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::local_control_manager
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// local_control_manager Constructor
+//
+// Arguments:
+//
+//	pipename	- Name of the pipe to accept control requests on
+//	entries		- Service table entries to be hosted
+
+local_control_manager::local_control_manager(const tchar_t* pipename, const std::vector<service_table_entry>& entries)
+{
+	if((pipename == nullptr) || (*pipename == 0)) throw winexception(E_INVALIDARG);
+	if(entries.empty()) throw winexception(ERROR_INVALID_PARAMETER);
+
+	m_pipename = pipename;
+	for(const auto& entry : entries) m_services.push_back(std::make_unique<local_service>(entry));
+}
+
+//-----------------------------------------------------------------------------
+// local_control_manager::AllStopped (private)
+//
+// Determines if every hosted service has stopped
+//
+// Arguments:
+//
+//	NONE
+
+bool local_control_manager::AllStopped(void)
+{
+	return std::all_of(m_services.begin(), m_services.end(), [](const std::unique_ptr<local_service>& service) -> bool {
+
+		return service->Status.dwCurrentState == static_cast<DWORD>(ServiceStatus::Stopped);
+	});
+}
+
+//-----------------------------------------------------------------------------
+// local_control_manager::Process (private)
+//
+// Processes a request message and generates the response message
+//
+// Arguments:
+//
+//	request		- Request message
+//	length		- Length of the request message
+//	response	- Buffer to receive the response message
+
+size_t local_control_manager::Process(const uint8_t* request, size_t length, uint8_t* response)
+{
+	const local_message_header* header = reinterpret_cast<const local_message_header*>(request);
+	local_message_header* responseheader = reinterpret_cast<local_message_header*>(response);
+	local_control_result* results = reinterpret_cast<local_control_result*>(response + sizeof(local_message_header));
+
+	responseheader->magic = local_message_header::MAGIC;
+	responseheader->count = 0;
+	responseheader->result = ERROR_INVALID_DATA;
+
+	// Malformed requests get an empty response rather than dropping the client
+	if((length < sizeof(local_message_header)) || (header->magic != local_message_header::MAGIC) || (header->count > local_message_header::BATCH_MAX) ||
+		(length != sizeof(local_message_header) + (header->count * sizeof(local_control)))) return sizeof(local_message_header);
+
+	const local_control* controls = reinterpret_cast<const local_control*>(request + sizeof(local_message_header));
+
+	// Expand the batch into one result per targeted service, and group the results for each service
+	// so that controls sent to the same service are still delivered in the order they were requested
+	std::vector<std::pair<const local_control*, local_service*>> targets;
+	for(uint32_t index = 0; index < header->count; index++) {
+
+		const local_control& control = controls[index];
+		bool broadcast = (control.ServiceName[0] == 0);
+		bool found = false;
+
+		for(const auto& service : m_services) {
+
+			if(broadcast || (_tcsnicmp(control.ServiceName, service->Name, local_control::SERVICE_NAME_LENGTH) == 0)) {
+
+				targets.emplace_back(&control, service.get());
+				found = true;
+			}
+		}
+
+		// Keep a placeholder for an unknown service so that it gets a result as well
+		if(!found) targets.emplace_back(&control, nullptr);
+	}
+
+	// A batch that expands to more results than a response can hold is rejected before any of it's
+	// controls are delivered rather than silently dropping the controls that don't fit
+	if(targets.size() > local_message_header::RESULT_MAX) { responseheader->result = ERROR_INVALID_PARAMETER; return sizeof(local_message_header); }
+	responseheader->result = ERROR_SUCCESS;
+
+	// Fan the controls out to each service in parallel; each service receives it's controls in order
+	std::vector<std::future<void>> tasks;
+	for(const auto& service : m_services) {
+
+		local_service* target = service.get();
+		if(std::none_of(targets.begin(), targets.end(), [=](const auto& item) -> bool { return item.second == target; })) continue;
+
+		tasks.emplace_back(std::async(std::launch::async, [&, target]() -> void {
+
+			for(size_t index = 0; index < targets.size(); index++) {
+
+				if(targets[index].second != target) continue;
+
+				local_control_result& result = results[index];
+				_tcsncpy_s(result.ServiceName, target->Name, _TRUNCATE);
+				result.Result = target->SendControl(static_cast<ServiceControl>(targets[index].first->Control), targets[index].first->EventType, nullptr);
+				result.Status = target->Status;
+			}
+		}));
+	}
+
+	// Fill in the results for any unknown services while the controls are being delivered
+	for(size_t index = 0; index < targets.size(); index++) {
+
+		if(targets[index].second != nullptr) continue;
+
+		local_control_result& result = zero_init(results[index]);
+		_tcsncpy_s(result.ServiceName, targets[index].first->ServiceName, local_control::SERVICE_NAME_LENGTH - 1);
+		result.Result = ERROR_SERVICE_DOES_NOT_EXIST;
+	}
+
+	for(auto& task : tasks) task.get();
+
+	responseheader->count = static_cast<uint32_t>(targets.size());
+	return sizeof(local_message_header) + (targets.size() * sizeof(local_control_result));
+}
+
+//-----------------------------------------------------------------------------
+// local_control_manager::Run
+//
+// Starts the services and processes control requests until they have all stopped
+//
+// Arguments:
+//
+//	NONE
+
+int local_control_manager::Run(void)
+{
+	// Start each of the services; a service that fails to start is left stopped
+	for(const auto& service : m_services) {
+
+		try { service->Start(service->Name); }
+		catch(winexception&) { /* service is stopped */ }
+	}
+
+	std::vector<uint8_t> request(sizeof(local_message_header) + (local_message_header::BATCH_MAX * sizeof(local_control)));
+	std::vector<uint8_t> response(sizeof(local_message_header) + (local_message_header::RESULT_MAX * sizeof(local_control_result)));
+
+	OVERLAPPED overlapped = {};
+	overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	if(overlapped.hEvent == nullptr) throw winexception();
+
+	HANDLE pipe = CreateNamedPipe(m_pipename.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED, PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | 
+		PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, static_cast<DWORD>(response.size()), static_cast<DWORD>(request.size()), 0, nullptr);
+	if(pipe == INVALID_HANDLE_VALUE) {
+
+		DWORD result = GetLastError();
+		CloseHandle(overlapped.hEvent);
+		throw winexception(result);
+	}
+
+	// Serve one client at a time until every service has stopped; each control request is a
+	// single message and is answered with a single message
+	DWORD bytes = 0;
+	while(!AllStopped()) {
+
+		if(!ConnectNamedPipe(pipe, &overlapped)) {
+
+			DWORD result = GetLastError();
+			if((result == ERROR_IO_PENDING) && !WaitForPipe(pipe, overlapped, bytes)) break;
+			else if((result != ERROR_IO_PENDING) && (result != ERROR_PIPE_CONNECTED)) break;
+		}
+
+		for(;;) {
+
+			// Read the next request message from the client
+			if(!ReadFile(pipe, request.data(), static_cast<DWORD>(request.size()), nullptr, &overlapped)) {
+
+				if(GetLastError() != ERROR_IO_PENDING) break;
+				if(!WaitForPipe(pipe, overlapped, bytes)) break;
+			}
+			else if(!GetOverlappedResult(pipe, &overlapped, &bytes, FALSE)) break;
+
+			// Process the request and write the response message back to the client
+			size_t length = Process(request.data(), bytes, response.data());
+			if(!WriteFile(pipe, response.data(), static_cast<DWORD>(length), nullptr, &overlapped)) {
+
+				if(GetLastError() != ERROR_IO_PENDING) break;
+				if(!WaitForPipe(pipe, overlapped, bytes)) break;
+			}
+		}
+
+		DisconnectNamedPipe(pipe);
+	}
+
+	CloseHandle(pipe);
+	CloseHandle(overlapped.hEvent);
+
+	// Wait for the main thread of each service to terminate
+	for(const auto& service : m_services) {
+
+		try { service->WaitForStatus(ServiceStatus::Stopped); }
+		catch(winexception&) { /* service stopped with an error */ }
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// local_control_manager::WaitForPipe (private)
+//
+// Waits for an overlapped pipe operation to complete
+//
+// Arguments:
+//
+//	pipe		- Pipe handle
+//	overlapped	- OVERLAPPED structure used for the operation
+//	bytes		- Receives the number of bytes transferred
+
+bool local_control_manager::WaitForPipe(HANDLE pipe, OVERLAPPED& overlapped, DWORD& bytes)
+{
+	// Periodically check if every service has stopped while the operation is pending
+	while(WaitForSingleObject(overlapped.hEvent, STOPPED_POLL_INTERVAL) == WAIT_TIMEOUT) {
+
+		if(AllStopped()) {
+
+			// Cancel the operation and wait for the cancellation to complete
+			CancelIoEx(pipe, &overlapped);
+			GetOverlappedResult(pipe, &overlapped, &bytes, TRUE);
+			return false;
+		}
+	}
+
+	return (GetOverlappedResult(pipe, &overlapped, &bytes, FALSE) != FALSE);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::memory_pressure_source
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// memory_pressure_source::getLevel
+//
+// Gets the most recently raised memory pressure level
+//
+// Arguments:
+//
+//	NONE
+
+ServiceMemoryPressure memory_pressure_source::getLevel(void)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+	return m_level;
+}
+
+//-----------------------------------------------------------------------------
+// memory_pressure_source::Raise (protected)
+//
+// Changes the memory pressure level and notifies the subscribers if it differs
+//
+// Arguments:
+//
+//	level		- New memory pressure level
+
+void memory_pressure_source::Raise(ServiceMemoryPressure level)
+{
+	std::lock_guard<std::mutex> raiselock(m_raiselock);
+
+	// Count the notification against each subscriber, Unsubscribe() waits for it to be delivered,
+	// and hold a reference to the pooled ones so a handler that stops one cannot destroy it
+	std::vector<std::pair<service*, std::shared_ptr<service>>> subscribers;
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+
+		if(level == m_level) return;
+		m_level = level;
+		m_raising = std::this_thread::get_id();
+
+		for(auto& iterator : m_subscribers) {
+
+			++iterator.second;
+			subscribers.emplace_back(iterator.first, std::atomic_load(&iterator.first->m_self));
+		}
+	}
+
+	// The handlers run without the lock held, they are free to subscribe and unsubscribe services
+	for(const auto& subscriber : subscribers) {
+
+		subscriber.first->DispatchControl(ServiceControl::MemoryPressure, static_cast<DWORD>(level), nullptr);
+
+		std::lock_guard<std::mutex> critsec(m_lock);
+		auto found = m_subscribers.find(subscriber.first);
+		if(found != m_subscribers.end()) --found->second;
+
+		m_changed.notify_all();
+	}
+
+	// Releasing the references may destroy pooled services, which then unsubscribe from this thread
+	subscribers.clear();
+
+	std::lock_guard<std::mutex> critsec(m_lock);
+	m_raising = std::thread::id();
+}
+
+//-----------------------------------------------------------------------------
+// memory_pressure_source::Subscribe
+//
+// Adds a service instance to the set of subscribers
+//
+// Arguments:
+//
+//	instance	- Service instance to be notified of memory pressure changes
+
+void memory_pressure_source::Subscribe(service* instance)
+{
+	if(instance == nullptr) throw winexception(ERROR_INVALID_PARAMETER);
+
+	// Start and Stop are serialized separately from m_lock, which is never held while they run
+	std::lock_guard<std::mutex> runlock(m_runlock);
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		m_subscribers.emplace(instance, 0);
+	}
+
+	if(m_started) return;
+
+	try { Start(); }
+	catch(...) {
+
+		std::lock_guard<std::mutex> critsec(m_lock);
+		m_subscribers.erase(instance);
+		throw;
+	}
+
+	m_started = true;
+}
+
+//-----------------------------------------------------------------------------
+// memory_pressure_source::Unsubscribe
+//
+// Removes a service instance from the set of subscribers
+//
+// Arguments:
+//
+//	instance	- Service instance to be removed
+
+void memory_pressure_source::Unsubscribe(service* instance)
+{
+	{
+		std::unique_lock<std::mutex> critsec(m_lock);
+
+		// Wait for a notification being delivered to the instance by another thread; the raising
+		// thread itself does not wait, it unsubscribes pooled services as it releases them
+		m_changed.wait(critsec, [&]() -> bool {
+
+			auto found = m_subscribers.find(instance);
+			return (found == m_subscribers.end()) || (found->second == 0) || (m_raising == std::this_thread::get_id());
+		});
+
+		if(m_subscribers.erase(instance) == 0) return;
+	}
+
+	std::lock_guard<std::mutex> runlock(m_runlock);
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		if(!m_started || !m_subscribers.empty()) return;
+
+		// Forget the level once nobody is listening, the next subscriber gets the first change again
+		m_level = ServiceMemoryPressure::Normal;
+	}
+
+	Stop();
+	m_started = false;
+}
+
+//-----------------------------------------------------------------------------
+// svctl::memory_trimmer
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// memory_trimmer::AddHooks
+//
+// Registers a pair of shrink and regrow functions
+//
+// Arguments:
+//
+//	shrink		- Function invoked when the service is paused; can be empty
+//	regrow		- Function invoked when the service is continued; can be empty
+
+void memory_trimmer::AddHooks(trim_func shrink, trim_func regrow)
+{
+	if(!shrink && !regrow) throw winexception(ERROR_INVALID_PARAMETER);
+
+	std::lock_guard<std::mutex> critsec(m_lock);
+	m_hooks.emplace_back(std::move(shrink), std::move(regrow));
+}
+
+//-----------------------------------------------------------------------------
+// memory_trimmer::AddRegion
+//
+// Registers a region of memory to be removed from the working set
+//
+// Arguments:
+//
+//	address		- Base address of the region
+//	length		- Length of the region, in bytes
+
+void memory_trimmer::AddRegion(void* address, size_t length)
+{
+	if((address == nullptr) || (length == 0)) throw winexception(ERROR_INVALID_PARAMETER);
+
+	std::lock_guard<std::mutex> critsec(m_lock);
+	m_regions.emplace_back(address, length);
+}
+
+//-----------------------------------------------------------------------------
+// memory_trimmer::EmptyWorkingSet
+//
+// Empties the working set of the process
+//
+// Arguments:
+//
+//	NONE
+
+void memory_trimmer::EmptyWorkingSet(void)
+{
+	LARGE_INTEGER				frequency;			// Performance counter frequency
+	LARGE_INTEGER				started;			// Performance counter at start of trim
+	LARGE_INTEGER				finished;			// Performance counter at end of trim
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&started);
+
+	SetProcessWorkingSetSize(GetCurrentProcess(), static_cast<SIZE_T>(-1), static_cast<SIZE_T>(-1));
+
+	size_t after = WorkingSet();
+	QueryPerformanceCounter(&finished);
+
+	// Counted as part of the most recent trim
+	std::lock_guard<std::mutex> critsec(m_lock);
+	m_statistics.WorkingSetAfter = after;
+	m_statistics.TrimTime += static_cast<uint32_t>(((finished.QuadPart - started.QuadPart) * 1000000) / frequency.QuadPart);
+}
+
+//-----------------------------------------------------------------------------
+// memory_trimmer::getStatistics
+//
+// Gets the memory released by the most recent trim
+//
+// Arguments:
+//
+//	NONE
+
+trim_statistics memory_trimmer::getStatistics(void) const
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+	return m_statistics;
+}
+
+//-----------------------------------------------------------------------------
+// memory_trimmer::Regrow
+//
+// Invokes the regrow hooks
+//
+// Arguments:
+//
+//	NONE
+
+void memory_trimmer::Regrow(void)
+{
+	std::vector<std::pair<trim_func, trim_func>> hooks;
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		hooks = m_hooks;
+	}
+
+	// Undo the shrink hooks in the opposite order they were applied
+	for(auto iterator = hooks.rbegin(); iterator != hooks.rend(); iterator++) if(iterator->second) iterator->second();
+}
+
+//-----------------------------------------------------------------------------
+// memory_trimmer::Shrink
+//
+// Invokes the shrink hooks and releases memory to the system
+//
+// Arguments:
+//
+//	memory		- Memory resources of the service to be compacted
+
+void memory_trimmer::Shrink(service_memory& memory)
+{
+	LARGE_INTEGER				frequency;			// Performance counter frequency
+	LARGE_INTEGER				started;			// Performance counter at start of trim
+	LARGE_INTEGER				finished;			// Performance counter at end of trim
+
+	std::vector<std::pair<trim_func, trim_func>> hooks;
+	std::vector<std::pair<void*, size_t>> regions;
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		hooks = m_hooks;
+		regions = m_regions;
+	}
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&started);
+	size_t before = WorkingSet();
+
+	// The hooks release whatever the service is able to rebuild, which leaves free blocks in the
+	// heaps that can then be decommitted; the CRT heap is the process heap in current runtimes
+	for(const auto& hook : hooks) if(hook.first) hook.first();
+
+	memory.Compact();
+	_heapmin();
+	HeapCompact(GetProcessHeap(), 0);
+
+	// Unlocking pages that are not locked removes them from the working set without discarding
+	// them, so the regions are paged out and come back on demand; the call is expected to fail
+	for(const auto& region : regions) VirtualUnlock(region.first, region.second);
+
+	size_t after = WorkingSet();
+	QueryPerformanceCounter(&finished);
+
+	std::lock_guard<std::mutex> critsec(m_lock);
+	m_statistics.Trims++;
+	m_statistics.WorkingSetBefore = before;
+	m_statistics.WorkingSetAfter = after;
+	m_statistics.TrimTime = static_cast<uint32_t>(((finished.QuadPart - started.QuadPart) * 1000000) / frequency.QuadPart);
+}
+
+//-----------------------------------------------------------------------------
+// memory_trimmer::WorkingSet (private, static)
+//
+// Gets the working set of the process, in bytes
+//
+// Arguments:
+//
+//	NONE
+
+size_t memory_trimmer::WorkingSet(void)
+{
+	PROCESS_MEMORY_COUNTERS counters = { sizeof(PROCESS_MEMORY_COUNTERS) };
+	return (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) ? counters.WorkingSetSize : 0;
+}
+
+//-----------------------------------------------------------------------------
+// svctl::placement_scope
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// placement_scope Constructor
+//
+// Arguments:
+//
+//	placement	- Placement to apply to the calling thread; can be null
+
+placement_scope::placement_scope(const service_placement* placement)
+{
+	if(placement == nullptr) return;
+
+	HANDLE thread = GetCurrentThread();
+	GROUP_AFFINITY affinity = placement->Affinity;
+
+	// A NUMA node without an explicit mask runs the thread on the processors of that node, which
+	// also keeps the memory first touched by the thread local to the node
+	if((affinity.Mask == 0) && (placement->NumaNode != service_placement::ANY_NODE))
+		if(!GetNumaNodeProcessorMaskEx(placement->NumaNode, &affinity)) affinity.Mask = 0;
+
+	// Placement is best effort, a thread that cannot be moved still runs the service.  The
+	// previous values are only recorded if they were changed, so only those are restored
+	if((affinity.Mask != 0) && !SetThreadGroupAffinity(thread, &affinity, &m_affinity)) m_affinity.Mask = 0;
+
+	if(placement->Priority != service_placement::INHERIT_PRIORITY) {
+
+		m_priority = GetThreadPriority(thread);
+		if((m_priority == THREAD_PRIORITY_ERROR_RETURN) || !SetThreadPriority(thread, placement->Priority))
+			m_priority = service_placement::INHERIT_PRIORITY;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// placement_scope Destructor
+
+placement_scope::~placement_scope()
+{
+	HANDLE thread = GetCurrentThread();
+
+	if(m_affinity.Mask != 0) SetThreadGroupAffinity(thread, &m_affinity, nullptr);
+	if(m_priority != service_placement::INHERIT_PRIORITY) SetThreadPriority(thread, m_priority);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::placement_table
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// placement_table::Add
+//
+// Adds or replaces the placement for a service
+//
+// Arguments:
+//
+//	servicename		- Service name
+//	placement		- Placement policy for the service
+
+void placement_table::Add(const tchar_t* servicename, const service_placement& placement)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	for(auto& iterator : m_placements) 
+		if(_tcsicmp(iterator.first.c_str(), servicename) == 0) { iterator.second = placement; return; }
+
+	m_placements.emplace_back(servicename, placement);
+}
+
+//-----------------------------------------------------------------------------
+// placement_table::Find
+//
+// Retrieves the placement for a service
+//
+// Arguments:
+//
+//	servicename		- Service name
+//	placement		- On success, receives the placement policy for the service
+
+bool placement_table::Find(const tchar_t* servicename, service_placement& placement)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	// The service control manager does not necessarily use the same case as the service table
+	for(const auto& iterator : m_placements)
+		if(_tcsicmp(iterator.first.c_str(), servicename) == 0) { placement = iterator.second; return true; }
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// placement_table::Instance (static)
+//
+// Gets the process-wide placement table
+//
+// Arguments:
+//
+//	NONE
+
+placement_table& placement_table::Instance(void)
+{
+	static placement_table instance;
+	return instance;
+}
+
+//-----------------------------------------------------------------------------
+// svctl::private_heap
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// private_heap Constructor
+//
+// Arguments:
+//
+//	NONE
+
+private_heap::private_heap() : m_heap(HeapCreate(0, 0, 0))
+{
+	// The process heap is not a substitute; the allocations still outstanding when the
+	// service is destroyed would never be released without destroying the heap
+	if(m_heap == nullptr) throw winexception();
+}
+
+//-----------------------------------------------------------------------------
+// private_heap Destructor
+
+private_heap::~private_heap()
+{
+	// Destroying the heap releases everything allocated from it at once
+	HeapDestroy(m_heap);
+}
+
+//-----------------------------------------------------------------------------
+// private_heap::do_allocate (private)
+//
+// Allocates memory from the private heap
+//
+// Arguments:
+//
+//	bytes		- Number of bytes to allocate
+//	alignment	- Required alignment of the allocation
+
+void* private_heap::do_allocate(size_t bytes, size_t alignment)
+{
+	void* ptr = nullptr;
+
+	// The heap already provides MEMORY_ALLOCATION_ALIGNMENT; for anything stricter over-allocate
+	// and store the original pointer immediately before the aligned pointer that is returned
+	if(alignment <= MEMORY_ALLOCATION_ALIGNMENT) ptr = HeapAlloc(m_heap, 0, bytes);
+	else {
+
+		uint8_t* raw = reinterpret_cast<uint8_t*>(HeapAlloc(m_heap, 0, bytes + alignment));
+		if(raw) {
+
+			uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + alignment) & ~(static_cast<uintptr_t>(alignment) - 1);
+			reinterpret_cast<void**>(aligned)[-1] = raw;
+			ptr = reinterpret_cast<void*>(aligned);
+		}
+	}
+
+	if(ptr == nullptr) throw std::bad_alloc();
+
+	// Update the accounting, including the high water mark
+	size_t allocated = (m_allocated += bytes);
+	++m_allocations;
+
+	size_t peak = m_peak;
+	while((allocated > peak) && !m_peak.compare_exchange_weak(peak, allocated));
+
+	return ptr;
+}
+
+//-----------------------------------------------------------------------------
+// private_heap::do_deallocate (private)
+//
+// Releases memory back to the private heap
+//
+// Arguments:
+//
+//	ptr			- Pointer returned by do_allocate
+//	bytes		- Number of bytes that were allocated
+//	alignment	- Alignment that was requested for the allocation
+
+void private_heap::do_deallocate(void* ptr, size_t bytes, size_t alignment)
+{
+	if(ptr == nullptr) return;
+
+	HeapFree(m_heap, 0, (alignment <= MEMORY_ALLOCATION_ALIGNMENT) ? ptr : reinterpret_cast<void**>(ptr)[-1]);
+
+	m_allocated -= bytes;
+	--m_allocations;
+}
+
+//-----------------------------------------------------------------------------
+// private_heap::do_is_equal (private)
+//
+// Compares this memory resource with another memory resource
+//
+// Arguments:
+//
+//	other		- Memory resource to compare against
+
+bool private_heap::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+	// Memory can only be released to the same private heap it was allocated from
+	return (this == &other);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::quiescence_domain
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// quiescence_domain Constructor
+//
+// Arguments:
+//
+//	NONE
+
+quiescence_domain::quiescence_domain() : m_table(std::make_shared<slot_table>())
+{
+	// Identifiers are never reused, a thread can keep a stale cache entry for a released domain
+	static std::atomic<uint64_t> nextid { 1 };
+	m_id = nextid++;
+}
+
+//-----------------------------------------------------------------------------
+// quiescence_domain::Attach (private)
+//
+// Gets the slot of the calling thread, assigning it on first use
+//
+// Arguments:
+//
+//	NONE
+
+quiescence_domain::slot* quiescence_domain::Attach(void)
+{
+	// Each thread caches the slots it has been assigned, keyed by the domain identifier
+	static thread_local thread_slots cache;
+
+	auto found = cache.entries.find(m_id);
+	if(found != cache.entries.end()) return found->second.second;
+
+	// Entries for domains that have since been destroyed are dropped as new ones are added
+	for(auto iterator = cache.entries.begin(); iterator != cache.entries.end();) {
+
+		if(iterator->second.first.expired()) iterator = cache.entries.erase(iterator);
+		else ++iterator;
+	}
+
+	std::lock_guard<std::mutex> critsec(m_table->lock);
+
+	// Reuse a slot given back by a thread that has exited, otherwise add a new one; a reused slot
+	// is outside of a region and any Quiesce() in progress sees the new thread park on entry
+	auto free = std::find_if(m_table->slots.begin(), m_table->slots.end(), [](const auto& entry) -> bool { return !entry->assigned; });
+	slot* current = (free != m_table->slots.end()) ? free->get() : m_table->slots.emplace_back(std::make_unique<slot>()).get();
+
+	current->assigned = true;
+	cache.entries.emplace(m_id, std::make_pair(std::weak_ptr<slot_table>(m_table), current));
+
+	return current;
+}
+
+//-----------------------------------------------------------------------------
+// quiescence_domain::Backoff (private, static)
+//
+// Spins, yields or sleeps while polling the epochs
+//
+// Arguments:
+//
+//	attempt		- Number of times the epochs have been polled
+
+void quiescence_domain::Backoff(uint32_t attempt)
+{
+	// Spin briefly for short regions before backing off to sleeping
+	if(attempt < 64) YieldProcessor();
+	else if(attempt < 128) SwitchToThread();
+	else Sleep(1);
+}
+
+//-----------------------------------------------------------------------------
+// quiescence_domain::Enter
+//
+// Enters a region of the domain
+//
+// Arguments:
+//
+//	NONE
+
+void quiescence_domain::Enter(void)
+{
+	slot* current = Attach();
+	if(current->depth++ > 0) return;
+
+	while(true) {
+
+		// Publish the odd epoch before checking the flag; Quiesce() sets the flag before reading
+		// the epochs so either this thread sees the flag or Quiesce() sees the odd epoch
+		uint64_t epoch = current->epoch.load(std::memory_order_relaxed);
+		current->epoch.store(epoch + 1, std::memory_order_seq_cst);
+		if(!m_quiesced.load(std::memory_order_seq_cst)) return;
+
+		// Back out of the region and park until the domain has been released
+		current->epoch.store(epoch + 2, std::memory_order_release);
+
+		std::unique_lock<std::mutex> critsec(m_lock);
+		m_condition.wait(critsec, [&]() -> bool { return !m_quiesced.load(); });
+	}
+}
+
+//-----------------------------------------------------------------------------
+// quiescence_domain::Exit
+//
+// Exits a region of the domain
+//
+// Arguments:
+//
+//	NONE
+
+void quiescence_domain::Exit(void)
+{
+	slot* current = Attach();
+
+	assert(current->depth > 0);
+	if(--current->depth > 0) return;
+
+	current->epoch.store(current->epoch.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+//-----------------------------------------------------------------------------
+// quiescence_domain::Quiesce
+//
+// Waits for every thread to leave it's region
+//
+// Arguments:
+//
+//	timeout		- Maximum time to wait, in milliseconds
+//	progress	- Optional function invoked as the number of threads inside a region drops
+
+size_t quiescence_domain::Quiesce(uint32_t timeout, const std::function<void(size_t remaining)>& progress)
+{
+	m_quiesced.store(true, std::memory_order_seq_cst);
+
+	// Only the slots that existed when the flag was set can be inside a region, any
+	// slot assigned afterwards will see the flag and park before entering
+	std::vector<slot*> slots;
+	{
+		std::lock_guard<std::mutex> critsec(m_table->lock);
+		for(const auto& iterator : m_table->slots) slots.push_back(iterator.get());
+	}
+
+	uint64_t deadline = (timeout == INFINITE) ? UINT64_MAX : GetTickCount64() + timeout;
+	size_t remaining = slots.size();
+
+	for(uint32_t attempt = 0; ; attempt++) {
+
+		// Threads are outside of a region when their epoch is even; they leave without writing
+		// any shared state so the epochs are polled rather than waited on
+		slots.erase(std::remove_if(slots.begin(), slots.end(), [](slot* current) -> bool { 
+			return (current->epoch.load(std::memory_order_acquire) & 1) == 0; }), slots.end());
+
+		if(slots.size() < remaining) {
+
+			remaining = slots.size();
+			if(progress) progress(remaining);
+		}
+
+		if((remaining == 0) || (GetTickCount64() >= deadline)) break;
+		Backoff(attempt);
+	}
+
+	return remaining;
+}
+
+//-----------------------------------------------------------------------------
+// quiescence_domain::Release
+//
+// Releases the threads parked by Quiesce()
+//
+// Arguments:
+//
+//	NONE
+
+void quiescence_domain::Release(void)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	m_quiesced.store(false);
+	m_condition.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+// quiescence_domain::Synchronize
+//
+// Waits for every thread inside a region when called to leave it
+//
+// Arguments:
+//
+//	NONE
+
+void quiescence_domain::Synchronize(void)
+{
+	slot* self = Attach();
+
+	// Record the epochs of the other threads that are currently inside a region
+	std::vector<std::pair<slot*, uint64_t>> readers;
+	{
+		std::lock_guard<std::mutex> critsec(m_table->lock);
+		for(const auto& iterator : m_table->slots) {
+
+			if(iterator.get() == self) continue;
+
+			uint64_t epoch = iterator->epoch.load(std::memory_order_seq_cst);
+			if(epoch & 1) readers.emplace_back(iterator.get(), epoch);
+		}
+	}
+
+	// A thread has left the region it was in once it's epoch has moved on, even if
+	// it has since entered another one
+	for(uint32_t attempt = 0; !readers.empty(); attempt++) {
+
+		readers.erase(std::remove_if(readers.begin(), readers.end(), [](const auto& reader) -> bool {
+			return reader.first->epoch.load(std::memory_order_acquire) != reader.second; }), readers.end());
+
+		if(!readers.empty()) Backoff(attempt);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// quiescence_domain::thread_slots Destructor
+
+quiescence_domain::thread_slots::~thread_slots()
+{
+	// Give the slots back to the domains that still exist so another thread can reuse them
+	for(auto& iterator : entries) {
+
+		std::shared_ptr<slot_table> table = iterator.second.first.lock();
+		if(!table) continue;
+
+		std::lock_guard<std::mutex> critsec(table->lock);
+		iterator.second.second->assigned = false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// svctl::realtime_clock
+//-----------------------------------------------------------------------------
+
+// realtime_timer
+//
+// Thread pool timer and callback allocated by realtime_clock::CreateTimer
+struct realtime_timer
+{
+	PTP_TIMER					handle;
+	std::function<void(void)>	callback;
+};
+
+//-----------------------------------------------------------------------------
+// realtime_clock::CancelTimer
+//
+// Cancels a timer and waits for any running callback to complete
+//
+// Arguments:
+//
+//	timer		- Timer returned from CreateTimer
+
+void realtime_clock::CancelTimer(void* timer)
+{
+	realtime_timer* rttimer = reinterpret_cast<realtime_timer*>(timer);
+
+	SetThreadpoolTimer(rttimer->handle, nullptr, 0, 0);
+	WaitForThreadpoolTimerCallbacks(rttimer->handle, TRUE);
+}
+
+//-----------------------------------------------------------------------------
+// realtime_clock::CloseTimer
+//
+// Cancels and releases a timer
+//
+// Arguments:
+//
+//	timer		- Timer returned from CreateTimer
+
+void realtime_clock::CloseTimer(void* timer)
+{
+	realtime_timer* rttimer = reinterpret_cast<realtime_timer*>(timer);
+
+	CancelTimer(timer);
+	CloseThreadpoolTimer(rttimer->handle);
+	delete rttimer;
+}
+
+//-----------------------------------------------------------------------------
+// realtime_clock::CreateTimer
+//
+// Creates a one-shot thread pool timer
+//
+// Arguments:
+//
+//	callback	- Function to invoke when the timer fires
+//	environ		- Optional thread pool callback environment
+
+void* realtime_clock::CreateTimer(std::function<void(void)> callback, PTP_CALLBACK_ENVIRON environ)
+{
+	std::unique_ptr<realtime_timer> timer = std::make_unique<realtime_timer>();
+	timer->callback = std::move(callback);
+
+	timer->handle = CreateThreadpoolTimer([](PTP_CALLBACK_INSTANCE, void* context, PTP_TIMER) -> void {
+		reinterpret_cast<realtime_timer*>(context)->callback(); }, timer.get(), environ);
+	if(timer->handle == nullptr) throw winexception();
+
+	return timer.release();
+}
+
+//-----------------------------------------------------------------------------
+// realtime_clock::Instance (static)
+//
+// Gets the process-wide realtime_clock instance
+//
+// Arguments:
+//
+//	NONE
+
+realtime_clock& realtime_clock::Instance(void)
+{
+	static realtime_clock instance;
+	return instance;
+}
+
+//-----------------------------------------------------------------------------
+// realtime_clock::Now
+//
+// Gets the current system tick count in milliseconds
+//
+// Arguments:
+//
+//	NONE
+
+uint64_t realtime_clock::Now(void)
+{
+	return GetTickCount64();
+}
+
+//-----------------------------------------------------------------------------
+// realtime_clock::StartTimer
+//
+// Starts a timer to fire once after the specified interval
+//
+// Arguments:
+//
+//	timer			- Timer returned from CreateTimer
+//	milliseconds	- Interval before the timer fires
+
+void realtime_clock::StartTimer(void* timer, uint32_t milliseconds)
+{
+	FILETIME duetime = RelativeFileTime(milliseconds);
+	SetThreadpoolTimer(reinterpret_cast<realtime_timer*>(timer)->handle, &duetime, 0, 0);
+}
+
+//-----------------------------------------------------------------------------
+// realtime_clock::WaitFor
+//
+// Waits on a condition variable until the predicate is satisfied or timeout
+//
+// Arguments:
+//
+//	lock		- Lock held on the condition variable's mutex
+//	condition	- Condition variable to wait on
+//	timeout		- Timeout value in milliseconds, or INFINITE
+//	predicate	- Predicate to be satisfied
+
+bool realtime_clock::WaitFor(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, 
+	uint32_t timeout, const std::function<bool(void)>& predicate)
+{
+	if(timeout == INFINITE) { condition.wait(lock, predicate); return true; }
+	return condition.wait_for(lock, std::chrono::milliseconds(timeout), predicate);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::resstring
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// resstring::GetResourceString (private, static)
+//
+// Gets a tstring from a module string resource
+//
+// Arguments:
+//
+//	id			- Resource identifier code
+//	instance	- Module instance handle to acquire the resource from
+
+const tstring resstring::GetResourceString(unsigned int id, HINSTANCE instance)
+{
+	// LoadString() has a neat trick to return a read-only string pointer, but
+	// it won't necessarily be null-terminated.  Length is returned as result
+	tchar_t* string = nullptr;
+	int result = LoadString(instance, id, reinterpret_cast<tchar_t*>(&string), 0);
+
+	return tstring(string, result);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::service
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// service Destructor
+
+service::~service()
+{
+	// Remove the instance from the shutdown coordinator and the memory pressure source before
+	// anything else is released
+	if(m_shutdown) m_shutdown->Unregister(this);
+	if(m_pressure) m_pressure->Unsubscribe(this);
+
+	// Cancel and release the pending status checkpoint timer if one was created
+	if(m_statustimer) {
+
+		m_statuspending = false;
+		m_clock->CloseTimer(m_statustimer);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// service::Abort (private)
+//
+// Abnormally terminates the service; does not return to the calling thread unless the
+// instance is pooled, the thread then belongs to the pool and has to be given back
+//
+// Arguments:
+//
+//	exception	- The unhandled exception that is aborting the service
+
+DWORD service::Abort(std::exception_ptr exception)
+{
+	// A pooled service instance releases it's last reference in SignalStopped(); keep it alive until return
+	std::shared_ptr<service> self = std::atomic_load(&m_self);
+	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+
+	// If this is an svctl::winexception the code can be used to set the exit
+	// code for the service otherwise just use ERROR_UNHANDLED_EXCEPTION
+	DWORD exitcode = ERROR_UNHANDLED_EXCEPTION;
+	try { std::rethrow_exception(exception); }
+	catch(winexception& ex) { exitcode = ex.code(); }
+	catch(...) { /* ERROR_UNHANDLED_EXCEPTION */ }
+
+	TrySetStatus(ServiceStatus::Stopped, exitcode);
+
+	SignalStopped();				// Interrupt the main service thread wait
+	if(m_reporter) m_reporter->Flush();
+
+	if(!self) Sleep(INFINITE);		// Never return
+	return exitcode;
+}
+
+//-----------------------------------------------------------------------------
+// service::AddHandler (protected)
+//
+// Registers a control handler with this instance of the service at runtime
+//
+// Arguments:
+//
+//	handler		- Control handler to register
+
+const control_handler* service::AddHandler(std::unique_ptr<control_handler> handler)
+{
+	if(!handler) throw winexception(ERROR_INVALID_PARAMETER);
+
+	std::shared_ptr<control_handler> shared(std::move(handler));
+	UpdateHandlers([&](dynamic_handler_table& table) -> void { table.push_back(shared); });
+
+	return shared.get();
+}
+
+//-----------------------------------------------------------------------------
+// service::AddStartupPhase (protected)
+//
+// Declares a named initialization phase; must be called from OnStart()
+//
+// Arguments:
+//
+//	name			- Name of the phase
+//	required		- Flag indicating the phase must be ready before SERVICE_RUNNING is reported
+//	dependencies	- Names of the phases that must be ready before this phase is launched
+//	func			- Function that performs the phase on a worker thread
+
+void service::AddStartupPhase(const tchar_t* name, bool required, const std::vector<tstring>& dependencies, worker_group::worker_func func)
+{
+	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+
+	// Phases can only be declared while the service is starting
+	if(m_status != ServiceStatus::StartPending) throw winexception(ERROR_INVALID_STATE);
+
+	if(!m_phases) m_phases = std::make_shared<startup_phases>(*m_clock);
+	m_phases->Add(name, required, dependencies, std::move(func));
+}
+
+//-----------------------------------------------------------------------------
+// service::AttachChannel (private)
+//
+// Records a channel this service is an endpoint of
+//
+// Arguments:
+//
+//	channel		- Channel created or opened by the service
+//	receiver	- Flag indicating that this service receives from the channel
+
+void service::AttachChannel(const std::shared_ptr<channel_base>& channel, bool receiver)
+{
+	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+	m_channels.emplace_back(channel, receiver);
+}
+
+//-----------------------------------------------------------------------------
+// service::CheckHandoff (private)
+//
+// Throws ERROR_NOT_SUPPORTED if nothing can be handed off to the next instance of the service
+//
+// Arguments:
+//
+//	NONE
+
+void service::CheckHandoff(void) const
+{
+	// The handoff store lives in the process; the next instance of a service that runs in it's own
+	// process is started in a new process by the service control manager and would never find it
+	if(m_ownprocess) throw winexception(ERROR_NOT_SUPPORTED);
+}
+
+//-----------------------------------------------------------------------------
+// service::Checkpoint (private)
+//
+// Timer callback that reports an incremented pending status checkpoint; also invoked
+// by Pause() on the control thread as the workers drain out of their regions
+//
+// Arguments:
+//
+//	NONE
+
+void service::Checkpoint(void)
+{
+	// m_statuslock cannot be taken here, SetStatus() holds it while it waits for the timer
+	// callback to complete; the checkpoint gets it's own lock so that the timer and Pause()
+	// never increment and report it at the same time, or out of order
+	std::lock_guard<std::mutex> critsec(m_checkpointlock);
+	if(!m_statuspending) return;
+
+	placement_scope placement(&m_placement);
+
+	try {
+
+		// Report the same pending status with an incremented checkpoint
+		++m_pendingstatus.dwCheckPoint;
+		m_statusfunc(m_pendingstatus);
+
+		// The timer is one-shot to prevent overlapping callbacks; restart it while pending
+		if(m_statuspending) m_clock->StartTimer(m_statustimer, PENDING_CHECKPOINT_INTERVAL);
+	}
+
+	// Copy any callback exceptions into the m_statusexception member variable,
+	// this can be checked on the next call to SetStatus()
+	catch(...) { m_statusexception = std::current_exception(); }
+}
+
+//-----------------------------------------------------------------------------
+// service::Continue
+//
+// Continues the service from a paused state
+//
+// Arguments:
+//
+//	NONE
+
+DWORD service::Continue(void)
+{
+	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+
+	// Service has to be in a status of PAUSED to accept this control
+	if(m_status != ServiceStatus::Paused) return ERROR_CALL_NOT_IMPLEMENTED;
+	
+	// Set the status to CONTINUE_PENDING and resume the I/O loop, if one has been created
+	try { SetStatus(ServiceStatus::ContinuePending); if(m_ioloop) m_ioloop->Continue(); }
+	catch(...) { return Abort(std::current_exception()); }
+
+	try {
+
+		// Allow the memory released on pause to be used again before the handlers run
+		m_trimmer.Regrow();
+
+		// Invoke all of the CONTINUE handlers prior to setting the service to RUNNING
+		ForEachHandler([&](const control_handler& handler) -> bool {
+			
+			if(handler.Control == ServiceControl::Continue) InvokeHandler(handler, 0, nullptr);
+			return true;
+		});
+
+		// Release the threads that were parked at the quiescence barrier
+		m_quiescence.Release();
+
+		SetStatus(ServiceStatus::Running);
+	}
+
+	catch(...) { return Abort(std::current_exception()); }
+
+	return ERROR_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// service::ControlHandler (private)
+//
+// Handles a service control request from the service control manager
+//
+// Arguments:
+//
+//	control			- Service control code
+//	eventtype		- Control-specific event type
+//	eventdata		- Control-specific event data
+
+DWORD service::ControlHandler(ServiceControl control, DWORD eventtype, void* eventdata)
+{
+	// A pooled service instance stopped or aborted by the control may release it's last reference
+	std::shared_ptr<service> self = std::atomic_load(&m_self);
+
+	// Controls arrive on the dispatcher thread, the thread pool or a control channel
+	// callback; none of these belong to the service so the placement is only borrowed
+	placement_scope placement(&m_placement);
+
+	std::unique_lock<std::recursive_mutex> critsec(m_statuslock);
+
+	// Nothing should be coming in from the service control manager when stopped
+	if(m_status == ServiceStatus::Stopped) return ERROR_CALL_NOT_IMPLEMENTED;
+
+	// INTERROGATE, STOP, PAUSE and CONTINUE are special case handlers
+	if(control == ServiceControl::Interrogate) return ERROR_SUCCESS;
+	else if(control == ServiceControl::Stop) { Stop(); return ERROR_SUCCESS; }
+	else if(control == ServiceControl::Pause) {
+
+		DWORD result = Pause();
+		critsec.unlock();
+
+		// Emptying the working set of the process pages out everything in it and can take a while,
+		// it's done once the service has been paused without holding the status lock
+		if((result == ERROR_SUCCESS) && m_ownprocess) m_trimmer.EmptyWorkingSet();
+		return result;
+	}
+	else if(control == ServiceControl::Continue) { Continue(); return ERROR_SUCCESS; }
+
+	// When a trigger event is received during service stop, ERROR_SHUTDOWN_IN_PROGRESS
+	// should be returned.  The service won't indicate that this is accepted, but the
+	// documentation in MSDN seems to imply that it may still get this control ...
+	if((control == ServiceControl::TriggerEvent) && (m_status == ServiceStatus::StopPending))
+		return ERROR_SHUTDOWN_IN_PROGRESS;
+
+	// Done with messing about with the current service status; release the critsec
+	critsec.unlock();
+
+	if((control == ServiceControl::Shutdown) || (control == ServiceControl::PreShutdown)) {
+
+		// The workers can start winding down while the shutdown handlers run
+		if(m_workers) m_workers->RequestStop();
+
+		// Shutdown controls are sent to every service in the process at once by the coordinator
+		DWORD result = (m_shutdown) ? m_shutdown->Dispatch(this, control) : InvokeHandlers(control, eventtype, eventdata);
+
+		// The service was stopped at the shutdown deadline; it's handlers are still running
+		if(result == ERROR_TIMEOUT) return ERROR_SUCCESS;
+
+		// The service is expected to stop once the shutdown handlers have returned; this takes the normal
+		// stop path so the snapshot is written, the I/O loop is stopped and the workers are joined.  Does
+		// nothing if the handlers have already stopped the service
+		Stop();
+		return result;
+	}
+
+	return InvokeHandlers(control, eventtype, eventdata);
+}
+
+//-----------------------------------------------------------------------------
+// service::Delay (protected)
+//
+// Waits for the specified interval on the service clock
+//
+// Arguments:
+//
+//	milliseconds	- Interval to wait, in milliseconds
+
+bool service::Delay(uint32_t milliseconds)
+{
+	// Wait for the interval to elapse or for the service to be stopped
+	std::unique_lock<std::mutex> critsec(m_stoplock);
+	return !m_clock->WaitFor(critsec, m_stopcondition, milliseconds, [&]() -> bool { return m_stopped; });
+}
+
+//-----------------------------------------------------------------------------
+// service::DispatchControl (private)
+//
+// Delivers a control that originates in the process, rather than from the service control
+// manager, through the handler registered by the service so it's recorded and counted
+//
+// Arguments:
+//
+//	control			- Service control code
+//	eventtype		- Control-specific event type
+//	eventdata		- Control-specific event data
+
+DWORD service::DispatchControl(ServiceControl control, DWORD eventtype, void* eventdata)
+{
+	return (m_dispatchfunc) ? m_dispatchfunc(static_cast<DWORD>(control), eventtype, eventdata) : ControlHandler(control, eventtype, eventdata);
+}
+
+//-----------------------------------------------------------------------------
+// service::DispatchDepth (private, static)
+//
+// Gets the number of runtime handler dispatches in progress on the calling thread
+//
+// Arguments:
+//
+//	NONE
+
+uint32_t& service::DispatchDepth(void)
+{
+	static thread_local uint32_t depth = 0;
+	return depth;
+}
+
+//-----------------------------------------------------------------------------
+// service::ForceStop (private)
+//
+// Stops the service while the handlers that overran the shutdown budget are still running;
+// the handlers are not waited for and the snapshot is written after they have returned
+//
+// Arguments:
+//
+//	win32exitcode	- Win32 service exit code
+
+void service::ForceStop(DWORD win32exitcode)
+{
+	// A pooled service instance may release it's last reference; keep it alive until return
+	std::shared_ptr<service> self = std::atomic_load(&m_self);
+
+	// A handler that overran the budget while stopping the service itself holds the status lock;
+	// that stop reports SERVICE_STOPPED and releases the main thread on it's own
+	std::unique_lock<std::recursive_mutex> critsec(m_statuslock, std::try_to_lock);
+	if(!critsec.owns_lock() || (m_status == ServiceStatus::Stopped)) return;
+
+	try { SignalStopping(); }
+	catch(...) { /* the service is stopped regardless */ }
+
+	m_snapshotpending = true;
+	TrySetStatus(ServiceStatus::Stopped, win32exitcode);
+	critsec.unlock();
+
+	if(m_reporter) m_reporter->Flush();
+	SignalStopped();
+}
+
+//-----------------------------------------------------------------------------
+// service::ForEachHandler (private)
+//
+// Invokes a function for each control handler in the map and each runtime handler
+//
+// Arguments:
+//
+//	func		- Function to invoke; return false to stop the iteration
+
+bool service::ForEachHandler(const std::function<bool(const control_handler& handler)>& func) const
+{
+	for(const auto& handler : Handlers) if(!func(*handler)) return false;
+
+	// The runtime handlers are copied from the current snapshot without a lock; being inside a region
+	// prevents UpdateHandlers() from releasing the snapshot while it's being copied.  The handlers are
+	// invoked after leaving the region so a long running handler never holds up an update
+	dynamic_handler_table handlers;
+	{
+		quiescence_domain::region region(m_handlerepochs);
+
+		const dynamic_handler_table* table = m_handlers.load(std::memory_order_acquire);
+		if(table) handlers = *table;
+	}
+
+	// RemoveHandler() waits for the copies to be released, except on a thread that holds them
+	bool completed = false;
+	++DispatchDepth();
+
+	try { completed = std::all_of(handlers.begin(), handlers.end(), [&](const auto& handler) -> bool { return func(*handler); }); }
+	catch(...) { --DispatchDepth(); throw; }
+
+	--DispatchDepth();
+	return completed;
+}
+
+//-----------------------------------------------------------------------------
+// service::getAcceptedControls (private)
+//
+// Determines what SERVICE_ACCEPT_XXXX codes the service will respond to based
+// on what control handlers have been registered
+//
+// Arguments:
+//
+//	NONE
+
+DWORD service::getAcceptedControls(void)
+{
+	DWORD accept = 0;
+
+	// Derive what controls this service should report based on what service control handlers have
+	// been implemented in the derived class or registered at runtime
+	ForEachHandler([&](const control_handler& handler) -> bool {
+
+		if(handler.Control == ServiceControl::Stop)							accept |= SERVICE_ACCEPT_STOP;
+		else if(handler.Control == ServiceControl::Pause)					accept |= SERVICE_ACCEPT_PAUSE_CONTINUE;
+		else if(handler.Control == ServiceControl::Continue)				accept |= SERVICE_ACCEPT_PAUSE_CONTINUE;
+		else if(handler.Control == ServiceControl::Shutdown)				accept |= SERVICE_ACCEPT_SHUTDOWN;
+		else if(handler.Control == ServiceControl::ParameterChange)			accept |= SERVICE_ACCEPT_PARAMCHANGE;
+		else if(handler.Control == ServiceControl::NetBindAdd)				accept |= SERVICE_ACCEPT_NETBINDCHANGE;
+		else if(handler.Control == ServiceControl::NetBindRemove)			accept |= SERVICE_ACCEPT_NETBINDCHANGE;
+		else if(handler.Control == ServiceControl::NetBindEnable)			accept |= SERVICE_ACCEPT_NETBINDCHANGE;
+		else if(handler.Control == ServiceControl::NetBindDisable)			accept |= SERVICE_ACCEPT_NETBINDCHANGE;
+		else if(handler.Control == ServiceControl::HardwareProfileChange)	accept |= SERVICE_ACCEPT_HARDWAREPROFILECHANGE;
+		else if(handler.Control == ServiceControl::PowerEvent)				accept |= SERVICE_ACCEPT_POWEREVENT;
+		else if(handler.Control == ServiceControl::SessionChange)			accept |= SERVICE_ACCEPT_SESSIONCHANGE;
+		else if(handler.Control == ServiceControl::PreShutdown)				accept |= SERVICE_ACCEPT_PRESHUTDOWN;
+		else if(handler.Control == ServiceControl::TimeChange)				accept |= SERVICE_ACCEPT_TIMECHANGE;
+		else if(handler.Control == ServiceControl::TriggerEvent)			accept |= SERVICE_ACCEPT_TRIGGEREVENT;
+
+		return true;
+	});
+
+	return accept;						// Return the generated bitmask
+}
+
+//-----------------------------------------------------------------------------
+// service::getHandlers (protected, virtual)
+//
+// Gets the collection of service-specific control handlers
+
+const control_handler_table& service::getHandlers(void) const
+{
+	// The default implementation has no handlers; this results in a service that
+	// can be started but otherwise will not respond to any controls, including STOP
+	static control_handler_table nohandlers;
+	return nohandlers;
+}
+
+//-----------------------------------------------------------------------------
+// service::getIoLoop (protected)
+//
+// Gets the service's I/O completion port event loop, creating it on first use
+//
+// Arguments:
+//
+//	NONE
+
+io_loop& service::getIoLoop(void)
+{
+	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+
+	if(!m_ioloop) m_ioloop = std::make_unique<io_loop>(*m_clock, m_environ);
+	return *m_ioloop;
+}
+
+//-----------------------------------------------------------------------------
+// service::getShard (protected)
+//
+// Gets the index of this instance within a sharded service table entry
+
+uint32_t service::getShard(void) const
+{
+	// A service that merely has an @ in it's name is not a shard; only the names
+	// generated for a ServiceTableShards<> entry are
+	uint32_t shard = 0;
+	return (service_table_shards::FindShard(m_name.c_str(), shard)) ? shard : NOT_SHARDED;
+}
+
+//-----------------------------------------------------------------------------
+// service::HandlesControl (private)
+//
+// Determines if the service has at least one handler for a control
+//
+// Arguments:
+//
+//	control			- Service control code
+
+bool service::HandlesControl(ServiceControl control) const
+{
+	return !ForEachHandler([=](const control_handler& handler) -> bool { return handler.Control != control; });
+}
+
+//-----------------------------------------------------------------------------
+// service::InvokeHandler (private)
+//
+// Invokes a single control handler, watching it if it declared a latency budget
+//
+// Arguments:
+//
+//	handler			- Control handler to invoke
+//	eventtype		- Control-specific event type
+//	eventdata		- Control-specific event data
+
+DWORD service::InvokeHandler(const control_handler& handler, DWORD eventtype, void* eventdata)
+{
+	handler_watchdog::scope watch(m_watchdog.get(), handler.Control, handler.Budget);
+	return handler.Invoke(this, eventtype, eventdata);
+}
+
+//-----------------------------------------------------------------------------
+// service::InvokeHandlers (private)
+//
+// Invokes the service-specific handlers registered for a control
+//
+// Arguments:
+//
+//	control			- Service control code
+//	eventtype		- Control-specific event type
+//	eventdata		- Control-specific event data
+
+DWORD service::InvokeHandlers(ServiceControl control, DWORD eventtype, void* eventdata)
+{
+	// Iterate over all of the implemented control handlers and invoke each of them
+	// in the order in which they appear in the control handler vector<>, followed
+	// by the handlers that have been registered at runtime
+	bool handled = false;
+	DWORD result = ERROR_SUCCESS;
+	ForEachHandler([&](const control_handler& handler) -> bool {
+
+		if(handler.Control != control) return true;
+
+		// Invoke the service control handler; if a non-zero result is returned stop
+		// processing them and return that result back to the service control manager
+		try { result = InvokeHandler(handler, eventtype, eventdata); }
+		catch(...) { result = Abort(std::current_exception()); }
+		
+		handled = true;				// At least one handler was successfully invoked
+		return (result == ERROR_SUCCESS);
+	});
+
+	if(result != ERROR_SUCCESS) return result;
+
+	// Default for most service controls is to return ERROR_SUCCESS if it was handled
+	// and ERROR_CALL_NOT_IMPLEMENTED if no handler was present for the control
+	return (handled) ? ERROR_SUCCESS : ERROR_CALL_NOT_IMPLEMENTED;
+}
+
+//-----------------------------------------------------------------------------
+// service::LaunchWorker (protected)
+//
+// Starts a thread owned by the service
+//
+// Arguments:
+//
+//	name		- Name of the worker, reported in the worker statistics
+//	func		- Function to execute on the worker thread
+
+void service::LaunchWorker(const tchar_t* name, worker_group::worker_func func)
+{
+	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+
+	// A group created after the stop request would never be asked to stop
+	if((m_status == ServiceStatus::StopPending) || (m_status == ServiceStatus::Stopped)) throw winexception(ERROR_SERVICE_CANNOT_ACCEPT_CTRL);
+
+	if(!m_workers) m_workers = std::make_unique<worker_group>(*m_clock, m_placement, [=]() -> std::shared_ptr<void> { return std::atomic_load(&m_self); });
+	m_workers->Launch(name, std::move(func));
+}
+
+//-----------------------------------------------------------------------------
+// service::Main (private)
+//
+// Service instance entry point
+//
+// Arguments:
+//
+//	argc				- Number of command line arguments
+//	argv				- Array of command line argument strings
+//	context				- Service runtime context information and callbacks
+
+void service::Main(int argc, tchar_t** argv, const service_context& context)
+{
+	std::exception_ptr exception;
+
+	std::function<void(void)> body = [&]() -> void {
+
+		try {
+
+			// The main service thread keeps the placement until the service has stopped
+			placement_scope placement(context.Placement);
+
+			// Start the service; if it failed to start it has already been set to SERVICE_STOPPED
+			if(Startup(argc, argv, context)) {
+
+				// Service is now running, wait for the indication that SERVICE_STOPPED has been set
+				std::unique_lock<std::mutex> critsec(m_stoplock);
+				m_stopcondition.wait(critsec, [&]() -> bool { return m_stopped; });
+			}
+
+			// Workers that overran the stop deadline, or the one that stopped the service, still refer
+			// to the derived class; it cannot be destroyed until they have exited
+			if(m_workers) {
+
+				try { m_workers->Join(INFINITE); }
+				catch(...) { /* SERVICE_STOPPED has already been reported */ }
+			}
+
+			// The same goes for shutdown handlers that were still running when the service was stopped
+			// at the shutdown deadline; unregistering waits for them
+			if(m_shutdown) m_shutdown->Unregister(this);
+
+			// Nothing can be modifying the snapshot regions anymore
+			SavePendingSnapshot();
+
+			// No control handler can run anymore; closing the watchdog waits for a stall report being
+			// delivered, which is never on this thread, and the report may have stopped the service
+			m_watchdog.reset();
+		}
+
+		catch(...) { exception = std::current_exception(); }
+	};
+
+	// The stack of the calling thread cannot be changed; if a stack size has been specified
+	// the service runs on a new thread with that reservation and this thread waits for it
+	if(context.Placement && (context.Placement->StackSize != 0)) {
+
+		HANDLE thread = CreateThread(nullptr, context.Placement->StackSize, [](void* arg) -> DWORD {
+
+			(*reinterpret_cast<std::function<void(void)>*>(arg))();
+			return 0;
+
+		}, &body, STACK_SIZE_PARAM_IS_A_RESERVATION, nullptr);
+		if(thread == nullptr) throw winexception();
+
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+	}
+
+	else body();
+
+	// The process can exit as soon as this returns; make sure SERVICE_STOPPED has been reported
+	if(m_reporter) m_reporter->Flush();
+
+	if(exception) std::rethrow_exception(exception);
+}
+
+//-----------------------------------------------------------------------------
+// service::MainPooled (private, static)
+//
+// Service instance entry point when hosted on a thread pool; the instance holds
+// a reference to itself and returns without waiting for the service to stop
+//
+// Arguments:
+//
+//	instance			- Service instance to take ownership of
+//	argc				- Number of command line arguments
+//	argv				- Array of command line argument strings
+//	context				- Service runtime context information and callbacks
+
+void service::MainPooled(std::shared_ptr<service> instance, int argc, tchar_t** argv, const service_context& context)
+{
+	assert(context.CallbackEnvironment);
+
+	// The self-reference is released by SignalStopped() once the service stops
+	std::atomic_store(&instance->m_self, instance);
+
+	// The pool thread is only borrowed for startup; the stack size cannot be applied to it
+	placement_scope placement(context.Placement);
+	
+	// If the service failed to start, release the self-reference here instead; the instance
+	// will be destroyed when this function returns and releases the last reference
+	try { if(!instance->Startup(argc, argv, context)) std::atomic_store(&instance->m_self, std::shared_ptr<service>()); }
+	catch(...) { std::atomic_store(&instance->m_self, std::shared_ptr<service>()); throw; }
+}
+
+//-----------------------------------------------------------------------------
+// service::OnHandlerStall (protected, virtual)
+//
+// Invoked from the thread pool when a control handler overruns it's latency budget
+//
+// Arguments:
+//
+//	stall		- Describes the handler, the thread running it and it's stack
+
+void service::OnHandlerStall(const handler_stall& stall)
+{
+	// Report the overrun to an attached debugger; a service can override this to log the stack or
+	// to escalate, for example by stopping itself with a service specific exit code
+	tstring message = m_name + _T(": handler for control ") + to_tstring(static_cast<DWORD>(stall.Control)) +
+		_T(" has run for ") + to_tstring(stall.Elapsed) + _T("ms of a ") + to_tstring(stall.Budget) + _T("ms budget on thread ") +
+		to_tstring(stall.ThreadId) + _T("\n");
+
+	for(const auto& frame : stall.Stack) {
+
+		tchar_t address[32];
+		_sntprintf_s(address, _countof(address), _TRUNCATE, _T("\t%p\n"), reinterpret_cast<void*>(frame));
+		message += address;
+	}
+
+	OutputDebugString(message.c_str());
+}
+
+//-----------------------------------------------------------------------------
+// service::Pause
+//
+// Pauses the service
+//
+// Arguments:
+//
+//	NONE
+
+DWORD service::Pause(void)
+{
+	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+
+	// Service has to be in a status of RUNNING to accept this control
+	if(m_status != ServiceStatus::Running) return ERROR_CALL_NOT_IMPLEMENTED;
+	
+	// Set the service status to PAUSE_PENDING and hold the I/O loop, if one has been created
+	try { SetStatus(ServiceStatus::PausePending); if(m_ioloop) m_ioloop->Pause(); }
+	catch(...) { return Abort(std::current_exception()); }
+
+	try {
+
+		// Wait for the workers to drain out of their regions before the handlers run; the
+		// pending checkpoint is advanced as each straggler leaves
+		if(m_quiescence.Quiesce(QUIESCE_TIMEOUT, [&](size_t) -> void { Checkpoint(); }) != 0) {
+
+			// A worker that did not leave it's region in time fails the pause; the service keeps running
+			m_quiescence.Release();
+			if(m_ioloop) m_ioloop->Continue();
+			SetStatus(ServiceStatus::Running);
+
+			return ERROR_SERVICE_REQUEST_TIMEOUT;
+		}
+
+		// Invoke all of the PAUSE handlers prior to setting the service to PAUSED
+		ForEachHandler([&](const control_handler& handler) -> bool {
+			
+			if(handler.Control == ServiceControl::Pause) InvokeHandler(handler, 0, nullptr);
+			return true;
+		});
+
+		// Release the memory the service can do without while paused
+		m_trimmer.Shrink(m_memory);
+
+		SetStatus(ServiceStatus::Paused);
+	}
+
+	catch(...) { return Abort(std::current_exception()); }
+
+	return ERROR_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// service::RemoveHandler (protected)
+//
+// Removes a control handler registered with AddHandler()
+//
+// Arguments:
+//
+//	handler		- Control handler returned from AddHandler()
+
+void service::RemoveHandler(const control_handler* handler)
+{
+	std::shared_ptr<control_handler> removed;
+
+	UpdateHandlers([&](dynamic_handler_table& table) -> void {
+		
+		auto found = std::find_if(table.begin(), table.end(), [&](const auto& entry) -> bool { return entry.get() == handler; });
+		if(found == table.end()) return;
+
+		removed = *found;
+		table.erase(found);
+	});
+
+	// Dispatches that copied the handler before the update still hold a reference to it; wait for them
+	// to invoke it and let go, unless this is called from a dispatch that might be holding one itself
+	if(DispatchDepth() > 0) return;
+
+	for(uint32_t attempt = 0; removed && (removed.use_count() > 1); attempt++) {
+
+		if(attempt < 64) SwitchToThread();
+		else Sleep(1);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// service::SavePendingSnapshot (private)
+//
+// Writes and commits a snapshot that could not be written when the service was stopped
+// because workers or shutdown handlers were still running
+//
+// Arguments:
+//
+//	NONE
+
+void service::SavePendingSnapshot(void)
+{
+	if(!m_snapshotpending.exchange(false)) return;
+
+	// The regions may still be modified by a worker that overran the stop deadline
+	if(m_workers) {
+
+		try { m_workers->Join(INFINITE); }
+		catch(...) { /* SERVICE_STOPPED has already been reported */ }
+	}
+
+	m_snapshot.Save();
+	m_snapshot.Commit();
+}
+
+//-----------------------------------------------------------------------------
+// service::SetNonPendingStatus (private)
+//
+// Sets a non-pending service status
+//
+// Arguments:
+//
+//	status				- New service status to set
+//	win32exitcode		- Win32 service exit code for ServiceStatus::Stopped (see documentation)
+//	serviceexitcode		- Service specific exit code for ServiceStatus::Stopped (see documentation)
+
+void service::SetNonPendingStatus(ServiceStatus status, uint32_t win32exitcode, uint32_t serviceexitcode)
+{
+	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+
+	assert(m_statusfunc);							// Needs to be set
+	assert(!m_statuspending);						// Should not be running
+
+	// Create and initialize a new SERVICE_STATUS for this operation
+	SERVICE_STATUS newstatus;
+	newstatus.dwServiceType = 0;		// <-- Set by m_statusfunc
+	newstatus.dwCurrentState = static_cast<DWORD>(status);
+	newstatus.dwControlsAccepted = (status == ServiceStatus::Stopped) ? 0 : AcceptedControls;
+	newstatus.dwWin32ExitCode = (status == ServiceStatus::Stopped) ? win32exitcode : ERROR_SUCCESS;
+	newstatus.dwServiceSpecificExitCode = (status == ServiceStatus::Stopped) ? serviceexitcode : ERROR_SUCCESS;
+	newstatus.dwCheckPoint = 0;
+	newstatus.dwWaitHint = 0;
+
+	m_statusfunc(newstatus);						// Set the non-pending status
+}
+
+//-----------------------------------------------------------------------------
+// service::SetPendingStatus (private)
+//
+// Sets an automatically checkpointed pending service status
+//
+// Arguments:
+//
+//	status				- Pending service status to set
+
+void service::SetPendingStatus(ServiceStatus status)
+{
+	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+
+	assert(m_statusfunc);							// Needs to be set
+	assert(!m_statuspending);						// Should not be running
+
+	// Block all controls during SERVICE_START_PENDING and SERVICE_STOP_PENDING, otherwise only block
+	// controls that would result in a service status change while a status change is pending
+	DWORD accept = ((status == ServiceStatus::StartPending) || (status == ServiceStatus::StopPending)) ? 0 
+		: (AcceptedControls & ~(SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_PAUSE_CONTINUE | SERVICE_ACCEPT_SHUTDOWN));
+
+	// Set the initial pending status before starting the checkpoint timer
+	SERVICE_STATUS newstatus;
+	newstatus.dwServiceType = 0;			// <-- Set by m_statusfunc
+	newstatus.dwCurrentState = static_cast<DWORD>(status);
+	newstatus.dwControlsAccepted = accept;
+	newstatus.dwWin32ExitCode = ERROR_SUCCESS;
+	newstatus.dwServiceSpecificExitCode = ERROR_SUCCESS;
+	newstatus.dwCheckPoint = 1;
+	newstatus.dwWaitHint = (status == ServiceStatus::StartPending) ? STARTUP_WAIT_HINT : PENDING_WAIT_HINT;
+	m_statusfunc(newstatus);
+
+	// Create the timer used to manage the automatic checkpoint operation on first use; this
+	// runs on the service's thread pool rather than occupying a dedicated thread
+	if(m_statustimer == nullptr) m_statustimer = m_clock->CreateTimer([=]() { Checkpoint(); }, m_environ);
+
+	// Continually report the same pending status with an incremented checkpoint until canceled
+	m_pendingstatus = newstatus;
+	m_statuspending = true;
+	m_clock->StartTimer(m_statustimer, PENDING_CHECKPOINT_INTERVAL);
+}
+
+//-----------------------------------------------------------------------------
+// service::SetStatus (private)
+//
+// Sets a new service status; pending vs. non-pending is handled automatically
+//
+// Arguments:
+//
+//	status			- New service status to set
+//	win32exitcode	- Win32 specific exit code for ServiceStatus::Stopped (see documentation)
+//	serviceexitcode	- Service-specific exit code for ServiceStatus::Stopped (see documentation)
+
+void service::SetStatus(ServiceStatus status, uint32_t win32exitcode, uint32_t serviceexitcode)
+{
+	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+
+	// Check for a duplicate status; pending states are managed automatically
+	if(status == m_status) return;
+
+	// Check for a pending service state operation
+	if(m_statuspending) {
+
+		// Cancel the pending state checkpoint timer and wait for any running callback to complete
+		m_statuspending = false;
+		m_clock->CancelTimer(m_statustimer);
+
+		// Check for the presence of an exception from the timer callback and rethrow it
+		if(m_statusexception) {
+
+			std::exception_ptr exception = m_statusexception;
+			m_statusexception = nullptr;
+			std::rethrow_exception(exception);
+		}
+	}
+
+	// Check for an exception from the asynchronous status reporter and rethrow it
+	if(m_reporter) {
+
+		std::exception_ptr exception = m_reporter->TakeException();
+		if(exception) std::rethrow_exception(exception);
+	}
+
+	// Invoke the proper status helper based on the type of status being set
+	switch(status) {
+
+		// Pending status codes
+		case ServiceStatus::StartPending:
+		case ServiceStatus::StopPending:
+		case ServiceStatus::ContinuePending:
+		case ServiceStatus::PausePending:
+			SetPendingStatus(status);
+			break;
+
+		// Non-pending status codes without an exit status
+		case ServiceStatus::Running:
+		case ServiceStatus::Paused:
+			SetNonPendingStatus(status);
+			break;
+
+		// Non-pending status codes that report exit status
+		case ServiceStatus::Stopped:
+			SetNonPendingStatus(status, win32exitcode, serviceexitcode);
+			break;
+
+		// Invalid status code
+		default: throw winexception(E_INVALIDARG);
+	}
+	
+	m_status = status;						// Service status has been changed		
+}
+
+//-----------------------------------------------------------------------------
+// service::SignalStopped (private)
+//
+// Releases the main thread wait, or for a pooled service releases the reference the 
+// instance holds to itself.  The caller must hold a reference to a pooled instance
+//
+// Arguments:
+//
+//	NONE
+
+void service::SignalStopped(void)
+{
+	// Stop dispatching control channel requests before the derived class can be destroyed
+	if(m_controlchannel) m_controlchannel->Close();
+
+	// Wake up the main service thread, if there is one waiting
+	std::unique_lock<std::mutex> critsec(m_stoplock);
+	m_stopped = true;
+	m_stopcondition.notify_all();
+	critsec.unlock();
+
+	// Release any self-reference held by a pooled service instance
+	std::atomic_store(&m_self, std::shared_ptr<service>());
+}
+
+//-----------------------------------------------------------------------------
+// service::SignalStopping (private)
+//
+// Cancels the I/O loop, signals the workers and closes the channels once the service
+// is stopping; the status lock must be held
+//
+// Arguments:
+//
+//	NONE
+
+void service::SignalStopping(void)
+{
+	if(m_ioloop) m_ioloop->Stop();
+	if(m_workers) m_workers->RequestStop();
+
+	// Threads parked by a pause have to be able to see the stop request
+	m_quiescence.Release();
+
+	// Close the channels this service is an endpoint of; nothing will receive the items
+	// still queued in the channels it receives from so those are released now
+	for(auto& iterator : m_channels) {
+
+		iterator.first->Close();
+		if(iterator.second) iterator.first->Drain();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// service::Startup (private)
+//
+// Registers the service control handler and starts the service
+//
+// Arguments:
+//
+//	argc				- Number of command line arguments
+//	argv				- Array of command line argument strings
+//	context				- Service runtime context information and callbacks
+
+bool service::Startup(int argc, tchar_t** argv, const service_context& context)
+{
+
+	assert(context.RegisterHandlerFunc);
+	if(!context.RegisterHandlerFunc) throw winexception(ERROR_INVALID_PARAMETER);
+
+	assert(context.SetStatusFunc);
+	if(!context.SetStatusFunc) throw winexception(ERROR_INVALID_PARAMETER);
+
+	// Define a static HandlerEx callback that calls back into this service instance; a pooled
+	// instance is kept alive until the handler returns in case the control stops the service
+	LPHANDLER_FUNCTION_EX handler = [](DWORD control, DWORD eventtype, void* eventdata, void* context) -> DWORD { 
+
+		service* instance = reinterpret_cast<service*>(context);
+		std::shared_ptr<service> self = std::atomic_load(&instance->m_self);
+		return instance->ControlHandler(static_cast<ServiceControl>(control), eventtype, eventdata); 
+	};
+
+	// Pending status checkpoints are reported from the specified thread pool (if any)
+	// using the specified clock (if any)
+	m_name = argv[0];
+	m_environ = context.CallbackEnvironment;
+	if(context.Clock) m_clock = context.Clock;
+	if(context.Placement) m_placement = *context.Placement;
+	m_pressure = context.MemoryPressure;
+
+	// Handlers that declared a latency budget are watched from the same thread pool and clock
+	m_watchdog = std::make_unique<handler_watchdog>(*m_clock, m_environ, [=](const handler_stall& stall) -> void {
+
+		// A pooled instance that the report stops could be destroyed on this thread, which would close the
+		// watchdog from it's own callback; the last reference is released from a work item instead
+		std::unique_ptr<std::shared_ptr<service>> self = std::make_unique<std::shared_ptr<service>>(std::atomic_load(&m_self));
+		OnHandlerStall(stall);
+
+		if(!*self) return;
+		if(TrySubmitThreadpoolCallback([](PTP_CALLBACK_INSTANCE, void* context) -> void {
+
+			delete reinterpret_cast<std::shared_ptr<service>*>(context);
+
+		}, self.get(), m_environ)) self.release();
+	});
+
+	// Emptying the working set on pause would also take it from the other services in a shared process,
+	// and a handoff needs the next instance to be started in this process; a harness hosts the service in
+	// a process it does not own, and reports it as shared
+	m_ownprocess = ((static_cast<DWORD>(context.ProcessType) & SERVICE_WIN32_SHARE_PROCESS) == 0);
+
+	// Register a service control handler for this service instance
+	SERVICE_STATUS_HANDLE statushandle = context.RegisterHandlerFunc(argv[0], handler, this);
+	if(statushandle == 0) throw winexception();
+
+	// Controls raised within the process go through the same wrappers as the registered handler
+	m_dispatchfunc = context.DispatchControlFunc;
+
+	// Register with the shutdown coordinator, if there is one; this lasts for the lifetime of the instance
+	m_shutdown = context.ShutdownCoordinator;
+	if(m_shutdown) m_shutdown->Register(this, argv[0]);
+
+	// Define a status reporting function that uses the handle and process type defined above
+	m_statusfunc = [=](SERVICE_STATUS& status) -> void {
+
+		assert(statushandle != 0);
+		status.dwServiceType = static_cast<DWORD>(context.ProcessType);
+		if(!context.SetStatusFunc(statushandle, &status)) throw winexception();
+	};
+
+	// If requested, the status function only posts the status to a reporter that delivers it
+	// from the thread pool; any error from the status function surfaces on the next SetStatus()
+	if(context.AsyncStatus) {
+
+		m_reporter = std::make_unique<status_reporter>(m_statusfunc, m_environ);
+		m_statusfunc = [=](SERVICE_STATUS& status) -> void { m_reporter->Post(status); };
+	}
+
+	try {
+
+		// Service is starting; report SERVICE_START_PENDING
+		SetStatus(ServiceStatus::StartPending);
+
+		// Invoke derived service class startup code
+		OnStart(argc, argv);
+
+		// Run the startup phases declared by OnStart(), if any, and wait for the required ones; the
+		// status remains START_PENDING while they run and the others continue in the background
+		if(m_phases) {
+
+			{
+				std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+				if(!m_workers) m_workers = std::make_unique<worker_group>(*m_clock, m_placement, [=]() -> std::shared_ptr<void> { return std::atomic_load(&m_self); });
+			}
+
+			m_phases->Run(*m_workers);
+			m_phases->WaitForRequired(REQUIRED_PHASES_TIMEOUT);
+		}
+
+		// If the service implements any payload handlers, expose the shared memory control channel
+		// once the service has started; requests are dispatched through the normal control handler
+		if(!ForEachHandler([](const control_handler& handler) -> bool { return !handler.HasPayload; })) {
+
+			m_controlchannel = std::make_unique<control_channel_host>(argv[0], 
+				[=](uint32_t control, control_payload& payload) -> DWORD { return DispatchControl(static_cast<ServiceControl>(control), control_payload::EVENT_TYPE, &payload); },
+				[=]() -> std::shared_ptr<void> { return std::atomic_load(&m_self); }, m_environ);
+		}
+
+		// Subscribe to the memory pressure source if the service has a handler for it
+		if(m_pressure && HandlesControl(ServiceControl::MemoryPressure)) m_pressure->Subscribe(this);
+		else m_pressure = nullptr;
+
+		// Service is now running
+		SetStatus(ServiceStatus::Running);
+		return true;
+	}
+
+	// Set the service to STOPPED on an unhandled winexception, translating ERROR_SUCCESS into ERROR_SERVICE_SPECIFIC.
+	// If the exception thrown is unknown use a generic ERROR_UNHANDLED_EXCEPTION as the stop code
+	catch(winexception& ex) { StartupFailed((ex.code() != ERROR_SUCCESS) ? ex.code() : ERROR_SERVICE_SPECIFIC_ERROR); }
+	catch(...) { StartupFailed(ERROR_UNHANDLED_EXCEPTION); }
+
+	if(m_controlchannel) m_controlchannel->Close();
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// service::StartupFailed (private)
+//
+// Joins the workers started before a startup failure and reports SERVICE_STOPPED
+//
+// Arguments:
+//
+//	win32exitcode	- Win32 service exit code
+
+void service::StartupFailed(DWORD win32exitcode)
+{
+	// Startup phases that are still running are asked to stop and waited for; the status
+	// remains START_PENDING, with checkpoints, until every one of them has exited
+	if(m_workers) {
+
+		try { m_workers->Join(INFINITE); }
+		catch(...) { /* the start has already failed */ }
+	}
+
+	TrySetStatus(ServiceStatus::Stopped, win32exitcode);
+}
+
+//-----------------------------------------------------------------------------
+// service::Stop
+//
+// Stops the service
+//
+// Arguments:
+//
+//	win32exitcode		- Win32 service exit code
+//	serviceexitcode		- Service specific exit code
+
+DWORD service::Stop(DWORD win32exitcode, DWORD serviceexitcode)
+{
+	// A pooled service instance may release it's last reference; keep it alive until return
+	std::shared_ptr<service> self = std::atomic_load(&m_self);
+	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+
+	// Service cannot be stopped unless it's RUNNING or PAUSED, this could cause
+	// potential race conditions in the derived service class; better to block it
+	if(m_status != ServiceStatus::Running && m_status != ServiceStatus::Paused) return ERROR_CALL_NOT_IMPLEMENTED;
+
+	// Set the service status to STOP_PENDING, cancel the I/O loop and signal the workers
+	try { 
+		
+		SetStatus(ServiceStatus::StopPending); 
+		SignalStopping();
+	}
+	catch(...) { return Abort(std::current_exception()); }
+
+	try {
+
+		// Invoke all of the STOP handlers prior to setting the service to STOPPED
+		ForEachHandler([&](const control_handler& handler) -> bool {
+			
+			if(handler.Control == ServiceControl::Stop) InvokeHandler(handler, 0, nullptr);
+			return true;
+		});
+
+		// Wait for the workers to exit; the stop handlers may have to close something they are blocked on
+		bool joined = (m_workers) ? m_workers->Join(WORKER_JOIN_TIMEOUT) : true;
+
+		// Write the snapshot regions once nothing can be modifying them anymore, and replace the mapped
+		// snapshot once nothing can be referring to it.  If a worker is still running both wait until
+		// it has exited; a snapshot that cannot be written leaves the previous one in place
+		if(joined) { m_snapshot.Save(); m_snapshot.Commit(); }
+		else m_snapshotpending = true;
+
+		SetStatus(ServiceStatus::Stopped, win32exitcode, serviceexitcode);
+	}
+
+	catch(...) { return Abort(std::current_exception()); }
+
+	SignalStopped();				// Signal the exit from the main thread
+
+	return ERROR_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// service::TrySetStatus (private)
+//
+// Exception-safe version of SetStatus(), should only be used when an exception
+// cannot be dealt with, like when stopping the service from another exception
+//
+// Arguments:
+//
+//	status			- New service status to set
+//	win32exitcode	- Win32 specific exit code for ServiceStatus::Stopped (see documentation)
+//	serviceexitcode	- Service-specific exit code for ServiceStatus::Stopped (see documentation)
+
+bool service::TrySetStatus(ServiceStatus status, uint32_t win32exitcode, uint32_t serviceexitcode)
+{
+	// Attempt to change the service status and just eat any thrown exceptions
+	try { SetStatus(status, win32exitcode, serviceexitcode); }
+	catch(...) { return false; }
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// service::UpdateHandlers (private)
+//
+// Publishes a new snapshot of the runtime control handlers
+//
+// Arguments:
+//
+//	update		- Function that applies the change to a copy of the current snapshot
+
+void service::UpdateHandlers(const std::function<void(dynamic_handler_table& table)>& update)
+{
+	std::vector<std::unique_ptr<const dynamic_handler_table>> released;
+
+	{
+		// Updates are serialized with each other and with the service status changes
+		std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+
+		DWORD accepted = AcceptedControls;
+
+		std::unique_ptr<dynamic_handler_table> table = std::make_unique<dynamic_handler_table>((m_handlertable) ? *m_handlertable : dynamic_handler_table());
+		update(*table);
+
+		// Publish the new snapshot; the previous one is retired until no dispatch can still be copying it
+		m_handlers.store(table.get(), std::memory_order_release);
+		if(m_handlertable) released.push_back(std::move(m_handlertable));
+		m_handlertable = std::move(table);
+
+		// Report the new set of accepted controls; a pending status will report it at the next transition
+		if((AcceptedControls != accepted) && ((m_status == ServiceStatus::Running) || (m_status == ServiceStatus::Paused)))
+			SetNonPendingStatus(m_status);
+	}
+
+	// Wait for the dispatches that may be copying the retired snapshot before releasing it
+	m_handlerepochs.Synchronize();
+}
+
+//-----------------------------------------------------------------------------
+// svctl::service_harness
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// service_harness Constructor
+//
+// Arguments:
+//
+//	NONE
+
+service_harness::service_harness()
+{
+	// Initialize the SERVICE_STATUS to the default state
+	zero_init(m_status).dwCurrentState = static_cast<DWORD>(ServiceStatus::Stopped);
+}
+
+//-----------------------------------------------------------------------------
+// service_harness Constructor
+//
+// Arguments:
+//
+//	pool		- Thread pool to host the service on instead of a dedicated thread
+
+service_harness::service_harness(service_pool& pool) : service_harness()
+{
+	m_environ = pool;
+}
+
+//-----------------------------------------------------------------------------
+// service_harness Destructor
+
+service_harness::~service_harness()
+{
+	// Stop receiving controls from the system event source before anything is released
+	if(m_events) m_events->Unsubscribe(this);
+
+	// If the main service thread is still active, it needs to be detached
+	// (There doesn't appear to be a legitimate way to also kill it)
+	if(m_mainthread.joinable()) m_mainthread.detach();
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::Continue
+//
+// Sends SERVICE_CONTROL_CONTINUE to the service, throws an exception if the
+// service does not accept the control or stops prematurely
+//
+// Arguments:
+//
+//	NONE
+
+void service_harness::Continue(void)
+{
+	uint64_t started = m_clock->Now();
+
+	DWORD result = SendControl(ServiceControl::Continue);
+	if(result != ERROR_SUCCESS) throw winexception(result);
+
+	WaitForStatus(ServiceStatus::Running);
+	RecordTime(started, true);
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::putAsyncStatus
+//
+// Sets the flag provided to the service to report status asynchronously
+//
+// Arguments:
+//
+//	value		- Flag indicating if the service should use a status_reporter
+
+void service_harness::putAsyncStatus(bool value)
+{
+	std::lock_guard<std::mutex> critsec(m_statuslock);
+
+	// The flag cannot be changed while the service is running
+	if(m_launched) throw winexception(ERROR_SERVICE_ALREADY_RUNNING);
+	m_asyncstatus = value;
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::getCanContinue
+//
+// Determines if the service can be continued
+
+bool service_harness::getCanContinue(void)
+{
+	std::lock_guard<std::mutex> critsec(m_statuslock);
+
+	// If the service is not running, it cannot be controlled at all
+	if(!m_launched) return false;
+
+	// The service can be continued if it's in a PAUSED state and accepts the control
+	return ((static_cast<ServiceStatus>(m_status.dwCurrentState) == ServiceStatus::Paused) && 
+		ServiceControlAccepted(ServiceControl::Continue, m_status.dwControlsAccepted));
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::getCanPause
+//
+// Determines if the service can be paused
+
+bool service_harness::getCanPause(void)
+{
+	std::lock_guard<std::mutex> critsec(m_statuslock);
+
+	// If the service is not running, it cannot be controlled at all
+	if(!m_launched) return false;
+
+	// The service can be paused if it's in a RUNNING state and accepts the control
+	return ((static_cast<ServiceStatus>(m_status.dwCurrentState) == ServiceStatus::Running) && 
+		ServiceControlAccepted(ServiceControl::Pause, m_status.dwControlsAccepted));
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::getCanStop
+//
+// Determines if the service can be stopped
+
+bool service_harness::getCanStop(void)
+{
+	std::lock_guard<std::mutex> critsec(m_statuslock);
+
+	// If the service is not running, it cannot be controlled at all
+	if(!m_launched) return false;
+
+	// The service can be stopped if it's not in a STOPPED or STOP_PENDING state and accepts the control
+	return ((static_cast<ServiceStatus>(m_status.dwCurrentState) != ServiceStatus::Stopped) && 
+		(static_cast<ServiceStatus>(m_status.dwCurrentState) != ServiceStatus::StopPending) &&
+		ServiceControlAccepted(ServiceControl::Stop, m_status.dwControlsAccepted));
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::putClock
+//
+// Sets the clock used by the harness and provided to the service
+//
+// Arguments:
+//
+//	value		- Clock instance; must outlive the harness
+
+void service_harness::putClock(service_clock& value)
+{
+	std::lock_guard<std::mutex> critsec(m_statuslock);
+
+	// The clock cannot be changed while the service is running
+	if(m_launched) throw winexception(ERROR_SERVICE_ALREADY_RUNNING);
+	m_clock = &value;
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::putEvents
+//
+// Sets the source of the TimeChange and NetBind controls sent to the service
+//
+// Arguments:
+//
+//	value		- System event source, typically system_event_source::Instance(); can be null
+
+void service_harness::putEvents(system_event_source* value)
+{
+	std::lock_guard<std::mutex> critsec(m_statuslock);
+
+	// The source cannot be changed while the service is running
+	if(m_launched) throw winexception(ERROR_SERVICE_ALREADY_RUNNING);
+	m_events = value;
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::InjectFault (private)
+//
+// Applies the latency and failure rate of a fault_profile to a callback
+//
+// Arguments:
+//
+//	profile		- Fault profile to be applied
+
+bool service_harness::InjectFault(const fault_profile& profile)
+{
+	std::unique_lock<std::mutex> critsec(m_faultlock);
+
+	uint32_t latency = 0;
+	bool fail = false;
+
+	// Draw the latency from the requested distribution
+	switch(profile.Distribution) {
+
+		case latency_distribution::Constant: latency = profile.Latency; break;
+		case latency_distribution::Uniform:
+			latency = std::uniform_int_distribution<uint32_t>(0, (profile.Latency > (UINT32_MAX / 2)) ? UINT32_MAX : profile.Latency * 2)(m_random);
+			break;
+		case latency_distribution::Exponential:
+			if(profile.Latency) latency = static_cast<uint32_t>(std::min<double>(std::exponential_distribution<double>(1.0 / profile.Latency)(m_random), UINT32_MAX));
+			break;
+	}
+
+	// Add any jitter, saturating rather than wrapping, and determine if this call will fail
+	if(profile.Jitter) {
+
+		uint32_t jitter = std::uniform_int_distribution<uint32_t>(0, profile.Jitter)(m_random);
+		latency = (jitter > (UINT32_MAX - latency)) ? UINT32_MAX : latency + jitter;
+	}
+	if(profile.FailureRate > 0.0) fail = std::bernoulli_distribution(std::min(profile.FailureRate, 1.0))(m_random);
+
+	m_statistics.InjectedLatency += latency;
+	if(fail) ++m_statistics.InjectedFailures;
+
+	critsec.unlock();
+
+	// Delay the caller on the harness clock so that virtual time is respected
+	if(latency) {
+
+		std::mutex delaylock;
+		std::condition_variable delaycondition;
+		std::unique_lock<std::mutex> delay(delaylock);
+		m_clock->WaitFor(delay, delaycondition, latency, []() -> bool { return false; });
+	}
+
+	if(fail) SetLastError((profile.FailureCode != ERROR_SUCCESS) ? profile.FailureCode : ERROR_GEN_FAILURE);
+	return fail;
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::putMemoryPressure
+//
+// Sets the memory pressure source provided to the service
+//
+// Arguments:
+//
+//	value		- Memory pressure source, typically a virtual_memory_pressure; can be null
+
+void service_harness::putMemoryPressure(memory_pressure_source* value)
+{
+	std::lock_guard<std::mutex> critsec(m_statuslock);
+
+	// The source cannot be changed while the service is running
+	if(m_launched) throw winexception(ERROR_SERVICE_ALREADY_RUNNING);
+	m_pressure = value;
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::Pause
+//
+// Sends SERVICE_CONTROL_PAUSE to the service, throws an exception if the
+// service does not accept the control or stops prematurely
+//
+// Arguments:
+//
+//	NONE
+
+void service_harness::Pause(void)
+{
+	uint64_t started = m_clock->Now();
+
+	DWORD result = SendControl(ServiceControl::Pause);
+	if(result != ERROR_SUCCESS) throw winexception(result);
+
+	WaitForStatus(ServiceStatus::Paused);
+	RecordTime(started, true);
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::putPlacement
+//
+// Sets the placement policy provided to the service
+//
+// Arguments:
+//
+//	value		- Placement policy for the service threads
+
+void service_harness::putPlacement(const service_placement& value)
+{
+	std::lock_guard<std::mutex> critsec(m_statuslock);
+
+	// The placement cannot be changed while the service is running
+	if(m_launched) throw winexception(ERROR_SERVICE_ALREADY_RUNNING);
+	m_placement = value;
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::RecordTime (private)
+//
+// Records a control or transition time into the statistics
+//
+// Arguments:
+//
+//	started		- Clock time when the operation started
+//	transition	- Flag indicating a status transition rather than a control
+
+void service_harness::RecordTime(uint64_t started, bool transition)
+{
+	uint32_t elapsed = static_cast<uint32_t>(m_clock->Now() - started);
+	std::lock_guard<std::mutex> critsec(m_faultlock);
+
+	if(transition) {
+
+		++m_statistics.Transitions;
+		m_statistics.TransitionTime += elapsed;
+		m_statistics.MaxTransitionTime = std::max(m_statistics.MaxTransitionTime, elapsed);
+	}
+
+	else {
+
+		++m_statistics.Controls;
+		m_statistics.ControlTime += elapsed;
+		m_statistics.MaxControlTime = std::max(m_statistics.MaxControlTime, elapsed);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::RegisterHandlerFunc (private)
+//
+// Function invoked by the service to register it's control handler
+//
+// Arguments:
+//
+//	servicename		- Name assigned to the service instance
+//	handler			- Pointer to the service's HandlerEx() callback
+//	context			- HandlerEx() callback context pointer
+
+SERVICE_STATUS_HANDLE service_harness::RegisterHandlerFunc(LPCTSTR servicename, LPHANDLER_FUNCTION_EX handler, LPVOID context)
+{
+	assert(handler != nullptr);
+	UNREFERENCED_PARAMETER(servicename);
+
+	// Apply any injected latency and failure before registering the handler
+	if(InjectFault(getRegisterFaults())) return nullptr;
+
+	m_handler = handler;					// Store the handler function pointer
+	m_context = context;					// Store the handler context pointer
+
+	// Return the address of this harness instance as a pseudo SERVICE_STATUS_HANDLE for the service
+	return reinterpret_cast<SERVICE_STATUS_HANDLE>(this);
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::Replay
+//
+// Reissues the controls recorded in a trace file against the running service and
+// compares the results, latencies and final status against the recording
+//
+// Arguments:
+//
+//	path		- Path to the trace file
+//	speed		- Timing multiplier (2.0 = twice as fast) or zero for no delays
+
+replay_result service_harness::Replay(const tchar_t* path, float speed)
+{
+	replay_result result;
+	result.ExpectedStatus = result.ActualStatus = ServiceStatus::Stopped;
+
+	if(speed < 0.0f) throw winexception(E_INVALIDARG);
+
+	// Read the entire trace file into memory
+	HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(file == INVALID_HANDLE_VALUE) throw winexception();
+
+	trace_header header;
+	std::vector<trace_record> records;
+	DWORD read = 0;
+
+	if(!ReadFile(file, &header, sizeof(trace_header), &read, nullptr) || (read != sizeof(trace_header)) || 
+		(header.magic != service_recorder::TRACE_MAGIC) || (header.version != service_recorder::TRACE_VERSION) || 
+		(header.recordsize != sizeof(trace_record))) {
+
+		CloseHandle(file);
+		throw winexception(ERROR_BAD_FORMAT);
+	}
+
+	trace_record record;
+	while(ReadFile(file, &record, sizeof(trace_record), &read, nullptr) && (read == sizeof(trace_record))) records.push_back(record);
+	CloseHandle(file);
+
+	// Reissue each control at it's original offset from the first control, scaled by speed
+	LARGE_INTEGER frequency, before, after;
+	QueryPerformanceFrequency(&frequency);
+
+	uint64_t origin = 0;
+	uint64_t start = m_clock->Now();
+	bool first = true;
+	std::mutex delaylock;
+	std::condition_variable delaycondition;
+
+	for(const auto& entry : records) {
+
+		// Status records only contribute the final expected status
+		if(entry.type == trace_record_type::Status) { result.ExpectedStatus = static_cast<ServiceStatus>(entry.code); continue; }
+		if(entry.type != trace_record_type::Control) continue;
+
+		if(first) { origin = entry.timestamp; first = false; }
+
+		// Wait on the harness clock until the scaled offset of this control has been reached
+		if(speed > 0.0f) {
+
+			uint64_t offset = static_cast<uint64_t>(((entry.timestamp - origin) / 1000) / speed);
+			uint64_t elapsed = m_clock->Now() - start;
+			if(offset > elapsed) {
+
+				std::unique_lock<std::mutex> critsec(delaylock);
+				m_clock->WaitFor(critsec, delaycondition, static_cast<uint32_t>(offset - elapsed), []() -> bool { return false; });
+			}
+		}
+
+		// Send the control and measure the latency; event data cannot be recorded
+		replay_control control = { static_cast<ServiceControl>(entry.code), entry.data1, entry.data2, 0, entry.data3, 0 };
+
+		QueryPerformanceCounter(&before);
+		control.ActualResult = SendControl(control.Control, control.EventType, nullptr);
+		QueryPerformanceCounter(&after);
+
+		control.ActualLatency = static_cast<uint32_t>(((after.QuadPart - before.QuadPart) * 1000000) / frequency.QuadPart);
+		result.Controls.push_back(control);
+	}
+
+	// Allow the service some time to reach the expected final status
+	try { WaitForStatus(result.ExpectedStatus, REPLAY_SETTLE_TIMEOUT); }
+	catch(winexception&) { /* reported through ActualStatus */ }
+
+	result.ActualStatus = static_cast<ServiceStatus>(getStatus().dwCurrentState);
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::ResetStatistics
+//
+// Resets the collected control and transition statistics
+//
+// Arguments:
+//
+//	NONE
+
+void service_harness::ResetStatistics(void)
+{
+	std::lock_guard<std::mutex> critsec(m_faultlock);
+	zero_init(m_statistics);
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::SendControl
+//
+// Sends a control to the service
+//
+// Arguments:
+//
+//	control		- Control to be sent to the service
+//	eventtype	- Specifies a control-specific event type code (uncommon)
+//	eventdata	- Specifies control-specific event data (uncommon)
+
+DWORD service_harness::SendControl(ServiceControl control, DWORD eventtype, void* eventdata)
+{
+	std::unique_lock<std::mutex> critsec(m_statuslock);
+
+	// If the service has not been launched, that's the same result as SERVICE_STOPPED
+	if(!m_launched) return ERROR_SERVICE_NOT_ACTIVE;
+
+	// Certain service statuses prevent the service from being controlled at all, see ControlService() on MSDN
+	switch(static_cast<ServiceStatus>(m_status.dwCurrentState)) {
+
+		// SERVICE_STOPPED and SERVICE_STOP_PENDING never allow for a new control to be sent
+		case ServiceStatus::Stopped : return ERROR_SERVICE_NOT_ACTIVE;
+		case ServiceStatus::StopPending: return ERROR_SERVICE_CANNOT_ACCEPT_CTRL;
+
+		// SERVICE_START_PENDING only allows SERVICE_CONTROL_STOP
+		case ServiceStatus::StartPending : 
+			if(control != ServiceControl::Stop) return ERROR_SERVICE_CANNOT_ACCEPT_CTRL;
+			// fall-through
+
+		// Check the requested control against the service's current accepted controls mask
+		default: if(!ServiceControlAccepted(control, m_status.dwControlsAccepted)) return ERROR_INVALID_SERVICE_CONTROL;
+	}
+
+	// Unlock the status critical section and invoke the service's handler directly
+	critsec.unlock();
+
+	uint64_t started = m_clock->Now();
+	DWORD result = m_handler(static_cast<DWORD>(control), eventtype, eventdata, m_context);
+	RecordTime(started, false);
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::ServiceControlAccepted (private, static)
+//
+// Checks a ServiceControl against a SERVICE_ACCEPT_XXXX mask
+//
+// Arguments:
+//
+//	control			- Service control code to be checked
+//	mask			- SERVICE_ACCEPT_XXXX mask to check control against
+
+bool service_harness::ServiceControlAccepted(ServiceControl control, DWORD mask)
+{
+	switch(control) {
+		
+		case ServiceControl::Stop:					return ((mask & SERVICE_ACCEPT_STOP) == SERVICE_ACCEPT_STOP);
+		case ServiceControl::Pause:					return ((mask & SERVICE_ACCEPT_PAUSE_CONTINUE) == SERVICE_ACCEPT_PAUSE_CONTINUE);
+		case ServiceControl::Continue:				return ((mask & SERVICE_ACCEPT_PAUSE_CONTINUE) == SERVICE_ACCEPT_PAUSE_CONTINUE);
+		case ServiceControl::Interrogate:			return true;
+		case ServiceControl::Shutdown:				return ((mask & SERVICE_ACCEPT_SHUTDOWN) == SERVICE_ACCEPT_SHUTDOWN);
+		case ServiceControl::ParameterChange:		return ((mask & SERVICE_ACCEPT_PARAMCHANGE) == SERVICE_ACCEPT_PARAMCHANGE);
+		case ServiceControl::NetBindAdd:			return ((mask & SERVICE_ACCEPT_NETBINDCHANGE) == SERVICE_ACCEPT_NETBINDCHANGE);
+		case ServiceControl::NetBindRemove:			return ((mask & SERVICE_ACCEPT_NETBINDCHANGE) == SERVICE_ACCEPT_NETBINDCHANGE);
+		case ServiceControl::NetBindEnable:			return ((mask & SERVICE_ACCEPT_NETBINDCHANGE) == SERVICE_ACCEPT_NETBINDCHANGE);
+		case ServiceControl::NetBindDisable:		return ((mask & SERVICE_ACCEPT_NETBINDCHANGE) == SERVICE_ACCEPT_NETBINDCHANGE);
+		case ServiceControl::DeviceEvent:			return false;
+		case ServiceControl::HardwareProfileChange:	return ((mask & SERVICE_ACCEPT_HARDWAREPROFILECHANGE) == SERVICE_ACCEPT_HARDWAREPROFILECHANGE);
+		case ServiceControl::PowerEvent:			return ((mask & SERVICE_ACCEPT_POWEREVENT) == SERVICE_ACCEPT_POWEREVENT);
+		case ServiceControl::SessionChange:			return ((mask & SERVICE_ACCEPT_SESSIONCHANGE) == SERVICE_ACCEPT_SESSIONCHANGE);
+		case ServiceControl::PreShutdown:			return ((mask & SERVICE_ACCEPT_PRESHUTDOWN) == SERVICE_ACCEPT_PRESHUTDOWN);
+		case ServiceControl::TimeChange:			return ((mask & SERVICE_ACCEPT_TIMECHANGE) == SERVICE_ACCEPT_TIMECHANGE);
+		case ServiceControl::TriggerEvent:			return ((mask & SERVICE_ACCEPT_TRIGGEREVENT) == SERVICE_ACCEPT_TRIGGEREVENT);
+
+		// Memory pressure is delivered to the service directly by the memory_pressure_source, it
+		// cannot be sent through the harness
+		case ServiceControl::MemoryPressure:		return false;
+
+		// Allow any user-defined controls (128-255) to be passed to the service regardless of accept mask		
+		default: return ((static_cast<int>(control) >= 128) && (static_cast<int>(control) <= 255));
+	}
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::SetStatusFunc (private)
+//
+// Function invoked by the service to report a change in status
+//
+// Arguments:
+//
+//	handle		- Handle returned by RegisterHandlerFunc
+//	status		- New status being reported by the service
+
+BOOL service_harness::SetStatusFunc(SERVICE_STATUS_HANDLE handle, LPSERVICE_STATUS status)
+{
+	// Apply any injected latency and failure before accepting the status; this happens
+	// on the calling service thread in the same way as a slow status sink would
+	if(InjectFault(getStatusFaults())) return FALSE;
+
+	std::unique_lock<std::mutex> critsec(m_statuslock);
+
+	// Ensure that the handle provided is actually the address of this harness instance
+	assert(reinterpret_cast<service_harness*>(handle) == this);
+	if(reinterpret_cast<service_harness*>(handle) != this) { SetLastError(ERROR_INVALID_HANDLE); return FALSE; }
+
+	m_status = *status;						// Copy the new SERVICE_STATUS
+	m_statuschanged.notify_all();			// Notify the status has been changed
+
+	return TRUE;
+};
+
+//-----------------------------------------------------------------------------
+// service_harness::putShutdownCoordinator
+//
+// Sets the coordinator that fans the shutdown controls out to every service in the process
+//
+// Arguments:
+//
+//	value		- Shutdown coordinator, typically shutdown_coordinator::Instance(); can be null
+
+void service_harness::putShutdownCoordinator(shutdown_coordinator* value)
+{
+	std::lock_guard<std::mutex> critsec(m_statuslock);
+
+	// The coordinator cannot be changed while the service is running
+	if(m_launched) throw winexception(ERROR_SERVICE_ALREADY_RUNNING);
+	m_shutdown = value;
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::Start
+//
+// Starts the service, specifying an argc/argv style set of command line arguments
+//
+// Arguments:
+//
+//	servicename		- Name of the service
+//	argc			- Number of command line arguments
+//	argv			- Array of command line argument strings
+
+void service_harness::Start(const resstring& servicename, int argc, tchar_t** argv)
+{
+	// Construct a vector<> for the arguments starting with the service name
+	std::vector<tstring> argvector { servicename };
+
+	// Skip argv[0], that becomes the service name which is handled automatically,
+	// this allows the caller to send in the process argc/argv if so inclined
+	for(int index = 1; index < argc; index++) argvector.emplace_back(argv[index]);
+
+	Start(std::move(argvector));
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::Start (private)
+//
+// Starts the service
+//
+// Arguments:
+//
+//	argvector		- vector<> of command line argument strings
+
+void service_harness::Start(std::vector<tstring>&& argvector)
+{
+	using namespace std::placeholders;
+
+	// If the service has already been launched, it has already been started
+	if(m_launched) throw winexception(ERROR_SERVICE_ALREADY_RUNNING);
+
+	// Always reset the SERVICE_STATUS back to defaults before starting the service
+	zero_init(m_status).dwCurrentState = static_cast<DWORD>(ServiceStatus::Stopped);
+
+	// There is an expectation that argv[0] is set to the service name
+	if((argvector.size() == 0) || (argvector[0].length() == 0)) throw winexception(E_INVALIDARG);
+
+	uint64_t started = m_clock->Now();
+
+	// The trace and status page outlive the service so that the handlers they register stay valid;
+	// they are created once for the harness and attached again each time the service is started
+	if(!m_recorder) m_recorder = service_recorder::FromRegistry(argvector[0].c_str());
+	if(!m_publisher) m_publisher = status_publisher::TryCreate(argvector[0].c_str());
+
+	// Define the function that launches the service on the main service thread
+	std::function<void(void)> launcher = [=]() {
+
+		// Move the arguments vector into this thread and convert it into an argv-style 
+		// array of generic text string pointers to pass onto the ServiceMain() function
+		std::vector<tstring> arguments(argvector);
+		std::vector<tchar_t*> argv;
+		for(const auto& arg: arguments) argv.push_back(const_cast<tchar_t*>(arg.c_str()));
+		argv.push_back(nullptr);
+
+		// Create the context for the service by binding this instance's member functions
+		// The harness runs the service in the calling process alongside whatever else it hosts, a
+		// pool or the local control manager included, so the process is never the service's own
+		service_context context = { 
+			ServiceProcessType::Shared,
+			std::bind(&service_harness::RegisterHandlerFunc, this, _1, _2, _3),
+			std::bind(&service_harness::SetStatusFunc, this, _1, _2),
+			m_environ,
+			m_clock
+		};
+		context.Placement = &m_placement;
+		context.AsyncStatus = m_asyncstatus;
+		context.MemoryPressure = m_pressure;
+		context.ShutdownCoordinator = m_shutdown;
+
+		// Record the service and publish the status and counters for monitoring tools the same way
+		// a service started by the service control manager does
+		if(m_recorder) context = m_recorder->Attach(context);
+		if(m_publisher) context = m_publisher->Attach(context);
+
+		// Launch the service with the specified command line arguments and instance context; if the
+		// service could not be launched at all, report that as SERVICE_STOPPED with the error code
+		try {
+
+			LaunchService(static_cast<int>(argv.size() - 1), argv.data(), context);
+
+			// A service that is not pooled has run to completion; if the harness never received
+			// SERVICE_STOPPED the report was lost, which the service control manager would see as
+			// the service terminating unexpectedly
+			if(m_environ == nullptr) {
+
+				std::lock_guard<std::mutex> critsec(m_statuslock);
+				if(static_cast<ServiceStatus>(m_status.dwCurrentState) != ServiceStatus::Stopped) {
+
+					zero_init(m_status).dwCurrentState = static_cast<DWORD>(ServiceStatus::Stopped);
+					m_status.dwWin32ExitCode = ERROR_PROCESS_ABORTED;
+					m_statuschanged.notify_all();
+				}
+			}
+		}
+
+		catch(winexception& ex) {
+
+			std::lock_guard<std::mutex> critsec(m_statuslock);
+			zero_init(m_status).dwCurrentState = static_cast<DWORD>(ServiceStatus::Stopped);
+			m_status.dwWin32ExitCode = (ex.code() != ERROR_SUCCESS) ? ex.code() : ERROR_SERVICE_SPECIFIC_ERROR;
+			m_statuschanged.notify_all();
+		}
+	};
+
+	// Pooled services are launched from a thread pool work item, otherwise create the main thread
+	if(m_environ) {
+
+		std::unique_ptr<std::function<void(void)>> work = std::make_unique<std::function<void(void)>>(std::move(launcher));
+		if(!TrySubmitThreadpoolCallback([](PTP_CALLBACK_INSTANCE, void* context) -> void {
+
+			std::unique_ptr<std::function<void(void)>> func(reinterpret_cast<std::function<void(void)>*>(context));
+			(*func)();
+
+		}, work.get(), m_environ)) throw winexception();
+
+		work.release();					// Ownership passed to the work item
+	}
+
+	else m_mainthread = std::thread(std::move(launcher));
+
+	m_launched = true;
+
+	// Controls from the system event source are rejected until the service accepts them
+	if(m_events) m_events->Subscribe(this);
+
+	// Wait up to 30 seconds for the service to set SERVICE_START_PENDING
+	if(!WaitForStatus(ServiceStatus::StartPending, START_TIMEOUT)) throw winexception(ERROR_SERVICE_REQUEST_TIMEOUT);
+
+	// Wait for the service to set SERVICE_RUNNING; like the service control manager this waits for as long
+	// as the checkpoint keeps advancing within the wait hint, a status report that was lost cannot leave
+	// the caller waiting forever
+	DWORD checkpoint = 0;
+	uint32_t waithint = START_TIMEOUT;
+	{
+		std::lock_guard<std::mutex> critsec(m_statuslock);
+		checkpoint = m_status.dwCheckPoint;
+		if(m_status.dwWaitHint) waithint = m_status.dwWaitHint;
+	}
+
+	while(!WaitForStatus(ServiceStatus::Running, waithint)) {
+
+		std::lock_guard<std::mutex> critsec(m_statuslock);
+		if((static_cast<ServiceStatus>(m_status.dwCurrentState) != ServiceStatus::StartPending) || (m_status.dwCheckPoint == checkpoint))
+			throw winexception(ERROR_SERVICE_REQUEST_TIMEOUT);
+
+		checkpoint = m_status.dwCheckPoint;
+		waithint = (m_status.dwWaitHint) ? m_status.dwWaitHint : START_TIMEOUT;
+	}
+
+	RecordTime(started, true);
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::Stop
+//
+// Sends SERVICE_CONTROL_STOP to the service, throws an exception if the
+// service does not accept the control or stops prematurely
+//
+// Arguments:
+//
+//	NONE
+
+void service_harness::Stop(void)
+{
+	uint64_t started = m_clock->Now();
+
+	DWORD result = SendControl(ServiceControl::Stop);
+	if(result != ERROR_SUCCESS) throw winexception(result);
+
+	WaitForStatus(ServiceStatus::Stopped);
+	RecordTime(started, true);
+}
+
+//-----------------------------------------------------------------------------
+// service_harness::WaitForStatus
+//
+// Waits for the service to reach the specified status
+//
+// Arguments:
+//
+//	status		- Service status to wait for
+//	timeout		- Amount of time, in milliseconds, to wait before failing
+
+bool service_harness::WaitForStatus(ServiceStatus status, uint32_t timeout)
+{
+	std::unique_lock<std::mutex> critsec(m_statuslock);
+
+	// Wait for the condition variable to be trigged with the service status caller is looking for, or if
+	// the service has stopped unexpectedly due to an unhandled exception caught in ServiceMain()
+	bool result = m_clock->WaitFor(critsec, m_statuschanged, timeout, [=]() -> bool
+	{ 
+		return (static_cast<ServiceStatus>(m_status.dwCurrentState) == status) || 
+			((static_cast<ServiceStatus>(m_status.dwCurrentState) == ServiceStatus::Stopped) && (m_status.dwWin32ExitCode != ERROR_SUCCESS)); 
+	});
+
+	// If the service has stopped (regardless of the reason), wait for the main thread to terminate
+	if(static_cast<ServiceStatus>(m_status.dwCurrentState) == ServiceStatus::Stopped) {
+
+		if(m_mainthread.joinable()) m_mainthread.join();
+		m_launched = false;
+	}
+
+	// If an error was generated by the service, throw that as an exception to the caller
+	if(m_status.dwWin32ExitCode != ERROR_SUCCESS) throw winexception(m_status.dwWin32ExitCode);
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// svctl::service_recorder
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// service_recorder Constructor
+//
+// Arguments:
+//
+//	path		- Path to the trace file to be created
+
+service_recorder::service_recorder(const tchar_t* path)
+{
+	QueryPerformanceFrequency(&m_frequency);
+	QueryPerformanceCounter(&m_start);
+
+	// Create the trace file, overwriting any existing file with the same name
+	m_file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(m_file == INVALID_HANDLE_VALUE) throw winexception();
+
+	// Write the trace file header
+	FILETIME starttime;
+	GetSystemTimeAsFileTime(&starttime);
+	trace_header header = { TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record), 
+		(static_cast<uint64_t>(starttime.dwHighDateTime) << 32) | starttime.dwLowDateTime };
+
+	DWORD written;
+	if(!WriteFile(m_file, &header, sizeof(trace_header), &written, nullptr)) {
+
+		DWORD result = GetLastError();
+		CloseHandle(m_file);
+		throw winexception(result);
+	}
+
+	m_buffer.reserve(FLUSH_THRESHOLD);
+}
+
+//-----------------------------------------------------------------------------
+// service_recorder Destructor
+
+service_recorder::~service_recorder()
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	Flush();
+	CloseHandle(m_file);
+}
+
+//-----------------------------------------------------------------------------
+// service_recorder::Attach
+//
+// Creates a recording service_context that wraps the specified context
+//
+// Arguments:
+//
+//	context		- Service context to be wrapped; must remain valid
+
+service_context service_recorder::Attach(const service_context& context)
+{
+	service_context recording = context;
+
+	// Substitute the recorder's HandlerEx callback for the one registered by the service
+	register_handler_func registerfunc = context.RegisterHandlerFunc;
+	recording.RegisterHandlerFunc = [=](LPCTSTR servicename, LPHANDLER_FUNCTION_EX handler, LPVOID handlercontext) -> SERVICE_STATUS_HANDLE {
+
+		m_handler = handler;
+		m_context = handlercontext;
+		return registerfunc(servicename, HandlerFunc, this);
+	};
+
+	// Record each status after it has been reported by the original function
+	set_status_func statusfunc = context.SetStatusFunc;
+	recording.SetStatusFunc = [=](SERVICE_STATUS_HANDLE handle, LPSERVICE_STATUS status) -> BOOL {
+
+		BOOL result = statusfunc(handle, status);
+		if(result) Write({ trace_record_type::Status, 0, static_cast<uint16_t>(status->dwCheckPoint), status->dwCurrentState,
+			status->dwControlsAccepted, status->dwWin32ExitCode, status->dwServiceSpecificExitCode, Elapsed() });
+
+		return result;
+	};
+
+	// Controls raised within the process enter the handler chain here, like a control from the system
+	recording.DispatchControlFunc = [=](DWORD control, DWORD eventtype, void* eventdata) -> DWORD { return HandlerFunc(control, eventtype, eventdata, this); };
+
+	return recording;
+}
+
+//-----------------------------------------------------------------------------
+// service_recorder::Elapsed (private)
+//
+// Gets the number of microseconds elapsed since the trace was started
+//
+// Arguments:
+//
+//	NONE
+
+uint64_t service_recorder::Elapsed(void) const
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	return static_cast<uint64_t>(((now.QuadPart - m_start.QuadPart) * 1000000) / m_frequency.QuadPart);
+}
+
+//-----------------------------------------------------------------------------
+// service_recorder::Flush (private)
+//
+// Writes the buffered records to the trace file; lock must be held
+//
+// Arguments:
+//
+//	NONE
+
+void service_recorder::Flush(void)
+{
+	DWORD written;
+
+	// Recording is best-effort; a failed write discards the buffered records
+	if(!m_buffer.empty()) WriteFile(m_file, m_buffer.data(), static_cast<DWORD>(m_buffer.size() * sizeof(trace_record)), &written, nullptr);
+	m_buffer.clear();
+}
+
+//-----------------------------------------------------------------------------
+// service_recorder::FromRegistry (static)
+//
+// Creates a service_recorder if a TraceFile value has been set in the service's
+// Parameters registry key
+//
+// Arguments:
+//
+//	name		- Service key name
+
+std::unique_ptr<service_recorder> service_recorder::FromRegistry(const tchar_t* name)
+{
+	HKEY			key;						// Service registry key
+	tchar_t			path[MAX_PATH] = {};		// REG_SZ value buffer
+	DWORD			cb = sizeof(path);			// Size of value buffer
+
+	// Attempt to open the services registry key with read-only access
+	if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, _T("SYSTEM\\CurrentControlSet\\Services"), 0, KEY_READ, &key) != ERROR_SUCCESS) return nullptr;
+
+	// Attempt to grab the TraceFile REG_SZ or REG_EXPAND_SZ value and close the key
+	tstring subkey = tstring(name) + _T("\\Parameters");
+	LSTATUS result = RegGetValue(key, subkey.c_str(), _T("TraceFile"), RRF_RT_REG_SZ, nullptr, path, &cb);
+	RegCloseKey(key);
+
+	if((result != ERROR_SUCCESS) || (path[0] == 0)) return nullptr;
+
+	// A trace file that cannot be created should not prevent the service from starting
+	try { return std::make_unique<service_recorder>(path); }
+	catch(...) { return nullptr; }
+}
+
+//-----------------------------------------------------------------------------
+// service_recorder::HandlerFunc (private, static)
+//
+// HandlerEx callback that forwards a control to the service and records it
+//
+// Arguments:
+//
+//	control		- Service control code
+//	eventtype	- Control-specific event type
+//	eventdata	- Control-specific event data
+//	context		- Pointer to the service_recorder instance
+
+DWORD WINAPI service_recorder::HandlerFunc(DWORD control, DWORD eventtype, void* eventdata, void* context)
+{
+	service_recorder* recorder = reinterpret_cast<service_recorder*>(context);
+
+	// Time the original handler and record the control along with the result
+	uint64_t timestamp = recorder->Elapsed();
+	DWORD result = recorder->m_handler(control, eventtype, eventdata, recorder->m_context);
+	uint32_t latency = static_cast<uint32_t>(recorder->Elapsed() - timestamp);
+
+	recorder->Write({ trace_record_type::Control, 0, 0, control, eventtype, result, latency, timestamp });
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// service_recorder::Write (private)
+//
+// Adds a record to the trace buffer, flushing it if necessary
+//
+// Arguments:
+//
+//	record		- Trace record to be written
+
+void service_recorder::Write(const trace_record& record)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	m_buffer.push_back(record);
+
+	// Flush the buffer once it reaches the threshold, or immediately for a STOPPED status
+	// since the process may be terminated shortly afterwards
+	if((m_buffer.size() >= FLUSH_THRESHOLD) || ((record.type == trace_record_type::Status) && 
+		(record.code == static_cast<DWORD>(ServiceStatus::Stopped)))) Flush();
+}
+
+//-----------------------------------------------------------------------------
+// svctl::service_pool
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// service_pool Constructor
+//
+// Arguments:
+//
+//	threads		- Fixed number of threads to allocate to the pool
+
+service_pool::service_pool(DWORD threads)
+{
+	if(threads == 0) throw winexception(ERROR_INVALID_PARAMETER);
+
+	// Create the private thread pool and fix the number of threads
+	m_pool = CreateThreadpool(nullptr);
+	if(m_pool == nullptr) throw winexception();
+
+	SetThreadpoolThreadMaximum(m_pool, threads);
+	if(!SetThreadpoolThreadMinimum(m_pool, threads)) {
+
+		DWORD result = GetLastError();
+		CloseThreadpool(m_pool);
+		throw winexception(result);
+	}
+
+	// Bind a callback environment to the private thread pool
+	InitializeThreadpoolEnvironment(&m_environ);
+	SetThreadpoolCallbackPool(&m_environ, m_pool);
+}
+
+//-----------------------------------------------------------------------------
+// service_pool Destructor
+
+service_pool::~service_pool()
+{
+	// The pool is released asynchronously if there are outstanding callback objects
+	DestroyThreadpoolEnvironment(&m_environ);
+	CloseThreadpool(m_pool);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::service_snapshot
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// service_snapshot Destructor
+
+service_snapshot::~service_snapshot()
+{
+	Unmap();
+
+	// A temporary file that was never committed is of no use to anyone
+	if(m_saved) DeleteFile((m_path + _T(".tmp")).c_str());
+}
+
+//-----------------------------------------------------------------------------
+// service_snapshot::Commit
+//
+// Releases the mapped snapshot and replaces the snapshot file
+//
+// Arguments:
+//
+//	NONE
+
+void service_snapshot::Commit(void)
+{
+	// A file cannot be replaced while a view of it is mapped
+	Unmap();
+	if(!m_saved) return;
+
+	tstring temp = m_path + _T(".tmp");
+	if(!MoveFileEx(temp.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) DeleteFile(temp.c_str());
+
+	m_saved = false;
+}
+
+//-----------------------------------------------------------------------------
+// service_snapshot::Find
+//
+// Gets a region of the mapped snapshot
+//
+// Arguments:
+//
+//	name		- Region name
+
+snapshot_region service_snapshot::Find(const tchar_t* name) const
+{
+	if((m_view == nullptr) || (name == nullptr)) return snapshot_region{ nullptr, 0 };
+
+	const snapshot_layout::header* header = reinterpret_cast<const snapshot_layout::header*>(m_view);
+	const snapshot_layout::region* regions = reinterpret_cast<const snapshot_layout::region*>(m_view + sizeof(snapshot_layout::header));
+	size_t namelength = _tcslen(name);
+
+	for(uint32_t index = 0; index < header->regions; index++) {
+
+		const snapshot_layout::region& region = regions[index];
+		if((region.namelength == namelength) && (memcmp(m_view + region.nameoffset, name, namelength * sizeof(tchar_t)) == 0))
+			return snapshot_region{ m_view + region.offset, static_cast<size_t>(region.length) };
+	}
+
+	return snapshot_region{ nullptr, 0 };
+}
+
+//-----------------------------------------------------------------------------
+// service_snapshot::Open
+//
+// Sets the snapshot file and version and maps the existing snapshot
+//
+// Arguments:
+//
+//	path		- Path to the snapshot file
+//	version		- Service-defined version of the region contents
+
+bool service_snapshot::Open(const tchar_t* path, uint32_t version)
+{
+	if((path == nullptr) || (*path == 0)) throw winexception(E_INVALIDARG);
+
+	LARGE_INTEGER frequency, started, finished;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&started);
+
+	Unmap();
+	m_path = path;
+	m_version = version;
+	zero_init(m_statistics);
+
+	// Sharing delete access allows the snapshot to be replaced by Commit() in the event that
+	// another instance of the service has mapped the same file
+	HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size = {};
+	if(GetFileSizeEx(file, &size) && (static_cast<uint64_t>(size.QuadPart) >= sizeof(snapshot_layout::header)) && (static_cast<uint64_t>(size.QuadPart) <= SIZE_MAX)) {
+
+		m_mapping = CreateFileMapping(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if(m_mapping) m_view = reinterpret_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	}
+
+	CloseHandle(file);
+	if(m_view == nullptr) { Unmap(); return false; }
+
+	// Validate the header, the checksum and that every region lies within the file.  Only the region
+	// descriptors and names are checksummed so that the region data isn't paged in until it's used; the
+	// data can't be torn, a snapshot only replaces the file once it has been completely written
+	const snapshot_layout::header* header = reinterpret_cast<const snapshot_layout::header*>(m_view);
+	size_t length = static_cast<size_t>(size.QuadPart);
+
+	bool valid = (header->magic == snapshot_layout::MAGIC) && (header->format == snapshot_layout::FORMAT) && (header->version == version) &&
+		(header->charsize == sizeof(tchar_t)) && (header->length == length) &&
+		(header->regions <= (length - sizeof(snapshot_layout::header)) / sizeof(snapshot_layout::region)) &&
+		(header->metadata >= sizeof(snapshot_layout::header) + (header->regions * sizeof(snapshot_layout::region))) && (header->metadata <= length) &&
+		(snapshot_layout::Checksum(m_view + sizeof(snapshot_layout::header), header->metadata - sizeof(snapshot_layout::header)) == header->checksum);
+
+	const snapshot_layout::region* regions = reinterpret_cast<const snapshot_layout::region*>(m_view + sizeof(snapshot_layout::header));
+	for(uint32_t index = 0; valid && (index < header->regions); index++) {
+
+		const snapshot_layout::region& region = regions[index];
+		valid = (region.nameoffset <= header->metadata) && (region.namelength <= (header->metadata - region.nameoffset) / sizeof(tchar_t)) &&
+			(region.offset <= length) && (region.length <= length - region.offset);
+	}
+
+	if(!valid) { Unmap(); return false; }
+
+	QueryPerformanceCounter(&finished);
+
+	m_statistics.Restored = true;
+	m_statistics.Regions = header->regions;
+	m_statistics.RestoredBytes = length;
+	m_statistics.RestoreTime = static_cast<uint32_t>(((finished.QuadPart - started.QuadPart) * 1000000) / frequency.QuadPart);
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// service_snapshot::Register
+//
+// Registers a function that provides a region to write to the snapshot
+//
+// Arguments:
+//
+//	name		- Region name
+//	source		- Function that provides the region when the snapshot is written
+
+void service_snapshot::Register(const tchar_t* name, std::function<snapshot_region(void)> source)
+{
+	if((name == nullptr) || (*name == 0) || !source) throw winexception(E_INVALIDARG);
+	m_sources.emplace_back(name, std::move(source));
+}
+
+//-----------------------------------------------------------------------------
+// service_snapshot::Save
+//
+// Writes the registered regions to a temporary snapshot file
+//
+// Arguments:
+//
+//	NONE
+
+bool service_snapshot::Save(void)
+{
+	if(m_path.empty() || m_sources.empty()) return false;
+
+	LARGE_INTEGER frequency, started, finished;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&started);
+
+	tstring temp = m_path + _T(".tmp");
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+	uint8_t* view = nullptr;
+
+	try {
+
+		auto align = [](uint64_t value) -> uint64_t { return (value + snapshot_layout::ALIGNMENT - 1) & ~static_cast<uint64_t>(snapshot_layout::ALIGNMENT - 1); };
+
+		// Collect the regions and calculate the layout of the file
+		std::vector<snapshot_region> regions;
+		uint64_t length = sizeof(snapshot_layout::header) + (m_sources.size() * sizeof(snapshot_layout::region));
+		for(const auto& source : m_sources) length += source.first.length() * sizeof(tchar_t);
+
+		for(const auto& source : m_sources) {
+
+			regions.push_back(source.second());
+			if((regions.back().Data == nullptr) && (regions.back().Length > 0)) throw winexception(E_POINTER);
+			length = align(length) + regions.back().Length;
+		}
+
+		if(length > SIZE_MAX) throw winexception(ERROR_ARITHMETIC_OVERFLOW);
+
+		file = CreateFile(temp.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if(file == INVALID_HANDLE_VALUE) throw winexception();
+
+		mapping = CreateFileMapping(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(length >> 32), static_cast<DWORD>(length), nullptr);
+		if(mapping == nullptr) throw winexception();
+
+		view = reinterpret_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0));
+		if(view == nullptr) throw winexception();
+
+		// Write the region descriptors and names followed by the aligned region data
+		snapshot_layout::region* descriptors = reinterpret_cast<snapshot_layout::region*>(view + sizeof(snapshot_layout::header));
+		uint64_t offset = sizeof(snapshot_layout::header) + (m_sources.size() * sizeof(snapshot_layout::region));
+
+		for(size_t index = 0; index < m_sources.size(); index++) {
+
+			const tstring& name = m_sources[index].first;
+			descriptors[index].nameoffset = static_cast<uint32_t>(offset);
+			descriptors[index].namelength = static_cast<uint32_t>(name.length());
+			memcpy(view + offset, name.data(), name.length() * sizeof(tchar_t));
+			offset += name.length() * sizeof(tchar_t);
+		}
+
+		if(offset > UINT32_MAX) throw winexception(ERROR_ARITHMETIC_OVERFLOW);
+		uint64_t metadata = offset;
+
+		for(size_t index = 0; index < regions.size(); index++) {
+
+			offset = align(offset);
+			descriptors[index].offset = offset;
+			descriptors[index].length = regions[index].Length;
+			if(regions[index].Length) memcpy(view + offset, regions[index].Data, regions[index].Length);
+			offset += regions[index].Length;
+		}
+
+		// The header is written last, with the checksum of the region descriptors and names
+		snapshot_layout::header* header = reinterpret_cast<snapshot_layout::header*>(view);
+		header->magic = snapshot_layout::MAGIC;
+		header->format = snapshot_layout::FORMAT;
+		header->version = m_version;
+		header->charsize = sizeof(tchar_t);
+		header->length = length;
+		header->regions = static_cast<uint32_t>(m_sources.size());
+		header->metadata = static_cast<uint32_t>(metadata);
+		header->checksum = snapshot_layout::Checksum(view + sizeof(snapshot_layout::header), static_cast<size_t>(metadata - sizeof(snapshot_layout::header)));
+
+		if(!FlushViewOfFile(view, 0)) throw winexception();
+		UnmapViewOfFile(view);
+		view = nullptr;
+		CloseHandle(mapping);
+		mapping = nullptr;
+
+		if(!FlushFileBuffers(file)) throw winexception();
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+
+		QueryPerformanceCounter(&finished);
+
+		m_saved = true;
+		m_statistics.SavedBytes = length;
+		m_statistics.SaveTime = static_cast<uint32_t>(((finished.QuadPart - started.QuadPart) * 1000000) / frequency.QuadPart);
+		return true;
+	}
+
+	catch(...) {
+
+		if(view) UnmapViewOfFile(view);
+		if(mapping) CloseHandle(mapping);
+		if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		DeleteFile(temp.c_str());
+
+		return false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// service_snapshot::Unmap (private)
+//
+// Releases the mapped snapshot
+//
+// Arguments:
+//
+//	NONE
+
+void service_snapshot::Unmap(void)
+{
+	if(m_view) UnmapViewOfFile(m_view);
+	if(m_mapping) CloseHandle(m_mapping);
+
+	m_view = nullptr;
+	m_mapping = nullptr;
+}
+
+//-----------------------------------------------------------------------------
+// svctl::service_table_shards
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// service_table_shards Constructor (protected)
+//
+// Arguments:
+//
+//	name			- Base service name
+//	count			- Number of shards; zero for one shard per active processor
+//	servicemain		- ServiceMain() entry point of the service class
+//	localmain		- LocalMain() entry point of the service class
+//	placement		- Placement policy; the processors it allows are divided among the shards
+
+service_table_shards::service_table_shards(const tstring& name, uint32_t count, const LPSERVICE_MAIN_FUNCTION servicemain, 
+	const local_main_func localmain, const service_placement& placement)
+{
+	if(count == 0) count = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+
+	for(uint32_t shard = 0; shard < count; shard++)
+		m_entries.push_back(service_table_entry(ShardName(name.c_str(), shard), servicemain, localmain, ShardPlacement(placement, shard)));
+
+	// Register the base name so that the shards can identify themselves by name
+	std::lock_guard<std::mutex> critsec(RegistryLock());
+
+	auto& registry = Registry();
+	auto found = std::find_if(registry.begin(), registry.end(), [&](const auto& entry) -> bool { return _tcsicmp(entry.first.c_str(), name.c_str()) == 0; });
+	if(found != registry.end()) found->second = count;
+	else registry.emplace_back(name, count);
+}
+
+//-----------------------------------------------------------------------------
+// service_table_shards::FindShard (static)
+//
+// Gets the index of a shard from it's name
+//
+// Arguments:
+//
+//	name			- Service name
+//	shard			- On success, receives the index of the shard
+
+bool service_table_shards::FindShard(const tchar_t* name, uint32_t& shard)
+{
+	if(name == nullptr) return false;
+
+	// Shard names are generated as name@index, the index has no leading zeros
+	const tchar_t* separator = _tcsrchr(name, _T('@'));
+	if((separator == nullptr) || (separator[1] == _T('\0'))) return false;
+	if((separator[1] == _T('0')) && (separator[2] != _T('\0'))) return false;
+
+	// Accumulate the index in 64 bits so that it can be range checked before it overflows
+	uint64_t index = 0;
+	for(const tchar_t* digit = separator + 1; *digit; digit++) {
+
+		if((*digit < _T('0')) || (*digit > _T('9'))) return false;
+
+		index = (index * 10) + static_cast<uint64_t>(*digit - _T('0'));
+		if(index >= UINT32_MAX) return false;
+	}
+
+	tstring basename(name, separator);
+
+	std::lock_guard<std::mutex> critsec(RegistryLock());
+
+	// The service control manager does not necessarily use the same case as the service table
+	for(const auto& entry : Registry()) {
+
+		if(_tcsicmp(entry.first.c_str(), basename.c_str()) != 0) continue;
+		if(index >= entry.second) return false;
+
+		shard = static_cast<uint32_t>(index);
+		return true;
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// service_table_shards::Registry (private, static)
+//
+// Gets the process-wide base names and shard counts of the sharded entries
+//
+// Arguments:
+//
+//	NONE
+
+std::vector<std::pair<tstring, uint32_t>>& service_table_shards::Registry(void)
+{
+	static std::vector<std::pair<tstring, uint32_t>> registry;
+	return registry;
+}
+
+//-----------------------------------------------------------------------------
+// service_table_shards::RegistryLock (private, static)
+//
+// Gets the synchronization object for the registry
+//
+// Arguments:
+//
+//	NONE
+
+std::mutex& service_table_shards::RegistryLock(void)
+{
+	static std::mutex lock;
+	return lock;
+}
+
+//-----------------------------------------------------------------------------
+// service_table_shards::ShardName (static)
+//
+// Generates the name of a shard
+//
+// Arguments:
+//
+//	name			- Base service name
+//	shard			- Index of the shard
+
+tstring service_table_shards::ShardName(const tchar_t* name, uint32_t shard)
+{
+	return tstring(name) + _T("@") + to_tstring(shard);
+}
+
+//-----------------------------------------------------------------------------
+// service_table_shards::ShardPlacement (private, static)
+//
+// Selects the processor for a shard from the processors allowed by the placement
+//
+// Arguments:
+//
+//	placement		- Placement policy of the sharded entry
+//	shard			- Index of the shard
+
+service_placement service_table_shards::ShardPlacement(const service_placement& placement, uint32_t shard)
+{
+	service_placement result = placement;
+
+	// Collect the processors the shards can be spread over: the explicit mask, the processors
+	// of the NUMA node or, without either, every active processor in every group
+	std::vector<std::pair<WORD, BYTE>> processors;
+	GROUP_AFFINITY allowed = placement.Affinity;
+	if((allowed.Mask == 0) && (placement.NumaNode != service_placement::ANY_NODE))
+		if(!GetNumaNodeProcessorMaskEx(placement.NumaNode, &allowed)) allowed.Mask = 0;
+
+	if(allowed.Mask != 0) {
+
+		for(BYTE index = 0; index < sizeof(KAFFINITY) * 8; index++)
+			if(allowed.Mask & (static_cast<KAFFINITY>(1) << index)) processors.emplace_back(allowed.Group, index);
+	}
+
+	else for(WORD group = 0; group < GetActiveProcessorGroupCount(); group++) {
+
+		DWORD active = GetActiveProcessorCount(group);
+		for(DWORD index = 0; index < active; index++) processors.emplace_back(group, static_cast<BYTE>(index));
+	}
+
+	// Shards wrap around when there are more of them than processors
+	if(processors.empty()) return result;
+	const auto& processor = processors[shard % processors.size()];
+
+	result.Affinity = {};
+	result.Affinity.Group = processor.first;
+	result.Affinity.Mask = static_cast<KAFFINITY>(1) << processor.second;
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// svctl::shard_controller
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// shard_controller Constructor
+//
+// Arguments:
+//
+//	name			- Base service name of the sharded service
+//	count			- Number of shards
+
+shard_controller::shard_controller(const tchar_t* name, uint32_t count)
+{
+	if(name == nullptr) throw winexception(ERROR_INVALID_PARAMETER);
+
+	m_scm = OpenSCManager(nullptr, nullptr, SC_MANAGER_CONNECT);
+	if(m_scm == nullptr) throw winexception();
+
+	const DWORD access = SERVICE_QUERY_STATUS | SERVICE_START | SERVICE_STOP | SERVICE_PAUSE_CONTINUE | 
+		SERVICE_INTERROGATE | SERVICE_USER_DEFINED_CONTROL;
+
+	for(uint32_t shard = 0; shard < count; shard++) {
+
+		SC_HANDLE service = OpenService(m_scm, service_table_shards::ShardName(name, shard).c_str(), access);
+		if(service == nullptr) {
+
+			DWORD result = GetLastError();
+			for(auto& handle : m_shards) CloseServiceHandle(handle);
+			CloseServiceHandle(m_scm);
+			throw winexception(result);
+		}
+
+		m_shards.push_back(service);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// shard_controller Destructor
+
+shard_controller::~shard_controller()
+{
+	for(auto& handle : m_shards) CloseServiceHandle(handle);
+	CloseServiceHandle(m_scm);
+}
+
+//-----------------------------------------------------------------------------
+// shard_controller::Aggregate
+//
+// Queries every shard and aggregates their status
+//
+// Arguments:
+//
+//	NONE
+
+shard_status shard_controller::Aggregate(void)
+{
+	shard_status aggregate = { ServiceStatus::Running, 0, 0, 0, 0 };
+	bool degraded = false;
+
+	for(uint32_t shard = 0; shard < Count; shard++) {
+
+		ServiceStatus status = static_cast<ServiceStatus>(Query(shard).dwCurrentState);
+
+		if(status == ServiceStatus::Running) aggregate.Running++;
+		else if(status == ServiceStatus::Paused) aggregate.Paused++;
+		else if(status == ServiceStatus::Stopped) aggregate.Stopped++;
+		else aggregate.Pending++;
+
+		// Shards that all agree report that status, otherwise the first shard that is not running
+		// decides it; a service with some shards paused or stopped is not RUNNING as a whole
+		if((status != ServiceStatus::Running) && !degraded) { aggregate.Status = status; degraded = true; }
+	}
+
+	return aggregate;
+}
+
+//-----------------------------------------------------------------------------
+// shard_controller::Broadcast
+//
+// Sends a control to every shard
+//
+// Arguments:
+//
+//	control			- Control to send
+
+std::vector<DWORD> shard_controller::Broadcast(ServiceControl control)
+{
+	std::vector<DWORD> results;
+	for(uint32_t shard = 0; shard < Count; shard++) results.push_back(Control(shard, control));
+
+	return results;
+}
+
+//-----------------------------------------------------------------------------
+// shard_controller::Control
+//
+// Sends a control to a single shard
+//
+// Arguments:
+//
+//	shard			- Index of the shard
+//	control			- Control to send
+//	status			- Optional SERVICE_STATUS to receive the status of the shard
+
+DWORD shard_controller::Control(uint32_t shard, ServiceControl control, SERVICE_STATUS* status)
+{
+	if(shard >= Count) throw winexception(ERROR_INVALID_PARAMETER);
+
+	SERVICE_STATUS local;
+	if(!ControlService(m_shards[shard], static_cast<DWORD>(control), (status) ? status : &local)) return GetLastError();
+
+	return ERROR_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// shard_controller::Query
+//
+// Queries the status of a single shard
+//
+// Arguments:
+//
+//	shard			- Index of the shard
+
+SERVICE_STATUS shard_controller::Query(uint32_t shard)
+{
+	if(shard >= Count) throw winexception(ERROR_INVALID_PARAMETER);
+
+	SERVICE_STATUS status;
+	if(!QueryServiceStatus(m_shards[shard], &status)) throw winexception();
+
+	return status;
+}
+
+//-----------------------------------------------------------------------------
+// shard_controller::RollingRestart
+//
+// Restarts the shards one at a time
+//
+// Arguments:
+//
+//	timeout			- Maximum time to wait for each shard to stop and to start
+
+void shard_controller::RollingRestart(uint32_t timeout)
+{
+	for(uint32_t shard = 0; shard < Count; shard++) {
+
+		// Never take a shard down while another one is not running; the restart stops
+		// where it is and the shards that have already been restarted remain running
+		for(uint32_t other = 0; other < Count; other++) {
+
+			if((other != shard) && (static_cast<ServiceStatus>(Query(other).dwCurrentState) != ServiceStatus::Running))
+				throw winexception(ERROR_SERVICE_NOT_ACTIVE);
+		}
+
+		// A shard that is already stopped only needs to be started
+		if(static_cast<ServiceStatus>(Query(shard).dwCurrentState) != ServiceStatus::Stopped) {
+
+			DWORD result = Control(shard, ServiceControl::Stop);
+			if((result != ERROR_SUCCESS) && (result != ERROR_SERVICE_NOT_ACTIVE)) throw winexception(result);
+			if(!WaitForStatus(shard, ServiceStatus::Stopped, timeout)) throw winexception(ERROR_SERVICE_REQUEST_TIMEOUT);
+		}
+
+		if(!StartService(m_shards[shard], 0, nullptr)) throw winexception();
+		if(!WaitForStatus(shard, ServiceStatus::Running, timeout)) throw winexception(ERROR_SERVICE_REQUEST_TIMEOUT);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// shard_controller::WaitForStatus (private)
+//
+// Polls a shard until it reaches the specified status
+//
+// Arguments:
+//
+//	shard			- Index of the shard
+//	status			- Status to wait for
+//	timeout			- Maximum time to wait, in milliseconds
+
+bool shard_controller::WaitForStatus(uint32_t shard, ServiceStatus status, uint32_t timeout)
+{
+	uint64_t deadline = (timeout == INFINITE) ? UINT64_MAX : GetTickCount64() + timeout;
+
+	while(true) {
+
+		SERVICE_STATUS current = Query(shard);
+		if(static_cast<ServiceStatus>(current.dwCurrentState) == status) return true;
+
+		// A shard that stopped while waiting for it to start isn't coming back on it's own
+		if((status != ServiceStatus::Stopped) && (static_cast<ServiceStatus>(current.dwCurrentState) == ServiceStatus::Stopped)) return false;
+
+		uint64_t now = GetTickCount64();
+		if(now >= deadline) return false;
+
+		// Poll at a tenth of the wait hint, the same as the documented service start sample
+		DWORD interval = std::max<DWORD>(100, std::min<DWORD>(current.dwWaitHint / 10, 1000));
+		Sleep(static_cast<DWORD>(std::min<uint64_t>(interval, deadline - now)));
+	}
+}
+
+//-----------------------------------------------------------------------------
+// svctl::shutdown_coordinator
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// shutdown_coordinator::Budget (private)
+//
+// Determines the budget for a shutdown control; lock must be held
+//
+// Arguments:
+//
+//	control		- Shutdown control code
+
+uint32_t shutdown_coordinator::Budget(ServiceControl control)
+{
+	HKEY			key;						// Registry key
+	uint32_t		budget = UINT32_MAX;		// Shutdown budget
+
+	// PRESHUTDOWN: the shared deadline has to satisfy the shortest PreshutdownTimeout configured
+	// for any of the services; each service can be given a different timeout by the installer
+	if(control == ServiceControl::PreShutdown) {
+
+		if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, _T("SYSTEM\\CurrentControlSet\\Services"), 0, KEY_READ, &key) == ERROR_SUCCESS) {
+
+			for(const auto& iterator : m_participants) {
+
+				DWORD value = DEFAULT_PRESHUTDOWN_TIMEOUT;
+				DWORD cb = sizeof(DWORD);
+				if(RegGetValue(key, iterator.second.name.c_str(), _T("PreshutdownTimeout"), RRF_RT_REG_DWORD, nullptr, &value, &cb) != ERROR_SUCCESS)
+					value = DEFAULT_PRESHUTDOWN_TIMEOUT;
+
+				budget = std::min(budget, static_cast<uint32_t>(value));
+			}
+
+			RegCloseKey(key);
+		}
+
+		if(budget == UINT32_MAX) budget = DEFAULT_PRESHUTDOWN_TIMEOUT;
+	}
+
+	// SHUTDOWN: the host gives all services WaitToKillServiceTimeout, stored as a REG_SZ
+	else {
+
+		tchar_t		value[32] = {};				// REG_SZ value buffer
+		DWORD		cb = sizeof(value);			// Size of value buffer
+
+		if((RegGetValue(HKEY_LOCAL_MACHINE, _T("SYSTEM\\CurrentControlSet\\Control"), _T("WaitToKillServiceTimeout"), RRF_RT_REG_SZ, 
+			nullptr, value, &cb) == ERROR_SUCCESS) && (value[0] != 0)) budget = static_cast<uint32_t>(_tcstoul(value, nullptr, 10));
+
+		if((budget == UINT32_MAX) || (budget == 0)) budget = DEFAULT_WAIT_TO_KILL_TIMEOUT;
+	}
+
+	// Reserve part of the budget to report the services that overrun it
+	return (budget > BUDGET_MARGIN) ? budget - BUDGET_MARGIN : 0;
+}
+
+//-----------------------------------------------------------------------------
+// shutdown_coordinator::Complete (private)
+//
+// Records the completion of a handler work item
+//
+// Arguments:
+//
+//	instance	- Service instance
+//	control		- Shutdown control code
+
+void shutdown_coordinator::Complete(service* instance, ServiceControl control)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	auto found = m_participants.find(instance);
+	if(found != m_participants.end()) {
+
+		found->second.complete[control] = true;
+		--found->second.running;
+	}
+
+	m_changed.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+// shutdown_coordinator::Dispatch
+//
+// Invoked by a service that received a shutdown control; starts the round for the control
+// if this is the first service to receive it and waits for the service's own handlers
+//
+// Arguments:
+//
+//	instance	- Service instance that received the control
+//	control		- Shutdown control code
+
+DWORD shutdown_coordinator::Dispatch(service* instance, ServiceControl control)
+{
+	std::unique_lock<std::mutex> critsec(m_lock);
+
+	if(m_rounds.find(control) == m_rounds.end()) StartRound(control);
+	uint64_t deadline = m_rounds[control];
+
+	// A service that wasn't eligible when the round started (or couldn't be queued) runs
+	// it's handlers on this thread instead, the same way it would without the coordinator
+	auto found = m_participants.find(instance);
+	if((found == m_participants.end()) || (found->second.complete.find(control) == found->second.complete.end())) {
+
+		critsec.unlock();
+		return instance->InvokeHandlers(control, 0, nullptr);
+	}
+
+	// Wait for the service's handlers to complete or the shared deadline to pass; the participant
+	// is looked up each time, it may have unregistered if the handlers stopped the service
+	for(;;) {
+
+		found = m_participants.find(instance);
+		if((found == m_participants.end()) || found->second.complete[control]) return ERROR_SUCCESS;
+
+		uint64_t now = GetTickCount64();
+		if(now >= deadline) break;
+
+		m_changed.wait_for(critsec, std::chrono::milliseconds(deadline - now));
+	}
+
+	// The service overran the budget; stop it so the host can move on while the remaining services
+	// finish.  The caller is the instance itself, so it cannot be unregistered without the lock
+	critsec.unlock();
+	instance->ForceStop(ERROR_TIMEOUT);
+	return ERROR_TIMEOUT;
+}
+
+//-----------------------------------------------------------------------------
+// shutdown_coordinator::getRemaining
+//
+// Gets the number of milliseconds left in the shutdown budget
+//
+// Arguments:
+//
+//	NONE
+
+uint32_t shutdown_coordinator::getRemaining(void)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+	if(m_deadline == 0) return INFINITE;
+
+	uint64_t now = GetTickCount64();
+	return (now < m_deadline) ? static_cast<uint32_t>(m_deadline - now) : 0;
+}
+
+//-----------------------------------------------------------------------------
+// shutdown_coordinator::Instance (static)
+//
+// Gets the process-wide shutdown coordinator
+//
+// Arguments:
+//
+//	NONE
+
+shutdown_coordinator& shutdown_coordinator::Instance(void)
+{
+	static shutdown_coordinator instance;
+	return instance;
+}
+
+//-----------------------------------------------------------------------------
+// shutdown_coordinator::Register
+//
+// Adds a running service instance to the coordinator
+//
+// Arguments:
+//
+//	instance		- Service instance
+//	servicename		- Service name, used to look up the service's PreshutdownTimeout
+
+void shutdown_coordinator::Register(service* instance, const tchar_t* servicename)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	// A service started after the deadline of the last shutdown belongs to the next one
+	if((m_deadline != 0) && (GetTickCount64() >= m_deadline)) Reset();
+
+	m_participants[instance].name = servicename;
+}
+
+//-----------------------------------------------------------------------------
+// shutdown_coordinator::Reset (private)
+//
+// Ends the rounds that have been started so that a later shutdown starts over; lock must be held
+//
+// Arguments:
+//
+//	NONE
+
+void shutdown_coordinator::Reset(void)
+{
+	for(auto& iterator : m_participants) iterator.second.complete.clear();
+
+	m_rounds.clear();
+	m_deadline = 0;
+}
+
+//-----------------------------------------------------------------------------
+// shutdown_coordinator::StartRound (private)
+//
+// Sends a shutdown control to every eligible service in parallel; lock must be held
+//
+// Arguments:
+//
+//	control		- Shutdown control code
+
+void shutdown_coordinator::StartRound(ServiceControl control)
+{
+	// All of the services share one deadline, which is also reported as the remaining budget
+	m_deadline = m_rounds[control] = GetTickCount64() + Budget(control);
+
+	for(auto& iterator : m_participants) {
+
+		service* instance = iterator.first;
+
+		// Only services that would have been sent the control are included in the round
+		if((instance->m_status != ServiceStatus::Running) && (instance->m_status != ServiceStatus::Paused)) continue;
+		if(!instance->HandlesControl(control)) continue;
+
+		// Queue a work item to invoke the service's handlers; if it cannot be queued the
+		// handlers are invoked from Dispatch() when the service receives the control
+		std::unique_ptr<work> context = std::make_unique<work>(work{ this, instance, std::atomic_load(&instance->m_self), control });
+		if(!TrySubmitThreadpoolCallback(WorkCallback, context.get(), instance->m_environ)) continue;
+
+		context.release();
+		iterator.second.complete[control] = false;
+		++iterator.second.running;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// shutdown_coordinator::Unregister
+//
+// Removes a service instance from the coordinator
+//
+// Arguments:
+//
+//	instance	- Service instance
+
+void shutdown_coordinator::Unregister(service* instance)
+{
+	std::unique_lock<std::mutex> critsec(m_lock);
+
+	// Wait for any handlers the coordinator is running on the instance before it goes away
+	m_changed.wait(critsec, [&]() -> bool {
+
+		auto found = m_participants.find(instance);
+		return (found == m_participants.end()) || (found->second.running == 0);
+	});
+
+	m_participants.erase(instance);
+	if(m_participants.empty()) Reset();
+
+	m_changed.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+// shutdown_coordinator::WorkCallback (private, static)
+//
+// Thread pool callback that invokes the shutdown handlers of a service
+//
+// Arguments:
+//
+//	instance	- Callback instance
+//	context		- Pointer to the work item context
+
+void CALLBACK shutdown_coordinator::WorkCallback(PTP_CALLBACK_INSTANCE instance, void* context)
+{
+	UNREFERENCED_PARAMETER(instance);
+
+	std::unique_ptr<work> item(reinterpret_cast<work*>(context));
+	placement_scope placement(&item->instance->m_placement);
+
+	item->instance->InvokeHandlers(item->control, 0, nullptr);
+
+	// A pooled service stopped at the deadline has no main thread to write the snapshot once it's
+	// handlers have returned; this work item holds the instance alive so it's done here instead
+	if(item->self) item->instance->SavePendingSnapshot();
+
+	item->coordinator->Complete(item->instance, item->control);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::snapshot_layout
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// snapshot_layout::Checksum (static)
+//
+// Calculates the 64-bit FNV-1a hash of a block of memory
+//
+// Arguments:
+//
+//	data		- Pointer to the memory to be hashed
+//	length		- Length of the memory to be hashed
+
+uint64_t snapshot_layout::Checksum(const void* data, size_t length)
+{
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+	uint64_t hash = 14695981039346656037ULL;
+
+	for(size_t index = 0; index < length; index++) {
+
+		hash ^= bytes[index];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+//-----------------------------------------------------------------------------
+// svctl::startup_phases
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// startup_phases::Add
+//
+// Declares a phase; cannot be called once the phases are running
+//
+// Arguments:
+//
+//	name			- Name of the phase
+//	required		- Flag indicating the phase must be ready before SERVICE_RUNNING is reported
+//	dependencies	- Names of the phases that must be ready before this phase is launched
+//	func			- Function that performs the phase on a worker thread
+
+void startup_phases::Add(const tchar_t* name, bool required, const std::vector<tstring>& dependencies, worker_group::worker_func func)
+{
+	if((name == nullptr) || (*name == 0) || !func) throw winexception(ERROR_INVALID_PARAMETER);
+
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	// The graph is fixed once the phases have been launched
+	if(m_workers) throw winexception(ERROR_INVALID_STATE);
+	if(Find(name)) throw winexception(ERROR_ALREADY_EXISTS);
+
+	phase entry;
+	entry.name = name;
+	entry.required = required;
+	entry.dependencies = dependencies;
+	entry.func = std::move(func);
+
+	m_phases.push_back(std::move(entry));
+}
+
+//-----------------------------------------------------------------------------
+// startup_phases::Cancel (private)
+//
+// Cancels a pending phase and every phase depending on it; lock must be held
+//
+// Arguments:
+//
+//	index		- Index of the phase to cancel
+//	error		- Error code to record for the cancelled phases
+
+void startup_phases::Cancel(size_t index, DWORD error)
+{
+	phase& entry = m_phases[index];
+	if(entry.status != startup_phase_status::Pending) return;
+
+	entry.status = startup_phase_status::Cancelled;
+	entry.error = error;
+
+	for(const auto& dependent : entry.dependents) Cancel(dependent, error);
+}
+
+//-----------------------------------------------------------------------------
+// startup_phases::Complete (private)
+//
+// Records the completion of a phase and launches the phases that were waiting for it
+//
+// Arguments:
+//
+//	index		- Index of the completed phase
+//	error		- Error code of the phase, ERROR_SUCCESS if it completed successfully
+//	stopped		- Flag indicating the service was being stopped when the phase returned
+
+void startup_phases::Complete(size_t index, DWORD error, bool stopped)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	phase& entry = m_phases[index];
+	entry.finished = m_clock.Now();
+
+	// A phase that returns after stop was requested is assumed to have given up early
+	if((error == ERROR_SUCCESS) && !stopped) {
+
+		entry.status = startup_phase_status::Ready;
+		for(const auto& dependent : entry.dependents)
+			if((--m_phases[dependent].remaining == 0) && (m_phases[dependent].status == startup_phase_status::Pending)) Launch(dependent);
+	}
+
+	else {
+
+		entry.status = (error == ERROR_SUCCESS) ? startup_phase_status::Cancelled : startup_phase_status::Failed;
+		entry.error = (error == ERROR_SUCCESS) ? ERROR_OPERATION_ABORTED : error;
+		for(const auto& dependent : entry.dependents) Cancel(dependent, ERROR_SERVICE_DEPENDENCY_FAIL);
+	}
+
+	m_changed.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+// startup_phases::Find (private)
+//
+// Locates a phase by name; lock must be held
+//
+// Arguments:
+//
+//	name		- Name of the phase
+
+const startup_phases::phase* startup_phases::Find(const tchar_t* name) const
+{
+	if(name == nullptr) return nullptr;
+
+	auto found = std::find_if(m_phases.begin(), m_phases.end(), [&](const phase& entry) -> bool { return _tcsicmp(entry.name.c_str(), name) == 0; });
+	return (found == m_phases.end()) ? nullptr : &(*found);
+}
+
+//-----------------------------------------------------------------------------
+// startup_phases::getPhases
+//
+// Gets the progress of each phase
+//
+// Arguments:
+//
+//	NONE
+
+std::vector<startup_phase_info> startup_phases::getPhases(void) const
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	uint64_t now = m_clock.Now();
+	std::vector<startup_phase_info> phases;
+
+	for(const auto& entry : m_phases) {
+
+		// Phases that are still running report the time they have been running for
+		uint64_t finished = (entry.status == startup_phase_status::Running) ? now : entry.finished;
+		uint64_t elapsed = ((entry.started == 0) || (finished < entry.started)) ? 0 : finished - entry.started;
+
+		phases.push_back({ entry.name, entry.required, entry.status, entry.error, static_cast<uint32_t>(std::min<uint64_t>(elapsed, UINT32_MAX)) });
+	}
+
+	return phases;
+}
+
+//-----------------------------------------------------------------------------
+// startup_phases::IsReady
+//
+// Determines if a phase has completed successfully
+//
+// Arguments:
+//
+//	name		- Name of the phase
+
+bool startup_phases::IsReady(const tchar_t* name) const
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	const phase* entry = Find(name);
+	return (entry != nullptr) && (entry->status == startup_phase_status::Ready);
+}
+
+//-----------------------------------------------------------------------------
+// startup_phases::Launch (private)
+//
+// Launches a phase on a worker thread; lock must be held
+//
+// Arguments:
+//
+//	index		- Index of the phase to launch
+
+void startup_phases::Launch(size_t index)
+{
+	phase& entry = m_phases[index];
+
+	// The worker keeps the phases alive in case it is detached when the service stops; the
+	// phases are not added to or removed once launched so the entry can be accessed by index
+	std::shared_ptr<startup_phases> self = shared_from_this();
+
+	try {
+
+		m_workers->Launch(entry.name.c_str(), [self, index](const worker_token& token) -> void {
+
+			DWORD error = ERROR_SUCCESS;
+
+			try { self->m_phases[index].func(token); }
+			catch(winexception& ex) { error = (ex.code() != ERROR_SUCCESS) ? ex.code() : ERROR_SERVICE_SPECIFIC_ERROR; }
+			catch(...) { error = ERROR_UNHANDLED_EXCEPTION; }
+
+			self->Complete(index, error, token.StopRequested);
+		});
+
+		entry.status = startup_phase_status::Running;
+		entry.started = m_clock.Now();
+	}
+
+	// The service is stopping and no longer accepts new workers
+	catch(winexception&) { Cancel(index, ERROR_OPERATION_ABORTED); }
+}
+
+//-----------------------------------------------------------------------------
+// startup_phases::Run
+//
+// Validates the graph and launches every phase that has no dependencies
+//
+// Arguments:
+//
+//	workers		- Worker group to launch the phases into
+
+void startup_phases::Run(worker_group& workers)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	if(m_workers) throw winexception(ERROR_INVALID_STATE);
+
+	// Resolve the dependencies by name into the dependents of each phase
+	for(size_t index = 0; index < m_phases.size(); index++) {
+
+		for(const auto& name : m_phases[index].dependencies) {
+
+			const phase* dependency = Find(name.c_str());
+			if(dependency == nullptr) throw winexception(ERROR_NOT_FOUND);
+
+			m_phases[dependency - m_phases.data()].dependents.push_back(index);
+			m_phases[index].remaining++;
+		}
+	}
+
+	// Sort the phases topologically; if not every phase can be visited the graph has a cycle
+	std::vector<size_t> order;
+	std::vector<size_t> remaining;
+	for(const auto& entry : m_phases) remaining.push_back(entry.remaining);
+	for(size_t index = 0; index < m_phases.size(); index++) if(remaining[index] == 0) order.push_back(index);
+
+	for(size_t visited = 0; visited < order.size(); visited++)
+		for(const auto& dependent : m_phases[order[visited]].dependents) if(--remaining[dependent] == 0) order.push_back(dependent);
+
+	if(order.size() != m_phases.size()) throw winexception(ERROR_CIRCULAR_DEPENDENCY);
+
+	// A phase that a required phase depends on is required as well; dependents always follow a phase
+	// in the topological order so walking it backwards sees every dependent before the phase itself
+	for(auto iterator = order.rbegin(); iterator != order.rend(); iterator++) {
+
+		phase& entry = m_phases[*iterator];
+		for(const auto& dependent : entry.dependents) if(m_phases[dependent].required) entry.required = true;
+	}
+
+	m_workers = &workers;
+	for(size_t index = 0; index < m_phases.size(); index++) if(m_phases[index].remaining == 0) Launch(index);
+}
+
+//-----------------------------------------------------------------------------
+// startup_phases::Wait
+//
+// Waits for a phase to complete; returns true only if it completed successfully
+//
+// Arguments:
+//
+//	name		- Name of the phase
+//	timeout		- Amount of time, in milliseconds, to wait for the phase
+
+bool startup_phases::Wait(const tchar_t* name, uint32_t timeout) const
+{
+	std::unique_lock<std::mutex> critsec(m_lock);
+
+	const phase* entry = Find(name);
+	if(entry == nullptr) return false;
+
+	m_clock.WaitFor(critsec, m_changed, timeout, [=]() -> bool {
+
+		return (entry->status != startup_phase_status::Pending) && (entry->status != startup_phase_status::Running);
+	});
+
+	return (entry->status == startup_phase_status::Ready);
+}
+
+//-----------------------------------------------------------------------------
+// startup_phases::WaitForRequired
+//
+// Waits for the required phases; throws the error of a required phase that did not complete
+//
+// Arguments:
+//
+//	timeout		- Maximum time to wait for the required phases, in milliseconds
+
+void startup_phases::WaitForRequired(uint32_t timeout) const
+{
+	std::unique_lock<std::mutex> critsec(m_lock);
+	DWORD error = ERROR_SUCCESS;
+
+	// A required phase that hangs would otherwise leave the service START_PENDING indefinitely
+	bool completed = m_clock.WaitFor(critsec, m_changed, timeout, [&]() -> bool {
+
+		auto failed = std::find_if(m_phases.begin(), m_phases.end(), [](const phase& entry) -> bool {
+
+			return entry.required && ((entry.status == startup_phase_status::Failed) || (entry.status == startup_phase_status::Cancelled));
+		});
+
+		if(failed != m_phases.end()) { error = failed->error; return true; }
+
+		return std::all_of(m_phases.begin(), m_phases.end(), [](const phase& entry) -> bool {
+
+			return !entry.required || (entry.status == startup_phase_status::Ready);
+		});
+	});
+
+	if(error != ERROR_SUCCESS) throw winexception(error);
+	if(!completed) throw winexception(ERROR_SERVICE_REQUEST_TIMEOUT);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::status_page_layout
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// status_page_layout::ObjectName (static)
+//
+// Generates the name of the status page section
+//
+// Arguments:
+//
+//	servicename		- Name of the service publishing the status page
+//	processid		- Process hosting the service instance
+//	global			- Flag to use the global rather than the session namespace
+
+tstring status_page_layout::ObjectName(const tchar_t* servicename, DWORD processid, bool global)
+{
+	return tstring((global) ? TEXT("Global\\") : TEXT("Local\\")) + TEXT("svctl.status.") + servicename + TEXT(".") + to_tstring(processid);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::status_publisher
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// status_publisher Constructor
+//
+// Arguments:
+//
+//	servicename		- Name of the service publishing the status page
+
+status_publisher::status_publisher(const tchar_t* servicename)
+{
+	PSECURITY_DESCRIPTOR	descriptor = nullptr;		// Status page security descriptor
+
+	if((servicename == nullptr) || (*servicename == 0)) throw winexception(E_INVALIDARG);
+
+	// Monitoring agents don't necessarily run with administrative rights; grant read access
+	// to authenticated users in addition to full access for SYSTEM and administrators
+	if(!ConvertStringSecurityDescriptorToSecurityDescriptor(TEXT("D:(A;;GA;;;SY)(A;;GA;;;BA)(A;;GR;;;AU)"), SDDL_REVISION_1, &descriptor, nullptr))
+		throw winexception();
+
+	SECURITY_ATTRIBUTES attributes = { sizeof(SECURITY_ATTRIBUTES), descriptor, FALSE };
+
+	// Create the page in the global namespace, falling back to the session namespace if the
+	// process doesn't hold SeCreateGlobalPrivilege
+	DWORD processid = GetCurrentProcessId();
+	m_mapping = CreateFileMapping(INVALID_HANDLE_VALUE, &attributes, PAGE_READWRITE, 0, sizeof(status_page_layout), 
+		status_page_layout::ObjectName(servicename, processid, true).c_str());
+	if(m_mapping == nullptr) m_mapping = CreateFileMapping(INVALID_HANDLE_VALUE, &attributes, PAGE_READWRITE, 0, sizeof(status_page_layout), 
+		status_page_layout::ObjectName(servicename, processid, false).c_str());
+
+	DWORD result = GetLastError();
+	LocalFree(descriptor);
+	if(m_mapping == nullptr) throw winexception(result);
+
+	// Another instance of the service in this process is already publishing the page
+	if(result == ERROR_ALREADY_EXISTS) {
+
+		CloseHandle(m_mapping);
+		throw winexception(ERROR_ALREADY_EXISTS);
+	}
+
+	m_layout = reinterpret_cast<status_page_layout*>(MapViewOfFile(m_mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(status_page_layout)));
+	if(m_layout == nullptr) {
+
+		result = GetLastError();
+		CloseHandle(m_mapping);
+		throw winexception(result);
+	}
+
+	// Initialize the snapshot before the magic number and version are set, readers won't accept
+	// the page until then
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+
+	Update([&](status_snapshot& snapshot) -> void {
+
+		zero_init(snapshot);
+		snapshot.ProcessId = GetCurrentProcessId();
+		snapshot.StartTime = snapshot.UpdateTime = (static_cast<uint64_t>(now.dwHighDateTime) << 32) | now.dwLowDateTime;
+		snapshot.Status.dwCurrentState = static_cast<DWORD>(ServiceStatus::Stopped);
+	});
+
+	m_layout->version = status_page_layout::VERSION;
+	m_layout->magic = status_page_layout::MAGIC;
+}
+
+//-----------------------------------------------------------------------------
+// status_publisher Destructor
+
+status_publisher::~status_publisher()
+{
+	UnmapViewOfFile(m_layout);
+	CloseHandle(m_mapping);
+}
+
+//-----------------------------------------------------------------------------
+// status_publisher::Attach
+//
+// Creates a publishing service_context that wraps the specified context
+//
+// Arguments:
+//
+//	context		- Service context to be wrapped; must remain valid
+
+service_context status_publisher::Attach(const service_context& context)
+{
+	service_context publishing = context;
+
+	// Substitute the publisher's HandlerEx callback for the one registered by the service
+	register_handler_func registerfunc = context.RegisterHandlerFunc;
+	publishing.RegisterHandlerFunc = [=](LPCTSTR servicename, LPHANDLER_FUNCTION_EX handler, LPVOID handlercontext) -> SERVICE_STATUS_HANDLE {
+
+		m_handler = handler;
+		m_context = handlercontext;
+		return registerfunc(servicename, HandlerFunc, this);
+	};
+
+	// Publish each status after it has been reported by the original function
+	set_status_func statusfunc = context.SetStatusFunc;
+	publishing.SetStatusFunc = [=](SERVICE_STATUS_HANDLE handle, LPSERVICE_STATUS status) -> BOOL {
+
+		BOOL result = statusfunc(handle, status);
+		Update([&](status_snapshot& snapshot) -> void {
+
+			if(result) { snapshot.Status = *status; ++snapshot.StatusReports; }
+			else ++snapshot.StatusFailures;
+		});
+
+		return result;
+	};
+
+	// Controls raised within the process enter the handler chain here, like a control from the system
+	publishing.DispatchControlFunc = [=](DWORD control, DWORD eventtype, void* eventdata) -> DWORD { return HandlerFunc(control, eventtype, eventdata, this); };
+
+	return publishing;
+}
+
+//-----------------------------------------------------------------------------
+// status_publisher::HandlerFunc (private, static)
+//
+// HandlerEx callback that forwards a control to the service and counts it
+//
+// Arguments:
+//
+//	control		- Service control code
+//	eventtype	- Control-specific event type
+//	eventdata	- Control-specific event data
+//	context		- Pointer to the status_publisher instance
+
+DWORD WINAPI status_publisher::HandlerFunc(DWORD control, DWORD eventtype, void* eventdata, void* context)
+{
+	status_publisher* publisher = reinterpret_cast<status_publisher*>(context);
+
+	DWORD result = publisher->m_handler(control, eventtype, eventdata, publisher->m_context);
+	publisher->Update([&](status_snapshot& snapshot) -> void {
+
+		++snapshot.Controls;
+		if(result != ERROR_SUCCESS) ++snapshot.ControlFailures;
+	});
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// status_publisher::TryCreate (static)
+//
+// Creates a status publisher for the service; the status page is a convenience for
+// monitoring tools so failure to create it does not prevent the service from starting
+//
+// Arguments:
+//
+//	servicename		- Name of the service publishing the status page
+
+std::unique_ptr<status_publisher> status_publisher::TryCreate(const tchar_t* servicename)
+{
+	try { return std::make_unique<status_publisher>(servicename); }
+	catch(winexception&) { return nullptr; }
+}
+
+//-----------------------------------------------------------------------------
+// status_publisher::Update (private)
+//
+// Applies an update to the status page snapshot under the sequence lock
+//
+// Arguments:
+//
+//	update		- Function that modifies the snapshot
+
+void status_publisher::Update(const std::function<void(status_snapshot&)>& update)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	// Make the sequence odd before touching the snapshot so readers will retry; the fence keeps
+	// the snapshot writes from becoming visible before the odd sequence
+	uint32_t sequence = m_layout->sequence.load(std::memory_order_relaxed);
+	m_layout->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	update(m_layout->snapshot);
+
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	m_layout->snapshot.UpdateTime = (static_cast<uint64_t>(now.dwHighDateTime) << 32) | now.dwLowDateTime;
+
+	// Publish the updated snapshot with an even sequence
+	m_layout->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+//-----------------------------------------------------------------------------
+// svctl::status_reader
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// status_reader Constructor
+//
+// Arguments:
+//
+//	servicename		- Name of the service to read the status page for
+//	processid		- Process hosting the service instance, or zero to ask the service control manager
+
+status_reader::status_reader(const tchar_t* servicename, DWORD processid)
+{
+	if((servicename == nullptr) || (*servicename == 0)) throw winexception(E_INVALIDARG);
+
+	// The page name includes the hosting process, which the service control manager knows for a service
+	if(processid == 0) processid = GetServiceProcessId(servicename);
+	if(processid == 0) throw winexception(ERROR_SERVICE_NOT_ACTIVE);
+
+	// Look for the page in the global namespace first, then the session namespace
+	m_mapping = OpenFileMapping(FILE_MAP_READ, FALSE, status_page_layout::ObjectName(servicename, processid, true).c_str());
+	if(m_mapping == nullptr) m_mapping = OpenFileMapping(FILE_MAP_READ, FALSE, status_page_layout::ObjectName(servicename, processid, false).c_str());
+	if(m_mapping == nullptr) throw winexception((GetLastError() == ERROR_FILE_NOT_FOUND) ? ERROR_SERVICE_NOT_ACTIVE : GetLastError());
+
+	m_layout = reinterpret_cast<const status_page_layout*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, sizeof(status_page_layout)));
+	if((m_layout == nullptr) || (m_layout->magic != status_page_layout::MAGIC) || (m_layout->version != status_page_layout::VERSION)) {
+
+		DWORD result = (m_layout == nullptr) ? GetLastError() : ERROR_INVALID_DATA;
+
+		if(m_layout) UnmapViewOfFile(m_layout);
+		CloseHandle(m_mapping);
+
+		throw winexception(result);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// status_reader Destructor
+
+status_reader::~status_reader()
+{
+	UnmapViewOfFile(m_layout);
+	CloseHandle(m_mapping);
+}
+
+//-----------------------------------------------------------------------------
+// status_reader::getSnapshot
+//
+// Gets a consistent copy of the published status and counters
+//
+// Arguments:
+//
+//	NONE
+
+status_snapshot status_reader::getSnapshot(void) const
+{
+	status_snapshot snapshot;
+
+	if(!TryGetSnapshot(snapshot)) throw winexception(ERROR_TIMEOUT);
+	return snapshot;
+}
+
+//-----------------------------------------------------------------------------
+// status_reader::TryGetSnapshot
+//
+// Gets a consistent copy of the published status and counters
+//
+// Arguments:
+//
+//	snapshot		- Receives the copy of the status and counters
+
+bool status_reader::TryGetSnapshot(status_snapshot& snapshot) const
+{
+	uint64_t deadline = GetTickCount64() + SNAPSHOT_TIMEOUT;
+
+	// Copy the snapshot until the sequence was even and unchanged across the copy; the publisher
+	// holds the sequence odd only for the few instructions it takes to update it, unless it has
+	// been preempted or died in the middle of the update
+	for(uint32_t iteration = 0;; iteration++) {
+
+		uint32_t sequence = m_layout->sequence.load(std::memory_order_acquire);
+		if((sequence & 1) == 0) {
+
+			memcpy(&snapshot, &m_layout->snapshot, sizeof(status_snapshot));
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			if(m_layout->sequence.load(std::memory_order_relaxed) == sequence) return true;
+		}
+
+		if(iteration < SPIN_COUNT) YieldProcessor();
+		else if(GetTickCount64() >= deadline) return false;
+		else SwitchToThread();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// svctl::status_reporter
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// status_reporter Constructor
+//
+// Arguments:
+//
+//	sink		- Function that delivers the status; may block
+//	environ		- Thread pool callback environment, or null for the default pool
+
+status_reporter::status_reporter(report_status_func sink, PTP_CALLBACK_ENVIRON environ) : m_sink(std::move(sink))
+{
+	zero_init(m_mailbox);
+
+	m_work = CreateThreadpoolWork(WorkCallback, this, environ);
+	if(m_work == nullptr) throw winexception();
+}
+
+//-----------------------------------------------------------------------------
+// status_reporter Destructor
+
+status_reporter::~status_reporter()
+{
+	Flush();
+	CloseThreadpoolWork(m_work);
+}
+
+//-----------------------------------------------------------------------------
+// status_reporter::Deliver (private)
+//
+// Delivers the status in the mailbox until it is empty
+//
+// Arguments:
+//
+//	NONE
+
+void status_reporter::Deliver(void)
+{
+	// The mailbox is emptied while holding the delivery lock, otherwise two threads delivering
+	// at the same time could pass an older status to the sink after a newer one
+	std::lock_guard<std::mutex> delivering(m_deliverlock);
+
+	while(true) {
+
+		std::unique_lock<std::mutex> critsec(m_lock);
+		if(!m_pending) { m_scheduled = false; return; }
+
+		SERVICE_STATUS status = m_mailbox;
+		m_pending = false;
+		critsec.unlock();
+
+		// Only the first exception is kept, it is rethrown by the service on it's next status change
+		try { m_sink(status); }
+		catch(...) {
+
+			critsec.lock();
+			if(!m_exception) m_exception = std::current_exception();
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// status_reporter::Flush
+//
+// Delivers any status that has been posted but not yet delivered
+//
+// Arguments:
+//
+//	NONE
+
+void status_reporter::Flush(void)
+{
+	// A callback that has not started is canceled rather than waited for, the calling thread
+	// may be the only thread in the pool.  Whatever it would have delivered is delivered here
+	WaitForThreadpoolWorkCallbacks(m_work, TRUE);
+	Deliver();
+}
+
+//-----------------------------------------------------------------------------
+// status_reporter::Post
+//
+// Posts a status update to the mailbox
+//
+// Arguments:
+//
+//	status		- Status to be delivered
+
+void status_reporter::Post(const SERVICE_STATUS& status)
+{
+	std::unique_lock<std::mutex> critsec(m_lock);
+
+	// SERVICE_STOPPED is always the last status delivered; nothing can replace it
+	if(m_stopped) return;
+
+	// Replace any status that has not been delivered yet, back-to-back transitions
+	// and pending checkpoints are coalesced into the most recent one
+	m_mailbox = status;
+	m_pending = true;
+	m_stopped = (status.dwCurrentState == SERVICE_STOPPED);
+
+	if(m_scheduled) return;
+	m_scheduled = true;
+	critsec.unlock();
+
+	SubmitThreadpoolWork(m_work);
+}
+
+//-----------------------------------------------------------------------------
+// status_reporter::TakeException
+//
+// Gets and clears the exception thrown by the status sink
+//
+// Arguments:
+//
+//	NONE
+
+std::exception_ptr status_reporter::TakeException(void)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+
+	std::exception_ptr exception = m_exception;
+	m_exception = nullptr;
+	return exception;
+}
+
+//-----------------------------------------------------------------------------
+// status_reporter::WorkCallback (private, static)
+//
+// Thread pool callback that delivers the posted status
+//
+// Arguments:
+//
+//	instance	- Callback instance
+//	context		- Pointer to the status_reporter instance
+//	work		- Thread pool work object
+
+void CALLBACK status_reporter::WorkCallback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work)
+{
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(work);
+
+	reinterpret_cast<status_reporter*>(context)->Deliver();
+}
+
+//-----------------------------------------------------------------------------
+// svctl::system_event_source
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// system_event_source Constructor
+//
+// Arguments:
+//
+//	NONE
+
+system_event_source::system_event_source()
+{
+	m_coalesce = CreateWaitableTimer(nullptr, FALSE, nullptr);
+	if(m_coalesce == nullptr) throw winexception();
+}
+
+//-----------------------------------------------------------------------------
+// system_event_source Destructor
+
+system_event_source::~system_event_source()
+{
+	// The thread is detached; it has to be gone before the timer and the instance are
+	std::shared_ptr<monitor> current = m_monitor;
+	if(current) {
+
+		if(m_notification) CancelMibChangeNotify2(m_notification);
+		current->stop.Set();
+		WaitForSingleObject(current->exited, INFINITE);
+	}
+
+	CloseHandle(m_coalesce);
+}
+
+//-----------------------------------------------------------------------------
+// system_event_source::Deliver (private)
+//
+// Sends a control to every subscribed service harness
+//
+// Arguments:
+//
+//	control		- Control to be sent
+//	eventtype	- Control-specific event type
+//	eventdata	- Control-specific event data
 
-	// Check for a pending service state operation
-	if(m_statusworker.joinable()) {
+void system_event_source::Deliver(ServiceControl control, DWORD eventtype, void* eventdata)
+{
+	std::lock_guard<std::mutex> deliverlock(m_deliverlock);
 
-		// Cancel the pending state checkpoint thread by signaling the event object
-		if(SignalObjectAndWait(m_statussignal, m_statusworker.native_handle(), INFINITE, FALSE) == WAIT_FAILED) 
-			throw winexception();
+	// Count the control against each harness, Unsubscribe() waits for it to be delivered so
+	// that a harness cannot be destroyed while it's being sent one
+	std::vector<service_harness*> subscribers;
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		m_delivering = std::this_thread::get_id();
 
-		m_statusworker.join();
-		m_statussignal.Reset();
+		for(auto& iterator : m_subscribers) {
 
-		// Check for the presence of an exception from the worker thread and rethrow it
-		if(m_statusexception) std::rethrow_exception(m_statusexception);
+			++iterator.second;
+			subscribers.push_back(iterator.first);
+		}
 	}
 
-	// Invoke the proper status helper based on the type of status being set
-	switch(status) {
+	// The controls are sent without the lock held, a service that does not accept the control rejects it
+	for(const auto& harness : subscribers) {
 
-		// Pending status codes
-		case ServiceStatus::StartPending:
-		case ServiceStatus::StopPending:
-		case ServiceStatus::ContinuePending:
-		case ServiceStatus::PausePending:
-			SetPendingStatus(status);
-			break;
+		harness->SendControl(control, eventtype, eventdata);
 
-		// Non-pending status codes without an exit status
-		case ServiceStatus::Running:
-		case ServiceStatus::Paused:
-			SetNonPendingStatus(status);
-			break;
+		std::lock_guard<std::mutex> critsec(m_lock);
+		auto found = m_subscribers.find(harness);
+		if(found != m_subscribers.end()) --found->second;
 
-		// Non-pending status codes that report exit status
-		case ServiceStatus::Stopped:
-			SetNonPendingStatus(status, win32exitcode, serviceexitcode);
-			break;
+		m_changed.notify_all();
+	}
 
-		// Invalid status code
-		default: throw winexception(E_INVALIDARG);
+	std::lock_guard<std::mutex> critsec(m_lock);
+	m_delivering = std::thread::id();
+}
+
+//-----------------------------------------------------------------------------
+// system_event_source::Instance (static)
+//
+// Gets the process-wide system event source
+//
+// Arguments:
+//
+//	NONE
+
+system_event_source& system_event_source::Instance(void)
+{
+	static system_event_source instance;
+	return instance;
+}
+
+//-----------------------------------------------------------------------------
+// system_event_source::Notify (private)
+//
+// Queues an interface change control and starts the coalescing timer
+//
+// Arguments:
+//
+//	control		- Interface change control to be delivered
+
+void system_event_source::Notify(ServiceControl control)
+{
+	std::lock_guard<std::mutex> critsec(m_pendinglock);
+
+	// A burst of changes is delivered once per control; the timer is started by the first
+	// change of the burst and is not extended by the ones that follow it
+	if(std::find(m_pending.begin(), m_pending.end(), control) != m_pending.end()) return;
+
+	if(m_pending.empty()) {
+
+		LARGE_INTEGER duetime;
+		duetime.QuadPart = -(static_cast<LONGLONG>(COALESCE_INTERVAL) * 10000);
+		SetWaitableTimer(m_coalesce, &duetime, 0, nullptr, nullptr, FALSE);
 	}
-	
-	m_status = status;						// Service status has been changed		
+
+	m_pending.push_back(control);
 }
 
 //-----------------------------------------------------------------------------
-// service::Stop
+// system_event_source::Run (private)
 //
-// Stops the service
+// Body of the thread that delivers the controls
 //
 // Arguments:
 //
-//	win32exitcode		- Win32 service exit code
-//	serviceexitcode		- Service specific exit code
+//	NONE
 
-DWORD service::Stop(DWORD win32exitcode, DWORD serviceexitcode)
+void system_event_source::Run(std::shared_ptr<monitor> state)
 {
-	std::lock_guard<std::recursive_mutex> critsec(m_statuslock);
+	HANDLE handles[] = { state->stop, m_coalesce };
 
-	// Service cannot be stopped unless it's RUNNING or PAUSED, this could cause
-	// potential race conditions in the derived service class; better to block it
-	if(m_status != ServiceStatus::Running && m_status != ServiceStatus::Paused) return ERROR_CALL_NOT_IMPLEMENTED;
+	// Session changes are only reported to a window; without one the thread still delivers the other controls
+	WNDCLASSEX windowclass = { sizeof(WNDCLASSEX) };
+	windowclass.lpfnWndProc = SessionWindowProc;
+	windowclass.hInstance = GetModuleHandle(nullptr);
+	windowclass.lpszClassName = _T("svctl::system_event_source");
+	RegisterClassEx(&windowclass);
 
-	// Set the service status to STOP_PENDING
-	try { SetStatus(ServiceStatus::StopPending); }
-	catch(...) { Abort(std::current_exception()); }
+	HWND window = CreateWindowEx(0, windowclass.lpszClassName, nullptr, 0, 0, 0, 0, 0, HWND_MESSAGE, nullptr, windowclass.hInstance, nullptr);
+	if(window) {
 
-	try {
+		SetWindowLongPtr(window, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(this));
+		if(!WTSRegisterSessionNotification(window, NOTIFY_FOR_ALL_SESSIONS)) { DestroyWindow(window); window = nullptr; }
+	}
 
-		// Invoke all of the STOP handlers prior to setting the service to STOPPED
-		for(const auto& handler : Handlers) if(handler->Control == ServiceControl::Stop) handler->Invoke(this, 0, nullptr);
-		SetStatus(ServiceStatus::Stopped, win32exitcode, serviceexitcode);
+	// The system time is expected to advance along with the tick count; any difference between
+	// the two beyond the threshold means that the system time has been changed
+	FILETIME systemtime;
+	GetSystemTimeAsFileTime(&systemtime);
+	ULARGE_INTEGER lasttime = { systemtime.dwLowDateTime, systemtime.dwHighDateTime };
+	uint64_t lasttick = GetTickCount64();
+
+	while(true) {
+
+		DWORD wait = MsgWaitForMultipleObjects(_countof(handles), handles, FALSE, CLOCK_CHECK_INTERVAL, QS_ALLINPUT);
+		if(wait == WAIT_OBJECT_0) break;
+
+		// Dispatch the window messages, session changes are delivered by the window procedure
+		if(wait == WAIT_OBJECT_0 + _countof(handles)) {
+
+			MSG message;
+			while(PeekMessage(&message, nullptr, 0, 0, PM_REMOVE)) DispatchMessage(&message);
+		}
+
+		// Deliver the interface change controls that have been coalesced
+		if(wait == WAIT_OBJECT_0 + 1) {
+
+			std::vector<ServiceControl> pending;
+			{
+				std::lock_guard<std::mutex> critsec(m_pendinglock);
+				pending.swap(m_pending);
+			}
+
+			for(const auto& control : pending) Deliver(control, 0, nullptr);
+		}
+
+		GetSystemTimeAsFileTime(&systemtime);
+		ULARGE_INTEGER now = { systemtime.dwLowDateTime, systemtime.dwHighDateTime };
+		uint64_t tick = GetTickCount64();
+
+		LONGLONG expected = static_cast<LONGLONG>(lasttime.QuadPart + ((tick - lasttick) * 10000));
+		LONGLONG difference = static_cast<LONGLONG>(now.QuadPart) - expected;
+		if((difference >= static_cast<LONGLONG>(TIME_CHANGE_THRESHOLD) * 10000) || (difference <= -static_cast<LONGLONG>(TIME_CHANGE_THRESHOLD) * 10000)) {
+
+			SERVICE_TIMECHANGE_INFO info;
+			info.liNewTime.QuadPart = static_cast<LONGLONG>(now.QuadPart);
+			info.liOldTime.QuadPart = expected;
+			Deliver(ServiceControl::TimeChange, 0, &info);
+		}
+
+		lasttime = now;
+		lasttick = tick;
 	}
 
-	catch(...) { Abort(std::current_exception()); }
+	if(window) {
 
-	m_stopsignal.Set();				// Signal the exit from the main thread
+		WTSUnRegisterSessionNotification(window);
+		DestroyWindow(window);
+	}
 
-	return ERROR_SUCCESS;
+	state->exited.Set();
 }
 
 //-----------------------------------------------------------------------------
-// service::TrySetStatus (private)
+// system_event_source::SessionWindowProc (private, static)
 //
-// Exception-safe version of SetStatus(), should only be used when an exception
-// cannot be dealt with, like when stopping the service from another exception
+// Window procedure for the message-only window that receives session notifications
 //
 // Arguments:
 //
-//	status			- New service status to set
-//	win32exitcode	- Win32 specific exit code for ServiceStatus::Stopped (see documentation)
-//	serviceexitcode	- Service-specific exit code for ServiceStatus::Stopped (see documentation)
+//	window		- Message-only window handle
+//	message		- Window message
+//	wparam		- Message-specific information
+//	lparam		- Message-specific information
 
-bool service::TrySetStatus(ServiceStatus status, uint32_t win32exitcode, uint32_t serviceexitcode)
+LRESULT CALLBACK system_event_source::SessionWindowProc(HWND window, UINT message, WPARAM wparam, LPARAM lparam)
 {
-	// Attempt to change the service status and just eat any thrown exceptions
-	try { SetStatus(status, win32exitcode, serviceexitcode); }
-	catch(...) { return false; }
+	system_event_source* instance = reinterpret_cast<system_event_source*>(GetWindowLongPtr(window, GWLP_USERDATA));
+	if((message != WM_WTSSESSION_CHANGE) || (instance == nullptr)) return DefWindowProc(window, message, wparam, lparam);
 
-	return true;
+	// SERVICE_CONTROL_SESSIONCHANGE carries the WTS_XXXX event as the event type and the session identifier
+	WTSSESSION_NOTIFICATION notification;
+	notification.cbSize = sizeof(WTSSESSION_NOTIFICATION);
+	notification.dwSessionId = static_cast<DWORD>(lparam);
+
+	instance->Deliver(ServiceControl::SessionChange, static_cast<DWORD>(wparam), &notification);
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
-// svctl::service_harness
+// system_event_source::Start (private)
+//
+// Starts the thread and registers for interface change notifications
+//
+// Arguments:
+//
+//	NONE
+
+void system_event_source::Start(void)
+{
+	// The thread keeps its own reference to the shared state so that it can be detached
+	std::shared_ptr<monitor> state = std::make_shared<monitor>();
+	std::thread(&system_event_source::Run, this, state).detach();
+	m_monitor = std::move(state);
+
+	// Interfaces coming and going are reported as NetBindAdd and NetBindRemove; a change to an existing
+	// interface is reported as NetBindEnable or NetBindDisable depending on whether it's connected
+	DWORD result = NotifyIpInterfaceChange(AF_UNSPEC, [](void* context, PMIB_IPINTERFACE_ROW row, MIB_NOTIFICATION_TYPE type) -> void {
+
+		system_event_source* instance = reinterpret_cast<system_event_source*>(context);
+
+		if(type == MibAddInstance) instance->Notify(ServiceControl::NetBindAdd);
+		else if(type == MibDeleteInstance) instance->Notify(ServiceControl::NetBindRemove);
+		else if((type == MibParameterNotification) && (row != nullptr)) 
+			instance->Notify((row->Connected) ? ServiceControl::NetBindEnable : ServiceControl::NetBindDisable);
+
+	}, this, FALSE, &m_notification);
+
+	// Without interface change notifications the thread still detects changes to the system time
+	if(result != NO_ERROR) m_notification = nullptr;
+}
+
 //-----------------------------------------------------------------------------
+// system_event_source::Stop (private)
+//
+// Cancels the interface change notifications and signals the thread to stop; does not wait
+// for it, this may be invoked from the thread itself
+//
+// Arguments:
+//
+//	NONE
+
+void system_event_source::Stop(void)
+{
+	// CancelMibChangeNotify2 waits for any callback that is running to return
+	if(m_notification) CancelMibChangeNotify2(m_notification);
+	m_notification = nullptr;
+
+	if(m_monitor) m_monitor->stop.Set();
+	m_monitor.reset();
+
+	// Discard anything that was queued but not delivered
+	std::lock_guard<std::mutex> critsec(m_pendinglock);
+	CancelWaitableTimer(m_coalesce);
+	m_pending.clear();
+}
 
 //-----------------------------------------------------------------------------
-// service_harness Constructor
+// system_event_source::Subscribe
+//
+// Adds a service harness to the set of subscribers
+//
+// Arguments:
+//
+//	harness		- Service harness to send the controls to
+
+void system_event_source::Subscribe(service_harness* harness)
+{
+	if(harness == nullptr) throw winexception(ERROR_INVALID_PARAMETER);
+
+	// Start and Stop are serialized separately from m_lock, which is never held while they run
+	std::lock_guard<std::mutex> runlock(m_runlock);
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		m_subscribers.emplace(harness, 0);
+	}
+
+	if(!m_monitor) Start();
+}
+
+//-----------------------------------------------------------------------------
+// system_event_source::Unsubscribe
+//
+// Removes a service harness from the set of subscribers
+//
+// Arguments:
+//
+//	harness		- Service harness to be removed
+
+void system_event_source::Unsubscribe(service_harness* harness)
+{
+	{
+		std::unique_lock<std::mutex> critsec(m_lock);
+
+		// Wait for a control being sent to the harness by the thread, unless this is the thread
+		m_changed.wait(critsec, [&]() -> bool {
+
+			auto found = m_subscribers.find(harness);
+			return (found == m_subscribers.end()) || (found->second == 0) || (m_delivering == std::this_thread::get_id());
+		});
+
+		if(m_subscribers.erase(harness) == 0) return;
+	}
+
+	// Another harness may have subscribed since the lock was released
+	std::lock_guard<std::mutex> runlock(m_runlock);
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		if(!m_subscribers.empty()) return;
+	}
+
+	if(m_monitor) Stop();
+}
+
+//-----------------------------------------------------------------------------
+// svctl::system_memory_pressure
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// system_memory_pressure Destructor
+
+system_memory_pressure::~system_memory_pressure()
+{
+	// The worker thread is detached; it has to be gone before the instance is
+	std::shared_ptr<monitor> current = m_monitor;
+	if(!current) return;
+
+	current->stop.Set();
+	WaitForSingleObject(current->exited, INFINITE);
+}
+
+//-----------------------------------------------------------------------------
+// system_memory_pressure::Instance (static)
+//
+// Gets the process-wide system memory pressure source
 //
 // Arguments:
 //
 //	NONE
 
-service_harness::service_harness()
+system_memory_pressure& system_memory_pressure::Instance(void)
 {
-	// Initialize the SERVICE_STATUS to the default state
-	zero_init(m_status).dwCurrentState = static_cast<DWORD>(ServiceStatus::Stopped);
+	static system_memory_pressure instance;
+	return instance;
 }
 
 //-----------------------------------------------------------------------------
-// service_harness Destructor
+// system_memory_pressure::Sample (private, static)
+//
+// Determines the current memory pressure level
+//
+// Arguments:
+//
+//	lowmemory	- Low memory resource notification handle
 
-service_harness::~service_harness()
+ServiceMemoryPressure system_memory_pressure::Sample(HANDLE lowmemory)
 {
-	// If the main service thread is still active, it needs to be detached
-	// (There doesn't appear to be a legitimate way to also kill it)
-	if(m_mainthread.joinable()) m_mainthread.detach();
+	// The system signals the low memory notification when available physical memory is
+	// running out; if that is the case nothing else needs to be looked at
+	BOOL low = FALSE;
+	if(QueryMemoryResourceNotification(lowmemory, &low) && low) return ServiceMemoryPressure::Critical;
+
+	MEMORYSTATUSEX status = { sizeof(MEMORYSTATUSEX) };
+	if(GlobalMemoryStatusEx(&status) && (status.dwMemoryLoad >= MODERATE_LOAD)) return ServiceMemoryPressure::Moderate;
+
+	return ServiceMemoryPressure::Normal;
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::Continue
+// system_memory_pressure::Start (private)
 //
-// Sends SERVICE_CONTROL_CONTINUE to the service, throws an exception if the
-// service does not accept the control or stops prematurely
+// Starts the worker thread that monitors the system memory pressure
 //
 // Arguments:
 //
 //	NONE
 
-void service_harness::Continue(void)
+void system_memory_pressure::Start(void)
 {
-	DWORD result = SendControl(ServiceControl::Continue);
-	if(result != ERROR_SUCCESS) throw winexception(result);
+	HANDLE lowmemory = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+	if(lowmemory == nullptr) throw winexception();
 
-	WaitForStatus(ServiceStatus::Running);
+	// The thread keeps its own reference to the shared state so that it can be detached
+	std::shared_ptr<monitor> state = std::make_shared<monitor>();
+
+	try { std::thread([=]() -> void {
+
+		HANDLE handles[] = { state->stop, lowmemory };
+		ServiceMemoryPressure level = ServiceMemoryPressure::Normal;
+
+		// The low memory notification stays signaled for as long as the condition persists, so it's
+		// only waited on while the level is below critical; the memory load is sampled on an interval
+		// to detect moderate pressure and the end of a low memory condition
+		while(true) {
+
+			DWORD count = (level == ServiceMemoryPressure::Critical) ? 1 : 2;
+			if(WaitForMultipleObjects(count, handles, FALSE, POLL_INTERVAL) == WAIT_OBJECT_0) break;
+
+			level = Sample(lowmemory);
+			Raise(level);
+		}
+
+		CloseHandle(lowmemory);
+		state->exited.Set();
+
+	}).detach(); }
+
+	catch(...) { CloseHandle(lowmemory); throw; }
+
+	m_monitor = std::move(state);
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::getCanContinue
+// system_memory_pressure::Stop (private)
 //
-// Determines if the service can be continued
+// Stops the worker thread that monitors the system memory pressure; does not wait for it,
+// this may be invoked from the worker thread itself
+//
+// Arguments:
+//
+//	NONE
 
-bool service_harness::getCanContinue(void)
+void system_memory_pressure::Stop(void)
+{
+	if(m_monitor) m_monitor->stop.Set();
+	m_monitor.reset();
+}
+
+//-----------------------------------------------------------------------------
+// svctl::virtual_clock
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// virtual_clock Destructor
+
+virtual_clock::~virtual_clock()
+{
+	// Release any timers that were not closed by their owners
+	for(timer* t : m_timers) delete t;
+}
+
+//-----------------------------------------------------------------------------
+// virtual_clock::Advance
+//
+// Advances the clock by the specified interval, firing any timers in order
+//
+// Arguments:
+//
+//	milliseconds	- Interval to advance the clock by
+
+void virtual_clock::Advance(uint32_t milliseconds)
+{
+	std::unique_lock<std::mutex> critsec(m_lock);
+	uint64_t target = m_now + milliseconds;
+
+	// Step through each timer that comes due within the interval in order
+	while(true) {
+
+		uint64_t next = target;
+		for(const timer* t : m_timers) if(t->armed && (t->due < next)) next = t->due;
+
+		if(next > m_now) m_now = next;
+		FireTimers(critsec);
+		if(next == target) break;
+	}
+
+	// Wake up any waiters to check their deadlines against the new time
+	for(const auto& waiter : m_waiters) waiter.second->notify_all();
+}
+
+//-----------------------------------------------------------------------------
+// virtual_clock::AdvanceToNext
+//
+// Advances the clock to the next timer or waiter deadline
+//
+// Arguments:
+//
+//	NONE
+
+bool virtual_clock::AdvanceToNext(void)
+{
+	std::unique_lock<std::mutex> critsec(m_lock);
+
+	// Time cannot move while a participant is still running
+	m_changed.wait(critsec, [&]() -> bool { return Idle(); });
+
+	return AdvanceToNext(critsec);
+}
+
+//-----------------------------------------------------------------------------
+// virtual_clock::AdvanceToNext (private)
+//
+// Advances the clock to the next timer or waiter deadline
+//
+// Arguments:
+//
+//	lock		- Lock held on m_lock
+
+bool virtual_clock::AdvanceToNext(std::unique_lock<std::mutex>& lock)
+{
+	uint64_t next = UINT64_MAX;
+
+	// Find the earliest armed timer or finite waiter deadline
+	for(const timer* t : m_timers) if(t->armed && (t->due < next)) next = t->due;
+	if(!m_waiters.empty() && (m_waiters.begin()->first < next)) next = m_waiters.begin()->first;
+	if(next == UINT64_MAX) return false;
+
+	if(next > m_now) m_now = next;
+	FireTimers(lock);
+
+	// Wake up any waiters to check their deadlines against the new time
+	for(const auto& waiter : m_waiters) waiter.second->notify_all();
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// virtual_clock::CancelTimer
+//
+// Cancels a timer and waits for any running callback to complete
+//
+// Arguments:
+//
+//	timer		- Timer returned from CreateTimer
+
+void virtual_clock::CancelTimer(void* timer)
 {
-	std::lock_guard<std::mutex> critsec(m_statuslock);
+	std::unique_lock<std::mutex> critsec(m_lock);
+	virtual_clock::timer* vtimer = reinterpret_cast<virtual_clock::timer*>(timer);
 
-	// If the service is not running, it cannot be controlled at all
-	if(!m_mainthread.joinable()) return false;
+	vtimer->armed = false;
 
-	// The service can be continued if it's in a PAUSED state and accepts the control
-	return ((static_cast<ServiceStatus>(m_status.dwCurrentState) == ServiceStatus::Paused) && 
-		ServiceControlAccepted(ServiceControl::Continue, m_status.dwControlsAccepted));
+	// Wait for a running callback unless it's the callback itself canceling the timer
+	if(m_firingthread != GetCurrentThreadId()) m_changed.wait(critsec, [&]() -> bool { return m_firing != vtimer; });
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::getCanPause
+// virtual_clock::CloseTimer
 //
-// Determines if the service can be paused
+// Cancels and releases a timer
+//
+// Arguments:
+//
+//	timer		- Timer returned from CreateTimer
 
-bool service_harness::getCanPause(void)
+void virtual_clock::CloseTimer(void* timer)
 {
-	std::lock_guard<std::mutex> critsec(m_statuslock);
+	CancelTimer(timer);
 
-	// If the service is not running, it cannot be controlled at all
-	if(!m_mainthread.joinable()) return false;
+	std::lock_guard<std::mutex> critsec(m_lock);
+	virtual_clock::timer* vtimer = reinterpret_cast<virtual_clock::timer*>(timer);
 
-	// The service can be paused if it's in a RUNNING state and accepts the control
-	return ((static_cast<ServiceStatus>(m_status.dwCurrentState) == ServiceStatus::Running) && 
-		ServiceControlAccepted(ServiceControl::Pause, m_status.dwControlsAccepted));
+	m_timers.erase(std::remove(m_timers.begin(), m_timers.end(), vtimer), m_timers.end());
+	delete vtimer;
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::getCanStop
+// virtual_clock::CreateTimer
 //
-// Determines if the service can be stopped
+// Creates a one-shot virtual timer
+//
+// Arguments:
+//
+//	callback	- Function to invoke when the timer fires
+//	environ		- Ignored; virtual timers fire on the thread advancing the clock
 
-bool service_harness::getCanStop(void)
+void* virtual_clock::CreateTimer(std::function<void(void)> callback, PTP_CALLBACK_ENVIRON environ)
 {
-	std::lock_guard<std::mutex> critsec(m_statuslock);
+	UNREFERENCED_PARAMETER(environ);
 
-	// If the service is not running, it cannot be controlled at all
-	if(!m_mainthread.joinable()) return false;
+	std::lock_guard<std::mutex> critsec(m_lock);
 
-	// The service can be stopped if it's not in a STOPPED or STOP_PENDING state and accepts the control
-	return ((static_cast<ServiceStatus>(m_status.dwCurrentState) != ServiceStatus::Stopped) && 
-		(static_cast<ServiceStatus>(m_status.dwCurrentState) != ServiceStatus::StopPending) &&
-		ServiceControlAccepted(ServiceControl::Stop, m_status.dwControlsAccepted));
+	std::unique_ptr<timer> vtimer = std::make_unique<timer>();
+	vtimer->callback = std::move(callback);
+	vtimer->due = 0;
+	vtimer->sequence = 0;
+	vtimer->armed = false;
+
+	m_timers.push_back(vtimer.get());
+	return vtimer.release();
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::Pause
+// virtual_clock::FireTimers (private)
 //
-// Sends SERVICE_CONTROL_PAUSE to the service, throws an exception if the
-// service does not accept the control or stops prematurely
+// Fires all timers that have become due ordered by due time and start sequence;
+// the lock is released while each callback is executing
 //
 // Arguments:
 //
-//	NONE
+//	lock		- Lock held on m_lock
 
-void service_harness::Pause(void)
+void virtual_clock::FireTimers(std::unique_lock<std::mutex>& lock)
 {
-	DWORD result = SendControl(ServiceControl::Pause);
-	if(result != ERROR_SUCCESS) throw winexception(result);
+	while(true) {
 
-	WaitForStatus(ServiceStatus::Paused);
+		// Locate the next timer that has become due
+		timer* next = nullptr;
+		for(timer* t : m_timers) {
+
+			if(!t->armed || (t->due > m_now)) continue;
+			if((next == nullptr) || (t->due < next->due) || ((t->due == next->due) && (t->sequence < next->sequence))) next = t;
+		}
+
+		if(next == nullptr) return;
+
+		// Disarm the timer and invoke the callback without holding the lock
+		next->armed = false;
+		m_firing = next;
+		m_firingthread = GetCurrentThreadId();
+
+		lock.unlock();
+		try { next->callback(); } catch(...) { /* timer callbacks are not expected to throw */ }
+		lock.lock();
+
+		m_firing = nullptr;
+		m_firingthread = 0;
+		m_changed.notify_all();
+	}
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::RegisterHandlerFunc (private)
+// virtual_clock::Idle (private)
 //
-// Function invoked by the service to register it's control handler
+// Determines if every participant other than the calling thread is waiting on the clock
 //
 // Arguments:
 //
-//	servicename		- Name assigned to the service instance
-//	handler			- Pointer to the service's HandlerEx() callback
-//	context			- HandlerEx() callback context pointer
+//	NONE
 
-SERVICE_STATUS_HANDLE service_harness::RegisterHandlerFunc(LPCTSTR servicename, LPHANDLER_FUNCTION_EX handler, LPVOID context)
+bool virtual_clock::Idle(void) const
 {
-	assert(handler != nullptr);
-	UNREFERENCED_PARAMETER(servicename);
+	DWORD threadid = GetCurrentThreadId();
 
-	m_handler = handler;					// Store the handler function pointer
-	m_context = context;					// Store the handler context pointer
+	for(const auto& iterator : m_participants)
+		if((iterator.first != threadid) && (iterator.second == 0)) return false;
 
-	// Return the address of this harness instance as a pseudo SERVICE_STATUS_HANDLE for the service
-	return reinterpret_cast<SERVICE_STATUS_HANDLE>(this);
+	return true;
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::SendControl
-//
-// Sends a control to the service
+// virtual_clock::participant Constructor
 //
 // Arguments:
 //
-//	control		- Control to be sent to the service
-//	eventtype	- Specifies a control-specific event type code (uncommon)
-//	eventdata	- Specifies control-specific event data (uncommon)
+//	clock		- Clock to register the calling thread with
 
-DWORD service_harness::SendControl(ServiceControl control, DWORD eventtype, void* eventdata)
+virtual_clock::participant::participant(virtual_clock& clock) : m_clock(clock)
 {
-	std::unique_lock<std::mutex> critsec(m_statuslock);
+	std::lock_guard<std::mutex> critsec(m_clock.m_lock);
+	if(!m_clock.m_participants.emplace(GetCurrentThreadId(), 0).second) throw winexception(ERROR_ALREADY_EXISTS);
+}
 
-	// If the main service thread is not running, that's the same result as SERVICE_STOPPED
-	if(!m_mainthread.joinable()) return ERROR_SERVICE_NOT_ACTIVE;
+//-----------------------------------------------------------------------------
+// virtual_clock::participant Destructor
 
-	// Certain service statuses prevent the service from being controlled at all, see ControlService() on MSDN
-	switch(static_cast<ServiceStatus>(m_status.dwCurrentState)) {
+virtual_clock::participant::~participant()
+{
+	std::lock_guard<std::mutex> critsec(m_clock.m_lock);
+	m_clock.m_participants.erase(GetCurrentThreadId());
 
-		// SERVICE_STOPPED and SERVICE_STOP_PENDING never allow for a new control to be sent
-		case ServiceStatus::Stopped : return ERROR_SERVICE_NOT_ACTIVE;
-		case ServiceStatus::StopPending: return ERROR_SERVICE_CANNOT_ACCEPT_CTRL;
+	// A thread waiting for the participants to be idle may have been waiting on this one
+	m_clock.m_changed.notify_all();
+}
 
-		// SERVICE_START_PENDING only allows SERVICE_CONTROL_STOP
-		case ServiceStatus::StartPending : 
-			if(control != ServiceControl::Stop) return ERROR_SERVICE_CANNOT_ACCEPT_CTRL;
-			// fall-through
+//-----------------------------------------------------------------------------
+// virtual_clock::StartTimer
+//
+// Starts a timer to fire once after the specified interval
+//
+// Arguments:
+//
+//	timer			- Timer returned from CreateTimer
+//	milliseconds	- Interval before the timer fires
 
-		// Check the requested control against the service's current accepted controls mask
-		default: if(!ServiceControlAccepted(control, m_status.dwControlsAccepted)) return ERROR_INVALID_SERVICE_CONTROL;
-	}
+void virtual_clock::StartTimer(void* timer, uint32_t milliseconds)
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+	virtual_clock::timer* vtimer = reinterpret_cast<virtual_clock::timer*>(timer);
 
-	// Unlock the status critical section and invoke the service's handler directly
-	critsec.unlock();
-	return m_handler(static_cast<DWORD>(control), eventtype, eventdata, m_context);
+	vtimer->due = m_now + milliseconds;
+	vtimer->sequence = ++m_sequence;
+	vtimer->armed = true;
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::ServiceControlAccepted (private, static)
+// virtual_clock::WaitFor
 //
-// Checks a ServiceControl against a SERVICE_ACCEPT_XXXX mask
+// Waits on a condition variable until the predicate is satisfied or the virtual
+// timeout has elapsed.  If nothing happens within the idle interval of real time
+// the clock is advanced to the next pending deadline
 //
 // Arguments:
 //
-//	control			- Service control code to be checked
-//	mask			- SERVICE_ACCEPT_XXXX mask to check control against
+//	lock		- Lock held on the condition variable's mutex
+//	condition	- Condition variable to wait on
+//	timeout		- Timeout value in virtual milliseconds, or INFINITE
+//	predicate	- Predicate to be satisfied
 
-bool service_harness::ServiceControlAccepted(ServiceControl control, DWORD mask)
+bool virtual_clock::WaitFor(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, 
+	uint32_t timeout, const std::function<bool(void)>& predicate)
 {
-	switch(control) {
-		
-		case ServiceControl::Stop:					return ((mask & SERVICE_ACCEPT_STOP) == SERVICE_ACCEPT_STOP);
-		case ServiceControl::Pause:					return ((mask & SERVICE_ACCEPT_PAUSE_CONTINUE) == SERVICE_ACCEPT_PAUSE_CONTINUE);
-		case ServiceControl::Continue:				return ((mask & SERVICE_ACCEPT_PAUSE_CONTINUE) == SERVICE_ACCEPT_PAUSE_CONTINUE);
-		case ServiceControl::Interrogate:			return true;
-		case ServiceControl::Shutdown:				return ((mask & SERVICE_ACCEPT_SHUTDOWN) == SERVICE_ACCEPT_SHUTDOWN);
-		case ServiceControl::ParameterChange:		return ((mask & SERVICE_ACCEPT_PARAMCHANGE) == SERVICE_ACCEPT_PARAMCHANGE);
-		case ServiceControl::NetBindAdd:			return ((mask & SERVICE_ACCEPT_NETBINDCHANGE) == SERVICE_ACCEPT_NETBINDCHANGE);
-		case ServiceControl::NetBindRemove:			return ((mask & SERVICE_ACCEPT_NETBINDCHANGE) == SERVICE_ACCEPT_NETBINDCHANGE);
-		case ServiceControl::NetBindEnable:			return ((mask & SERVICE_ACCEPT_NETBINDCHANGE) == SERVICE_ACCEPT_NETBINDCHANGE);
-		case ServiceControl::NetBindDisable:		return ((mask & SERVICE_ACCEPT_NETBINDCHANGE) == SERVICE_ACCEPT_NETBINDCHANGE);
-		case ServiceControl::DeviceEvent:			return false;
-		case ServiceControl::HardwareProfileChange:	return ((mask & SERVICE_ACCEPT_HARDWAREPROFILECHANGE) == SERVICE_ACCEPT_HARDWAREPROFILECHANGE);
-		case ServiceControl::PowerEvent:			return ((mask & SERVICE_ACCEPT_POWEREVENT) == SERVICE_ACCEPT_POWEREVENT);
-		case ServiceControl::SessionChange:			return ((mask & SERVICE_ACCEPT_SESSIONCHANGE) == SERVICE_ACCEPT_SESSIONCHANGE);
-		case ServiceControl::PreShutdown:			return ((mask & SERVICE_ACCEPT_PRESHUTDOWN) == SERVICE_ACCEPT_PRESHUTDOWN);
-		case ServiceControl::TimeChange:			return ((mask & SERVICE_ACCEPT_TIMECHANGE) == SERVICE_ACCEPT_TIMECHANGE);
-		case ServiceControl::TriggerEvent:			return ((mask & SERVICE_ACCEPT_TRIGGEREVENT) == SERVICE_ACCEPT_TRIGGEREVENT);
+	uint64_t deadline = (timeout == INFINITE) ? UINT64_MAX : m_now + timeout;
+
+	// Register the deadline so that other waiters can advance the clock to it; a participant
+	// is idle for as long as it's waiting here
+	std::unique_lock<std::mutex> critsec(m_lock);
+	auto waiter = m_waiters.emplace((timeout == INFINITE) ? UINT64_MAX : deadline, &condition);
+	auto participant = m_participants.find(GetCurrentThreadId());
+	if(participant != m_participants.end()) { ++participant->second; m_changed.notify_all(); }
+	critsec.unlock();
 
-		// Allow any user-defined controls (128-255) to be passed to the service regardless of accept mask		
-		default: return ((static_cast<int>(control) >= 128) && (static_cast<int>(control) <= 255));
+	while(!predicate() && (m_now < deadline)) {
+
+		// Wait for the idle interval of real time for something to happen
+		if(condition.wait_for(lock, std::chrono::milliseconds(m_idleinterval), predicate)) break;
+
+		// Nothing happened; release the caller's lock and advance the virtual time, unless a
+		// participant is still running, in which case this keeps waiting
+		lock.unlock();
+		critsec.lock();
+		if(Idle()) AdvanceToNext(critsec);
+		critsec.unlock();
+		lock.lock();
 	}
+
+	critsec.lock();
+	m_waiters.erase(waiter);
+	if(participant != m_participants.end()) --participant->second;
+	critsec.unlock();
+
+	return predicate();
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::SetStatusFunc (private)
-//
-// Function invoked by the service to report a change in status
+// svctl::worker_group
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// worker_group Constructor
 //
 // Arguments:
 //
-//	handle		- Handle returned by RegisterHandlerFunc
-//	status		- New status being reported by the service
+//	clock		- Clock used for the interruptible sleeps
+//	placement	- Placement policy applied to each worker thread
+//	owner		- Provides the reference to the owner held by each worker
 
-BOOL service_harness::SetStatusFunc(SERVICE_STATUS_HANDLE handle, LPSERVICE_STATUS status)
+worker_group::worker_group(service_clock& clock, const service_placement& placement, owner_func owner) : m_owner(std::move(owner)),
+	m_placement(placement), m_state(std::make_shared<worker_token::stop_state>(clock))
 {
-	std::unique_lock<std::mutex> critsec(m_statuslock);
+}
 
-	// Ensure that the handle provided is actually the address of this harness instance
-	assert(reinterpret_cast<service_harness*>(handle) == this);
-	if(reinterpret_cast<service_harness*>(handle) != this) { SetLastError(ERROR_INVALID_HANDLE); return FALSE; }
+//-----------------------------------------------------------------------------
+// worker_group Destructor
 
-	m_status = *status;						// Copy the new SERVICE_STATUS
-	m_statuschanged.notify_all();			// Notify the status has been changed
+worker_group::~worker_group()
+{
+	// Every worker holds a reference to the owner, so the only one that can still be running
+	// is the calling thread when it released the last reference; it's on the way out
+	try { Join(INFINITE); }
+	catch(...) { /* nothing more can be done */ }
+}
 
-	return TRUE;
-};
+//-----------------------------------------------------------------------------
+// worker_group::getStatistics
+//
+// Gets the join statistics for each worker once the group has been joined
+
+std::vector<worker_statistics> worker_group::getStatistics(void) const
+{
+	std::lock_guard<std::mutex> critsec(m_lock);
+	return m_statistics;
+}
 
 //-----------------------------------------------------------------------------
-// service_harness::Start
+// worker_group::Join
 //
-// Starts the service, specifying an argc/argv style set of command line arguments
+// Requests stop and joins every worker that exits before the deadline; the workers
+// still running are left in the group and are waited for by the next Join()
 //
 // Arguments:
 //
-//	servicename		- Name of the service
-//	argc			- Number of command line arguments
-//	argv			- Array of command line argument strings
+//	timeout		- Maximum time to wait for all of the workers, in milliseconds
 
-void service_harness::Start(const resstring& servicename, int argc, tchar_t** argv)
+bool worker_group::Join(uint32_t timeout)
 {
-	// Construct a vector<> for the arguments starting with the service name
-	std::vector<tstring> argvector { servicename };
+	std::exception_ptr				exception;			// First exception from a worker
+	LARGE_INTEGER					frequency;			// Performance counter frequency
 
-	// Skip argv[0], that becomes the service name which is handled automatically,
-	// this allows the caller to send in the process argc/argv if so inclined
-	for(int index = 1; index < argc; index++) argvector.emplace_back(argv[index]);
+	RequestStop();
+	QueryPerformanceFrequency(&frequency);
 
-	Start(std::move(argvector));
+	std::vector<std::shared_ptr<worker>> workers;
+	{
+		std::lock_guard<std::mutex> critsec(m_lock);
+		workers = m_workers;
+	}
+
+	uint64_t deadline = (timeout == INFINITE) ? UINT64_MAX : GetTickCount64() + timeout;
+	bool joined = true;
+
+	for(auto& worker : workers) {
+
+		// A worker that stops the service itself cannot wait for it's own thread; it's on the
+		// way out and is treated as having exited at the stop request, but stays in the group
+		bool self = (worker->threadid == GetCurrentThreadId());
+
+		// The deadline applies to the group, not to each worker
+		uint64_t now = GetTickCount64();
+		DWORD wait = (deadline == UINT64_MAX) ? INFINITE : (now >= deadline) ? 0 : static_cast<DWORD>(deadline - now);
+		bool exited = !self && (WaitForSingleObject(worker->exited, wait) == WAIT_OBJECT_0);
+
+		std::lock_guard<std::mutex> critsec(m_lock);
+
+		// The statistics are recorded by the first join that reaches the worker
+		if(!worker->reported) {
+
+			LARGE_INTEGER finished = worker->finished;
+			if(!exited) QueryPerformanceCounter(&finished);
+
+			// Workers that exited before the stop request report a join time of zero
+			int64_t elapsed = finished.QuadPart - m_state->requested.QuadPart;
+			uint32_t jointime = (elapsed <= 0) ? 0 : static_cast<uint32_t>(std::min<int64_t>((elapsed * 1000000) / frequency.QuadPart, UINT32_MAX));
+
+			m_statistics.push_back({ worker->name, exited || self, jointime });
+			worker->reported = true;
+		}
+
+		// A worker that has not exited is never detached; another join may have already taken it
+		if(!exited && !self) joined = false;
+		auto found = std::find(m_workers.begin(), m_workers.end(), worker);
+		if(!exited || (found == m_workers.end())) continue;
+
+		WaitForSingleObject(worker->thread, INFINITE);
+		m_workers.erase(found);
+
+		if(worker->exception && !exception) exception = worker->exception;
+	}
+
+	if(exception) std::rethrow_exception(exception);
+	return joined;
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::Start (private)
+// worker_group::Launch
 //
-// Starts the service
+// Starts a new worker thread with the placement and stack reservation of the group
 //
 // Arguments:
 //
-//	argvector		- vector<> of command line argument strings
+//	name		- Name of the worker
+//	func		- Function to execute on the worker thread
 
-void service_harness::Start(std::vector<tstring>&& argvector)
+void worker_group::Launch(const tchar_t* name, worker_func func)
 {
-	using namespace std::placeholders;
+	if(name == nullptr) throw winexception(ERROR_INVALID_PARAMETER);
 
-	// If the main thread has already been created, the service has already been started
-	if(m_mainthread.joinable()) throw winexception(ERROR_SERVICE_ALREADY_RUNNING);
+	std::lock_guard<std::mutex> critsec(m_lock);
 
-	// Always reset the SERVICE_STATUS back to defaults before starting the service
-	zero_init(m_status).dwCurrentState = static_cast<DWORD>(ServiceStatus::Stopped);
+	// Workers cannot be launched once the group has been asked to stop
+	if(worker_token(m_state).StopRequested) throw winexception(ERROR_SERVICE_CANNOT_ACCEPT_CTRL);
 
-	// There is an expectation that argv[0] is set to the service name
-	if((argvector.size() == 0) || (argvector[0].length() == 0)) throw winexception(E_INVALIDARG);
+	std::shared_ptr<worker> entry = std::make_shared<worker>();
+	entry->name = name;
 
-	// Create the main service thread and launch it
-	m_mainthread = std::move(std::thread([=]() {
+	// The thread holds it's own references to the worker and the stop state, and a reference to
+	// the owner so that the group and anything the function refers to outlive the thread
+	std::shared_ptr<worker_token::stop_state> state = m_state;
+	std::shared_ptr<void> owner = (m_owner) ? m_owner() : nullptr;
+	std::unique_ptr<std::function<void(void)>> body = std::make_unique<std::function<void(void)>>(
+		[entry, state, owner, placement = m_placement, func = std::move(func)]() mutable -> void {
 
-		// Move the arguments vector into this thread and convert it into an argv-style 
-		// array of generic text string pointers to pass onto the ServiceMain() function
-		std::vector<tstring> arguments(std::move(argvector));
-		std::vector<tchar_t*> argv;
-		for(const auto& arg: arguments) argv.push_back(const_cast<tchar_t*>(arg.c_str()));
-		argv.push_back(nullptr);
+		// The worker runs with the placement of the service, like the main service thread
+		{
+			placement_scope scope(&placement);
 
-		// Create the context for the service by binding this instance's member functions
-		service_context context = { 
-			ServiceProcessType::Unique,
-			std::bind(&service_harness::RegisterHandlerFunc, this, _1, _2, _3),
-			std::bind(&service_harness::SetStatusFunc, this, _1, _2) 
-		};
+			try { func(worker_token(state)); }
+			catch(...) { entry->exception = std::current_exception(); }
+		}
 
-		// Launch the service with the specified command line arguments and instance context
-		LaunchService(static_cast<int>(argv.size() - 1), argv.data(), context);
-	}));
+		QueryPerformanceCounter(&entry->finished);
+		entry->exited.Set();
 
-	// Wait up to 30 seconds for the service to set SERVICE_START_PENDING
-	if(!WaitForStatus(ServiceStatus::StartPending, 30000)) throw winexception(ERROR_SERVICE_REQUEST_TIMEOUT);
+		// This may release the last reference to the owner, which then joins the group from here
+		owner.reset();
+	});
 
-	// Wait indefinitely for the service to set SERVICE_RUNNING
-	WaitForStatus(ServiceStatus::Running);
+	// std::thread cannot reserve a stack size; the thread owns the body once it has been created
+	entry->thread = CreateThread(nullptr, m_placement.StackSize, [](void* arg) -> DWORD {
+
+		std::unique_ptr<std::function<void(void)>> body(reinterpret_cast<std::function<void(void)>*>(arg));
+		(*body)();
+		return 0;
+
+	}, body.get(), STACK_SIZE_PARAM_IS_A_RESERVATION, &entry->threadid);
+	if(entry->thread == nullptr) throw winexception();
+
+	body.release();
+	m_workers.push_back(std::move(entry));
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::Stop
+// worker_group::RequestStop
 //
-// Sends SERVICE_CONTROL_STOP to the service, throws an exception if the
-// service does not accept the control or stops prematurely
+// Signals the stop token of every worker
 //
 // Arguments:
 //
 //	NONE
 
-void service_harness::Stop(void)
+void worker_group::RequestStop(void)
 {
-	DWORD result = SendControl(ServiceControl::Stop);
-	if(result != ERROR_SUCCESS) throw winexception(result);
+	std::lock_guard<std::mutex> critsec(m_state->lock);
+	if(m_state->stopping) return;
 
-	WaitForStatus(ServiceStatus::Stopped);
+	QueryPerformanceCounter(&m_state->requested);
+	m_state->stopping = true;
+	m_state->stopevent.Set();
+	m_state->condition.notify_all();
 }
 
 //-----------------------------------------------------------------------------
-// service_harness::WaitForStatus
+// svctl::worker_token
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// worker_token::getHandle
 //
-// Waits for the service to reach the specified status
+// Gets a manual reset event that is signaled when stop is requested
+
+HANDLE worker_token::getHandle(void) const
+{
+	return m_state->stopevent;
+}
+
+//-----------------------------------------------------------------------------
+// worker_token::getStopRequested
+//
+// Gets a flag indicating that the worker has been asked to exit
+
+bool worker_token::getStopRequested(void) const
+{
+	std::lock_guard<std::mutex> critsec(m_state->lock);
+	return m_state->stopping;
+}
+
+//-----------------------------------------------------------------------------
+// worker_token::Sleep
+//
+// Waits for the interval on the service clock
 //
 // Arguments:
 //
-//	status		- Service status to wait for
-//	timeout		- Amount of time, in milliseconds, to wait before failing
+//	milliseconds	- Interval to wait, in milliseconds
 
-bool service_harness::WaitForStatus(ServiceStatus status, uint32_t timeout)
+bool worker_token::Sleep(uint32_t milliseconds) const
 {
-	std::unique_lock<std::mutex> critsec(m_statuslock);
+	std::unique_lock<std::mutex> critsec(m_state->lock);
+	return !m_state->clock.WaitFor(critsec, m_state->condition, milliseconds, [&]() -> bool { return m_state->stopping; });
+}
 
-	// Wait for the condition variable to be trigged with the service status caller is looking for, or if
-	// the service has stopped unexpectedly due to an unhandled exception caught in ServiceMain()
-	bool result = m_statuschanged.wait_until(critsec, std::chrono::system_clock::now() + std::chrono::milliseconds(timeout), [=]() 
-	{ 
-		return (static_cast<ServiceStatus>(m_status.dwCurrentState) == status) || 
-			((static_cast<ServiceStatus>(m_status.dwCurrentState) == ServiceStatus::Stopped) && (m_status.dwWin32ExitCode != ERROR_SUCCESS)); 
-	});
+//-----------------------------------------------------------------------------
+// worker_token::Wait
+//
+// Waits for an object to be signaled or for stop to be requested
+//
+// Arguments:
+//
+//	handle			- Object to wait on
+//	timeout			- Maximum time to wait, in milliseconds
 
-	// If the service has stopped (regardless of the reason), wait for the main thread to terminate
-	if((static_cast<ServiceStatus>(m_status.dwCurrentState) == ServiceStatus::Stopped) && (m_mainthread.joinable())) m_mainthread.join();
+bool worker_token::Wait(HANDLE handle, uint32_t timeout) const
+{
+	HANDLE handles[] = { m_state->stopevent, handle };
 
-	// If an error was generated by the service, throw that as an exception to the caller
-	if(m_status.dwWin32ExitCode != ERROR_SUCCESS) throw winexception(m_status.dwWin32ExitCode);
+	// The stop event is first so that it wins when both objects are signaled
+	DWORD result = WaitForMultipleObjects(2, handles, FALSE, timeout);
+	if(result == WAIT_FAILED) throw winexception();
 
-	return result;
+	return (result == WAIT_OBJECT_0 + 1);
 }
 
 //-----------------------------------------------------------------------------
@@ -995,6 +7966,9 @@ int ServiceTable::Dispatch(void)
 
 		const svctl::service_table_entry& entry = vector::at(index);
 		table.push_back( { const_cast<LPTSTR>(entry.Name), entry.ServiceMain } );
+
+		// ServiceMain only receives the service name; it looks the placement up from the table
+		svctl::placement_table::Instance().Add(entry.Name, entry.Placement);
 	}
 
 	table.push_back( { nullptr, nullptr } );		// Table needs to end with NULLs
@@ -1006,4 +7980,20 @@ int ServiceTable::Dispatch(void)
 }
 
 //-----------------------------------------------------------------------------
+// ServiceTable::DispatchLocal
+//
+// Hosts the collection of services without the service control manager
+//
+// Arguments:
+//
+//	pipename		- Name of the pipe to accept control requests on
+
+int ServiceTable::DispatchLocal(const svctl::tchar_t* pipename)
+{
+	// Like Dispatch(), this returns once all of the services have stopped
+	try { return svctl::local_control_manager(pipename, *this).Run(); }
+	catch(svctl::winexception& ex) { return static_cast<int>(ex.code()); }
+}
+
+//-----------------------------------------------------------------------------
 
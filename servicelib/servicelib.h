@@ -24,20 +24,39 @@
 #define __SERVICELIB_H_
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <future>
 #include <map>
 #include <memory>
+#include <memory_resource>
 #include <mutex>
+#include <random>
 #include <exception>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 #include <assert.h>
 #include <stdint.h>
+#include <malloc.h>
 #include <tchar.h>
+
+// winsock2.h has to be included before Windows.h, which otherwise includes the conflicting
+// winsock.h declarations unless WIN32_LEAN_AND_MEAN has been defined
+#if defined(_WINSOCKAPI_) && !defined(_WINSOCK2API_)
+#error servicelib.h requires winsock2.h; include it before Windows.h or define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <winsock2.h>
 #include <Windows.h>
+#include <ws2ipdef.h>
+#include <iphlpapi.h>
+#include <psapi.h>
+#include <sddl.h>
+#include <wtsapi32.h>
 
 #pragma warning(push, 4)
 
@@ -69,6 +88,7 @@ enum class ServiceControl
 	PreShutdown					= SERVICE_CONTROL_PRESHUTDOWN,
 	TimeChange					= SERVICE_CONTROL_TIMECHANGE,
 	TriggerEvent				= SERVICE_CONTROL_TRIGGEREVENT,
+	MemoryPressure				= 0x00010000,		// Generated by the library, see svctl::memory_pressure_source
 };
 
 // ::ServiceErrorControl
@@ -82,6 +102,16 @@ enum class ServiceErrorControl
 	Critical					= SERVICE_ERROR_CRITICAL,
 };
 
+// ::ServiceMemoryPressure
+//
+// Strongly typed enumeration of the levels delivered with ServiceControl::MemoryPressure
+enum class ServiceMemoryPressure
+{
+	Normal						= 0,
+	Moderate					= 1,
+	Critical					= 2,
+};
+
 // ::ServiceProcessType (Bitmask)
 //
 // Strongly typed enumeration of service process type flags
@@ -185,6 +215,26 @@ namespace svctl {
 	}
 #endif
 
+	// svctl::memory_pressure_source, svctl::service, svctl::service_context, svctl::service_harness,
+	// svctl::shutdown_coordinator
+	//
+	// Forward declarations
+	class memory_pressure_source;
+	class service;
+	struct service_context;
+	class service_harness;
+	class shutdown_coordinator;
+
+	// svctl::dispatch_control_func
+	//
+	// Function used to deliver a control through the control handler registered by a service
+	typedef std::function<DWORD(DWORD control, DWORD eventtype, void* eventdata)> dispatch_control_func;
+
+	// svctl::local_main_func
+	//
+	// Function used to launch a service with a specific service_context
+	typedef void(*local_main_func)(DWORD argc, LPTSTR* argv, const service_context& context);
+
 	// svctl::register_handler_func
 	//
 	// Function used to register a service's control handler callback function
@@ -213,11 +263,26 @@ namespace svctl {
 	// Global Functions
 	//
 
+	// svctl::GetServiceAsyncStatus
+	//
+	// Reads the AsyncStatus flag from the service's Parameters registry key
+	bool GetServiceAsyncStatus(const tchar_t* name);
+
+	// svctl::GetServiceProcessId
+	//
+	// Gets the identifier of the process hosting a running service from the service control manager
+	DWORD GetServiceProcessId(const tchar_t* name);
+
 	// svctl::GetServiceProcessType
 	//
 	// Reads the service process type bitmask from the registry
 	ServiceProcessType GetServiceProcessType(const tchar_t* name);
 
+	// svctl::RelativeFileTime
+	//
+	// Converts a millisecond interval into a relative thread pool timer due time
+	FILETIME RelativeFileTime(uint32_t milliseconds);
+
 	//
 	// Exception Classes
 	//
@@ -337,6 +402,221 @@ namespace svctl {
 		HANDLE m_handle;
 	};
 
+	// svctl::service_clock
+	//
+	// Interface to the clock used for library timers and timed waits
+	class __declspec(novtable) service_clock
+	{
+	public:
+
+		// Destructor
+		virtual ~service_clock()=default;
+
+		// CancelTimer
+		//
+		// Cancels a timer and waits for any running callback to complete
+		virtual void CancelTimer(void* timer) = 0;
+
+		// CloseTimer
+		//
+		// Cancels and releases a timer created by CreateTimer
+		virtual void CloseTimer(void* timer) = 0;
+
+		// CreateTimer
+		//
+		// Creates a one-shot timer that invokes the specified callback
+		virtual void* CreateTimer(std::function<void(void)> callback, PTP_CALLBACK_ENVIRON environ) = 0;
+
+		// Now
+		//
+		// Gets the current clock time in milliseconds
+		virtual uint64_t Now(void) = 0;
+
+		// StartTimer
+		//
+		// Starts (or restarts) a timer to fire once after the specified interval
+		virtual void StartTimer(void* timer, uint32_t milliseconds) = 0;
+
+		// WaitFor
+		//
+		// Waits on a condition variable until the predicate is satisfied or the timeout
+		// has elapsed; returns the final result of the predicate
+		virtual bool WaitFor(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, 
+			uint32_t timeout, const std::function<bool(void)>& predicate) = 0;
+	};
+
+	// svctl::realtime_clock
+	//
+	// Implements service_clock with the system tick count and thread pool timers
+	class realtime_clock : public service_clock
+	{
+	public:
+
+		// Constructor / Destructor
+		realtime_clock()=default;
+		virtual ~realtime_clock()=default;
+
+		// service_clock implementation
+		virtual void CancelTimer(void* timer);
+		virtual void CloseTimer(void* timer);
+		virtual void* CreateTimer(std::function<void(void)> callback, PTP_CALLBACK_ENVIRON environ);
+		virtual uint64_t Now(void);
+		virtual void StartTimer(void* timer, uint32_t milliseconds);
+		virtual bool WaitFor(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, 
+			uint32_t timeout, const std::function<bool(void)>& predicate);
+
+		// Instance (static)
+		//
+		// Gets the process-wide realtime_clock instance
+		static realtime_clock& Instance(void);
+
+	private:
+
+		realtime_clock(const realtime_clock&)=delete;
+		realtime_clock& operator=(const realtime_clock&)=delete;
+	};
+
+	// svctl::virtual_clock
+	//
+	// Implements a deterministic service_clock; time only moves when advanced explicitly
+	// or when a thread waiting on the clock has observed no activity for the idle interval.
+	// Threads can register as participants, the clock is then only advanced while every
+	// participant other than the advancing thread is waiting on the clock
+	class virtual_clock : public service_clock
+	{
+	public:
+
+		// Constructors / Destructor
+		virtual_clock() : virtual_clock(DEFAULT_IDLE_INTERVAL) {}
+		explicit virtual_clock(uint32_t idleinterval) : m_idleinterval(idleinterval) {}
+		virtual ~virtual_clock();
+
+		// participant
+		//
+		// Registers the calling thread as a participant for as long as the scope is alive
+		class participant
+		{
+		public:
+
+			// Constructor / Destructor
+			explicit participant(virtual_clock& clock);
+			~participant();
+
+		private:
+
+			participant(const participant&)=delete;
+			participant& operator=(const participant&)=delete;
+
+			// m_clock
+			//
+			// Clock the thread is registered with
+			virtual_clock& m_clock;
+		};
+
+		// Advance
+		//
+		// Advances the clock by the specified interval, firing timers in order
+		void Advance(uint32_t milliseconds);
+
+		// AdvanceToNext
+		//
+		// Waits for the participants to be idle and advances the clock to the next timer or
+		// wait deadline; returns false if none
+		bool AdvanceToNext(void);
+
+		// service_clock implementation
+		virtual void CancelTimer(void* timer);
+		virtual void CloseTimer(void* timer);
+		virtual void* CreateTimer(std::function<void(void)> callback, PTP_CALLBACK_ENVIRON environ);
+		virtual uint64_t Now(void) { return m_now; }
+		virtual void StartTimer(void* timer, uint32_t milliseconds);
+		virtual bool WaitFor(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, 
+			uint32_t timeout, const std::function<bool(void)>& predicate);
+
+	private:
+
+		virtual_clock(const virtual_clock&)=delete;
+		virtual_clock& operator=(const virtual_clock&)=delete;
+
+		// DEFAULT_IDLE_INTERVAL
+		//
+		// Real time, in milliseconds, a waiter must be idle before advancing the clock
+		static const uint32_t DEFAULT_IDLE_INTERVAL = 1;
+
+		// timer
+		//
+		// Virtual timer object; ordered by due time and then by start sequence
+		struct timer
+		{
+			std::function<void(void)>	callback;
+			uint64_t					due;
+			uint64_t					sequence;
+			bool						armed;
+		};
+
+		// AdvanceToNext
+		//
+		// Advances the clock to the next timer or wait deadline; lock must be held
+		bool AdvanceToNext(std::unique_lock<std::mutex>& lock);
+
+		// FireTimers
+		//
+		// Fires all timers that have become due, in order; lock must be held
+		void FireTimers(std::unique_lock<std::mutex>& lock);
+
+		// Idle
+		//
+		// Determines if every participant other than the calling thread is waiting on the clock;
+		// lock must be held
+		bool Idle(void) const;
+
+		// m_changed
+		//
+		// Condition variable signaled when a timer callback has completed or a participant is waiting
+		std::condition_variable m_changed;
+
+		// m_firing
+		//
+		// Timer whose callback is currently executing and the executing thread
+		timer* m_firing = nullptr;
+		DWORD m_firingthread = 0;
+
+		// m_idleinterval
+		//
+		// Real time, in milliseconds, a waiter must be idle before advancing the clock
+		const uint32_t m_idleinterval;
+
+		// m_lock
+		//
+		// Synchronization object for the timer and waiter collections
+		std::mutex m_lock;
+
+		// m_now
+		//
+		// Current virtual time, in milliseconds
+		std::atomic<uint64_t> m_now { 0 };
+
+		// m_participants
+		//
+		// Registered participant threads and the number of waits each has in progress
+		std::map<DWORD, uint32_t> m_participants;
+
+		// m_sequence
+		//
+		// Sequence counter used to order timers with identical due times
+		uint64_t m_sequence = 0;
+
+		// m_timers
+		//
+		// Collection of timers created against this clock
+		std::vector<timer*> m_timers;
+
+		// m_waiters
+		//
+		// Collection of waiter deadlines and their condition variables
+		std::multimap<uint64_t, std::condition_variable*> m_waiters;
+	};
+
 	// svctl::zero_init
 	//
 	// Handy little wrapper around memset to zero-initialize a structure
@@ -362,22 +642,39 @@ namespace svctl {
 		// Invokes the control handler
 		virtual DWORD Invoke(void* instance, DWORD eventtype, void* eventdata) const = 0;
 
+		// Budget
+		//
+		// Gets the number of milliseconds the handler is expected to complete in, INFINITE if not monitored
+		__declspec(property(get=getBudget)) uint32_t Budget;
+		uint32_t getBudget(void) const { return m_budget; }
+
 		// Control
 		//
 		// Gets the control code registered for this handler
 		__declspec(property(get=getControl)) ServiceControl Control;
 		ServiceControl getControl(void) const { return m_control; }
 
+		// HasPayload
+		//
+		// Determines if the handler accepts request/reply payloads from a control_channel
+		__declspec(property(get=getHasPayload)) bool HasPayload;
+		virtual bool getHasPayload(void) const { return false; }
+
 	protected:
 
 		// Constructor
-		control_handler(ServiceControl control) : m_control(control) {}
+		control_handler(ServiceControl control, uint32_t budget = INFINITE) : m_control(control), m_budget(budget) {}
 
 	private:
 
 		control_handler(const control_handler&)=delete;
 		control_handler& operator=(const control_handler&)=delete;
 
+		// m_budget
+		//
+		// Latency budget of the handler in milliseconds
+		const uint32_t m_budget;
+
 		// m_control
 		//
 		// ServiceControl code registered for this handler
@@ -390,11 +687,307 @@ namespace svctl {
 	// as a vector of unique pointers to control_handler instances ...
 	typedef std::vector<std::unique_ptr<svctl::control_handler>> control_handler_table;
 
+	// svctl::dynamic_handler_table
+	//
+	// Snapshot of the control handlers registered with a service instance at runtime; handlers
+	// are shared between the snapshots that contain them
+	typedef std::vector<std::shared_ptr<svctl::control_handler>> dynamic_handler_table;
+
+	// svctl::function_control_handler
+	//
+	// Control handler that invokes a function object; used to register handlers at runtime
+	class function_control_handler : public control_handler
+	{
+	public:
+
+		// handler_func
+		//
+		// Function invoked for the control, returns the control result
+		typedef std::function<DWORD(DWORD eventtype, void* eventdata)> handler_func;
+
+		// Constructor / Destructor
+		function_control_handler(ServiceControl control, handler_func func, uint32_t budget = INFINITE) : control_handler(control, budget), m_func(std::move(func)) {}
+		virtual ~function_control_handler()=default;
+
+		// Invoke (control_handler)
+		//
+		// Invokes the handler function
+		virtual DWORD Invoke(void* instance, DWORD eventtype, void* eventdata) const
+		{
+			UNREFERENCED_PARAMETER(instance);
+			return m_func(eventtype, eventdata);
+		}
+
+	private:
+
+		function_control_handler(const function_control_handler&)=delete;
+		function_control_handler& operator=(const function_control_handler&)=delete;
+
+		// m_func
+		//
+		// Handler function
+		const handler_func m_func;
+	};
+
+	// svctl::handler_stall
+	//
+	// Describes a control handler that has overrun it's latency budget
+	struct handler_stall
+	{
+		ServiceControl			Control;		// Control being handled
+		uint32_t				Budget;			// Latency budget of the handler, in milliseconds
+		uint32_t				Elapsed;		// Milliseconds the handler had been running when detected
+		DWORD					ThreadId;		// Identifier of the thread running the handler
+		std::vector<uintptr_t>	Stack;			// Return addresses on the handler thread, innermost first
+	};
+
+	// svctl::handler_watchdog
+	//
+	// Detects control handlers that overrun their latency budget.  A handler is watched for as long as
+	// a scope is alive; a single timer on the service clock fires at the earliest deadline and reports
+	// each overrun once, with the stack of the handler thread, from the thread pool
+	class handler_watchdog
+	{
+	public:
+
+		// stall_func
+		//
+		// Function invoked when a handler overruns it's budget
+		typedef std::function<void(const handler_stall& stall)> stall_func;
+
+		// Constructor / Destructor
+		handler_watchdog(service_clock& clock, PTP_CALLBACK_ENVIRON environ, stall_func func);
+		~handler_watchdog();
+
+		// scope
+		//
+		// Watches the calling thread while it runs a control handler; no-op if the budget is INFINITE
+		class scope
+		{
+		public:
+
+			// Constructor / Destructor
+			scope(handler_watchdog* watchdog, ServiceControl control, uint32_t budget);
+			~scope();
+
+		private:
+
+			scope(const scope&)=delete;
+			scope& operator=(const scope&)=delete;
+
+			// m_cookie
+			//
+			// Identifies the watch entry
+			uint64_t m_cookie = 0;
+
+			// m_watchdog
+			//
+			// Watchdog the scope is registered with; null if not watched
+			handler_watchdog* m_watchdog = nullptr;
+		};
+
+		// MAX_FRAMES
+		//
+		// Maximum number of return addresses captured from a stalled handler thread
+		static const size_t MAX_FRAMES = 64;
+
+		// MAX_STACK_BYTES
+		//
+		// Maximum number of bytes copied from the stack of a stalled handler thread
+		static const size_t MAX_STACK_BYTES = 64 * 1024;
+
+		// Stalls
+		//
+		// Gets the number of handler overruns that have been detected
+		__declspec(property(get=getStalls)) uint32_t Stalls;
+		uint32_t getStalls(void) const { return m_stalls; }
+
+	private:
+
+		handler_watchdog(const handler_watchdog&)=delete;
+		handler_watchdog& operator=(const handler_watchdog&)=delete;
+
+		// watch
+		//
+		// Handler being watched
+		struct watch
+		{
+			uint64_t				cookie;				// Identifies the entry
+			ServiceControl			control;			// Control being handled
+			uint32_t				budget;				// Latency budget, in milliseconds
+			uint64_t				started;			// Clock time the handler was invoked
+			DWORD					threadid;			// Thread running the handler
+			bool					reported;			// Flag indicating the overrun was reported
+		};
+
+		// CaptureStack (static)
+		//
+		// Captures the return addresses of a thread
+		static void CaptureStack(DWORD threadid, std::vector<uintptr_t>& stack);
+
+		// WalkStack (static)
+		//
+		// Unwinds a copy of a thread stack into an array of return addresses
+		static size_t WalkStack(CONTEXT& context, uintptr_t stackbase, uint8_t* copy, size_t length, uintptr_t* frames, size_t maxframes);
+
+		// Check
+		//
+		// Timer callback; reports the overdue handlers and restarts the timer
+		void Check(void);
+
+		// Schedule
+		//
+		// Starts the timer for the earliest unreported deadline; lock must be held
+		void Schedule(void);
+
+		// m_clock
+		//
+		// Clock used for the deadlines and the timer
+		service_clock& m_clock;
+
+		// m_func
+		//
+		// Function invoked for each overrun
+		stall_func m_func;
+
+		// m_lock
+		//
+		// Synchronization object
+		std::mutex m_lock;
+
+		// m_nextcookie
+		//
+		// Next watch entry identifier
+		uint64_t m_nextcookie = 1;
+
+		// m_stalls
+		//
+		// Number of overruns detected
+		std::atomic<uint32_t> m_stalls { 0 };
+
+		// m_timer
+		//
+		// Timer that fires at the earliest deadline
+		void* m_timer;
+
+		// m_watches
+		//
+		// Handlers being watched
+		std::vector<watch> m_watches;
+	};
+
+	// svctl::service_placement
+	//
+	// Processor affinity, NUMA node, priority and stack size for the threads that run a service
+	struct service_placement
+	{
+		// ANY_NODE
+		//
+		// Indicates that the service is not bound to a NUMA node
+		static const USHORT ANY_NODE = 0xFFFF;
+
+		// INHERIT_PRIORITY
+		//
+		// Indicates that the priority of the thread is left unchanged
+		static const int INHERIT_PRIORITY = THREAD_PRIORITY_ERROR_RETURN;
+
+		// Affinity
+		//
+		// Processor group and affinity mask; a zero mask does not restrict the processors
+		GROUP_AFFINITY Affinity = {};
+
+		// NumaNode
+		//
+		// NUMA node to run the service on when no affinity mask has been specified
+		USHORT NumaNode = ANY_NODE;
+
+		// Priority
+		//
+		// THREAD_PRIORITY_XXXX value applied to the service threads
+		int Priority = INHERIT_PRIORITY;
+
+		// StackSize
+		//
+		// Stack reservation for the main service thread and the worker threads, zero for the default
+		size_t StackSize = 0;
+	};
+
+	// svctl::placement_scope
+	//
+	// Applies a service_placement to the calling thread; the previous affinity and
+	// priority of the thread are restored when the scope is destroyed
+	class placement_scope
+	{
+	public:
+
+		// Instance Constructor
+		explicit placement_scope(const service_placement* placement);
+
+		// Destructor
+		~placement_scope();
+
+	private:
+
+		placement_scope(const placement_scope&)=delete;
+		placement_scope& operator=(const placement_scope&)=delete;
+
+		// m_affinity
+		//
+		// Previous affinity of the thread; zero mask if it was not changed
+		GROUP_AFFINITY m_affinity = {};
+
+		// m_priority
+		//
+		// Previous priority of the thread; INHERIT_PRIORITY if it was not changed
+		int m_priority = service_placement::INHERIT_PRIORITY;
+	};
+
+	// svctl::placement_table
+	//
+	// Process-wide table of the placements declared in a dispatched service table; the
+	// service control manager only provides ServiceMain with the name of the service
+	class placement_table
+	{
+	public:
+
+		// Add
+		//
+		// Adds or replaces the placement for a service
+		void Add(const tchar_t* servicename, const service_placement& placement);
+
+		// Find
+		//
+		// Retrieves the placement for a service; returns false if there is none
+		bool Find(const tchar_t* servicename, service_placement& placement);
+
+		// Instance (static)
+		//
+		// Gets the process-wide placement table
+		static placement_table& Instance(void);
+
+	private:
+
+		placement_table()=default;
+		placement_table(const placement_table&)=delete;
+		placement_table& operator=(const placement_table&)=delete;
+
+		// m_lock
+		//
+		// Synchronization object for the table
+		std::mutex m_lock;
+
+		// m_placements
+		//
+		// Service names and their placements; names are compared without case
+		std::vector<std::pair<tstring, service_placement>> m_placements;
+	};
+
 	// svctl::service_table_entry
 	//
 	// Defines a name and entry point for Service-derived class
 	class service_table_entry
 	{
+	friend class service_table_shards;
 	public:
 
 		// Copy Constructor
@@ -406,12 +999,24 @@ namespace svctl {
 		// SERVICE_TABLE_ENTRY typecasting operator
 		operator SERVICE_TABLE_ENTRY() const { return { const_cast<tchar_t*>(m_name.c_str()), m_servicemain }; }
 
+		// LocalMain
+		//
+		// Gets the address of the service::LocalMain function, if available
+		__declspec(property(get=getLocalMain)) const local_main_func LocalMain;
+		const local_main_func getLocalMain(void) const { return m_localmain; }
+
 		// Name
 		//
 		// Gets the service name
 		__declspec(property(get=getName)) const tchar_t* Name;
 		const tchar_t* getName(void) const { return m_name.c_str(); }
 
+		// Placement
+		//
+		// Gets the placement policy for the service threads
+		__declspec(property(get=getPlacement)) const service_placement& Placement;
+		const service_placement& getPlacement(void) const { return m_placement; }
+
 		// ServiceMain
 		//
 		// Gets the address of the service::ServiceMain function
@@ -421,64 +1026,2859 @@ namespace svctl {
 	protected:
 
 		// Instance constructors
-		service_table_entry(tstring name, const LPSERVICE_MAIN_FUNCTION servicemain) : 
-			m_name(name), m_servicemain(servicemain) {}
+		service_table_entry(tstring name, const LPSERVICE_MAIN_FUNCTION servicemain, const local_main_func localmain = nullptr, 
+			const service_placement& placement = service_placement()) : m_name(name), m_servicemain(servicemain), m_localmain(localmain), m_placement(placement) {}
 
 	private:
 
+		// m_localmain
+		//
+		// The service LocalMain() static entry point
+		local_main_func m_localmain;
+
 		// m_name
 		//
 		// The service name
 		tstring m_name;
 
+		// m_placement
+		//
+		// Placement policy for the service threads
+		service_placement m_placement;
+
 		// m_servicemain
 		//
 		// The service ServiceMain() static entry point
 		LPSERVICE_MAIN_FUNCTION m_servicemain;
 	};
 
-	// svctl::service_context
+	// svctl::service_table_shards
 	//
-	// Service runtime context information provided to ServiceMain to
-	// allow for differences in service vs. local application model
-	struct service_context
+	// Defines N instances of the same Service-derived class hosted in one process; the
+	// instances are named name@0 through name@N-1 and each is placed on it's own processor
+	class service_table_shards
 	{
-		// ProcessType
+	public:
+
+		// Copy Constructor
+		service_table_shards(const service_table_shards&)=default;
+
+		// Assignment Operator
+		service_table_shards& operator=(const service_table_shards&)=default;
+
+		// begin / end
 		//
-		// Defines the service process type (unique/shared)
-		ServiceProcessType ProcessType;
+		// Iterates over the service table entries for the shards
+		std::vector<service_table_entry>::const_iterator begin(void) const { return m_entries.begin(); }
+		std::vector<service_table_entry>::const_iterator end(void) const { return m_entries.end(); }
 
-		// RegisterHandlerFunc
+		// Count
 		//
-		// Function used by the service to register the control handler
-		register_handler_func RegisterHandlerFunc;
+		// Gets the number of shards
+		__declspec(property(get=getCount)) uint32_t Count;
+		uint32_t getCount(void) const { return static_cast<uint32_t>(m_entries.size()); }
 
-		// SetStatusFunc
+		// FindShard (static)
 		//
-		// Function used by the service to set status
-		set_status_func SetStatusFunc;
-	};
+		// Gets the index of a shard from it's name; returns false if the name is not one of the
+		// shard names generated for a sharded entry that has been defined in this process
+		static bool FindShard(const tchar_t* name, uint32_t& shard);
 
-	// svctl::service
-	//
+		// ShardName (static)
+		//
+		// Generates the name of a shard
+		static tstring ShardName(const tchar_t* name, uint32_t shard);
+
+	protected:
+
+		// Instance Constructor
+		service_table_shards(const tstring& name, uint32_t count, const LPSERVICE_MAIN_FUNCTION servicemain, 
+			const local_main_func localmain, const service_placement& placement);
+
+	private:
+
+		// Registry (static)
+		//
+		// Gets the process-wide base names and shard counts of the sharded entries; names are compared without case
+		static std::vector<std::pair<tstring, uint32_t>>& Registry(void);
+
+		// RegistryLock (static)
+		//
+		// Gets the synchronization object for the registry
+		static std::mutex& RegistryLock(void);
+
+		// ShardPlacement (static)
+		//
+		// Selects the processor for a shard from the processors allowed by the placement
+		static service_placement ShardPlacement(const service_placement& placement, uint32_t shard);
+
+		// m_entries
+		//
+		// Service table entry of each shard
+		std::vector<service_table_entry> m_entries;
+	};
+
+	// svctl::service_pool
+	//
+	// Fixed-size Win32 thread pool used to host many service instances without
+	// dedicating any threads to an individual instance
+	class service_pool
+	{
+	public:
+
+		// Instance Constructor
+		explicit service_pool(DWORD threads);
+
+		// Destructor
+		~service_pool();
+
+		// operator PTP_CALLBACK_ENVIRON()
+		//
+		// Converts this instance into a thread pool callback environment pointer
+		operator PTP_CALLBACK_ENVIRON() { return &m_environ; }
+
+	private:
+
+		service_pool(const service_pool&)=delete;
+		service_pool& operator=(const service_pool&)=delete;
+
+		// m_environ
+		//
+		// Callback environment bound to the private thread pool
+		TP_CALLBACK_ENVIRON m_environ;
+
+		// m_pool
+		//
+		// Private thread pool object
+		PTP_POOL m_pool;
+	};
+
+	// svctl::service_context
+	//
+	// Service runtime context information provided to ServiceMain to
+	// allow for differences in service vs. local application model
+	struct service_context
+	{
+		// ProcessType
+		//
+		// Defines the service process type (unique/shared)
+		ServiceProcessType ProcessType;
+
+		// RegisterHandlerFunc
+		//
+		// Function used by the service to register the control handler
+		register_handler_func RegisterHandlerFunc;
+
+		// SetStatusFunc
+		//
+		// Function used by the service to set status
+		set_status_func SetStatusFunc;
+
+		// CallbackEnvironment
+		//
+		// Optional thread pool environment; when set the service is hosted on the pool
+		// and Main() returns as soon as the service has been started
+		PTP_CALLBACK_ENVIRON CallbackEnvironment;
+
+		// Clock
+		//
+		// Optional clock for library timers and timed waits; realtime_clock if not set
+		service_clock* Clock;
+
+		// ShutdownCoordinator
+		//
+		// Optional coordinator that fans shutdown controls out to every service in the process
+		shutdown_coordinator* ShutdownCoordinator;
+
+		// Placement
+		//
+		// Optional placement policy for the main service thread and the library callbacks
+		const service_placement* Placement;
+
+		// AsyncStatus
+		//
+		// Optional flag to deliver status updates from the thread pool with a status_reporter
+		bool AsyncStatus;
+
+		// MemoryPressure
+		//
+		// Optional source of ServiceControl::MemoryPressure notifications
+		memory_pressure_source* MemoryPressure;
+
+		// DispatchControlFunc
+		//
+		// Optional function used to deliver controls that originate in the process, such as memory
+		// pressure and control channel requests, through the wrappers of the registered handler.  Set
+		// by service_recorder and status_publisher; the handler is invoked directly if not set
+		dispatch_control_func DispatchControlFunc;
+	};
+
+	// svctl::trace_record_type
+	//
+	// Type codes for records written to a service trace file
+	enum class trace_record_type : uint8_t
+	{
+		Control		= 1,
+		Status		= 2,
+	};
+
+#pragma pack(push, 1)
+
+	// svctl::trace_header
+	//
+	// Header written at the beginning of a service trace file
+	struct trace_header
+	{
+		uint32_t	magic;				// TRACE_MAGIC
+		uint16_t	version;			// TRACE_VERSION
+		uint16_t	recordsize;			// sizeof(trace_record)
+		uint64_t	starttime;			// UTC FILETIME of the first record
+	};
+
+	// svctl::trace_record
+	//
+	// Fixed-length record written to a service trace file.  Control records store the
+	// event type, handler result and handler latency; Status records store the accepted
+	// controls mask, Win32 exit code and service-specific exit code
+	struct trace_record
+	{
+		trace_record_type	type;		// Record type
+		uint8_t		reserved;			// Reserved; zero
+		uint16_t	checkpoint;			// Status checkpoint (low 16 bits)
+		uint32_t	code;				// Control code or current state
+		uint32_t	data1;				// Event type or controls accepted
+		uint32_t	data2;				// Handler result or Win32 exit code
+		uint32_t	data3;				// Handler latency (microseconds) or service exit code
+		uint64_t	timestamp;			// Microseconds since the start of the trace
+	};
+
+#pragma pack(pop)
+
+	// svctl::service_recorder
+	//
+	// Wraps a service_context to record the controls and status changes reported
+	// for the service into a compact binary trace file
+	class service_recorder
+	{
+	public:
+
+		// Instance Constructor
+		explicit service_recorder(const tchar_t* path);
+
+		// Destructor
+		~service_recorder();
+
+		// Attach
+		//
+		// Creates a recording service_context that wraps the specified context
+		service_context Attach(const service_context& context);
+
+		// FromRegistry (static)
+		//
+		// Creates a recorder if a TraceFile parameter has been set for the service
+		static std::unique_ptr<service_recorder> FromRegistry(const tchar_t* name);
+
+		// TRACE_MAGIC
+		//
+		// Magic number at the start of a trace file ('SVTR')
+		static const uint32_t TRACE_MAGIC = 0x52545653;
+
+		// TRACE_VERSION
+		//
+		// Version of the trace file format
+		static const uint16_t TRACE_VERSION = 2;
+
+	private:
+
+		service_recorder(const service_recorder&)=delete;
+		service_recorder& operator=(const service_recorder&)=delete;
+
+		// FLUSH_THRESHOLD
+		//
+		// Number of buffered records that causes the buffer to be flushed
+		static const size_t FLUSH_THRESHOLD = 64;
+
+		// Elapsed
+		//
+		// Gets the number of microseconds elapsed since the trace was started
+		uint64_t Elapsed(void) const;
+
+		// Flush
+		//
+		// Writes the buffered records to the trace file; lock must be held
+		void Flush(void);
+
+		// HandlerFunc (static)
+		//
+		// HandlerEx callback that records a control before and after forwarding it
+		static DWORD WINAPI HandlerFunc(DWORD control, DWORD eventtype, void* eventdata, void* context);
+
+		// Write
+		//
+		// Adds a record to the trace buffer
+		void Write(const trace_record& record);
+
+		// m_buffer
+		//
+		// Buffered trace records
+		std::vector<trace_record> m_buffer;
+
+		// m_context
+		//
+		// Original HandlerEx context pointer registered by the service
+		void* m_context = nullptr;
+
+		// m_file
+		//
+		// Trace file handle
+		HANDLE m_file;
+
+		// m_frequency
+		//
+		// Performance counter frequency
+		LARGE_INTEGER m_frequency;
+
+		// m_handler
+		//
+		// Original HandlerEx callback registered by the service
+		LPHANDLER_FUNCTION_EX m_handler = nullptr;
+
+		// m_lock
+		//
+		// Synchronization object for the trace buffer
+		std::mutex m_lock;
+
+		// m_start
+		//
+		// Performance counter value at the start of the trace
+		LARGE_INTEGER m_start;
+	};
+
+	// svctl::control_payload
+	//
+	// Request and reply buffers provided as the event data to a payload control handler
+	struct control_payload
+	{
+		// EVENT_TYPE
+		//
+		// Event type that accompanies a control_payload passed as the event data to a control handler;
+		// event data supplied with any other event type is never interpreted as a payload
+		static const DWORD EVENT_TYPE = 0x43435653;
+
+		const void*	Request;				// Request payload bytes
+		size_t		RequestLength;			// Length of the request payload
+		void*		Reply;					// Reply payload buffer
+		size_t		ReplyCapacity;			// Size of the reply payload buffer
+		size_t		ReplyLength;			// Length of the reply written by the handler
+	};
+
+	// svctl::control_channel_layout
+	//
+	// Layout of the shared memory section used by a control channel.  The ring of slots follows the
+	// bounded MPMC queue scheme: a slot is free when it's sequence equals the enqueue position, holds a
+	// published request at position + 1 and is released by the client at position + SLOTS once the
+	// reply has been read.  Each slot carries both the request and the reply payload.  Clients can die
+	// at any point, so a slot claimed but never published is skipped by the service after CLAIM_TIMEOUT
+	// and a reply that is never released is reclaimed by the next client after RELEASE_TIMEOUT
+	struct control_channel_layout
+	{
+		// CLAIM_TIMEOUT
+		//
+		// Time a claimed slot can remain unpublished before the service skips it, in milliseconds
+		static const uint32_t CLAIM_TIMEOUT = 5000;
+
+		// MAGIC
+		//
+		// Magic number at the start of the shared memory section ('SVCC')
+		static const uint32_t MAGIC = 0x43435653;
+
+		// PAYLOAD_MAX
+		//
+		// Maximum length of a request or reply payload
+		static const uint32_t PAYLOAD_MAX = 4064;
+
+		// RELEASE_TIMEOUT
+		//
+		// Time a reply can remain unreleased before another client reclaims the slot, in milliseconds
+		static const uint32_t RELEASE_TIMEOUT = 5000;
+
+		// SLOTS
+		//
+		// Number of request slots in the ring
+		static const uint32_t SLOTS = 16;
+
+		// STATE_XXXX
+		//
+		// Reply state of a published slot
+		static const uint32_t STATE_PENDING = 0;
+		static const uint32_t STATE_REPLIED = 1;
+		static const uint32_t STATE_ABANDONED = 2;
+
+		// header
+		//
+		// Section header; the enqueue and dequeue positions are kept on separate cache lines
+		struct header
+		{
+			uint32_t				magic;			// MAGIC
+			uint32_t				slots;			// SLOTS
+			uint32_t				payloadmax;		// PAYLOAD_MAX
+			uint32_t				reserved;
+			std::atomic<uint32_t>	enqueue;		// Next position claimed by a client
+			uint8_t					padding1[44];
+			std::atomic<uint32_t>	dequeue;		// Next position processed by the service
+			uint8_t					padding2[60];
+		};
+
+		// slot
+		//
+		// Request/reply slot within the ring
+		struct slot
+		{
+			std::atomic<uint32_t>	sequence;		// Slot sequence number
+			std::atomic<uint32_t>	state;			// STATE_XXXX
+			uint32_t				control;		// Control code (128 - 255)
+			uint32_t				result;			// Handler result code
+			uint32_t				requestlength;	// Length of the request payload
+			uint32_t				replylength;	// Length of the reply payload
+			uint64_t				replytime;		// GetTickCount64() when the reply was written
+			uint8_t					reserved[32];
+			uint8_t					request[PAYLOAD_MAX];
+			uint8_t					reply[PAYLOAD_MAX];
+		};
+
+		// ObjectName (static)
+		//
+		// Generates the name of a control channel kernel object for a service instance
+		static tstring ObjectName(const tchar_t* servicename, DWORD processid, const tchar_t* suffix, bool global);
+
+		header	Header;
+		slot	Slots[SLOTS];
+	};
+
+	// svctl::control_channel
+	//
+	// Client side of the shared memory request/reply channel exposed by a running service
+	// that implements payload handlers for custom control codes 128 through 255
+	class control_channel
+	{
+	public:
+
+		// Instance Constructor
+		//
+		// The process identifier selects the service instance; if zero the process hosting the
+		// service is retrieved from the service control manager
+		explicit control_channel(const tchar_t* servicename, DWORD processid = 0);
+
+		// Destructor
+		~control_channel();
+
+		// Send
+		//
+		// Sends a custom control with optional request and reply payloads; returns a status
+		// code from the service handler, ERROR_MORE_DATA if the reply was truncated or 
+		// ERROR_TIMEOUT if the service did not respond in time
+		DWORD Send(uint32_t control, uint32_t timeout = DEFAULT_TIMEOUT) { return Send(control, nullptr, 0, nullptr, 0, nullptr, timeout); }
+		DWORD Send(uint32_t control, const void* request, size_t requestlength, void* reply, size_t replycapacity, 
+			size_t* replylength, uint32_t timeout = DEFAULT_TIMEOUT);
+
+		// DEFAULT_TIMEOUT
+		//
+		// Default time to wait for a free slot and the service reply
+		static const uint32_t DEFAULT_TIMEOUT = 30000;
+
+	private:
+
+		control_channel(const control_channel&)=delete;
+		control_channel& operator=(const control_channel&)=delete;
+
+		// SPIN_COUNT
+		//
+		// Number of spins before a waiting client starts yielding the processor
+		static const uint32_t SPIN_COUNT = 4000;
+
+		// Backoff (static)
+		//
+		// Waits a progressively longer time; returns false if the deadline has passed
+		static bool Backoff(uint32_t iteration, uint64_t deadline);
+
+		// m_event
+		//
+		// Event signaled to wake up the service
+		HANDLE m_event = nullptr;
+
+		// m_layout
+		//
+		// Mapped view of the shared memory section
+		control_channel_layout* m_layout = nullptr;
+
+		// m_mapping
+		//
+		// Shared memory section handle
+		HANDLE m_mapping = nullptr;
+	};
+
+	// svctl::control_channel_host
+	//
+	// Service side of a control channel; dispatches requests from the ring on the thread pool
+	class control_channel_host
+	{
+	public:
+
+		// handler_func
+		//
+		// Function invoked to process a request
+		using handler_func = std::function<DWORD(uint32_t control, control_payload& payload)>;
+
+		// keepalive_func
+		//
+		// Function invoked to hold a reference to the owner while requests are processed
+		using keepalive_func = std::function<std::shared_ptr<void>(void)>;
+
+		// Instance Constructor
+		control_channel_host(const tchar_t* servicename, handler_func handler, keepalive_func keepalive, PTP_CALLBACK_ENVIRON environ);
+
+		// Destructor
+		~control_channel_host();
+
+		// Close
+		//
+		// Stops dispatching requests and waits for any running dispatch to complete
+		void Close(void);
+
+	private:
+
+		control_channel_host(const control_channel_host&)=delete;
+		control_channel_host& operator=(const control_channel_host&)=delete;
+
+		// Dispatching (static)
+		//
+		// Gets the host dispatching requests on the calling thread, if any
+		static const control_channel_host*& Dispatching(void);
+
+		// Drain
+		//
+		// Processes all published requests; returns false if the ring is held up by a slot
+		// that has been claimed by a client but not yet published
+		bool Drain(void);
+
+		// Release
+		//
+		// Releases the kernel objects held by the host
+		void Release(void);
+
+		// WaitCallback (static)
+		//
+		// Thread pool wait callback signaled when a client publishes a request
+		static void CALLBACK WaitCallback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WAIT wait, TP_WAIT_RESULT result);
+
+		// m_closed
+		//
+		// Flag indicating that the channel has been closed
+		std::atomic<bool> m_closed { false };
+
+		// m_event
+		//
+		// Event signaled by clients when a request has been published
+		HANDLE m_event = nullptr;
+
+		// m_handler
+		//
+		// Function invoked to process a request
+		handler_func m_handler;
+
+		// m_keepalive
+		//
+		// Function invoked to hold a reference to the owner during dispatch
+		keepalive_func m_keepalive;
+
+		// m_layout
+		//
+		// Mapped view of the shared memory section
+		control_channel_layout* m_layout = nullptr;
+
+		// m_mapping
+		//
+		// Shared memory section handle
+		HANDLE m_mapping = nullptr;
+
+		// m_stalled
+		//
+		// Position of the unpublished slot holding up the ring
+		uint32_t m_stalled = 0;
+
+		// m_stalledsince
+		//
+		// Tick count when the slot holding up the ring was first seen; zero if not stalled
+		uint64_t m_stalledsince = 0;
+
+		// m_wait
+		//
+		// Thread pool wait object for the request event
+		PTP_WAIT m_wait = nullptr;
+	};
+
+	// svctl::status_snapshot
+	//
+	// Consistent copy of the status and counters published for a service
+	struct status_snapshot
+	{
+		SERVICE_STATUS	Status;				// Last reported service status
+		uint32_t		ProcessId;			// Process hosting the service
+		uint64_t		StartTime;			// UTC FILETIME when the service was started
+		uint64_t		UpdateTime;			// UTC FILETIME of the last update
+		uint64_t		StatusReports;		// Number of successful status reports
+		uint64_t		StatusFailures;		// Number of failed status reports
+		uint64_t		Controls;			// Number of controls received
+		uint64_t		ControlFailures;	// Number of controls that returned an error
+	};
+
+	// svctl::status_page_layout
+	//
+	// Layout of the shared memory status page.  The snapshot is protected by a sequence lock:
+	// the sequence is odd while the publisher is updating it, and readers retry if the sequence
+	// was odd or changed while they were copying the snapshot
+	struct status_page_layout
+	{
+		// MAGIC
+		//
+		// Magic number at the start of the status page ('SVSP')
+		static const uint32_t MAGIC = 0x50535653;
+
+		// VERSION
+		//
+		// Version of the status page layout
+		static const uint32_t VERSION = 1;
+
+		// ObjectName (static)
+		//
+		// Generates the name of the status page section for a service instance
+		static tstring ObjectName(const tchar_t* servicename, DWORD processid, bool global);
+
+		uint32_t				magic;			// MAGIC
+		uint32_t				version;		// VERSION
+		std::atomic<uint32_t>	sequence;		// Sequence lock
+		uint32_t				reserved;
+		status_snapshot			snapshot;		// Published status and counters
+	};
+
+	// svctl::status_publisher
+	//
+	// Wraps a service_context to publish the service status and counters into a shared
+	// memory status page that monitoring tools can read without any IPC
+	class status_publisher
+	{
+	public:
+
+		// Instance Constructor
+		explicit status_publisher(const tchar_t* servicename);
+
+		// Destructor
+		~status_publisher();
+
+		// Attach
+		//
+		// Creates a publishing service_context that wraps the specified context
+		service_context Attach(const service_context& context);
+
+		// TryCreate (static)
+		//
+		// Creates a publisher for the service; returns null if the page could not be created
+		static std::unique_ptr<status_publisher> TryCreate(const tchar_t* servicename);
+
+	private:
+
+		status_publisher(const status_publisher&)=delete;
+		status_publisher& operator=(const status_publisher&)=delete;
+
+		// HandlerFunc (static)
+		//
+		// HandlerEx callback that forwards a control to the service and counts it
+		static DWORD WINAPI HandlerFunc(DWORD control, DWORD eventtype, void* eventdata, void* context);
+
+		// Update
+		//
+		// Applies an update to the snapshot under the sequence lock
+		void Update(const std::function<void(status_snapshot&)>& update);
+
+		// m_context
+		//
+		// Original HandlerEx context pointer registered by the service
+		void* m_context = nullptr;
+
+		// m_handler
+		//
+		// Original HandlerEx callback registered by the service
+		LPHANDLER_FUNCTION_EX m_handler = nullptr;
+
+		// m_layout
+		//
+		// Mapped view of the status page
+		status_page_layout* m_layout = nullptr;
+
+		// m_lock
+		//
+		// Serializes updates to the status page; there can only be one writer
+		std::mutex m_lock;
+
+		// m_mapping
+		//
+		// Status page section handle
+		HANDLE m_mapping = nullptr;
+	};
+
+	// svctl::status_reader
+	//
+	// Reads consistent snapshots from the status page published for a service
+	class status_reader
+	{
+	public:
+
+		// Instance Constructor
+		//
+		// The process identifier selects the service instance; if zero the process hosting the
+		// service is retrieved from the service control manager
+		explicit status_reader(const tchar_t* servicename, DWORD processid = 0);
+
+		// Destructor
+		~status_reader();
+
+		// TryGetSnapshot
+		//
+		// Gets a consistent copy of the published status and counters; returns false if the
+		// publisher did not leave the page consistent within SNAPSHOT_TIMEOUT
+		bool TryGetSnapshot(status_snapshot& snapshot) const;
+
+		// Snapshot
+		//
+		// Gets a consistent copy of the published status and counters; throws ERROR_TIMEOUT
+		// if the publisher did not leave the page consistent within SNAPSHOT_TIMEOUT
+		__declspec(property(get=getSnapshot)) status_snapshot Snapshot;
+		status_snapshot getSnapshot(void) const;
+
+		// SNAPSHOT_TIMEOUT
+		//
+		// Time to wait for a consistent snapshot; a publisher that dies in the middle of an
+		// update leaves the page inconsistent forever
+		static const uint32_t SNAPSHOT_TIMEOUT = 1000;
+
+	private:
+
+		status_reader(const status_reader&)=delete;
+		status_reader& operator=(const status_reader&)=delete;
+
+		// SPIN_COUNT
+		//
+		// Number of retries before a reader starts yielding the processor
+		static const uint32_t SPIN_COUNT = 4000;
+
+		// m_layout
+		//
+		// Read-only view of the status page
+		const status_page_layout* m_layout = nullptr;
+
+		// m_mapping
+		//
+		// Status page section handle
+		HANDLE m_mapping = nullptr;
+	};
+
+	// svctl::status_reporter
+	//
+	// Delivers status updates to the status sink from the thread pool so the service never waits
+	// on it.  The mailbox holds a single status; a status that has not been delivered yet is replaced
+	// by the next one, except that nothing replaces SERVICE_STOPPED once it has been posted
+	class status_reporter
+	{
+	public:
+
+		// Instance Constructor
+		status_reporter(report_status_func sink, PTP_CALLBACK_ENVIRON environ);
+
+		// Destructor
+		~status_reporter();
+
+		// Flush
+		//
+		// Delivers any status that has been posted but not yet delivered, on the calling thread if necessary
+		void Flush(void);
+
+		// Post
+		//
+		// Posts a status update to the mailbox; does not wait for it to be delivered
+		void Post(const SERVICE_STATUS& status);
+
+		// TakeException
+		//
+		// Gets and clears the exception thrown by the status sink, if any
+		std::exception_ptr TakeException(void);
+
+	private:
+
+		status_reporter(const status_reporter&)=delete;
+		status_reporter& operator=(const status_reporter&)=delete;
+
+		// Deliver
+		//
+		// Delivers the status in the mailbox until it is empty
+		void Deliver(void);
+
+		// WorkCallback (static)
+		//
+		// Thread pool callback that delivers the posted status
+		static void CALLBACK WorkCallback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work);
+
+		// m_deliverlock
+		//
+		// Serializes delivery so the sink sees the updates in the order they were posted
+		std::mutex m_deliverlock;
+
+		// m_exception
+		//
+		// Exception thrown by the status sink during delivery
+		std::exception_ptr m_exception;
+
+		// m_lock
+		//
+		// Synchronization object for the mailbox
+		std::mutex m_lock;
+
+		// m_mailbox
+		//
+		// Most recently posted status
+		SERVICE_STATUS m_mailbox;
+
+		// m_pending
+		//
+		// Flag indicating that m_mailbox holds a status that has not been delivered
+		bool m_pending = false;
+
+		// m_scheduled
+		//
+		// Flag indicating that the work callback has been submitted
+		bool m_scheduled = false;
+
+		// m_sink
+		//
+		// Function that reports the status, may block
+		const report_status_func m_sink;
+
+		// m_stopped
+		//
+		// Flag indicating that SERVICE_STOPPED has been posted; later updates are discarded
+		bool m_stopped = false;
+
+		// m_work
+		//
+		// Thread pool work object used to deliver the status
+		PTP_WORK m_work;
+	};
+
+	// svctl::private_heap
+	//
+	// Memory resource backed by a private Win32 heap; anything still allocated from
+	// the heap is released in a single operation when the heap is destroyed
+	class private_heap : public std::pmr::memory_resource
+	{
+	public:
+
+		// Instance Constructor
+		private_heap();
+
+		// Destructor
+		virtual ~private_heap();
+
+		// Compact
+		//
+		// Coalesces the free blocks of the heap and decommits the free pages
+		void Compact(void) { HeapCompact(m_heap, 0); }
+
+		// Allocated
+		//
+		// Gets the number of bytes currently allocated from the heap
+		__declspec(property(get=getAllocated)) size_t Allocated;
+		size_t getAllocated(void) const { return m_allocated; }
+
+		// Allocations
+		//
+		// Gets the number of allocations currently outstanding
+		__declspec(property(get=getAllocations)) size_t Allocations;
+		size_t getAllocations(void) const { return m_allocations; }
+
+		// Peak
+		//
+		// Gets the highest number of bytes allocated from the heap at one time
+		__declspec(property(get=getPeak)) size_t Peak;
+		size_t getPeak(void) const { return m_peak; }
+
+	private:
+
+		private_heap(const private_heap&)=delete;
+		private_heap& operator=(const private_heap&)=delete;
+
+		// do_allocate (std::pmr::memory_resource)
+		//
+		// Allocates memory from the private heap
+		virtual void* do_allocate(size_t bytes, size_t alignment);
+
+		// do_deallocate (std::pmr::memory_resource)
+		//
+		// Releases memory back to the private heap
+		virtual void do_deallocate(void* ptr, size_t bytes, size_t alignment);
+
+		// do_is_equal (std::pmr::memory_resource)
+		//
+		// Compares this memory resource with another memory resource
+		virtual bool do_is_equal(const std::pmr::memory_resource& other) const noexcept;
+
+		// m_allocated
+		//
+		// Number of bytes currently allocated
+		std::atomic<size_t> m_allocated { 0 };
+
+		// m_allocations
+		//
+		// Number of allocations currently outstanding
+		std::atomic<size_t> m_allocations { 0 };
+
+		// m_heap
+		//
+		// Private heap handle
+		HANDLE m_heap;
+
+		// m_peak
+		//
+		// Highest number of bytes allocated at one time
+		std::atomic<size_t> m_peak { 0 };
+	};
+
+	// svctl::service_memory_usage
+	//
+	// Memory accounting for a service instance
+	struct service_memory_usage
+	{
+		size_t		Allocated;			// Bytes currently allocated from the service heap
+		size_t		Allocations;		// Allocations currently outstanding
+		size_t		Peak;				// Highest number of bytes allocated at one time
+	};
+
+	// svctl::service_memory
+	//
+	// Memory resources owned by a service instance: a monotonic arena for initialization data that
+	// lives as long as the service, and a synchronized pool for steady state allocations.  Both draw
+	// from the same private heap, which is destroyed in one step along with the service instance
+	class service_memory
+	{
+	public:
+
+		// Constructor / Destructor
+		service_memory() : m_arena(&m_heap), m_pool(&m_heap) {}
+		~service_memory()=default;
+
+		// Arena
+		//
+		// Gets the monotonic memory resource; memory is only released with the service
+		__declspec(property(get=getArena)) std::pmr::memory_resource* Arena;
+		std::pmr::memory_resource* getArena(void) { return &m_arena; }
+
+		// Compact
+		//
+		// Returns the free pages of the service heap to the system; the arena and the pool still
+		// own the blocks they have carved up, only memory that has been released is affected
+		void Compact(void) { m_heap.Compact(); }
+
+		// Pool
+		//
+		// Gets the pooled memory resource for steady state allocations
+		__declspec(property(get=getPool)) std::pmr::memory_resource* Pool;
+		std::pmr::memory_resource* getPool(void) { return &m_pool; }
+
+		// Usage
+		//
+		// Gets the memory accounting for the service heap
+		__declspec(property(get=getUsage)) service_memory_usage Usage;
+		service_memory_usage getUsage(void) const { return { m_heap.Allocated, m_heap.Allocations, m_heap.Peak }; }
+
+	private:
+
+		service_memory(const service_memory&)=delete;
+		service_memory& operator=(const service_memory&)=delete;
+
+		// Member declaration order matters; the heap must be constructed before and
+		// destroyed after the arena and pool resources that allocate from it
+
+		// m_heap
+		//
+		// Private heap that backs the arena and pool resources
+		private_heap m_heap;
+
+		// m_arena
+		//
+		// Monotonic memory resource
+		std::pmr::monotonic_buffer_resource m_arena;
+
+		// m_pool
+		//
+		// Synchronized pool memory resource
+		std::pmr::synchronized_pool_resource m_pool;
+	};
+
+	// svctl::trim_statistics
+	//
+	// Memory released by the most recent trim of a paused service
+	struct trim_statistics
+	{
+		uint32_t		Trims;				// Number of times the service has been trimmed
+		size_t			WorkingSetBefore;	// Working set of the process before the trim, in bytes
+		size_t			WorkingSetAfter;	// Working set of the process after the trim, in bytes
+		uint32_t		TrimTime;			// Microseconds spent trimming
+	};
+
+	// svctl::memory_trimmer
+	//
+	// Releases memory while a service is paused.  Shrink() invokes the shrink hooks in the order they
+	// were registered, compacts the service and process heaps and removes the registered regions from
+	// the working set; EmptyWorkingSet() empties the working set of the whole process.  Regrow() only
+	// invokes the regrow hooks in reverse order; trimmed pages are faulted back in as they are touched
+	class memory_trimmer
+	{
+	public:
+
+		// trim_func
+		//
+		// Function invoked to shrink or regrow the memory held by a service
+		typedef std::function<void(void)> trim_func;
+
+		// Constructor / Destructor
+		memory_trimmer()=default;
+		~memory_trimmer()=default;
+
+		// AddHooks
+		//
+		// Registers a pair of shrink and regrow functions; either can be empty
+		void AddHooks(trim_func shrink, trim_func regrow);
+
+		// AddRegion
+		//
+		// Registers a region of memory to be removed from the working set
+		void AddRegion(void* address, size_t length);
+
+		// EmptyWorkingSet
+		//
+		// Empties the working set of the process; only appropriate if the service has it to itself
+		void EmptyWorkingSet(void);
+
+		// Regrow
+		//
+		// Invokes the regrow hooks
+		void Regrow(void);
+
+		// Shrink
+		//
+		// Invokes the shrink hooks and releases memory to the system
+		void Shrink(service_memory& memory);
+
+		// Statistics
+		//
+		// Gets the memory released by the most recent trim
+		__declspec(property(get=getStatistics)) trim_statistics Statistics;
+		trim_statistics getStatistics(void) const;
+
+	private:
+
+		memory_trimmer(const memory_trimmer&)=delete;
+		memory_trimmer& operator=(const memory_trimmer&)=delete;
+
+		// WorkingSet (static)
+		//
+		// Gets the working set of the process, in bytes
+		static size_t WorkingSet(void);
+
+		// m_hooks
+		//
+		// Registered shrink and regrow functions
+		std::vector<std::pair<trim_func, trim_func>> m_hooks;
+
+		// m_lock
+		//
+		// Synchronization object
+		mutable std::mutex m_lock;
+
+		// m_regions
+		//
+		// Registered regions of memory
+		std::vector<std::pair<void*, size_t>> m_regions;
+
+		// m_statistics
+		//
+		// Memory released by the most recent trim
+		trim_statistics m_statistics = {};
+	};
+
+	// svctl::io_loop
+	//
+	// I/O completion port event loop that can be owned by a service.  Overlapped operations are
+	// submitted with a completion function that is invoked on the thread running the loop; the
+	// service's Stop, Pause and Continue transitions are posted to the port as completions.
+	// Timeouts are measured on the service clock, a clock timer wakes the loop at the deadline
+	class io_loop
+	{
+	public:
+
+		// completion_func
+		//
+		// Function invoked when an operation completes with the Win32 result and bytes transferred
+		typedef std::function<void(DWORD result, DWORD bytes)> completion_func;
+
+		// timeout_func
+		//
+		// Function invoked when a timeout elapses (ERROR_SUCCESS) or is canceled (ERROR_OPERATION_ABORTED)
+		typedef std::function<void(DWORD result)> timeout_func;
+
+		// Constructor / Destructor
+		io_loop(service_clock& clock, PTP_CALLBACK_ENVIRON environ);
+		~io_loop();
+
+		// Accept
+		//
+		// Waits for a client to connect to an overlapped named pipe instance
+		void Accept(HANDLE pipe, completion_func func);
+
+		// Associate
+		//
+		// Associates a handle opened for overlapped I/O with the loop; required before submitting
+		// operations against the handle.  SOCKETs can be associated by casting them to HANDLE
+		void Associate(HANDLE handle);
+
+		// Continue
+		//
+		// Posts a continue completion; dispatching resumes with the completions held while paused
+		void Continue(void) { Post(KEY_CONTINUE); }
+
+		// Pause
+		//
+		// Posts a pause completion; the loop holds completions and timeouts until continued
+		void Pause(void) { Post(KEY_PAUSE); }
+
+		// Read
+		//
+		// Submits an overlapped read; the buffer must remain valid until the operation completes
+		void Read(HANDLE handle, void* buffer, DWORD length, uint64_t offset, completion_func func);
+
+		// Run
+		//
+		// Dispatches completions on the calling thread until the loop has been stopped and
+		// every operation in flight has completed
+		void Run(void);
+
+		// Stop
+		//
+		// Posts a stop completion; operations in flight are canceled and Run() returns
+		void Stop(void) { Post(KEY_STOP); }
+
+		// Timeout
+		//
+		// Invokes a function on the loop thread once the interval has elapsed
+		void Timeout(uint32_t milliseconds, timeout_func func);
+
+		// Write
+		//
+		// Submits an overlapped write; the buffer must remain valid until the operation completes
+		void Write(HANDLE handle, const void* buffer, DWORD length, uint64_t offset, completion_func func);
+
+	private:
+
+		io_loop(const io_loop&)=delete;
+		io_loop& operator=(const io_loop&)=delete;
+
+		// BATCH_SIZE
+		//
+		// Maximum number of completions dequeued at once
+		static const ULONG BATCH_SIZE = 64;
+
+		// KEY_XXXX
+		//
+		// Completion keys used to distinguish I/O from the posted control completions
+		static const ULONG_PTR KEY_IO		= 0;
+		static const ULONG_PTR KEY_STOP		= 1;
+		static const ULONG_PTR KEY_PAUSE	= 2;
+		static const ULONG_PTR KEY_CONTINUE	= 3;
+		static const ULONG_PTR KEY_WAKE		= 4;
+
+		// operation
+		//
+		// Overlapped operation in flight
+		struct operation : public OVERLAPPED
+		{
+			HANDLE				handle;			// Handle the operation was submitted against
+			completion_func		func;			// Completion function
+			DWORD				result;			// Win32 result once completed
+			DWORD				bytes;			// Bytes transferred once completed
+		};
+
+		// Begin
+		//
+		// Allocates and tracks a new operation
+		operation* Begin(HANDLE handle, uint64_t offset, completion_func&& func);
+
+		// Complete
+		//
+		// Removes an operation from tracking and invokes or holds it's completion function
+		void Complete(operation* op);
+
+		// Failed
+		//
+		// Releases an operation that could not be submitted and throws the error
+		void Failed(operation* op, DWORD result);
+
+		// Post
+		//
+		// Posts a control completion to the port
+		void Post(ULONG_PTR key);
+
+		// Submitted
+		//
+		// Cancels an operation that was submitted after the loop began stopping
+		void Submitted(operation* op);
+
+		// m_clock
+		//
+		// Clock used for the timeout deadlines
+		service_clock& m_clock;
+
+		// m_deferred
+		//
+		// Completed operations held while the loop is paused
+		std::vector<operation*> m_deferred;
+
+		// m_inflight
+		//
+		// Operations that have been submitted and have not completed
+		std::vector<operation*> m_inflight;
+
+		// m_lock
+		//
+		// Synchronization object for operation and timeout tracking
+		std::mutex m_lock;
+
+		// m_paused
+		//
+		// Flag indicating that the loop has been paused; accessed by the loop thread only
+		bool m_paused = false;
+
+		// m_port
+		//
+		// I/O completion port
+		HANDLE m_port;
+
+		// m_stopping
+		//
+		// Flag indicating that the loop has been stopped; no new operations are accepted
+		bool m_stopping = false;
+
+		// m_timeouts
+		//
+		// Pending timeouts ordered by their clock deadlines
+		std::multimap<uint64_t, timeout_func> m_timeouts;
+
+		// m_timer
+		//
+		// Clock timer that wakes the loop at the nearest timeout deadline
+		void* m_timer;
+	};
+
+	// svctl::worker_statistics
+	//
+	// Reports how a worker exited once the service has been stopped
+	struct worker_statistics
+	{
+		tstring			Name;				// Name the worker was launched with
+		bool			Joined;				// Flag indicating the worker exited before the deadline
+		uint32_t		JoinTime;			// Microseconds from the stop request until the worker exited
+	};
+
+	// svctl::worker_token
+	//
+	// Stop token provided to a worker launched by a service; the sleeps and waits return early
+	// once the Stop or Shutdown control has been received
+	class worker_token
+	{
+	friend class worker_group;
+	public:
+
+		// Sleep
+		//
+		// Waits for the interval on the service clock; returns false if stop was requested first
+		bool Sleep(uint32_t milliseconds) const;
+
+		// Wait
+		//
+		// Waits for an object to be signaled; returns false if stop was requested or the timeout elapsed
+		bool Wait(HANDLE handle, uint32_t timeout = INFINITE) const;
+
+		// Handle
+		//
+		// Gets a manual reset event that is signaled when stop is requested, for use with other waits
+		__declspec(property(get=getHandle)) HANDLE Handle;
+		HANDLE getHandle(void) const;
+
+		// StopRequested
+		//
+		// Gets a flag indicating that the worker has been asked to exit
+		__declspec(property(get=getStopRequested)) bool StopRequested;
+		bool getStopRequested(void) const;
+
+	private:
+
+		// stop_state
+		//
+		// Stop state shared by the group and it's workers; each worker thread keeps it's
+		// own reference to this state
+		struct stop_state
+		{
+			stop_state(service_clock& clock) : clock(clock) {}
+
+			service_clock&					clock;			// Clock used for interruptible sleeps
+			std::condition_variable			condition;		// Condition variable for interruptible sleeps
+			std::mutex						lock;			// Synchronization object
+			signal<signal_type::ManualReset> stopevent;		// Event signaled on stop request
+			bool							stopping = false;	// Flag indicating stop was requested
+			LARGE_INTEGER					requested = {};	// Performance counter at the stop request
+		};
+
+		// Instance Constructor
+		worker_token(const std::shared_ptr<stop_state>& state) : m_state(state) {}
+
+		// m_state
+		//
+		// Shared stop state
+		std::shared_ptr<stop_state> m_state;
+	};
+
+	// svctl::worker_group
+	//
+	// Group of threads owned by a service; stop is requested when the service receives the Stop
+	// or Shutdown control and the workers are joined with a deadline before SERVICE_STOPPED is set.
+	// A worker is never detached, each one holds a reference to the owner until it has exited
+	class worker_group
+	{
+	public:
+
+		// owner_func
+		//
+		// Function that provides a reference to the owner of the group, if it is reference counted
+		typedef std::function<std::shared_ptr<void>(void)> owner_func;
+
+		// worker_func
+		//
+		// Function executed by a worker thread
+		typedef std::function<void(const worker_token& token)> worker_func;
+
+		// Constructor / Destructor
+		worker_group(service_clock& clock, const service_placement& placement, owner_func owner);
+		~worker_group();
+
+		// Join
+		//
+		// Requests stop and joins every worker that exits before the timeout; workers still running
+		// remain in the group for the next Join() and the calling thread is never waited for.
+		// Returns false if any other worker is still running.  Rethrows the first exception that
+		// escaped from a joined worker, if any
+		bool Join(uint32_t timeout);
+
+		// Launch
+		//
+		// Starts a new worker thread with the placement and stack reservation of the group
+		void Launch(const tchar_t* name, worker_func func);
+
+		// RequestStop
+		//
+		// Signals the stop token of every worker
+		void RequestStop(void);
+
+		// Statistics
+		//
+		// Gets the join statistics for each worker once the group has been joined
+		__declspec(property(get=getStatistics)) std::vector<worker_statistics> Statistics;
+		std::vector<worker_statistics> getStatistics(void) const;
+
+	private:
+
+		worker_group(const worker_group&)=delete;
+		worker_group& operator=(const worker_group&)=delete;
+
+		// worker
+		//
+		// Worker thread and it's exit state, shared with the thread itself
+		struct worker
+		{
+			~worker() { if(thread) CloseHandle(thread); }
+
+			tstring								name;			// Name of the worker
+			HANDLE								thread = nullptr;	// Worker thread
+			DWORD								threadid = 0;	// Worker thread identifier
+			signal<signal_type::ManualReset>	exited;			// Event signaled as the worker exits
+			LARGE_INTEGER						finished = {};	// Performance counter at exit
+			std::exception_ptr					exception;		// Exception that escaped the worker
+			bool								reported = false;	// Statistics have been recorded
+		};
+
+		// m_lock
+		//
+		// Synchronization object
+		mutable std::mutex m_lock;
+
+		// m_owner
+		//
+		// Provides the reference to the owner held by each worker thread
+		owner_func m_owner;
+
+		// m_placement
+		//
+		// Placement policy applied to each worker thread
+		service_placement m_placement;
+
+		// m_state
+		//
+		// Stop state shared with the worker tokens
+		std::shared_ptr<worker_token::stop_state> m_state;
+
+		// m_statistics
+		//
+		// Join statistics collected by Join()
+		std::vector<worker_statistics> m_statistics;
+
+		// m_workers
+		//
+		// Workers that have been launched and not yet joined
+		std::vector<std::shared_ptr<worker>> m_workers;
+	};
+
+	// svctl::startup_phase_status
+	//
+	// Status of a phase declared with service::AddStartupPhase()
+	enum class startup_phase_status
+	{
+		Pending		= 0,			// Waiting for the phases it depends on
+		Running		= 1,			// Running on a worker thread
+		Ready		= 2,			// Completed successfully
+		Failed		= 3,			// Completed with an exception
+		Cancelled	= 4,			// A dependency failed or the service was stopped first
+	};
+
+	// svctl::startup_phase_info
+	//
+	// Reports the progress of a phase declared with service::AddStartupPhase()
+	struct startup_phase_info
+	{
+		tstring					Name;			// Name of the phase
+		bool					Required;		// Flag indicating the phase is required for SERVICE_RUNNING
+		startup_phase_status	Status;			// Current status of the phase
+		DWORD					Error;			// Error code of a failed or cancelled phase
+		uint32_t				Elapsed;		// Milliseconds the phase has been running or ran for
+	};
+
+	// svctl::startup_phases
+	//
+	// Dependency graph of the named initialization phases of a service.  Each phase runs on it's own
+	// worker as soon as the phases it depends on are ready; SERVICE_RUNNING is reported once every
+	// required phase (and everything a required phase depends on) is ready, the others finish in
+	// the background.  A phase that fails cancels the phases that depend on it
+	class startup_phases : public std::enable_shared_from_this<startup_phases>
+	{
+	public:
+
+		// Constructor / Destructor
+		explicit startup_phases(service_clock& clock) : m_clock(clock) {}
+		~startup_phases()=default;
+
+		// Add
+		//
+		// Declares a phase; cannot be called once the phases are running
+		void Add(const tchar_t* name, bool required, const std::vector<tstring>& dependencies, worker_group::worker_func func);
+
+		// IsReady
+		//
+		// Determines if a phase has completed successfully
+		bool IsReady(const tchar_t* name) const;
+
+		// Run
+		//
+		// Validates the graph and launches every phase that has no dependencies
+		void Run(worker_group& workers);
+
+		// Wait
+		//
+		// Waits for a phase to complete; returns true only if it completed successfully
+		bool Wait(const tchar_t* name, uint32_t timeout) const;
+
+		// WaitForRequired
+		//
+		// Waits for the required phases; throws the error of a required phase that did not complete,
+		// or ERROR_SERVICE_REQUEST_TIMEOUT if they have not all completed within the timeout
+		void WaitForRequired(uint32_t timeout) const;
+
+		// Phases
+		//
+		// Gets the progress of each phase
+		__declspec(property(get=getPhases)) std::vector<startup_phase_info> Phases;
+		std::vector<startup_phase_info> getPhases(void) const;
+
+	private:
+
+		startup_phases(const startup_phases&)=delete;
+		startup_phases& operator=(const startup_phases&)=delete;
+
+		// phase
+		//
+		// Declared phase and it's progress
+		struct phase
+		{
+			tstring						name;						// Name of the phase
+			bool						required = false;			// Required for SERVICE_RUNNING
+			std::vector<tstring>		dependencies;				// Names of the phases this one depends on
+			std::vector<size_t>			dependents;					// Indexes of the phases that depend on this one
+			size_t						remaining = 0;				// Dependencies that are not yet ready
+			worker_group::worker_func	func;						// Function that performs the phase
+			startup_phase_status		status = startup_phase_status::Pending;
+			DWORD						error = ERROR_SUCCESS;		// Error code if failed or cancelled
+			uint64_t					started = 0;				// Clock time when the phase was launched
+			uint64_t					finished = 0;				// Clock time when the phase completed
+		};
+
+		// Cancel
+		//
+		// Cancels a pending phase and every phase depending on it; lock must be held
+		void Cancel(size_t index, DWORD error);
+
+		// Complete
+		//
+		// Records the completion of a phase and launches the phases that were waiting for it
+		void Complete(size_t index, DWORD error, bool stopped);
+
+		// Find
+		//
+		// Locates a phase by name; lock must be held
+		const phase* Find(const tchar_t* name) const;
+
+		// Launch
+		//
+		// Launches a phase on a worker thread; lock must be held
+		void Launch(size_t index);
+
+		// m_changed
+		//
+		// Condition variable signaled when a phase completes
+		mutable std::condition_variable m_changed;
+
+		// m_clock
+		//
+		// Clock used for the phase times and timed waits
+		service_clock& m_clock;
+
+		// m_lock
+		//
+		// Synchronization object
+		mutable std::mutex m_lock;
+
+		// m_phases
+		//
+		// Declared phases
+		std::vector<phase> m_phases;
+
+		// m_workers
+		//
+		// Worker group the phases are launched into; set by Run()
+		worker_group* m_workers = nullptr;
+	};
+
+	// svctl::quiescence_domain
+	//
+	// Epoch-based barrier that lets a service pause it's worker threads at a known point.  Each
+	// thread entering a region increments an epoch counter on it's own cache line; the counter is
+	// odd while the thread is inside a region.  Quiesce() prevents new entries and waits for every
+	// counter to become even, threads trying to enter while quiesced park until Release()
+	class quiescence_domain
+	{
+	public:
+
+		// Constructor / Destructor
+		quiescence_domain();
+		~quiescence_domain()=default;
+
+		// region
+		//
+		// Scoped entry into a region of the domain
+		class region
+		{
+		public:
+
+			explicit region(quiescence_domain& domain) : m_domain(domain) { m_domain.Enter(); }
+			~region() { m_domain.Exit(); }
+
+		private:
+
+			region(const region&)=delete;
+			region& operator=(const region&)=delete;
+
+			quiescence_domain& m_domain;
+		};
+
+		// Enter
+		//
+		// Enters a region of the domain, parking the calling thread while the domain is quiesced.
+		// Regions can be nested on the same thread
+		void Enter(void);
+
+		// Exit
+		//
+		// Exits a region of the domain
+		void Exit(void);
+
+		// Quiesce
+		//
+		// Waits for every thread to leave it's region; the progress function is invoked each time
+		// the number of threads still inside a region drops.  Returns that number, zero on success
+		size_t Quiesce(uint32_t timeout = INFINITE, const std::function<void(size_t remaining)>& progress = nullptr);
+
+		// Release
+		//
+		// Releases the threads parked by Quiesce()
+		void Release(void);
+
+		// Synchronize
+		//
+		// Waits for a grace period: every thread inside a region when this was called has left
+		// it.  New entries are not blocked and the calling thread's own region is not waited on
+		void Synchronize(void);
+
+		// Inside
+		//
+		// Gets a flag indicating that the calling thread is inside a region of the domain
+		__declspec(property(get=getInside)) bool Inside;
+		bool getInside(void) { return Attach()->depth > 0; }
+
+		// Quiesced
+		//
+		// Gets a flag indicating that the domain has been quiesced and not yet released
+		__declspec(property(get=getQuiesced)) bool Quiesced;
+		bool getQuiesced(void) const { return m_quiesced.load(); }
+
+	private:
+
+		quiescence_domain(const quiescence_domain&)=delete;
+		quiescence_domain& operator=(const quiescence_domain&)=delete;
+
+		// slot
+		//
+		// Epoch counter of a single thread; only the owning thread writes to the slot
+		struct alignas(64) slot
+		{
+			std::atomic<uint64_t>	epoch { 0 };		// Odd while the thread is inside a region
+			uint32_t				depth = 0;		// Region nesting depth
+			bool					assigned = false;	// Assigned to a running thread; table lock must be held
+		};
+
+		// slot_table
+		//
+		// Slots of the domain; shared with the threads so that an exiting thread can give it's slot
+		// back for reuse, and released along with the slots once the domain and those threads are gone
+		struct slot_table
+		{
+			std::mutex							lock;		// Synchronization object
+			std::vector<std::unique_ptr<slot>>	slots;		// Slot of each thread, assigned or free
+		};
+
+		// thread_slots
+		//
+		// Per-thread map of domain identifiers to the slots assigned to the thread, the slots are
+		// given back to the domains that still exist when the thread exits
+		struct thread_slots
+		{
+			~thread_slots();
+			std::unordered_map<uint64_t, std::pair<std::weak_ptr<slot_table>, slot*>> entries;
+		};
+
+		// Attach
+		//
+		// Gets the slot of the calling thread, assigning it on first use
+		slot* Attach(void);
+
+		// Backoff (static)
+		//
+		// Spins, yields or sleeps while polling the epochs based on the number of attempts
+		static void Backoff(uint32_t attempt);
+
+		// m_condition
+		//
+		// Condition variable used to park threads while quiesced
+		std::condition_variable m_condition;
+
+		// m_id
+		//
+		// Unique identifier of this domain, used to look up the thread's slot
+		uint64_t m_id;
+
+		// m_lock
+		//
+		// Synchronization object for the parked threads
+		std::mutex m_lock;
+
+		// m_quiesced
+		//
+		// Flag indicating that new entries have to park
+		std::atomic<bool> m_quiesced { false };
+
+		// m_table
+		//
+		// Slots assigned to the threads that have entered a region of the domain
+		std::shared_ptr<slot_table> m_table;
+	};
+
+	// svctl::channel_base
+	//
+	// Untyped portion of a named in-process channel between services hosted by the same process
+	class channel_base
+	{
+	public:
+
+		// Destructor
+		virtual ~channel_base()=default;
+
+		// DEFAULT_CAPACITY
+		//
+		// Default number of items a channel can hold
+		static const size_t DEFAULT_CAPACITY = 1024;
+
+		// Close
+		//
+		// Closes the channel; sends fail and the receiver drains what is left.  The name is
+		// released so that a new channel can be created with it.  Sends that are already under
+		// way complete before this returns, so a Drain() that follows releases every item
+		void Close(void);
+
+		// Drain
+		//
+		// Releases every item still held by the channel
+		virtual void Drain(void) = 0;
+
+		// Closed
+		//
+		// Gets a flag indicating that the channel has been closed
+		__declspec(property(get=getClosed)) bool Closed;
+		bool getClosed(void) const { return m_closed.load(); }
+
+		// Name
+		//
+		// Gets the name of the channel
+		__declspec(property(get=getName)) const tchar_t* Name;
+		const tchar_t* getName(void) const { return m_name.c_str(); }
+
+	protected:
+
+		// Instance Constructor
+		explicit channel_base(const tchar_t* name) : m_name(name) {}
+
+		// Notify
+		//
+		// Wakes the receiver if it is waiting for an item
+		void Notify(void) { if(m_waiting.exchange(false, std::memory_order_seq_cst)) m_available.Set(); }
+
+		// Prepare / Wait
+		//
+		// Waits for an item to become available; the receiver has to check the queue again between
+		// calling Prepare and Wait since an item sent before Prepare does not signal the event
+		void Prepare(void) { m_waiting.store(true, std::memory_order_seq_cst); }
+		bool Wait(uint32_t timeout) { return WaitForSingleObject(m_available, timeout) == WAIT_OBJECT_0; }
+
+		// BeginSend / EndSend
+		//
+		// Brackets the enqueue of an item; BeginSend returns false if the channel has been closed
+		bool BeginSend(void)
+		{
+			m_senders.fetch_add(1, std::memory_order_seq_cst);
+			if(!m_closed.load(std::memory_order_seq_cst)) return true;
+
+			m_senders.fetch_sub(1, std::memory_order_seq_cst);
+			return false;
+		}
+		void EndSend(void) { m_senders.fetch_sub(1, std::memory_order_seq_cst); }
+
+		// m_closed
+		//
+		// Flag indicating that the channel has been closed
+		std::atomic<bool> m_closed { false };
+
+	private:
+
+		channel_base(const channel_base&)=delete;
+		channel_base& operator=(const channel_base&)=delete;
+
+		// m_available
+		//
+		// Event signaled when an item is sent to a waiting receiver
+		signal<signal_type::AutomaticReset> m_available;
+
+		// m_name
+		//
+		// Name of the channel
+		const tstring m_name;
+
+		// m_senders
+		//
+		// Number of sends that have checked the channel was open and not finished enqueuing
+		std::atomic<uint32_t> m_senders { 0 };
+
+		// m_waiting
+		//
+		// Flag indicating that the receiver is waiting for the event
+		std::atomic<bool> m_waiting { false };
+	};
+
+	// svctl::channel<>
+	//
+	// Bounded lock-free queue that transfers ownership of items between services in the same
+	// process without copying them; any number of services can send, one service receives
+	template<typename _type>
+	class channel : public channel_base
+	{
+	public:
+
+		// Instance Constructor
+		channel(const tchar_t* name, size_t capacity) : channel_base(name)
+		{
+			// The capacity is rounded up to a power of two so positions can be masked
+			size_t size = 2;
+			while(size < capacity) size <<= 1;
+
+			m_cells = std::make_unique<cell[]>(size);
+			m_mask = size - 1;
+			for(size_t index = 0; index < size; index++) m_cells[index].sequence.store(index, std::memory_order_relaxed);
+		}
+
+		// Destructor
+		virtual ~channel() { Drain(); }
+
+		// Drain (channel_base)
+		//
+		// Releases every item still held by the channel
+		virtual void Drain(void) { std::unique_ptr<_type> item; while(TryReceive(item)) item.reset(); }
+
+		// Receive
+		//
+		// Takes the next item, waiting up to the timeout for one to be sent; returns false if no
+		// item arrived or the channel has been closed and drained
+		bool Receive(std::unique_ptr<_type>& item, uint32_t timeout = 0)
+		{
+			if(TryReceive(item)) return true;
+			if(timeout == 0) return false;
+
+			uint64_t started = GetTickCount64();
+
+			// The event can be left signaled by an item that was already taken, the wait is
+			// repeated until an item arrives, the timeout elapses or the channel is closed
+			while(true) {
+
+				// Close waits for the sends under way, a closed channel is checked one last time
+				if(m_closed) return TryReceive(item);
+
+				Prepare();
+				if(TryReceive(item)) return true;
+
+				uint32_t remaining = timeout;
+				if(timeout != INFINITE) {
+
+					uint64_t elapsed = GetTickCount64() - started;
+					if(elapsed >= timeout) return TryReceive(item);
+					remaining = static_cast<uint32_t>(timeout - elapsed);
+				}
+
+				if(Wait(remaining) && TryReceive(item)) return true;
+			}
+		}
+
+		// Send
+		//
+		// Transfers ownership of an item to the channel; returns false, leaving the item with
+		// the caller, if the channel is full or closed
+		bool Send(std::unique_ptr<_type>& item)
+		{
+			if(!item) throw winexception(ERROR_INVALID_PARAMETER);
+			if(!BeginSend()) return false;
+
+			cell* target = nullptr;
+			size_t position = m_enqueue.load(std::memory_order_relaxed);
+
+			while(true) {
+
+				target = &m_cells[position & m_mask];
+				intptr_t difference = static_cast<intptr_t>(target->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(position);
+
+				// The cell is free for this position; try to claim it
+				if(difference == 0) { if(m_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break; }
+				else if(difference < 0) { EndSend(); return false; }
+				else position = m_enqueue.load(std::memory_order_relaxed);
+			}
+
+			target->item = item.release();
+			target->sequence.store(position + 1, std::memory_order_release);
+
+			EndSend();
+			Notify();
+			return true;
+		}
+
+		// TryReceive
+		//
+		// Takes the next item without waiting; returns false if the channel is empty
+		bool TryReceive(std::unique_ptr<_type>& item)
+		{
+			cell* source = nullptr;
+			size_t position = m_dequeue.load(std::memory_order_relaxed);
+
+			while(true) {
+
+				source = &m_cells[position & m_mask];
+				intptr_t difference = static_cast<intptr_t>(source->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(position + 1);
+
+				// The cell holds the item for this position; try to claim it
+				if(difference == 0) { if(m_dequeue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break; }
+				else if(difference < 0) return false;
+				else position = m_dequeue.load(std::memory_order_relaxed);
+			}
+
+			item.reset(source->item);
+			source->item = nullptr;
+			source->sequence.store(position + m_mask + 1, std::memory_order_release);
+
+			return true;
+		}
+
+	private:
+
+		channel(const channel&)=delete;
+		channel& operator=(const channel&)=delete;
+
+		// cell
+		//
+		// Queue cell; the sequence indicates whether the cell is ready to be written or read
+		struct cell
+		{
+			std::atomic<size_t>		sequence;			// Position the cell is ready for
+			_type*					item = nullptr;		// Item owned by the cell
+		};
+
+		// m_cells
+		//
+		// Ring of queue cells
+		std::unique_ptr<cell[]> m_cells;
+
+		// m_dequeue
+		//
+		// Next position to be received; kept on it's own cache line
+		alignas(64) std::atomic<size_t> m_dequeue { 0 };
+
+		// m_enqueue
+		//
+		// Next position to be sent; kept on it's own cache line
+		alignas(64) std::atomic<size_t> m_enqueue { 0 };
+
+		// m_mask
+		//
+		// Mask applied to positions to select a cell
+		alignas(64) size_t m_mask;
+	};
+
+	// svctl::channel_registry
+	//
+	// Process-wide collection of named channels between the services hosted by the process
+	class channel_registry
+	{
+	public:
+
+		// Add
+		//
+		// Registers a new channel; throws if a channel with the same name is open
+		void Add(const std::shared_ptr<channel_base>& channel);
+
+		// Find
+		//
+		// Retrieves an open channel; throws if there is none with the name
+		std::shared_ptr<channel_base> Find(const tchar_t* name);
+
+		// Instance (static)
+		//
+		// Gets the process-wide channel registry
+		static channel_registry& Instance(void);
+
+		// Remove
+		//
+		// Removes a channel from the registry if it is still registered
+		void Remove(const channel_base* channel);
+
+	private:
+
+		channel_registry()=default;
+		channel_registry(const channel_registry&)=delete;
+		channel_registry& operator=(const channel_registry&)=delete;
+
+		// m_channels
+		//
+		// Open channels; names are compared without case
+		std::vector<std::shared_ptr<channel_base>> m_channels;
+
+		// m_lock
+		//
+		// Synchronization object for the registry
+		std::mutex m_lock;
+	};
+
+	// svctl::snapshot_region
+	//
+	// Region of memory written to or restored from a service snapshot file
+	struct snapshot_region
+	{
+		const void*		Data;				// Start of the region
+		size_t			Length;				// Length of the region, in bytes
+	};
+
+	// svctl::snapshot_statistics
+	//
+	// Time spent restoring and saving the snapshot of a service
+	struct snapshot_statistics
+	{
+		bool			Restored;			// Flag indicating a valid snapshot was mapped
+		uint32_t		Regions;			// Number of regions in the mapped snapshot
+		uint64_t		RestoredBytes;		// Length of the mapped snapshot
+		uint32_t		RestoreTime;		// Microseconds spent mapping and validating the snapshot
+		uint64_t		SavedBytes;			// Length of the snapshot written at stop
+		uint32_t		SaveTime;			// Microseconds spent writing the snapshot
+	};
+
+	// svctl::snapshot_layout
+	//
+	// Layout of a service snapshot file: the header, a descriptor for each region, the region
+	// names and then the region data, each region aligned to ALIGNMENT bytes from the start of the
+	// file.  The checksum is a 64-bit FNV-1a hash of everything that follows the header
+	struct snapshot_layout
+	{
+		// MAGIC
+		//
+		// Snapshot file signature
+		static const uint32_t MAGIC = 'SVSN';
+
+		// FORMAT
+		//
+		// Version of the snapshot file layout
+		static const uint32_t FORMAT = 2;
+
+		// ALIGNMENT
+		//
+		// Alignment of the region data within the file
+		static const size_t ALIGNMENT = 16;
+
+		// header
+		//
+		// Snapshot file header
+		struct header
+		{
+			uint32_t		magic;				// MAGIC
+			uint32_t		format;				// FORMAT
+			uint32_t		version;			// Service-defined version of the region contents
+			uint32_t		charsize;			// sizeof(tchar_t) used for the region names
+			uint64_t		length;				// Total length of the file
+			uint64_t		checksum;			// FNV-1a hash of the region descriptors and names
+			uint32_t		regions;			// Number of region descriptors
+			uint32_t		metadata;			// Length of the header, region descriptors and names
+		};
+
+		// region
+		//
+		// Snapshot region descriptor
+		struct region
+		{
+			uint32_t		nameoffset;			// Offset of the region name from the start of the file
+			uint32_t		namelength;			// Length of the region name, in characters
+			uint64_t		offset;				// Offset of the region data from the start of the file
+			uint64_t		length;				// Length of the region data
+		};
+
+		// Checksum (static)
+		//
+		// Calculates the FNV-1a hash of a block of memory
+		static uint64_t Checksum(const void* data, size_t length);
+	};
+
+	// svctl::service_snapshot
+	//
+	// Writes the registered regions of a service to a snapshot file when it stops and maps
+	// the file read-only when the next instance of the service starts
+	class service_snapshot
+	{
+	public:
+
+		// Constructor / Destructor
+		service_snapshot()=default;
+		~service_snapshot();
+
+		// Commit
+		//
+		// Releases the mapped snapshot and replaces the snapshot file with the one written by Save()
+		void Commit(void);
+
+		// Find
+		//
+		// Gets a region of the mapped snapshot; empty if the region is not present
+		snapshot_region Find(const tchar_t* name) const;
+
+		// Open
+		//
+		// Sets the snapshot file and version and maps the existing snapshot; returns false if there
+		// is no snapshot or if it was written with another version or fails validation
+		bool Open(const tchar_t* path, uint32_t version);
+
+		// Register
+		//
+		// Registers a function that provides a region to write to the snapshot
+		void Register(const tchar_t* name, std::function<snapshot_region(void)> source);
+
+		// Save
+		//
+		// Writes the registered regions to a temporary snapshot file; returns false on failure
+		bool Save(void);
+
+		// Statistics
+		//
+		// Gets the snapshot restore and save statistics
+		__declspec(property(get=getStatistics)) snapshot_statistics Statistics;
+		snapshot_statistics getStatistics(void) const { return m_statistics; }
+
+	private:
+
+		service_snapshot(const service_snapshot&)=delete;
+		service_snapshot& operator=(const service_snapshot&)=delete;
+
+		// Unmap
+		//
+		// Releases the mapped snapshot
+		void Unmap(void);
+
+		// m_mapping
+		//
+		// Read-only file mapping of the existing snapshot
+		HANDLE m_mapping = nullptr;
+
+		// m_path
+		//
+		// Path to the snapshot file; nothing is saved if not set
+		tstring m_path;
+
+		// m_saved
+		//
+		// Flag indicating that Save() has written the temporary file
+		bool m_saved = false;
+
+		// m_sources
+		//
+		// Registered region names and the functions that provide them
+		std::vector<std::pair<tstring, std::function<snapshot_region(void)>>> m_sources;
+
+		// m_statistics
+		//
+		// Snapshot restore and save statistics
+		snapshot_statistics m_statistics = {};
+
+		// m_version
+		//
+		// Service-defined version of the region contents
+		uint32_t m_version = 0;
+
+		// m_view
+		//
+		// Read-only view of the existing snapshot
+		const uint8_t* m_view = nullptr;
+	};
+
+	// svctl::handoff_store
+	//
+	// Process-wide store that carries state and handles from an outgoing service instance to the
+	// next instance of the same service started in the same process.  Nothing in the store survives
+	// the process; it does not cover an upgrade that replaces the process or a restart after a crash.
+	// The state is kept in a pagefile backed section rather than on the heap of the outgoing instance
+	class handoff_store
+	{
+	public:
+
+		// Destructor
+		~handoff_store();
+
+		// ClaimHandle
+		//
+		// Takes ownership of a handle parked for a service; returns null if there is none
+		HANDLE ClaimHandle(const tchar_t* servicename, const tchar_t* name);
+
+		// ClaimSocket
+		//
+		// Takes ownership of a socket parked for a service; returns INVALID_SOCKET if there is none
+		SOCKET ClaimSocket(const tchar_t* servicename, const tchar_t* name);
+
+		// ClaimState
+		//
+		// Takes the state parked for a service; returns an empty vector if there is none
+		std::vector<uint8_t> ClaimState(const tchar_t* servicename);
+
+		// Instance (static)
+		//
+		// Gets the process-wide handoff store
+		static handoff_store& Instance(void);
+
+		// ParkHandle
+		//
+		// Transfers ownership of a handle to the store, replacing one parked with the same name
+		void ParkHandle(const tchar_t* servicename, const tchar_t* name, HANDLE handle);
+
+		// ParkSocket
+		//
+		// Transfers ownership of a socket to the store, replacing one parked with the same name
+		void ParkSocket(const tchar_t* servicename, const tchar_t* name, SOCKET sock);
+
+		// ParkState
+		//
+		// Copies the state of a service into the store, replacing any state already parked
+		void ParkState(const tchar_t* servicename, const void* data, size_t length);
+
+	private:
+
+		handoff_store()=default;
+		handoff_store(const handoff_store&)=delete;
+		handoff_store& operator=(const handoff_store&)=delete;
+
+		// parked_handle
+		//
+		// Handle or socket parked for a service; sockets have to be closed with closesocket()
+		struct parked_handle
+		{
+			HANDLE		handle = nullptr;		// Parked handle, or the SOCKET cast to a HANDLE
+			bool		socket = false;			// Flag indicating the handle is a SOCKET
+		};
+
+		// parked
+		//
+		// State and handles parked for a single service
+		struct parked
+		{
+			HANDLE								section = nullptr;		// Pagefile backed section holding the state
+			size_t								length = 0;				// Length of the state
+			std::map<tstring, parked_handle>	handles;				// Parked handles and sockets by name
+		};
+
+		// Find
+		//
+		// Finds the parked entry for a service, optionally creating it; lock must be held
+		parked* Find(const tchar_t* servicename, bool create);
+
+		// Release (static)
+		//
+		// Closes the section and handles held by a parked entry, or a single parked handle
+		static void Release(parked& entry);
+		static void Release(parked_handle& handle);
+
+		// m_entries
+		//
+		// Parked entries by service name; names are compared without case
+		std::vector<std::pair<tstring, parked>> m_entries;
+
+		// m_lock
+		//
+		// Synchronization object for the store
+		std::mutex m_lock;
+	};
+
+	// svctl::memory_pressure_source
+	//
+	// Base class for a source of memory pressure notifications.  Subscribed services receive
+	// ServiceControl::MemoryPressure with the new ServiceMemoryPressure level as the event type
+	// each time the level changes; the source is started with the first subscriber and stopped
+	// after the last one has been removed
+	class memory_pressure_source
+	{
+	public:
+
+		// Subscribe
+		//
+		// Adds a service instance to the set of subscribers
+		void Subscribe(service* instance);
+
+		// Unsubscribe
+		//
+		// Removes a service instance from the set of subscribers
+		void Unsubscribe(service* instance);
+
+		// Level
+		//
+		// Gets the most recently raised memory pressure level
+		__declspec(property(get=getLevel)) ServiceMemoryPressure Level;
+		ServiceMemoryPressure getLevel(void);
+
+	protected:
+
+		// Constructor / Destructor
+		memory_pressure_source()=default;
+		virtual ~memory_pressure_source()=default;
+
+		// Raise
+		//
+		// Changes the memory pressure level; subscribers are only notified if it differs
+		void Raise(ServiceMemoryPressure level);
+
+		// Start
+		//
+		// Invoked when the first service subscribes to the source
+		virtual void Start(void) {}
+
+		// Stop
+		//
+		// Invoked when the last service unsubscribes from the source; this can happen on the thread
+		// that is raising a level, so it must not wait for that thread
+		virtual void Stop(void) {}
+
+	private:
+
+		memory_pressure_source(const memory_pressure_source&)=delete;
+		memory_pressure_source& operator=(const memory_pressure_source&)=delete;
+
+		// m_changed
+		//
+		// Condition variable signaled when a notification has been delivered to a subscriber
+		std::condition_variable m_changed;
+
+		// m_level
+		//
+		// Most recently raised memory pressure level
+		ServiceMemoryPressure m_level = ServiceMemoryPressure::Normal;
+
+		// m_lock
+		//
+		// Synchronization object for the level and subscribers; never held while a handler runs
+		std::mutex m_lock;
+
+		// m_raiselock
+		//
+		// Serializes Raise so that the levels are delivered one at a time and in order
+		std::mutex m_raiselock;
+
+		// m_raising
+		//
+		// Thread delivering a level to the subscribers, if any
+		std::thread::id m_raising;
+
+		// m_runlock
+		//
+		// Serializes Start and Stop, which are invoked without m_lock held
+		std::mutex m_runlock;
+
+		// m_started
+		//
+		// Flag indicating that Start has been invoked without a matching Stop; m_runlock must be held
+		bool m_started = false;
+
+		// m_subscribers
+		//
+		// Subscribed service instances and the number of notifications being delivered to each
+		std::map<service*, uint32_t> m_subscribers;
+	};
+
+	// svctl::system_memory_pressure
+	//
+	// Memory pressure source for the system; a worker thread waits on the low memory resource
+	// notification and samples the physical memory load to determine the pressure level
+	class system_memory_pressure : public memory_pressure_source
+	{
+	public:
+
+		// Instance (static)
+		//
+		// Gets the process-wide system memory pressure source
+		static system_memory_pressure& Instance(void);
+
+		// MODERATE_LOAD
+		//
+		// Physical memory load percentage at or above which the pressure is Moderate
+		static const uint32_t MODERATE_LOAD = 85;
+
+		// POLL_INTERVAL
+		//
+		// Interval, in milliseconds, at which the memory load is sampled
+		static const uint32_t POLL_INTERVAL = 1000;
+
+	private:
+
+		// Constructor / Destructor
+		system_memory_pressure()=default;
+		virtual ~system_memory_pressure();
+
+		system_memory_pressure(const system_memory_pressure&)=delete;
+		system_memory_pressure& operator=(const system_memory_pressure&)=delete;
+
+		// Sample (static)
+		//
+		// Determines the current memory pressure level
+		static ServiceMemoryPressure Sample(HANDLE lowmemory);
+
+		// memory_pressure_source overrides
+		//
+		virtual void Start(void);
+		virtual void Stop(void);
+
+		// monitor
+		//
+		// State shared with a worker thread; the thread is detached and Stop only signals it, the
+		// last subscriber can be released on the worker thread and unsubscribe from there
+		struct monitor
+		{
+			signal<signal_type::ManualReset>	stop;		// Event signaled to stop the thread
+			signal<signal_type::ManualReset>	exited;		// Event signaled as the thread exits
+		};
+
+		// m_monitor
+		//
+		// State of the most recently started worker thread
+		std::shared_ptr<monitor> m_monitor;
+	};
+
+	// svctl::system_event_source
+	//
+	// Generates the TimeChange, NetBind and SessionChange controls the service control manager would send
+	// for services hosted without it.  A single thread waits for IP interface change notifications, which are
+	// coalesced for COALESCE_INTERVAL before being delivered, checks the system clock against the tick count to
+	// detect the system time being changed, and receives session notifications through a message-only window.
+	// Controls are sent to the subscribed harnesses with SendControl(), outside of any lock, so a service only
+	// receives the controls it has reported as accepted
+	class system_event_source
+	{
+	public:
+
+		// Instance (static)
+		//
+		// Gets the process-wide system event source
+		static system_event_source& Instance(void);
+
+		// Subscribe
+		//
+		// Adds a service harness to the set of subscribers
+		void Subscribe(service_harness* harness);
+
+		// Unsubscribe
+		//
+		// Removes a service harness from the set of subscribers
+		void Unsubscribe(service_harness* harness);
+
+		// CLOCK_CHECK_INTERVAL
+		//
+		// Interval, in milliseconds, at which the system clock is checked against the tick count
+		static const uint32_t CLOCK_CHECK_INTERVAL = 1000;
+
+		// COALESCE_INTERVAL
+		//
+		// Interval, in milliseconds, over which a burst of interface changes is combined
+		static const uint32_t COALESCE_INTERVAL = 250;
+
+		// TIME_CHANGE_THRESHOLD
+		//
+		// Difference, in milliseconds, between the system clock and the tick count reported as a time change
+		static const uint32_t TIME_CHANGE_THRESHOLD = 1000;
+
+	private:
+
+		// Constructor / Destructor
+		system_event_source();
+		~system_event_source();
+
+		system_event_source(const system_event_source&)=delete;
+		system_event_source& operator=(const system_event_source&)=delete;
+
+		// monitor
+		//
+		// State shared with a thread; the thread is detached and Stop only signals it, the last
+		// subscriber can be released by a handler running on the thread and unsubscribe from there
+		struct monitor
+		{
+			signal<signal_type::ManualReset>	stop;		// Event signaled to stop the thread
+			signal<signal_type::ManualReset>	exited;		// Event signaled as the thread exits
+		};
+
+		// Deliver
+		//
+		// Sends a control to every subscribed service harness
+		void Deliver(ServiceControl control, DWORD eventtype, void* eventdata);
+
+		// Notify
+		//
+		// Queues an interface change control and starts the coalescing timer
+		void Notify(ServiceControl control);
+
+		// Run
+		//
+		// Body of the thread that delivers the controls
+		void Run(std::shared_ptr<monitor> state);
+
+		// SessionWindowProc (static)
+		//
+		// Window procedure for the message-only window that receives session notifications
+		static LRESULT CALLBACK SessionWindowProc(HWND window, UINT message, WPARAM wparam, LPARAM lparam);
+
+		// Start
+		//
+		// Starts the thread and registers for interface change notifications
+		void Start(void);
+
+		// Stop
+		//
+		// Cancels the interface change notifications and signals the thread to stop; does not wait
+		// for it, this may be invoked from the thread itself
+		void Stop(void);
+
+		// m_changed
+		//
+		// Condition variable signaled when a control has been delivered to a subscriber
+		std::condition_variable m_changed;
+
+		// m_coalesce
+		//
+		// Waitable timer signaled at the end of the coalescing interval
+		HANDLE m_coalesce;
+
+		// m_deliverlock
+		//
+		// Serializes Deliver, a thread that has been stopped can still be delivering a control
+		std::mutex m_deliverlock;
+
+		// m_delivering
+		//
+		// Thread delivering a control to the subscribers, if any
+		std::thread::id m_delivering;
+
+		// m_lock
+		//
+		// Synchronization object for the subscribers; never held while a control is being delivered
+		std::mutex m_lock;
+
+		// m_monitor
+		//
+		// State of the most recently started thread
+		std::shared_ptr<monitor> m_monitor;
+
+		// m_notification
+		//
+		// Interface change notification handle
+		HANDLE m_notification = nullptr;
+
+		// m_pending
+		//
+		// Interface change controls waiting for the coalescing interval to elapse
+		std::vector<ServiceControl> m_pending;
+
+		// m_pendinglock
+		//
+		// Synchronization object for the pending controls
+		std::mutex m_pendinglock;
+
+		// m_runlock
+		//
+		// Serializes Start and Stop, which are invoked without m_lock held
+		std::mutex m_runlock;
+
+		// m_subscribers
+		//
+		// Subscribed service harnesses and the number of controls being delivered to each
+		std::map<service_harness*, uint32_t> m_subscribers;
+	};
+
+	// svctl::virtual_memory_pressure
+	//
+	// Memory pressure source that is raised explicitly, used to test services under pressure
+	class virtual_memory_pressure : public memory_pressure_source
+	{
+	public:
+
+		// Constructor / Destructor
+		virtual_memory_pressure()=default;
+		virtual ~virtual_memory_pressure()=default;
+
+		// Raise
+		//
+		// Changes the memory pressure level delivered to the subscribers
+		using memory_pressure_source::Raise;
+
+	private:
+
+		virtual_memory_pressure(const virtual_memory_pressure&)=delete;
+		virtual_memory_pressure& operator=(const virtual_memory_pressure&)=delete;
+	};
+
+	// svctl::shutdown_coordinator
+	//
+	// Coordinates SERVICE_CONTROL_PRESHUTDOWN and SERVICE_CONTROL_SHUTDOWN across every service hosted
+	// by the process.  The first service to receive the control sends it to all of the registered services
+	// in parallel on the thread pool with one shared deadline derived from the host shutdown budget.  A
+	// service that has not finished by the deadline is reported as stopped while the others continue
+	class shutdown_coordinator
+	{
+	public:
+
+		// Constructor / Destructor
+		shutdown_coordinator()=default;
+		~shutdown_coordinator()=default;
+
+		// Dispatch
+		//
+		// Invoked by a service that received a shutdown control; waits for that service's handlers.
+		// Returns ERROR_TIMEOUT if the handlers overran the deadline and the service was stopped
+		DWORD Dispatch(service* instance, ServiceControl control);
+
+		// Instance (static)
+		//
+		// Gets the process-wide coordinator used for services hosted by the service control manager
+		static shutdown_coordinator& Instance(void);
+
+		// Register
+		//
+		// Adds a running service instance to the coordinator
+		void Register(service* instance, const tchar_t* servicename);
+
+		// Unregister
+		//
+		// Removes a service instance; waits for any of it's handlers being run by the coordinator
+		void Unregister(service* instance);
+
+		// Remaining
+		//
+		// Gets the number of milliseconds left in the shutdown budget, INFINITE if not shutting down
+		__declspec(property(get=getRemaining)) uint32_t Remaining;
+		uint32_t getRemaining(void);
+
+		// BUDGET_MARGIN
+		//
+		// Portion of the host budget reserved to report services that overran the deadline
+		static const uint32_t BUDGET_MARGIN = 500;
+
+		// DEFAULT_PRESHUTDOWN_TIMEOUT
+		//
+		// Preshutdown budget used when a service has no PreshutdownTimeout configured
+		static const uint32_t DEFAULT_PRESHUTDOWN_TIMEOUT = 10000;
+
+		// DEFAULT_WAIT_TO_KILL_TIMEOUT
+		//
+		// Shutdown budget used when WaitToKillServiceTimeout has not been configured
+		static const uint32_t DEFAULT_WAIT_TO_KILL_TIMEOUT = 5000;
+
+	private:
+
+		shutdown_coordinator(const shutdown_coordinator&)=delete;
+		shutdown_coordinator& operator=(const shutdown_coordinator&)=delete;
+
+		// participant
+		//
+		// Registered service instance
+		struct participant
+		{
+			tstring		name;							// Service name
+			uint32_t	running = 0;					// Number of handler work items running
+			std::map<ServiceControl, bool> complete;	// Completion of each dispatched control
+		};
+
+		// work
+		//
+		// Context for a handler work item
+		struct work
+		{
+			shutdown_coordinator*		coordinator;	// Owning coordinator
+			service*					instance;		// Target service instance
+			std::shared_ptr<service>	self;			// Reference to a pooled instance
+			ServiceControl				control;		// Shutdown control
+		};
+
+		// Budget
+		//
+		// Determines the budget for a shutdown control; lock must be held
+		uint32_t Budget(ServiceControl control);
+
+		// Complete
+		//
+		// Records the completion of a handler work item
+		void Complete(service* instance, ServiceControl control);
+
+		// Reset
+		//
+		// Ends the rounds that have been started so that a later shutdown starts over; lock must be held
+		void Reset(void);
+
+		// StartRound
+		//
+		// Sends a shutdown control to every eligible service; lock must be held
+		void StartRound(ServiceControl control);
+
+		// WorkCallback (static)
+		//
+		// Thread pool callback that invokes the handlers of a service
+		static void CALLBACK WorkCallback(PTP_CALLBACK_INSTANCE instance, void* context);
+
+		// m_changed
+		//
+		// Condition variable signaled when a work item has completed
+		std::condition_variable m_changed;
+
+		// m_deadline
+		//
+		// Tick count deadline of the most recent round; zero if not shutting down or reset
+		uint64_t m_deadline = 0;
+
+		// m_lock
+		//
+		// Synchronization object
+		std::mutex m_lock;
+
+		// m_participants
+		//
+		// Registered service instances
+		std::map<service*, participant> m_participants;
+
+		// m_rounds
+		//
+		// Deadlines of the rounds that have been started for each control
+		std::map<ServiceControl, uint64_t> m_rounds;
+	};
+
+	// svctl::service
+	//
 	// Primary service base class
 	class service
 	{
+	friend class memory_pressure_source;
+	friend class shutdown_coordinator;
 	public:
 
 		// Destructor
-		virtual ~service()=default;
+		virtual ~service();
 
 	protected:
 		
 		// Instance Constructor
 		service()=default;
 
+		// NOT_SHARDED
+		//
+		// Shard index reported by a service instance that is not a shard
+		static const uint32_t NOT_SHARDED = UINT32_MAX;
+
+		// AddHandler
+		//
+		// Registers a control handler with this instance of the service at runtime; the handlers are
+		// invoked after those in the control handler map.  Returns the handler for RemoveHandler()
+		const control_handler* AddHandler(std::unique_ptr<control_handler> handler);
+		const control_handler* AddHandler(ServiceControl control, function_control_handler::handler_func func, uint32_t budget = INFINITE)
+			{ return AddHandler(std::make_unique<function_control_handler>(control, std::move(func), budget)); }
+
+		// AddStartupPhase
+		//
+		// Declares a named initialization phase from OnStart(); phases run in parallel on worker threads once
+		// OnStart() returns.  SERVICE_RUNNING waits for the required phases, the rest continue in the background
+		void AddStartupPhase(const tchar_t* name, bool required, const std::vector<tstring>& dependencies, worker_group::worker_func func);
+		void AddStartupPhase(const tchar_t* name, bool required, worker_group::worker_func func)
+			{ AddStartupPhase(name, required, std::vector<tstring>(), std::move(func)); }
+
+#ifdef SERVICELIB_BENCHMARK_HOOKS
+		// BenchmarkAcceptedControls
+		//
+		// Benchmark hook; gets what control codes the service will accept
+		DWORD BenchmarkAcceptedControls(void) { return AcceptedControls; }
+
+		// BenchmarkSetStatus
+		//
+		// Benchmark hook; sets a new service status on an instance that has not been started
+		void BenchmarkSetStatus(ServiceStatus status) { SetStatus(status); }
+
+		// BenchmarkStatusFunc
+		//
+		// Benchmark hook; sets the function the status of an instance that has not been started is reported to
+		void BenchmarkStatusFunc(report_status_func func) { m_statusfunc = std::move(func); }
+#endif
+
 		// Continue
 		//
 		// Continues the service from a paused state
 		DWORD Continue(void);
 
+		// CreateChannel<>
+		//
+		// Creates a named channel this service receives from; the channel is closed and drained when
+		// this service reaches STOP_PENDING.  Other services in the process send to it via OpenChannel<>
+		template<typename _type>
+		std::shared_ptr<channel<_type>> CreateChannel(const tchar_t* name, size_t capacity = channel_base::DEFAULT_CAPACITY)
+		{
+			if(name == nullptr) throw winexception(ERROR_INVALID_PARAMETER);
+
+			std::shared_ptr<channel<_type>> created = std::make_shared<channel<_type>>(name, capacity);
+			channel_registry::Instance().Add(created);
+			AttachChannel(created, true);
+
+			return created;
+		}
+
+		// ClaimHandle
+		//
+		// Takes ownership of a handle parked by the previous instance of the service; normally
+		// called from OnStart().  Returns null if the previous instance did not park one
+		HANDLE ClaimHandle(const tchar_t* name) { return handoff_store::Instance().ClaimHandle(m_name.c_str(), name); }
+
+		// ClaimSocket
+		//
+		// Takes ownership of a socket parked by the previous instance of the service; normally
+		// called from OnStart().  Returns INVALID_SOCKET if the previous instance did not park one
+		SOCKET ClaimSocket(const tchar_t* name) { return handoff_store::Instance().ClaimSocket(m_name.c_str(), name); }
+
+		// ClaimState
+		//
+		// Takes the state parked by the previous instance of the service; normally called from OnStart()
+		std::vector<uint8_t> ClaimState(void) { return handoff_store::Instance().ClaimState(m_name.c_str()); }
+
+		// Delay
+		//
+		// Waits for the specified interval on the service clock; returns false if the
+		// service was stopped before the interval elapsed
+		bool Delay(uint32_t milliseconds);
+
+		// HandoffHandle
+		//
+		// Parks a handle for the next instance of the service started in this process; ownership of the handle
+		// is transferred to the process-wide handoff store.  Normally called from a Stop handler.  Throws
+		// ERROR_NOT_SUPPORTED, leaving the handle with the caller, if the service runs in it's own process
+		void HandoffHandle(const tchar_t* name, HANDLE handle) { CheckHandoff(); handoff_store::Instance().ParkHandle(m_name.c_str(), name, handle); }
+
+		// HandoffSocket
+		//
+		// Parks a socket for the next instance of the service started in this process; ownership of the socket
+		// is transferred to the process-wide handoff store.  Normally called from a Stop handler.  Throws
+		// ERROR_NOT_SUPPORTED, leaving the socket with the caller, if the service runs in it's own process
+		void HandoffSocket(const tchar_t* name, SOCKET sock) { CheckHandoff(); handoff_store::Instance().ParkSocket(m_name.c_str(), name, sock); }
+
+		// HandoffState
+		//
+		// Parks a copy of the service state for the next instance of the service started in this process.
+		// Throws ERROR_NOT_SUPPORTED if the service runs in it's own process
+		void HandoffState(const void* data, size_t length) { CheckHandoff(); handoff_store::Instance().ParkState(m_name.c_str(), data, length); }
+
+		// IsPhaseReady
+		//
+		// Determines if a startup phase has completed successfully; false for unknown phases
+		bool IsPhaseReady(const tchar_t* name) const { return (m_phases) ? m_phases->IsReady(name) : false; }
+
+		// LaunchWorker
+		//
+		// Starts a thread owned by the service.  The token passed to the thread is signaled by the Stop
+		// and Shutdown controls and the thread is joined, up to WORKER_JOIN_TIMEOUT, before the service stops;
+		// the instance is not released until the thread has exited
+		void LaunchWorker(const tchar_t* name, worker_group::worker_func func);
+
 		// LocalMain (shared_ptr)
 		//
 		// Entry point when the service is executed as an application.  Enabled if the service class derives
@@ -489,8 +3889,11 @@ namespace svctl {
 		{
 			assert(argc >= 1);				// Service name = argv[0]
 
-			// Create an instance of the derived service class and invoke ServiceMain() with specified context
+			// Create an instance of the derived service class; pooled services take ownership of the instance
 			std::shared_ptr<service> instance = std::make_shared<_derived>();
+			if(context.CallbackEnvironment) return MainPooled(std::move(instance), static_cast<int>(argc), argv, context);
+
+			// Invoke ServiceMain() with specified context
 			instance->Main(static_cast<int>(argc), argv, context);
 
 			// If the service opted for shared_ptr, there isn't much that can be done to force the destructor
@@ -508,21 +3911,84 @@ namespace svctl {
 		{
 			assert(argc >= 1);				// Service name = argv[0]
 
-			// Create an instance of the derived service class and invoke ServiceMain() with specified context
+			// Create an instance of the derived service class; pooled services take ownership of the instance
 			std::unique_ptr<service> instance = std::make_unique<_derived>();
+			if(context.CallbackEnvironment) return MainPooled(std::move(instance), static_cast<int>(argc), argv, context);
+
+			// Invoke ServiceMain() with specified context
 			instance->Main(static_cast<int>(argc), argv, context);
 		}
 
+		// OnHandlerStall
+		//
+		// Invoked from the thread pool when a control handler overruns the budget declared for it; the
+		// handler is still running and may hold the service status lock.  Writes to the debugger by default
+		virtual void OnHandlerStall(const handler_stall& stall);
+
 		// OnStart
 		//
 		// Invoked when the service is started; must be implemented in the service
 		virtual void OnStart(int argc, LPTSTR* argv) = 0;
 
+		// OpenChannel<>
+		//
+		// Opens a named channel created by another service in the process to send to it; the channel
+		// is closed when this service reaches STOP_PENDING
+		template<typename _type>
+		std::shared_ptr<channel<_type>> OpenChannel(const tchar_t* name)
+		{
+			if(name == nullptr) throw winexception(ERROR_INVALID_PARAMETER);
+
+			std::shared_ptr<channel<_type>> opened = std::dynamic_pointer_cast<channel<_type>>(channel_registry::Instance().Find(name));
+			if(!opened) throw winexception(ERROR_INVALID_DATATYPE);
+			AttachChannel(opened, false);
+
+			return opened;
+		}
+
+		// OpenSnapshot
+		//
+		// Maps the snapshot written when the previous instance stopped and sets the file that will be
+		// written when this instance stops.  Returns false if there is nothing valid to restore from,
+		// in which case the service should build it's caches from scratch
+		bool OpenSnapshot(const tchar_t* path, uint32_t version) { return m_snapshot.Open(path, version); }
+
 		// Pause
 		//
 		// Pauses the service
 		DWORD Pause(void);
 
+		// RegisterSnapshot
+		//
+		// Registers a region to be written to the snapshot file when the service is stopped; the
+		// function is invoked after the Stop handlers have run and the workers have been joined,
+		// so the region has to remain valid until then
+		void RegisterSnapshot(const tchar_t* name, std::function<snapshot_region(void)> source) { m_snapshot.Register(name, std::move(source)); }
+
+		// RegisterTrim
+		//
+		// Registers functions invoked when the service is paused to release memory, for example caches,
+		// and when it continues to allow that memory to be used again.  Regrow should not refill eagerly
+		void RegisterTrim(memory_trimmer::trim_func shrink, memory_trimmer::trim_func regrow) { m_trimmer.AddHooks(std::move(shrink), std::move(regrow)); }
+
+		// RegisterTrimRegion
+		//
+		// Registers a region of memory that is paged out of the working set when the service is paused
+		void RegisterTrimRegion(void* address, size_t length) { m_trimmer.AddRegion(address, length); }
+
+		// RemoveHandler
+		//
+		// Removes a control handler registered with AddHandler(); returns once the handler can no
+		// longer be invoked unless called from a control handler, which may still be running it
+		void RemoveHandler(const control_handler* handler);
+
+		// RestoreSnapshot
+		//
+		// Gets a read-only view of a region in the mapped snapshot, empty if it is not present.
+		// The view is not copied and remains valid until the new snapshot is committed, which is
+		// after the Stop handlers have run and the workers have been joined
+		snapshot_region RestoreSnapshot(const tchar_t* name) const { return m_snapshot.Find(name); }
+
 		// ServiceMain (shared_ptr)
 		//
 		// Service entry point, specific for the derived class object.  Enabled if the service class derives
@@ -536,6 +4002,23 @@ namespace svctl {
 			// When running as a regular service, the process type is read from the registry, the standard Win32
 			// service API functions are used for registration and status reporting
 			service_context context = { GetServiceProcessType(argv[0]), ::RegisterServiceCtrlHandlerEx, ::SetServiceStatus };
+			context.ShutdownCoordinator = &shutdown_coordinator::Instance();
+			context.MemoryPressure = &system_memory_pressure::Instance();
+
+			// Apply the placement declared for the service in the dispatched service table, if any
+			service_placement placement;
+			if(placement_table::Instance().Find(argv[0], placement)) context.Placement = &placement;
+
+			// Deliver the status to the service control manager asynchronously if configured to
+			context.AsyncStatus = GetServiceAsyncStatus(argv[0]);
+
+			// Record the controls and status changes if a trace file has been configured for the service
+			std::unique_ptr<service_recorder> recorder = service_recorder::FromRegistry(argv[0]);
+			if(recorder) context = recorder->Attach(context);
+
+			// Publish the status and counters to the shared memory status page for monitoring tools
+			std::unique_ptr<status_publisher> publisher = status_publisher::TryCreate(argv[0]);
+			if(publisher) context = publisher->Attach(context);
 
 			// Create an instance of the derived service class and invoke ServiceMain()
 			std::shared_ptr<service> instance = std::make_shared<_derived>();
@@ -559,6 +4042,23 @@ namespace svctl {
 			// When running as a regular service, the process type is read from the registry, the standard Win32
 			// service API functions are used for registration and status reporting
 			service_context context = { GetServiceProcessType(argv[0]), ::RegisterServiceCtrlHandlerEx, ::SetServiceStatus };
+			context.ShutdownCoordinator = &shutdown_coordinator::Instance();
+			context.MemoryPressure = &system_memory_pressure::Instance();
+
+			// Apply the placement declared for the service in the dispatched service table, if any
+			service_placement placement;
+			if(placement_table::Instance().Find(argv[0], placement)) context.Placement = &placement;
+
+			// Deliver the status to the service control manager asynchronously if configured to
+			context.AsyncStatus = GetServiceAsyncStatus(argv[0]);
+
+			// Record the controls and status changes if a trace file has been configured for the service
+			std::unique_ptr<service_recorder> recorder = service_recorder::FromRegistry(argv[0]);
+			if(recorder) context = recorder->Attach(context);
+
+			// Publish the status and counters to the shared memory status page for monitoring tools
+			std::unique_ptr<status_publisher> publisher = status_publisher::TryCreate(argv[0]);
+			if(publisher) context = publisher->Attach(context);
 
 			// Create an instance of the derived service class and invoke ServiceMain()
 			std::unique_ptr<service> instance = std::make_unique<_derived>();
@@ -571,12 +4071,106 @@ namespace svctl {
 		DWORD Stop(void) { return Stop(ERROR_SUCCESS, ERROR_SUCCESS); }
 		DWORD Stop(DWORD win32exitcode, DWORD serviceexitcode);
 
+		// WaitForPhase
+		//
+		// Waits for a startup phase to complete; returns true only if it completed successfully
+		bool WaitForPhase(const tchar_t* name, uint32_t timeout = INFINITE) const { return (m_phases) ? m_phases->Wait(name, timeout) : false; }
+
+		// Clock
+		//
+		// Gets the clock used for library timers; services should use this clock for
+		// their own timers so they behave correctly under a virtual_clock
+		__declspec(property(get=getClock)) service_clock& Clock;
+		service_clock& getClock(void) const { return *m_clock; }
+
+		// Arena
+		//
+		// Gets the service's monotonic memory resource for data that lives as long as the service
+		__declspec(property(get=getArena)) std::pmr::memory_resource* Arena;
+		std::pmr::memory_resource* getArena(void) { return m_memory.Arena; }
+
 		// Handlers
 		//
 		// Gets the collection of service-specific control handlers
 		__declspec(property(get=getHandlers)) const control_handler_table& Handlers;
 		virtual const control_handler_table& getHandlers(void) const;
 
+		// HandlerStalls
+		//
+		// Gets the number of times a control handler has overrun it's latency budget
+		__declspec(property(get=getHandlerStalls)) uint32_t HandlerStalls;
+		uint32_t getHandlerStalls(void) const { return (m_watchdog) ? m_watchdog->Stalls : 0; }
+
+		// IoLoop
+		//
+		// Gets the service's I/O completion port event loop, created on first use.  The service runs
+		// the loop on a thread of it's own with IoLoop.Run(); Stop, Pause and Continue are posted to it
+		__declspec(property(get=getIoLoop)) io_loop& IoLoop;
+		io_loop& getIoLoop(void);
+
+		// MemoryUsage
+		//
+		// Gets the memory accounting for the service's memory resources
+		__declspec(property(get=getMemoryUsage)) service_memory_usage MemoryUsage;
+		service_memory_usage getMemoryUsage(void) const { return m_memory.Usage; }
+
+		// Placement
+		//
+		// Gets the placement policy of the service; apply it to threads created by the
+		// service with a placement_scope to keep them with the library threads
+		__declspec(property(get=getPlacement)) const service_placement& Placement;
+		const service_placement& getPlacement(void) const { return m_placement; }
+
+		// Pool
+		//
+		// Gets the service's pooled memory resource for steady state allocations
+		__declspec(property(get=getPool)) std::pmr::memory_resource* Pool;
+		std::pmr::memory_resource* getPool(void) { return m_memory.Pool; }
+
+		// Quiescence
+		//
+		// Gets the quiescence domain used by the service's worker threads; wrap work that touches
+		// shared state in a quiescence_domain::region and it will be drained before the Pause
+		// handlers are invoked and parked until the service has been continued
+		__declspec(property(get=getQuiescence)) quiescence_domain& Quiescence;
+		quiescence_domain& getQuiescence(void) { return m_quiescence; }
+
+		// Shard
+		//
+		// Gets the index of this instance within a ServiceTableShards<> entry, NOT_SHARDED if it isn't a shard
+		__declspec(property(get=getShard)) uint32_t Shard;
+		uint32_t getShard(void) const;
+
+		// ShutdownBudget
+		//
+		// Gets the number of milliseconds left for shutdown handlers, INFINITE if not shutting down
+		__declspec(property(get=getShutdownBudget)) uint32_t ShutdownBudget;
+		uint32_t getShutdownBudget(void) const { return (m_shutdown) ? m_shutdown->Remaining : INFINITE; }
+
+		// SnapshotStatistics
+		//
+		// Gets the time spent restoring and saving the service snapshot
+		__declspec(property(get=getSnapshotStatistics)) snapshot_statistics SnapshotStatistics;
+		snapshot_statistics getSnapshotStatistics(void) const { return m_snapshot.Statistics; }
+
+		// StartupPhases
+		//
+		// Gets the progress of each startup phase declared by OnStart()
+		__declspec(property(get=getStartupPhases)) std::vector<startup_phase_info> StartupPhases;
+		std::vector<startup_phase_info> getStartupPhases(void) const { return (m_phases) ? m_phases->Phases : std::vector<startup_phase_info>(); }
+
+		// TrimStatistics
+		//
+		// Gets the working set before and after the most recent pause
+		__declspec(property(get=getTrimStatistics)) trim_statistics TrimStatistics;
+		trim_statistics getTrimStatistics(void) const { return m_trimmer.Statistics; }
+
+		// WorkerStatistics
+		//
+		// Gets the join time of each worker launched by the service once it has been stopped
+		__declspec(property(get=getWorkerStatistics)) std::vector<worker_statistics> WorkerStatistics;
+		std::vector<worker_statistics> getWorkerStatistics(void) const { return (m_workers) ? m_workers->Statistics : std::vector<worker_statistics>(); }
+
 	private:
 
 		service(const service&)=delete;
@@ -592,26 +4186,102 @@ namespace svctl {
 		// Standard wait hint used when a pending status has been set
 		const uint32_t PENDING_WAIT_HINT = 2000;
 
+		// QUIESCE_TIMEOUT
+		//
+		// Maximum time Pause() waits for the worker threads to leave their regions
+		const uint32_t QUIESCE_TIMEOUT = 30000;
+
+		// REQUIRED_PHASES_TIMEOUT
+		//
+		// Maximum time to wait for the required startup phases before the start fails
+		const uint32_t REQUIRED_PHASES_TIMEOUT = 120000;
+
 		// STARTUP_WAIT_HINT
 		//
 		// Wait hint used during the initial service START_PENDING status
 		const uint32_t STARTUP_WAIT_HINT = 5000;
 
+		// WORKER_JOIN_TIMEOUT
+		//
+		// Maximum time to wait for the worker threads to exit when the service is stopped
+		const uint32_t WORKER_JOIN_TIMEOUT = 5000;
+
 		// Abort
 		//
-		// Causes an abnormal termination of the service
-		void Abort(std::exception_ptr exception);
+		// Causes an abnormal termination of the service; only returns, with the exit code, for a pooled instance
+		DWORD Abort(std::exception_ptr exception);
+
+		// AttachChannel
+		//
+		// Records a channel this service is an endpoint of so it can be closed at STOP_PENDING
+		void AttachChannel(const std::shared_ptr<channel_base>& channel, bool receiver);
+
+		// CheckHandoff
+		//
+		// Throws ERROR_NOT_SUPPORTED if nothing can be handed off to the next instance of the service
+		void CheckHandoff(void) const;
+
+		// Checkpoint
+		//
+		// Timer callback that reports pending status checkpoints; also invoked to report progress
+		void Checkpoint(void);
 
 		// ControlHandler
 		//
 		// Service control request handler method
 		DWORD ControlHandler(ServiceControl control, DWORD eventtype, void* eventdata);
 
-		// ServiceMain
+		// DispatchControl
+		//
+		// Delivers a control that originates in the process through the registered handler
+		DWORD DispatchControl(ServiceControl control, DWORD eventtype, void* eventdata);
+
+		// DispatchDepth (static)
+		//
+		// Gets the number of runtime handler dispatches in progress on the calling thread
+		static uint32_t& DispatchDepth(void);
+
+		// ForEachHandler
+		//
+		// Invokes a function for each control handler in the map and then each handler registered at
+		// runtime, until the function returns false.  Returns false if the iteration was stopped
+		bool ForEachHandler(const std::function<bool(const control_handler& handler)>& func) const;
+
+		// ForceStop
+		//
+		// Stops the service without waiting for the handlers that are still running
+		void ForceStop(DWORD win32exitcode);
+
+		// HandlesControl
+		//
+		// Determines if the service has at least one handler for a control
+		bool HandlesControl(ServiceControl control) const;
+
+		// InvokeHandler
+		//
+		// Invokes a single control handler, watching it if it declared a latency budget
+		DWORD InvokeHandler(const control_handler& handler, DWORD eventtype, void* eventdata);
+
+		// InvokeHandlers
 		//
-		// Service entry point
+		// Invokes the service-specific handlers registered for a control
+		DWORD InvokeHandlers(ServiceControl control, DWORD eventtype, void* eventdata);
+
+		// Main
+		//
+		// Service entry point; blocks until the service has stopped
 		void Main(int argc, tchar_t** argv, const service_context& context);
 
+		// MainPooled (static)
+		//
+		// Service entry point for a thread pool hosted service; returns once started
+		static void MainPooled(std::shared_ptr<service> instance, int argc, tchar_t** argv, const service_context& context);
+
+		// SavePendingSnapshot
+		//
+		// Writes and commits a snapshot that could not be written when the service was stopped
+		void SavePendingSnapshot(void);
+
 		// SetNonPendingStatus
 		//
 		// Sets a non-pending status
@@ -623,6 +4293,26 @@ namespace svctl {
 		// Sets an auto-checkpoint pending status
 		void SetPendingStatus(ServiceStatus status);
 
+		// SignalStopped
+		//
+		// Releases the main thread wait or the pooled instance reference
+		void SignalStopped(void);
+
+		// SignalStopping
+		//
+		// Cancels the I/O loop, signals the workers and closes the channels; status lock must be held
+		void SignalStopping(void);
+
+		// Startup
+		//
+		// Registers the control handler and starts the service
+		bool Startup(int argc, tchar_t** argv, const service_context& context);
+
+		// StartupFailed
+		//
+		// Joins the workers started before a startup failure and reports SERVICE_STOPPED
+		void StartupFailed(DWORD win32exitcode);
+
 		// SetStatus
 		//
 		// Sets a new service status
@@ -630,6 +4320,11 @@ namespace svctl {
 		void SetStatus(ServiceStatus status, uint32_t win32exitcode) { SetStatus(status, win32exitcode, ERROR_SUCCESS); }
 		void SetStatus(ServiceStatus status, uint32_t win32exitcode, uint32_t serviceexitcode);
 
+		// UpdateHandlers
+		//
+		// Publishes a new snapshot of the runtime control handlers and re-reports the accepted controls
+		void UpdateHandlers(const std::function<void(dynamic_handler_table& table)>& update);
+
 		// TrySetStatus
 		//
 		// Sets a new service status, does not allow exceptions to propogate
@@ -643,14 +4338,130 @@ namespace svctl {
 		__declspec(property(get=getAcceptedControls)) DWORD AcceptedControls;
 		DWORD getAcceptedControls(void);
 
+		// m_channels
+		//
+		// Channels this service is an endpoint of, and whether it is the receiver
+		std::vector<std::pair<std::shared_ptr<channel_base>, bool>> m_channels;
+
+		// m_checkpointlock
+		//
+		// Serializes the checkpoints reported by the timer and by a pause waiting for quiescence
+		std::mutex m_checkpointlock;
+
+		// m_clock
+		//
+		// Clock used for the checkpoint timer and timed waits
+		service_clock* m_clock = &realtime_clock::Instance();
+
+		// m_controlchannel
+		//
+		// Shared memory control channel; created if the service has payload handlers
+		std::unique_ptr<control_channel_host> m_controlchannel;
+
+		// m_dispatchfunc
+		//
+		// Delivers a control through the wrappers of the registered handler, if any
+		dispatch_control_func m_dispatchfunc;
+
+		// m_environ
+		//
+		// Thread pool callback environment; null for the default process pool
+		PTP_CALLBACK_ENVIRON m_environ = nullptr;
+
+		// m_handlerepochs
+		//
+		// Quiescence domain entered while reading the runtime control handlers
+		mutable quiescence_domain m_handlerepochs;
+
+		// m_handlers
+		//
+		// Current snapshot of the runtime control handlers, read without a lock
+		std::atomic<const dynamic_handler_table*> m_handlers { nullptr };
+
+		// m_handlertable
+		//
+		// Owner of the current snapshot of the runtime control handlers
+		std::unique_ptr<const dynamic_handler_table> m_handlertable;
+
+		// m_ioloop
+		//
+		// I/O completion port event loop; created on first use
+		std::unique_ptr<io_loop> m_ioloop;
+
+		// m_memory
+		//
+		// Memory resources owned by the service instance
+		service_memory m_memory;
+
+		// m_name
+		//
+		// Service name; identifies the state and handles handed off between instances
+		tstring m_name;
+
+		// m_ownprocess
+		//
+		// Flag indicating the service is the only one in it's process; the working set is emptied on pause
+		// and nothing can be handed off, the next instance of the service will be started in a new process
+		bool m_ownprocess = true;
+
+		// m_pendingstatus
+		//
+		// Pending status being reported by the checkpoint timer
+		SERVICE_STATUS m_pendingstatus;
+
+		// m_phases
+		//
+		// Startup phases declared by OnStart(), if any; shared with the workers running them
+		std::shared_ptr<startup_phases> m_phases;
+
+		// m_placement
+		//
+		// Placement policy applied to the service threads and library callbacks
+		service_placement m_placement;
+
+		// m_pressure
+		//
+		// Memory pressure source the service has subscribed to, if any
+		memory_pressure_source* m_pressure = nullptr;
+
+		// m_quiescence
+		//
+		// Quiescence domain drained by Pause and released by Continue
+		quiescence_domain m_quiescence;
+
+		// m_reporter
+		//
+		// Asynchronous status reporter; only created if the context asked for one
+		std::unique_ptr<status_reporter> m_reporter;
+
+		// m_self
+		//
+		// Reference held by a pooled service instance to itself until stopped
+		std::shared_ptr<service> m_self;
+
+		// m_shutdown
+		//
+		// Shutdown coordinator the service is registered with, if any
+		shutdown_coordinator* m_shutdown = nullptr;
+
+		// m_snapshot
+		//
+		// Snapshot of the service's cache regions
+		service_snapshot m_snapshot;
+
+		// m_snapshotpending
+		//
+		// Flag indicating the snapshot has to be written once the handlers and workers have exited
+		std::atomic<bool> m_snapshotpending { false };
+
 		// m_status
 		//
-		// Current service status
-		ServiceStatus m_status = ServiceStatus::Stopped;
+		// Current service status; atomic so the shutdown coordinator can read it without the status lock
+		std::atomic<ServiceStatus> m_status { ServiceStatus::Stopped };
 
 		// m_statusexception
 		//
-		// Holds any exception thrown by a status worker thread
+		// Holds any exception thrown by the checkpoint timer callback
 		std::exception_ptr m_statusexception;
 
 		// m_statusfunc
@@ -663,20 +4474,107 @@ namespace svctl {
 		// Synchronization object for status updates
 		std::recursive_mutex m_statuslock;
 
-		// m_statussignal
+		// m_statuspending
+		//
+		// Flag indicating that the checkpoint timer is reporting a pending status
+		std::atomic<bool> m_statuspending { false };
+
+		// m_statustimer
+		//
+		// Clock timer used to report pending status checkpoints
+		void* m_statustimer = nullptr;
+
+		// m_stopcondition
+		//
+		// Condition variable signaled when the service has been stopped
+		std::condition_variable m_stopcondition;
+
+		// m_stoplock
+		//
+		// Synchronization object for m_stopped
+		std::mutex m_stoplock;
+
+		// m_stopped
+		//
+		// Flag indicating that SERVICE_CONTROL_STOP has been processed
+		bool m_stopped = false;
+
+		// m_trimmer
 		//
-		// Signal (event) object used to stop a pending status thread
-		signal<signal_type::ManualReset> m_statussignal;
+		// Shrink and regrow hooks and regions released while the service is paused
+		memory_trimmer m_trimmer;
 
-		// m_statusworker
+		// m_watchdog
 		//
-		// Pending status worker thread
-		std::thread m_statusworker;
+		// Detects control handlers that overrun their latency budget; closed by Main() once the service has stopped
+		std::unique_ptr<handler_watchdog> m_watchdog;
 
-		// m_stopsignal
+		// m_workers
 		//
-		// Signal indicating that SERVICE_CONTROL_STOP has been triggered
-		signal<signal_type::ManualReset> m_stopsignal;
+		// Threads launched by the service; created on first use
+		std::unique_ptr<worker_group> m_workers;
+	};
+
+	// svctl::latency_distribution
+	//
+	// Distribution of the latency injected by a fault_profile
+	enum class latency_distribution
+	{
+		None,							// No latency is injected
+		Constant,						// Always the base latency
+		Uniform,						// Uniform between zero and twice the base latency
+		Exponential,					// Exponential with the base latency as the mean
+	};
+
+	// svctl::fault_profile
+	//
+	// Latency and failure injection settings for a service_harness callback
+	struct fault_profile
+	{
+		latency_distribution	Distribution;	// Latency distribution
+		uint32_t				Latency;		// Base latency in milliseconds
+		uint32_t				Jitter;			// Maximum additional random latency in milliseconds
+		double					FailureRate;	// Probability of failure (0.0 - 1.0)
+		DWORD					FailureCode;	// Error code reported on failure
+	};
+
+	// svctl::harness_statistics
+	//
+	// Control latency and status transition timings collected by service_harness,
+	// all times are measured on the harness clock in milliseconds
+	struct harness_statistics
+	{
+		uint32_t	Controls;					// Number of controls sent
+		uint64_t	ControlTime;				// Total time spent sending controls
+		uint32_t	MaxControlTime;				// Longest time spent sending a control
+		uint32_t	Transitions;				// Number of completed status transitions
+		uint64_t	TransitionTime;				// Total status transition time
+		uint32_t	MaxTransitionTime;			// Longest status transition time
+		uint32_t	InjectedFailures;			// Number of injected callback failures
+		uint64_t	InjectedLatency;			// Total injected callback latency
+	};
+
+	// svctl::replay_control
+	//
+	// Comparison of a replayed control against the recorded control
+	struct replay_control
+	{
+		ServiceControl	Control;			// Control code
+		DWORD			EventType;			// Event type
+		DWORD			ExpectedResult;		// Recorded handler result
+		DWORD			ActualResult;		// Handler result from the replay
+		uint32_t		ExpectedLatency;	// Recorded handler latency (microseconds)
+		uint32_t		ActualLatency;		// Handler latency from the replay (microseconds)
+	};
+
+	// svctl::replay_result
+	//
+	// Result of a service_harness trace replay operation
+	struct replay_result
+	{
+		std::vector<replay_control>	Controls;		// Replayed controls
+		ServiceStatus	ExpectedStatus;				// Final recorded status
+		ServiceStatus	ActualStatus;				// Final status after the replay
 	};
 
 	// svctl::service_harness
@@ -686,8 +4584,9 @@ namespace svctl {
 	{
 	public:
 	
-		// Constructor / Destructor
+		// Constructors / Destructor
 		service_harness();
+		explicit service_harness(service_pool& pool);
 		virtual ~service_harness();
 
 		// Continue
@@ -700,6 +4599,17 @@ namespace svctl {
 		// Sends ServiceControl::Pause and waits for ServiceStatus::Paused
 		void Pause(void);
 
+		// ResetStatistics
+		//
+		// Resets the collected control and transition statistics
+		void ResetStatistics(void);
+
+		// Replay
+		//
+		// Reissues the controls recorded in a trace file against the running service; the
+		// speed is a multiplier of the original timing or zero to send them back-to-back
+		replay_result Replay(const tchar_t* path, float speed = 1.0f);
+
 		// SendControl
 		//
 		// Sends a control code to the service
@@ -735,6 +4645,14 @@ namespace svctl {
 		// Waits for the service to reach the specified status
 		bool WaitForStatus(ServiceStatus status, uint32_t timeout = INFINITE);
 
+		// AsyncStatus
+		//
+		// Gets/sets the flag provided to the service to report status asynchronously;
+		// can only be changed while the service is not running
+		__declspec(property(get=getAsyncStatus, put=putAsyncStatus)) bool AsyncStatus;
+		bool getAsyncStatus(void) { std::lock_guard<std::mutex> critsec(m_statuslock); return m_asyncstatus; }
+		void putAsyncStatus(bool value);
+
 		// CanContinue
 		//
 		// Determines if the service can be continued
@@ -753,12 +4671,72 @@ namespace svctl {
 		__declspec(property(get=getCanStop)) bool CanStop;
 		bool getCanStop(void);
 
+		// Clock
+		//
+		// Gets/sets the clock used by the harness and the service; can only be
+		// changed while the service is not running
+		__declspec(property(get=getClock, put=putClock)) service_clock& Clock;
+		service_clock& getClock(void) const { return *m_clock; }
+		void putClock(service_clock& value);
+
+		// Events
+		//
+		// Gets/sets the source of the TimeChange and NetBind controls sent to the service; can only
+		// be changed while the service is not running
+		__declspec(property(get=getEvents, put=putEvents)) system_event_source* Events;
+		system_event_source* getEvents(void) { std::lock_guard<std::mutex> critsec(m_statuslock); return m_events; }
+		void putEvents(system_event_source* value);
+
+		// MemoryPressure
+		//
+		// Gets/sets the memory pressure source provided to the service; can only be
+		// changed while the service is not running
+		__declspec(property(get=getMemoryPressure, put=putMemoryPressure)) memory_pressure_source* MemoryPressure;
+		memory_pressure_source* getMemoryPressure(void) { std::lock_guard<std::mutex> critsec(m_statuslock); return m_pressure; }
+		void putMemoryPressure(memory_pressure_source* value);
+
+		// Placement
+		//
+		// Gets/sets the placement policy provided to the service; can only be
+		// changed while the service is not running
+		__declspec(property(get=getPlacement, put=putPlacement)) service_placement Placement;
+		service_placement getPlacement(void) { std::lock_guard<std::mutex> critsec(m_statuslock); return m_placement; }
+		void putPlacement(const service_placement& value);
+
+		// RegisterFaults
+		//
+		// Gets/sets the latency and failure injected into control handler registration
+		__declspec(property(get=getRegisterFaults, put=putRegisterFaults)) fault_profile RegisterFaults;
+		fault_profile getRegisterFaults(void) { std::lock_guard<std::mutex> critsec(m_faultlock); return m_registerfaults; }
+		void putRegisterFaults(const fault_profile& value) { std::lock_guard<std::mutex> critsec(m_faultlock); m_registerfaults = value; }
+
+		// ShutdownCoordinator
+		//
+		// Gets/sets the coordinator that fans the shutdown controls out to every service in the process;
+		// can only be changed while the service is not running
+		__declspec(property(get=getShutdownCoordinator, put=putShutdownCoordinator)) shutdown_coordinator* ShutdownCoordinator;
+		shutdown_coordinator* getShutdownCoordinator(void) { std::lock_guard<std::mutex> critsec(m_statuslock); return m_shutdown; }
+		void putShutdownCoordinator(shutdown_coordinator* value);
+
+		// Statistics
+		//
+		// Gets a copy of the collected control and transition statistics
+		__declspec(property(get=getStatistics)) harness_statistics Statistics;
+		harness_statistics getStatistics(void) { std::lock_guard<std::mutex> critsec(m_faultlock); return m_statistics; }
+
 		// Status
 		//
 		// Gets a copy of the current service status
 		__declspec(property(get=getStatus)) SERVICE_STATUS Status;
 		SERVICE_STATUS getStatus(void) { std::lock_guard<std::mutex> critsec(m_statuslock); return m_status; }
 
+		// StatusFaults
+		//
+		// Gets/sets the latency and failure injected into service status reporting
+		__declspec(property(get=getStatusFaults, put=putStatusFaults)) fault_profile StatusFaults;
+		fault_profile getStatusFaults(void) { std::lock_guard<std::mutex> critsec(m_faultlock); return m_statusfaults; }
+		void putStatusFaults(const fault_profile& value) { std::lock_guard<std::mutex> critsec(m_faultlock); m_statusfaults = value; }
+
 	protected:
 
 		// LaunchService
@@ -771,6 +4749,27 @@ namespace svctl {
 		service_harness(const service_harness&)=delete;
 		service_harness& operator=(const service_harness&)=delete;
 
+		// REPLAY_SETTLE_TIMEOUT
+		//
+		// Time allowed for the final status to be reached after a trace replay
+		static const uint32_t REPLAY_SETTLE_TIMEOUT = 5000;
+
+		// START_TIMEOUT
+		//
+		// Time allowed for SERVICE_START_PENDING to be set, and for the checkpoint to advance
+		// when the service has not provided a wait hint
+		static const uint32_t START_TIMEOUT = 30000;
+
+		// InjectFault
+		//
+		// Applies a fault_profile to a callback; returns true if the callback should fail
+		bool InjectFault(const fault_profile& profile);
+
+		// RecordTime
+		//
+		// Records a control or transition time into the statistics
+		void RecordTime(uint64_t started, bool transition);
+
 		// RegisterHandlerFunc
 		//
 		// Function invoked by the service to register it's control handler
@@ -822,21 +4821,91 @@ namespace svctl {
 		// Final overload in the variadic chain for Start()
 		void Start(std::vector<tstring>&& argvector);
 
+		// m_asyncstatus
+		//
+		// Flag provided to the service to report status asynchronously
+		bool m_asyncstatus = false;
+
+		// m_clock
+		//
+		// Clock used by the harness and provided to the service
+		service_clock* m_clock = &realtime_clock::Instance();
+
 		// m_context
 		//
 		// Context pointer registered for the service control handler
 		void* m_context = nullptr;
 
+		// m_environ
+		//
+		// Thread pool callback environment when hosting the service on a service_pool
+		PTP_CALLBACK_ENVIRON m_environ = nullptr;
+
+		// m_events
+		//
+		// Source of the TimeChange and NetBind controls sent to the service, if any
+		system_event_source* m_events = nullptr;
+
+		// m_faultlock
+		//
+		// Synchronization object for fault injection and statistics
+		std::mutex m_faultlock;
+
+		// m_random
+		//
+		// Random number generator for fault injection; default seeded for reproducibility
+		std::mt19937 m_random;
+
 		// m_handler
 		//
 		// Service control handler callback function pointer
 		LPHANDLER_FUNCTION_EX m_handler = nullptr;
 
+		// m_launched
+		//
+		// Flag indicating the service has been launched and not yet observed as stopped
+		bool m_launched = false;
+
 		// m_mainthread
 		//
 		// Main service thread
 		std::thread m_mainthread;
 
+		// m_placement
+		//
+		// Placement policy provided to the service
+		service_placement m_placement;
+
+		// m_pressure
+		//
+		// Memory pressure source provided to the service, if any
+		memory_pressure_source* m_pressure = nullptr;
+
+		// m_publisher
+		//
+		// Publishes the service status to the shared memory status page, if it could be created
+		std::unique_ptr<status_publisher> m_publisher;
+
+		// m_recorder
+		//
+		// Records the controls and status changes if a trace file has been configured for the service
+		std::unique_ptr<service_recorder> m_recorder;
+
+		// m_registerfaults
+		//
+		// Faults injected into RegisterHandlerFunc
+		fault_profile m_registerfaults = {};
+
+		// m_shutdown
+		//
+		// Shutdown coordinator provided to the service, if any
+		shutdown_coordinator* m_shutdown = nullptr;
+
+		// m_statistics
+		//
+		// Collected control and transition statistics
+		harness_statistics m_statistics = {};
+
 		// m_status
 		//
 		// Current service status
@@ -847,12 +4916,280 @@ namespace svctl {
 		// Condition variable set when service status has changed
 		std::condition_variable m_statuschanged;
 
+		// m_statusfaults
+		//
+		// Faults injected into SetStatusFunc
+		fault_profile m_statusfaults = {};
+
 		// m_statuslock
 		//
 		// Critical section to serialize access to the SERVICE_STATUS
 		std::mutex m_statuslock;
 	};
 
+	// svctl::local_control
+	//
+	// Control request sent to a local_control_manager; an empty service name
+	// sends the control to every service hosted by the manager
+	struct local_control
+	{
+		// SERVICE_NAME_LENGTH
+		//
+		// Maximum length of a service name, including the terminating null
+		static const size_t SERVICE_NAME_LENGTH = 257;
+
+		tchar_t		ServiceName[SERVICE_NAME_LENGTH];	// Target service name
+		DWORD		Control;							// Service control code
+		DWORD		EventType;							// Control-specific event type
+	};
+
+	// svctl::local_control_result
+	//
+	// Result of a control sent to a local_control_manager
+	struct local_control_result
+	{
+		tchar_t			ServiceName[local_control::SERVICE_NAME_LENGTH];	// Service name
+		DWORD			Result;						// Result returned by the service
+		SERVICE_STATUS	Status;						// Service status after the control
+	};
+
+	// svctl::local_message_header
+	//
+	// Header of a local_control_manager request or response message
+	struct local_message_header
+	{
+		// MAGIC
+		//
+		// Magic number at the start of each message ('SVLC')
+		static const uint32_t MAGIC = 0x434C5653;
+
+		// BATCH_MAX
+		//
+		// Maximum number of controls in a request message
+		static const uint32_t BATCH_MAX = 256;
+
+		// RESULT_MAX
+		//
+		// Maximum number of results in a response message
+		static const uint32_t RESULT_MAX = 1024;
+
+		uint32_t	magic;							// MAGIC
+		uint32_t	count;							// Number of records after the header
+		uint32_t	result;							// Response only; set if the request was rejected
+	};
+
+	// svctl::local_control_manager
+	//
+	// Hosts a collection of services in the current process without the service control manager.
+	// Each service is run through a service_harness and batches of controls are accepted over a
+	// named pipe, fanned out to the services in parallel and answered in a single reply
+	class local_control_manager
+	{
+	public:
+
+		// Instance Constructor
+		local_control_manager(const tchar_t* pipename, const std::vector<service_table_entry>& entries);
+
+		// Destructor
+		~local_control_manager()=default;
+
+		// Run
+		//
+		// Starts the services and processes control requests until every service has stopped
+		int Run(void);
+
+	private:
+
+		local_control_manager(const local_control_manager&)=delete;
+		local_control_manager& operator=(const local_control_manager&)=delete;
+
+		// STOPPED_POLL_INTERVAL
+		//
+		// Interval at which pipe operations check whether every service has stopped
+		static const uint32_t STOPPED_POLL_INTERVAL = 250;
+
+		// local_service
+		//
+		// Harness used to host a single service table entry
+		class local_service : public service_harness
+		{
+		public:
+
+			// Instance Constructor
+			local_service(const service_table_entry& entry) : m_localmain(entry.LocalMain), m_name(entry.Name)
+			{
+				Placement = entry.Placement;
+				Events = &system_event_source::Instance();
+				ShutdownCoordinator = &shutdown_coordinator::Instance();
+			}
+
+			// Name
+			//
+			// Gets the service name
+			__declspec(property(get=getName)) const tchar_t* Name;
+			const tchar_t* getName(void) const { return m_name.c_str(); }
+
+		private:
+
+			// LaunchService (service_harness)
+			//
+			// Launches the service through the service table entry
+			virtual void LaunchService(int argc, LPTSTR* argv, const service_context& context)
+			{
+				if(m_localmain == nullptr) throw winexception(ERROR_INVALID_FUNCTION);
+				m_localmain(static_cast<DWORD>(argc), argv, context);
+			}
+
+			// m_localmain
+			//
+			// Service LocalMain() entry point
+			const local_main_func m_localmain;
+
+			// m_name
+			//
+			// Service name
+			const tstring m_name;
+		};
+
+		// AllStopped
+		//
+		// Determines if every hosted service has stopped
+		bool AllStopped(void);
+
+		// Process
+		//
+		// Processes a request message and generates the response message; returns the response length
+		size_t Process(const uint8_t* request, size_t length, uint8_t* response);
+
+		// WaitForPipe
+		//
+		// Waits for an overlapped pipe operation; returns false if every service stopped first
+		bool WaitForPipe(HANDLE pipe, OVERLAPPED& overlapped, DWORD& bytes);
+
+		// m_pipename
+		//
+		// Name of the control request pipe
+		tstring m_pipename;
+
+		// m_services
+		//
+		// Hosted services
+		std::vector<std::unique_ptr<local_service>> m_services;
+	};
+
+	// svctl::local_control_client
+	//
+	// Sends batches of controls to the services hosted by a local_control_manager
+	class local_control_client
+	{
+	public:
+
+		// Instance Constructor
+		explicit local_control_client(const tchar_t* pipename);
+
+		// Destructor
+		~local_control_client();
+
+		// Control
+		//
+		// Sends a single control to a service; an empty name sends it to every service
+		DWORD Control(const tchar_t* servicename, ServiceControl control, SERVICE_STATUS* status = nullptr);
+
+		// Send
+		//
+		// Sends a batch of controls in a single round trip
+		std::vector<local_control_result> Send(const std::vector<local_control>& controls);
+
+	private:
+
+		local_control_client(const local_control_client&)=delete;
+		local_control_client& operator=(const local_control_client&)=delete;
+
+		// m_pipe
+		//
+		// Connected pipe handle
+		HANDLE m_pipe = INVALID_HANDLE_VALUE;
+	};
+
+	// svctl::shard_status
+	//
+	// Status aggregated over every shard of a sharded service
+	struct shard_status
+	{
+		ServiceStatus	Status;			// Common status of the shards, or the status of the first shard not RUNNING
+		uint32_t		Running;		// Number of shards that are RUNNING
+		uint32_t		Paused;			// Number of shards that are PAUSED
+		uint32_t		Pending;		// Number of shards with a pending status
+		uint32_t		Stopped;		// Number of shards that are STOPPED
+	};
+
+	// svctl::shard_controller
+	//
+	// Controls the shards of a sharded service through the service control manager
+	class shard_controller
+	{
+	public:
+
+		// Instance Constructor
+		shard_controller(const tchar_t* name, uint32_t count);
+
+		// Destructor
+		~shard_controller();
+
+		// Aggregate
+		//
+		// Queries every shard and aggregates their status
+		shard_status Aggregate(void);
+
+		// Broadcast
+		//
+		// Sends a control to every shard; returns the result from each shard
+		std::vector<DWORD> Broadcast(ServiceControl control);
+
+		// Control
+		//
+		// Sends a control to a single shard
+		DWORD Control(uint32_t shard, ServiceControl control, SERVICE_STATUS* status = nullptr);
+
+		// Query
+		//
+		// Queries the status of a single shard
+		SERVICE_STATUS Query(uint32_t shard);
+
+		// RollingRestart
+		//
+		// Restarts the shards one at a time; a shard is only stopped when every other shard is
+		// RUNNING and the next one is not stopped until it has come back.  The timeout applies to
+		// each stop and start of a shard
+		void RollingRestart(uint32_t timeout);
+
+		// Count
+		//
+		// Gets the number of shards
+		__declspec(property(get=getCount)) uint32_t Count;
+		uint32_t getCount(void) const { return static_cast<uint32_t>(m_shards.size()); }
+
+	private:
+
+		shard_controller(const shard_controller&)=delete;
+		shard_controller& operator=(const shard_controller&)=delete;
+
+		// WaitForStatus
+		//
+		// Polls a shard until it reaches the specified status; false if the timeout elapsed
+		bool WaitForStatus(uint32_t shard, ServiceStatus status, uint32_t timeout);
+
+		// m_scm
+		//
+		// Service control manager handle
+		SC_HANDLE m_scm = nullptr;
+
+		// m_shards
+		//
+		// Service handle of each shard
+		std::vector<SC_HANDLE> m_shards;
+	};
+
 } // namespace svctl
 
 //-----------------------------------------------------------------------------
@@ -868,6 +5205,76 @@ namespace svctl {
 
 using ServiceException = svctl::winexception;
 
+//-----------------------------------------------------------------------------
+// ::ServiceControlChannel
+//
+// Global namespace alias for svctl::control_channel
+
+using ServiceControlChannel = svctl::control_channel;
+
+//-----------------------------------------------------------------------------
+// ::ServiceControlClient
+//
+// Global namespace alias for svctl::local_control_client
+
+using ServiceControlClient = svctl::local_control_client;
+
+//-----------------------------------------------------------------------------
+// ::ServiceControlPayload
+//
+// Global namespace alias for svctl::control_payload
+
+using ServiceControlPayload = svctl::control_payload;
+
+//-----------------------------------------------------------------------------
+// ::ServicePlacement
+//
+// Global namespace alias for svctl::service_placement
+
+using ServicePlacement = svctl::service_placement;
+
+//-----------------------------------------------------------------------------
+// ::ServicePool
+//
+// Global namespace alias for svctl::service_pool
+
+using ServicePool = svctl::service_pool;
+
+//-----------------------------------------------------------------------------
+// ::ServiceShardController
+//
+// Global namespace alias for svctl::shard_controller
+
+using ServiceShardController = svctl::shard_controller;
+
+//-----------------------------------------------------------------------------
+// ::ServiceStatusReader
+//
+// Global namespace alias for svctl::status_reader
+
+using ServiceStatusReader = svctl::status_reader;
+
+//-----------------------------------------------------------------------------
+// ::ServiceSystemEvents
+//
+// Global namespace alias for svctl::system_event_source
+
+using ServiceSystemEvents = svctl::system_event_source;
+
+//-----------------------------------------------------------------------------
+// ::VirtualClock
+//
+// Global namespace alias for svctl::virtual_clock
+
+using VirtualClock = svctl::virtual_clock;
+
+//-----------------------------------------------------------------------------
+// ::VirtualMemoryPressure
+//
+// Global namespace alias for svctl::virtual_memory_pressure
+
+using VirtualMemoryPressure = svctl::virtual_memory_pressure;
+
 //-----------------------------------------------------------------------------
 // ::ServiceControlHandler<>
 //
@@ -891,28 +5298,40 @@ private:
 	typedef DWORD(_derived::*result_handler)(void);
 	typedef DWORD(_derived::*result_handler_ex)(DWORD, void*);
 
+	// payload_handler
+	//
+	// Custom control handlers that accept a request and return a reply through a ServiceControlChannel
+	typedef DWORD(_derived::*payload_handler)(svctl::control_payload&);
+
 public:
 
 	// Instance Constructors
-	ServiceControlHandler(ServiceControl control, void_handler func) :
-		control_handler(control), m_void_handler(std::bind(func, std::placeholders::_1)) {}
-	ServiceControlHandler(ServiceControl control, void_handler_ex func) :
-		control_handler(control), m_void_handler_ex(std::bind(func, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3)) {}
-	ServiceControlHandler(ServiceControl control, result_handler func) :
-		control_handler(control), m_result_handler(std::bind(func, std::placeholders::_1)) {}
-	ServiceControlHandler(ServiceControl control, result_handler_ex func) :
-		control_handler(control), m_result_handler_ex(std::bind(func, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3)) {}
+	ServiceControlHandler(ServiceControl control, void_handler func, uint32_t budget = INFINITE) :
+		control_handler(control, budget), m_void_handler(std::bind(func, std::placeholders::_1)) {}
+	ServiceControlHandler(ServiceControl control, void_handler_ex func, uint32_t budget = INFINITE) :
+		control_handler(control, budget), m_void_handler_ex(std::bind(func, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3)) {}
+	ServiceControlHandler(ServiceControl control, result_handler func, uint32_t budget = INFINITE) :
+		control_handler(control, budget), m_result_handler(std::bind(func, std::placeholders::_1)) {}
+	ServiceControlHandler(ServiceControl control, result_handler_ex func, uint32_t budget = INFINITE) :
+		control_handler(control, budget), m_result_handler_ex(std::bind(func, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3)) {}
+	ServiceControlHandler(ServiceControl control, payload_handler func, uint32_t budget = INFINITE) :
+		control_handler(control, budget), m_payload_handler(std::bind(func, std::placeholders::_1, std::placeholders::_2)) {}
 
 	// Destructor
 	virtual ~ServiceControlHandler()=default;
 
+	// getHasPayload (svctl::control_handler)
+	//
+	// Determines if the handler accepts request/reply payloads from a control channel
+	virtual bool getHasPayload(void) const { return static_cast<bool>(m_payload_handler); }
+
 	// Invoke (svctl::control_handler)
 	//
 	// Invokes the control handler set during handler construction
 	virtual DWORD Invoke(void* instance, DWORD eventtype, void* eventdata) const
 	{
 		// At least one of these is assumed to have been set during construction
-		assert(m_void_handler || m_void_handler_ex || m_result_handler || m_result_handler_ex);
+		assert(m_void_handler || m_void_handler_ex || m_result_handler || m_result_handler_ex || m_payload_handler);
 		
 		// Generally control handlers do not need to return a status, default to ERROR_SUCCESS
 		DWORD result = ERROR_SUCCESS;
@@ -925,6 +5344,14 @@ public:
 		else if(m_void_handler_ex) m_void_handler_ex(derived, eventtype, eventdata);
 		else if(m_result_handler) result = m_result_handler(derived);
 		else if(m_result_handler_ex) result = m_result_handler_ex(derived, eventtype, eventdata);
+		else if(m_payload_handler) {
+
+			// Controls sent through the service control manager rather than a control channel
+			// do not have a payload; provide the handler with an empty one instead
+			svctl::control_payload empty = {};
+			bool payload = (eventdata != nullptr) && (eventtype == svctl::control_payload::EVENT_TYPE);
+			result = m_payload_handler(derived, (payload) ? *reinterpret_cast<svctl::control_payload*>(eventdata) : empty);
+		}
 		else throw ServiceException(E_UNEXPECTED);
 		
 		return result;
@@ -954,6 +5381,11 @@ private:
 	//
 	// Set when a result_handler_ex function is provided during construction
 	const std::function<DWORD(_derived*, DWORD, void*)> m_result_handler_ex;
+
+	// m_payload_handler
+	//
+	// Set when a payload_handler function is provided during construction
+	const std::function<DWORD(_derived*, svctl::control_payload&)> m_payload_handler;
 };
 
 //-----------------------------------------------------------------------------
@@ -966,7 +5398,25 @@ struct ServiceTableEntry : public svctl::service_table_entry
 {
 	// Instance constructors
 	ServiceTableEntry(const svctl::resstring& name) : 
-		service_table_entry(name, &svctl::service::ServiceMain<_derived>) {}
+		service_table_entry(name, &svctl::service::ServiceMain<_derived>, &svctl::service::LocalMain<_derived>) {}
+	ServiceTableEntry(const svctl::resstring& name, const svctl::service_placement& placement) : 
+		service_table_entry(name, &svctl::service::ServiceMain<_derived>, &svctl::service::LocalMain<_derived>, placement) {}
+};
+
+//-----------------------------------------------------------------------------
+// ::ServiceTableShards<>
+//
+// Template version of svctl::service_table_shards; a count of zero creates
+// one shard for each active processor
+
+template <class _derived>
+struct ServiceTableShards : public svctl::service_table_shards
+{
+	// Instance constructors
+	ServiceTableShards(const svctl::resstring& name, uint32_t count = 0) : 
+		service_table_shards(name, count, &svctl::service::ServiceMain<_derived>, &svctl::service::LocalMain<_derived>, svctl::service_placement()) {}
+	ServiceTableShards(const svctl::resstring& name, uint32_t count, const svctl::service_placement& placement) : 
+		service_table_shards(name, count, &svctl::service::ServiceMain<_derived>, &svctl::service::LocalMain<_derived>, placement) {}
 };
 
 //-----------------------------------------------------------------------------
@@ -991,12 +5441,19 @@ public:
 	//
 	// Inserts a new entry into the collection
 	void Add(const svctl::service_table_entry& item) { vector::push_back(item); }
+	void Add(const svctl::service_table_shards& shards) { vector::insert(vector::end(), shards.begin(), shards.end()); }
 
 	// Dispatch
 	//
 	// Dispatches the service table to the service control manager
 	int Dispatch(void);
 
+	// DispatchLocal
+	//
+	// Hosts the service table without the service control manager; the services are
+	// controlled through a named pipe with ServiceControlClient until they have all stopped
+	int DispatchLocal(const svctl::tchar_t* pipename);
+
 private:
 
 	ServiceTable(const ServiceTable&)=delete;
@@ -1015,6 +5472,7 @@ public:
 
 	// Constructor / Destructor
 	ServiceHarness()=default;
+	explicit ServiceHarness(svctl::service_pool& pool) : service_harness(pool) {}
 	virtual ~ServiceHarness()=default;
 
 private:
@@ -1040,6 +5498,7 @@ template <class _derived>
 class Service : public svctl::service
 {
 friend struct ServiceTableEntry<_derived>;
+friend struct ServiceTableShards<_derived>;
 friend class ServiceHarness<_derived>;
 public:
 
@@ -1082,6 +5541,11 @@ private:
 //		CONTROL_HANDLER_ENTRY(200, OnMyCustomCommand)
 //	END_CONTROL_HANDLER_MAP()
 //
+// CONTROL_HANDLER_ENTRY_BUDGET declares the number of milliseconds the handler is expected to
+// complete in; a handler that overruns it is reported to the service through OnHandlerStall()
+//
+//		CONTROL_HANDLER_ENTRY_BUDGET(ServiceControl::Stop, OnStop, 2000)
+//
 #define BEGIN_CONTROL_HANDLER_MAP(_class) \
 	typedef _class __control_map_class; \
 	void __null_handler##_class(void) { return; } \
@@ -1093,6 +5557,9 @@ private:
 #define CONTROL_HANDLER_ENTRY(_control, _func) \
 		std::make_unique<ServiceControlHandler<__control_map_class>>(static_cast<ServiceControl>(_control), &__control_map_class::_func),
 
+#define CONTROL_HANDLER_ENTRY_BUDGET(_control, _func, _budget) \
+		std::make_unique<ServiceControlHandler<__control_map_class>>(static_cast<ServiceControl>(_control), &__control_map_class::_func, static_cast<uint32_t>(_budget)),
+
 #define END_CONTROL_HANDLER_MAP() \
 		}; \
 		static svctl::control_handler_table table { std::make_move_iterator(std::begin(handlers)), std::make_move_iterator(std::end(handlers)) }; \
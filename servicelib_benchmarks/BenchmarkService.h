@@ -0,0 +1,96 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2001-2017 Michael G. Brehm
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef __BENCHMARKSERVICE_H_
+#define __BENCHMARKSERVICE_H_
+#pragma once
+
+#pragma warning(push, 4)
+
+//-----------------------------------------------------------------------------
+// BenchmarkService
+//
+// Service that does nothing in any of it's handlers, so that the benchmarks only
+// measure the library.  Hosted with ServiceHarness<> for the transition and control
+// benchmarks, and instantiated directly for the handler dispatch and status benchmarks
+//
+class BenchmarkService : public Service<BenchmarkService>
+{
+public:
+
+	// Constructor / Destructor
+	BenchmarkService()=default;
+	virtual ~BenchmarkService()=default;
+
+	// Benchmark hooks (SERVICELIB_BENCHMARK_HOOKS)
+	//
+	// Measures the status transitions and accepted controls without a harness
+	using svctl::service::BenchmarkAcceptedControls;
+	using svctl::service::BenchmarkSetStatus;
+	using svctl::service::BenchmarkStatusFunc;
+
+	// OnEmpty
+	//
+	// Empty void(void) control handler
+	void OnEmpty(void) {}
+
+	// OnEmptyEx
+	//
+	// Empty DWORD(DWORD, void*) control handler
+	DWORD OnEmptyEx(DWORD eventtype, void* eventdata)
+	{
+		UNREFERENCED_PARAMETER(eventtype);
+		UNREFERENCED_PARAMETER(eventdata);
+
+		return ERROR_SUCCESS;
+	}
+
+private:
+
+	BenchmarkService(const BenchmarkService&)=delete;
+	BenchmarkService& operator=(const BenchmarkService&)=delete;
+
+	// CONTROL_HANDLER_MAP
+	//
+	// Stop, Pause and Continue have to be present for the harness to send them
+	BEGIN_CONTROL_HANDLER_MAP(BenchmarkService)
+		CONTROL_HANDLER_ENTRY(ServiceControl::Stop, OnEmpty)
+		CONTROL_HANDLER_ENTRY(ServiceControl::Pause, OnEmpty)
+		CONTROL_HANDLER_ENTRY(ServiceControl::Continue, OnEmpty)
+		CONTROL_HANDLER_ENTRY(ServiceControl::ParameterChange, OnEmptyEx)
+	END_CONTROL_HANDLER_MAP()
+
+	// OnStart (Service)
+	//
+	// Starts the service
+	void OnStart(int argc, LPTSTR* argv)
+	{
+		UNREFERENCED_PARAMETER(argc);
+		UNREFERENCED_PARAMETER(argv);
+	}
+};
+
+//-----------------------------------------------------------------------------
+
+#pragma warning(pop)
+
+#endif	// __BENCHMARKSERVICE_H_
@@ -0,0 +1,225 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2001-2017 Michael G. Brehm
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef __BENCHMARKSUITE_H_
+#define __BENCHMARKSUITE_H_
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#pragma warning(push, 4)
+
+//-----------------------------------------------------------------------------
+// BenchmarkSuite
+//
+// Runs a set of named microbenchmarks and writes the results as JSON.  Every benchmark
+// is run as a number of samples of a fixed iteration count after a warm-up sample; the
+// median, minimum and maximum nanoseconds per iteration across the samples are reported.
+// Values that are measured once rather than timed, like a memory footprint, are reported
+// as measurements.
+//
+// The output is intended to be compared between runs, the benchmarks and measurements are
+// always written in the order that they were taken and their fields never change order:
+//
+//	{
+//	  "version": 1,
+//	  "benchmarks": [
+//	    { "name": "signal.set_wait_reset", "iterations": 100000, "samples": 11, "median_ns": 85.2, "min_ns": 84.9, "max_ns": 90.1 },
+//	    ...
+//	  ],
+//	  "measurements": [
+//	    { "name": "pool.private_bytes_per_instance", "unit": "bytes", "value": 41234.5 },
+//	    ...
+//	  ]
+//	}
+//
+class BenchmarkSuite
+{
+public:
+
+	// Instance Constructor
+	//
+	// Benchmarks with names that do not contain the filter string are skipped
+	explicit BenchmarkSuite(const char* filter) : m_filter((filter) ? filter : "")
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		m_frequency = frequency.QuadPart;
+	}
+
+	// Destructor
+	~BenchmarkSuite()=default;
+
+	// Now (static)
+	//
+	// Gets the current performance counter value
+	static int64_t Now(void)
+	{
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		return now.QuadPart;
+	}
+
+	// Report
+	//
+	// Records a value that has been measured once rather than timed
+	void Report(const char* name, const char* unit, double value)
+	{
+		if(strstr(name, m_filter.c_str()) == nullptr) return;
+		m_measurements.push_back({ name, unit, value });
+	}
+
+	// Run
+	//
+	// Runs a benchmark whose function is timed in batches; the function should be
+	// shorter than the resolution of the performance counter
+	template <typename _func>
+	void Run(const char* name, uint32_t iterations, _func func)
+	{
+		RunTimed(name, iterations, [&](uint32_t count) -> int64_t {
+
+			int64_t started = Now();
+			for(uint32_t index = 0; index < count; index++) func();
+			return Now() - started;
+		});
+	}
+
+	// RunEach
+	//
+	// Runs a benchmark whose function times itself and returns the elapsed performance
+	// counter ticks; used when each iteration needs setup that should not be measured
+	template <typename _func>
+	void RunEach(const char* name, uint32_t iterations, _func func)
+	{
+		RunTimed(name, iterations, [&](uint32_t count) -> int64_t {
+
+			int64_t elapsed = 0;
+			for(uint32_t index = 0; index < count; index++) elapsed += func();
+			return elapsed;
+		});
+	}
+
+	// Write
+	//
+	// Writes the collected results to a stream as JSON
+	void Write(FILE* stream) const
+	{
+		fprintf(stream, "{\n  \"version\": 1,\n  \"benchmarks\": [\n");
+
+		for(size_t index = 0; index < m_results.size(); index++) {
+
+			const result& r = m_results[index];
+			fprintf(stream, "    { \"name\": \"%s\", \"iterations\": %u, \"samples\": %u, \"median_ns\": %.1f, \"min_ns\": %.1f, \"max_ns\": %.1f }%s\n",
+				r.name.c_str(), r.iterations, SAMPLES, r.median, r.min, r.max, (index + 1 < m_results.size()) ? "," : "");
+		}
+
+		fprintf(stream, "  ],\n  \"measurements\": [\n");
+
+		for(size_t index = 0; index < m_measurements.size(); index++) {
+
+			const measurement& m = m_measurements[index];
+			fprintf(stream, "    { \"name\": \"%s\", \"unit\": \"%s\", \"value\": %.1f }%s\n",
+				m.name.c_str(), m.unit.c_str(), m.value, (index + 1 < m_measurements.size()) ? "," : "");
+		}
+
+		fprintf(stream, "  ]\n}\n");
+	}
+
+private:
+
+	BenchmarkSuite(const BenchmarkSuite&)=delete;
+	BenchmarkSuite& operator=(const BenchmarkSuite&)=delete;
+
+	// SAMPLES
+	//
+	// Number of timed samples taken for each benchmark
+	static const uint32_t SAMPLES = 11;
+
+	// measurement
+	//
+	// Value reported with Report()
+	struct measurement
+	{
+		std::string		name;				// Measurement name
+		std::string		unit;				// Unit of the value
+		double			value;				// Measured value
+	};
+
+	// result
+	//
+	// Nanoseconds per iteration of a completed benchmark
+	struct result
+	{
+		std::string		name;				// Benchmark name
+		uint32_t		iterations;			// Iterations per sample
+		double			median;				// Median nanoseconds per iteration
+		double			min;				// Fastest sample
+		double			max;				// Slowest sample
+	};
+
+	// RunTimed
+	//
+	// Takes the warm-up and timed samples of a benchmark
+	template <typename _sample>
+	void RunTimed(const char* name, uint32_t iterations, _sample sample)
+	{
+		if(strstr(name, m_filter.c_str()) == nullptr) return;
+
+		// The warm-up sample brings the code and data into the caches and is discarded
+		sample(std::max(iterations / 10, 1U));
+
+		std::vector<double> samples;
+		for(uint32_t index = 0; index < SAMPLES; index++)
+			samples.push_back((sample(iterations) * 1000000000.0) / m_frequency / iterations);
+
+		std::sort(samples.begin(), samples.end());
+		m_results.push_back({ name, iterations, samples[SAMPLES / 2], samples.front(), samples.back() });
+	}
+
+	// m_filter
+	//
+	// Substring that a benchmark name must contain to be run
+	const std::string m_filter;
+
+	// m_frequency
+	//
+	// Performance counter frequency, in ticks per second
+	int64_t m_frequency;
+
+	// m_measurements
+	//
+	// Values that have been reported
+	std::vector<measurement> m_measurements;
+
+	// m_results
+	//
+	// Results of the benchmarks that have been run
+	std::vector<result> m_results;
+};
+
+//-----------------------------------------------------------------------------
+
+#pragma warning(pop)
+
+#endif	// __BENCHMARKSUITE_H_
@@ -0,0 +1,280 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2001-2017 Michael G. Brehm
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "stdafx.h"
+#include "resource.h"
+
+#include "BenchmarkService.h"
+#include "BenchmarkSuite.h"
+
+#pragma warning(push, 4)
+
+// g_sink
+//
+// Receives values computed by the benchmarks so they cannot be optimized away
+static volatile uintptr_t g_sink;
+
+// POOLED_INSTANCES
+//
+// Number of pooled service instances started at once by the pool benchmarks
+static const uint32_t POOLED_INSTANCES = 10000;
+
+//-----------------------------------------------------------------------------
+// PrivateBytes
+//
+// Gets the private memory committed by the process, in bytes
+//
+// Arguments:
+//
+//	NONE
+
+static size_t PrivateBytes(void)
+{
+	PROCESS_MEMORY_COUNTERS_EX counters = { sizeof(PROCESS_MEMORY_COUNTERS_EX) };
+	return (GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters), sizeof(counters))) ? counters.PrivateUsage : 0;
+}
+
+//-----------------------------------------------------------------------------
+// main
+//
+// Application entry point; runs the microbenchmarks and writes the results to
+// the standard output stream as JSON.  Errors are written to standard error
+//
+// Arguments:
+//
+//	argc		- Number of command line arguments
+//	argv		- Command line arguments; argv[1] optionally filters the benchmarks by name
+
+int main(int argc, char** argv)
+{
+	BenchmarkSuite suite((argc > 1) ? argv[1] : nullptr);
+
+	try {
+
+		//
+		// svctl::signal
+		//
+
+		// Set, wait and reset of a manual reset signal on a single thread
+		svctl::signal<svctl::signal_type::ManualReset> manual;
+		suite.Run("signal.set_wait_reset", 100000, [&]() {
+
+			manual.Set();
+			g_sink = WaitForSingleObject(manual, 0);
+			manual.Reset();
+		});
+
+		// Round trip between two threads through a pair of automatic reset signals
+		svctl::signal<svctl::signal_type::AutomaticReset> ping, pong;
+		std::atomic<bool> done { false };
+		std::thread responder([&]() {
+
+			while(WaitForSingleObject(ping, INFINITE) == WAIT_OBJECT_0 && !done) pong.Set();
+		});
+
+		suite.Run("signal.round_trip", 10000, [&]() {
+
+			ping.Set();
+			WaitForSingleObject(pong, INFINITE);
+		});
+
+		done = true;
+		ping.Set();
+		responder.join();
+
+		//
+		// ServiceControlHandler<>::Invoke
+		//
+
+		BenchmarkService service;
+
+		ServiceControlHandler<BenchmarkService> voidhandler(ServiceControl::Stop, &BenchmarkService::OnEmpty);
+		suite.Run("handler.invoke_void", 1000000, [&]() { g_sink = voidhandler.Invoke(&service, 0, nullptr); });
+
+		ServiceControlHandler<BenchmarkService> resulthandler(ServiceControl::ParameterChange, &BenchmarkService::OnEmptyEx);
+		suite.Run("handler.invoke_result_ex", 1000000, [&]() { g_sink = resulthandler.Invoke(&service, 0, nullptr); });
+
+		//
+		// svctl::service::SetStatus and svctl::service::getAcceptedControls
+		//
+		// Measured on an instance that was never started, with a status function that does
+		// nothing, so only the library's own work for each transition type is timed.  Every
+		// transition is timed from the status that precedes it, which is set beforehand
+		//
+
+		service.BenchmarkStatusFunc([](SERVICE_STATUS& status) { g_sink = status.dwCurrentState; });
+
+		suite.Run("status.accepted_controls", 1000000, [&]() { g_sink = service.BenchmarkAcceptedControls(); });
+
+		static const struct { const char* name; ServiceStatus from; ServiceStatus to; } TRANSITIONS[] = {
+
+			{ "status.start_pending",		ServiceStatus::Stopped,			ServiceStatus::StartPending },
+			{ "status.running",				ServiceStatus::StartPending,	ServiceStatus::Running },
+			{ "status.pause_pending",		ServiceStatus::Running,			ServiceStatus::PausePending },
+			{ "status.paused",				ServiceStatus::PausePending,	ServiceStatus::Paused },
+			{ "status.continue_pending",	ServiceStatus::Paused,			ServiceStatus::ContinuePending },
+			{ "status.stop_pending",		ServiceStatus::Running,			ServiceStatus::StopPending },
+			{ "status.stopped",				ServiceStatus::StopPending,		ServiceStatus::Stopped },
+		};
+
+		for(const auto& transition : TRANSITIONS) {
+
+			suite.RunEach(transition.name, 10000, [&]() -> int64_t {
+
+				service.BenchmarkSetStatus(transition.from);
+
+				int64_t started = BenchmarkSuite::Now();
+				service.BenchmarkSetStatus(transition.to);
+				return BenchmarkSuite::Now() - started;
+			});
+		}
+
+		// Leave the instance stopped so the checkpoint timer is not running when it's destroyed
+		service.BenchmarkSetStatus(ServiceStatus::Stopped);
+
+		//
+		// Service controls and status transitions through the harness
+		//
+		// These include the harness' own work, like creating the service thread on start
+		//
+
+		ServiceHarness<BenchmarkService> harness;
+
+		suite.RunEach("transition.start", 200, [&]() -> int64_t {
+
+			int64_t started = BenchmarkSuite::Now();
+			harness.Start(_T("BenchmarkService"));
+			int64_t elapsed = BenchmarkSuite::Now() - started;
+
+			harness.Stop();
+			return elapsed;
+		});
+
+		suite.RunEach("transition.stop", 200, [&]() -> int64_t {
+
+			harness.Start(_T("BenchmarkService"));
+
+			int64_t started = BenchmarkSuite::Now();
+			harness.Stop();
+			return BenchmarkSuite::Now() - started;
+		});
+
+		harness.Start(_T("BenchmarkService"));
+
+		suite.RunEach("transition.pause", 2000, [&]() -> int64_t {
+
+			int64_t started = BenchmarkSuite::Now();
+			harness.Pause();
+			int64_t elapsed = BenchmarkSuite::Now() - started;
+
+			harness.Continue();
+			return elapsed;
+		});
+
+		suite.RunEach("transition.continue", 2000, [&]() -> int64_t {
+
+			harness.Pause();
+
+			int64_t started = BenchmarkSuite::Now();
+			harness.Continue();
+			return BenchmarkSuite::Now() - started;
+		});
+
+		// Interrogate never reaches the handler table, it is answered by the library
+		suite.Run("control.interrogate", 100000, [&]() { g_sink = harness.SendControl(ServiceControl::Interrogate); });
+
+		// ParameterChange is dispatched through the handler table to an empty handler
+		suite.Run("control.param_change", 100000, [&]() { g_sink = harness.SendControl(ServiceControl::ParameterChange); });
+
+		harness.Stop();
+
+		//
+		// Pooled service instances
+		//
+		// Every pooled instance is a harness and a service sharing one thread pool, with the
+		// whole population running at once; each start and stop is timed on it's own, with
+		// the instances that are already running left in place
+		//
+
+		ServicePool pool(4);
+		std::vector<std::unique_ptr<ServiceHarness<BenchmarkService>>> instances;
+		for(uint32_t index = 0; index < POOLED_INSTANCES; index++) instances.push_back(std::make_unique<ServiceHarness<BenchmarkService>>(pool));
+
+		// The memory each running instance holds, harness included, with every instance started
+		size_t before = PrivateBytes();
+		for(auto& instance : instances) instance->Start(_T("BenchmarkService"));
+		suite.Report("pool.private_bytes_per_instance", "bytes", (static_cast<double>(PrivateBytes()) - static_cast<double>(before)) / POOLED_INSTANCES);
+
+		// Stops every instance at once when the population is full, then starts them one at a time
+		size_t running = POOLED_INSTANCES;
+		suite.RunEach("pool.start_10k", POOLED_INSTANCES, [&]() -> int64_t {
+
+			if(running == POOLED_INSTANCES) { for(auto& instance : instances) instance->Stop(); running = 0; }
+
+			int64_t started = BenchmarkSuite::Now();
+			instances[running++]->Start(_T("BenchmarkService"));
+			return BenchmarkSuite::Now() - started;
+		});
+
+		// Starts every instance at once when the population is empty, then stops them one at a time
+		suite.RunEach("pool.stop_10k", POOLED_INSTANCES, [&]() -> int64_t {
+
+			if(running == 0) { for(auto& instance : instances) instance->Start(_T("BenchmarkService")); running = POOLED_INSTANCES; }
+
+			int64_t started = BenchmarkSuite::Now();
+			instances[--running]->Stop();
+			return BenchmarkSuite::Now() - started;
+		});
+
+		for(size_t index = 0; index < running; index++) instances[index]->Stop();
+		instances.clear();
+
+		//
+		// svctl::winexception and svctl::resstring
+		//
+
+		suite.Run("winexception.construct", 10000, [&]() {
+
+			ServiceException ex(static_cast<DWORD>(ERROR_ACCESS_DENIED));
+			g_sink = reinterpret_cast<uintptr_t>(ex.what());
+		});
+
+		suite.Run("resstring.load", 100000, [&]() {
+
+			svctl::resstring str(IDS_BENCHMARK_STRING);
+			g_sink = str.length();
+		});
+	}
+
+	catch(std::exception& ex) { 
+		
+		fprintf(stderr, "benchmark failed: %s\n", ex.what());
+		return 1;
+	}
+
+	suite.Write(stdout);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+#pragma warning(pop)
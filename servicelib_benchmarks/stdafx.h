@@ -0,0 +1,48 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2001-2017 Michael G. Brehm
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef __STDAFX_H_
+#define __STDAFX_H_
+#pragma once
+
+//-----------------------------------------------------------------------------
+// Win32 Declarations
+
+#include <SDKDDKVer.h>
+#include <winsock2.h>				// <-- Before Windows.h for servicelib.h
+#include <Windows.h>
+#include <psapi.h>
+
+//-----------------------------------------------------------------------------
+// C Runtime Library
+
+#include <stdio.h>
+
+//---------------------------------------------------------------------------
+// Service Template Library
+
+#define SERVICELIB_BENCHMARK_HOOKS			// <-- Exposes the status transitions to the benchmarks
+#include <servicelib.h>
+
+//-----------------------------------------------------------------------------
+
+#endif	// __STDAFX_H_
@@ -28,6 +28,7 @@
 // Win32 Declarations
 
 #include <SDKDDKVer.h>
+#include <winsock2.h>				// <-- Before Windows.h for servicelib.h
 #include <Windows.h>
 
 //---------------------------------------------------------------------------